@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "alerts.h"
+
+#define LOG_TAG "alerts"
+
+/* Rates are measured over at least this long so a reading toggling by one
+ * LSB (62.5 mC) shows up as about 60 mC/min rather than thousands. */
+#define RATE_WINDOW_MS 60000
+
+typedef struct {
+  ds18x20_addr_t addr;
+  bool valid;
+  bool has_value;
+  int32_t last_value;
+  bool value_updated;
+  uint32_t last_seen_ms;
+  int32_t rate_start_value;
+  uint32_t rate_start_ms;
+  int32_t rate;
+  bool rate_updated;
+} sensor_slot_t;
+
+typedef struct {
+  bool active;
+  uint8_t count;
+} rule_state_t;
+
+static alert_rule_t rules[ALERTS_MAX_RULES] = {
+    {.type = ALERT_RULE_HIGH, .addr = ds18x20_ANY, .threshold = 8000, .hysteresis = 500, .debounce = 3},
+    {.type = ALERT_RULE_LOW, .addr = ds18x20_ANY, .threshold = -25000, .hysteresis = 500, .debounce = 3},
+    {.type = ALERT_RULE_RATE, .addr = ds18x20_ANY, .threshold = 2000, .hysteresis = 500, .debounce = 2},
+    {.type = ALERT_RULE_STALE, .addr = ds18x20_ANY, .threshold = ALERTS_DEFAULT_STALE_MS, .hysteresis = 0, .debounce = 1},
+};
+static portMUX_TYPE rules_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static sensor_slot_t slots[TEMPERATURE_MAX_SENSORS];
+static rule_state_t states[ALERTS_MAX_RULES][TEMPERATURE_MAX_SENSORS];
+static alert_rule_t evaluated_rules[ALERTS_MAX_RULES];
+static alert_handler_t alert_handler;
+
+void alerts_init(alert_handler_t handler)
+{
+    alert_handler = handler;
+}
+
+/**
+ * Replaces one rule. Its state is re-armed on the next evaluation.
+ * @returns ESP_OK or ESP_ERR_INVALID_ARG for an out of range index.
+ */
+int alerts_set_rule(int index, const alert_rule_t *rule)
+{
+    if (index < 0 || index >= ALERTS_MAX_RULES || rule->type > ALERT_RULE_STALE ||
+        rule->debounce == 0 || rule->hysteresis < 0 ||
+        (rule->type == ALERT_RULE_RATE && rule->threshold <= 0) ||
+        (rule->type == ALERT_RULE_STALE && rule->threshold <= 0))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&rules_lock);
+    rules[index] = *rule;
+    portEXIT_CRITICAL(&rules_lock);
+    ESP_LOGI(LOG_TAG, "Rule %d: %s %d/%d debounce %d", index,
+             alert_rule_type_name(rule->type), rule->threshold, rule->hysteresis, rule->debounce);
+    return ESP_OK;
+}
+
+/**
+ * Copies one rule.
+ * @returns ESP_OK or ESP_ERR_INVALID_ARG for an out of range index.
+ */
+int alerts_get_rule(int index, alert_rule_t *rule)
+{
+    if (index < 0 || index >= ALERTS_MAX_RULES)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    portENTER_CRITICAL(&rules_lock);
+    *rule = rules[index];
+    portEXIT_CRITICAL(&rules_lock);
+    return ESP_OK;
+}
+
+const char *alert_rule_type_name(alert_rule_type_t type)
+{
+    switch (type)
+    {
+    case ALERT_RULE_HIGH:
+        return "HIGH";
+    case ALERT_RULE_LOW:
+        return "LOW";
+    case ALERT_RULE_RATE:
+        return "RATE";
+    case ALERT_RULE_STALE:
+        return "STALE";
+    default:
+        return "NONE";
+    }
+}
+
+static sensor_slot_t *find_slot(ds18x20_addr_t addr)
+{
+    sensor_slot_t *unused = NULL;
+    for (int i = 0; i < TEMPERATURE_MAX_SENSORS; i++)
+    {
+        if (slots[i].valid && slots[i].addr == addr)
+        {
+            return &slots[i];
+        }
+        if (!slots[i].valid && unused == NULL)
+        {
+            unused = &slots[i];
+        }
+    }
+    return unused;
+}
+
+/**
+ * Frees the slots of sensors that are no longer in the sample set, clearing
+ * any alert still active on them. An empty set means the bus is down rather
+ * than that every sensor was removed, so the slots are kept for STALE.
+ */
+static void release_vanished_slots(const temperature_sample_t *samples, int count,
+                                   const alert_rule_t *active_rules)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    for (int s = 0; s < TEMPERATURE_MAX_SENSORS; s++)
+    {
+        sensor_slot_t *slot = &slots[s];
+        bool present = false;
+        for (int i = 0; i < count && slot->valid; i++)
+        {
+            present |= samples[i].addr == slot->addr;
+        }
+        if (!slot->valid || present)
+        {
+            continue;
+        }
+        for (int r = 0; r < ALERTS_MAX_RULES; r++)
+        {
+            if (states[r][s].active && alert_handler != NULL)
+            {
+                alert_event_t event = {
+                    .rule = r,
+                    .type = active_rules[r].type,
+                    .addr = slot->addr,
+                    .value = slot->last_value,
+                    .active = false,
+                };
+                alert_handler(&event);
+            }
+            memset(&states[r][s], 0, sizeof(states[r][s]));
+        }
+        ESP_LOGI(LOG_TAG, "Sensor %08x%08x gone, slot freed",
+                 (uint32_t)(slot->addr >> 32), (uint32_t)slot->addr);
+        memset(slot, 0, sizeof(*slot));
+    }
+}
+
+/**
+ * Works out whether a rule is beyond its threshold (trip) or back inside it
+ * by at least the hysteresis (clear). Neither is set inside the band.
+ */
+static void check_rule(const alert_rule_t *rule, const sensor_slot_t *slot,
+                       int32_t value, int32_t rate, uint32_t now_ms,
+                       bool *trip, bool *clear)
+{
+    uint32_t silence = now_ms - slot->last_seen_ms;
+    switch (rule->type)
+    {
+    case ALERT_RULE_HIGH:
+        *trip = slot->has_value && value > rule->threshold;
+        *clear = slot->has_value && value <= rule->threshold - rule->hysteresis;
+        break;
+    case ALERT_RULE_LOW:
+        *trip = slot->has_value && value < rule->threshold;
+        *clear = slot->has_value && value >= rule->threshold + rule->hysteresis;
+        break;
+    case ALERT_RULE_RATE:
+        *trip = abs(rate) > rule->threshold;
+        *clear = abs(rate) <= rule->threshold - rule->hysteresis;
+        break;
+    case ALERT_RULE_STALE:
+        *trip = silence > (uint32_t)rule->threshold;
+        *clear = silence <= (uint32_t)(rule->threshold - rule->hysteresis);
+        break;
+    default:
+        *trip = false;
+        *clear = false;
+        break;
+    }
+}
+
+/**
+ * Evaluates every rule against every known sensor. Runs in bounded time
+ * (ALERTS_MAX_RULES * TEMPERATURE_MAX_SENSORS checks) without allocating and
+ * calls the alert handler once per debounced edge.
+ */
+void alerts_evaluate(const temperature_sample_t *samples, int count, uint32_t now_ms)
+{
+    alert_rule_t active_rules[ALERTS_MAX_RULES];
+
+    portENTER_CRITICAL(&rules_lock);
+    memcpy(active_rules, rules, sizeof(rules));
+    portEXIT_CRITICAL(&rules_lock);
+
+    release_vanished_slots(samples, count, active_rules);
+    for (int i = 0; i < count; i++)
+    {
+        if (!samples[i].success)
+        {
+            continue;
+        }
+        sensor_slot_t *slot = find_slot(samples[i].addr);
+        if (slot == NULL)
+        {
+            continue;
+        }
+        if (!slot->valid)
+        {
+            memset(slot, 0, sizeof(*slot));
+            slot->valid = true;
+            slot->addr = samples[i].addr;
+        }
+        if (!slot->has_value)
+        {
+            slot->rate_start_value = samples[i].millicelsius;
+            slot->rate_start_ms = now_ms;
+        }
+        else if (now_ms - slot->rate_start_ms >= RATE_WINDOW_MS)
+        {
+            int64_t delta = (int64_t)samples[i].millicelsius - slot->rate_start_value;
+            slot->rate = (int32_t)(delta * 60000 / (int64_t)(now_ms - slot->rate_start_ms));
+            slot->rate_updated = true;
+            slot->rate_start_value = samples[i].millicelsius;
+            slot->rate_start_ms = now_ms;
+        }
+        slot->last_value = samples[i].millicelsius;
+        slot->value_updated = true;
+        slot->last_seen_ms = now_ms;
+        slot->has_value = true;
+    }
+
+    for (int r = 0; r < ALERTS_MAX_RULES; r++)
+    {
+        const alert_rule_t *rule = &active_rules[r];
+        if (memcmp(rule, &evaluated_rules[r], sizeof(*rule)) != 0)
+        {
+            memset(states[r], 0, sizeof(states[r]));
+            evaluated_rules[r] = *rule;
+        }
+        if (rule->type == ALERT_RULE_NONE)
+        {
+            continue;
+        }
+        for (int s = 0; s < TEMPERATURE_MAX_SENSORS; s++)
+        {
+            sensor_slot_t *slot = &slots[s];
+            rule_state_t *state = &states[r][s];
+            bool trip, clear;
+            if (!slot->valid || (rule->addr != ds18x20_ANY && rule->addr != slot->addr))
+            {
+                continue;
+            }
+            /* A rate only counts towards the debounce once per window, and
+             * a level only once per new reading. */
+            if ((rule->type == ALERT_RULE_RATE && !slot->rate_updated) ||
+                ((rule->type == ALERT_RULE_HIGH || rule->type == ALERT_RULE_LOW) &&
+                 !slot->value_updated))
+            {
+                continue;
+            }
+
+            check_rule(rule, slot, slot->last_value, slot->rate, now_ms, &trip, &clear);
+            if (state->active ? clear : trip)
+            {
+                state->count++;
+            }
+            else
+            {
+                state->count = 0;
+            }
+            if (state->count < rule->debounce)
+            {
+                continue;
+            }
+
+            state->active = !state->active;
+            state->count = 0;
+            if (alert_handler != NULL)
+            {
+                alert_event_t event = {
+                    .rule = r,
+                    .type = rule->type,
+                    .addr = slot->addr,
+                    .value = rule->type == ALERT_RULE_RATE ? slot->rate : slot->last_value,
+                    .active = state->active,
+                };
+                alert_handler(&event);
+            }
+        }
+    }
+
+    for (int s = 0; s < TEMPERATURE_MAX_SENSORS; s++)
+    {
+        slots[s].rate_updated = false;
+        slots[s].value_updated = false;
+    }
+}
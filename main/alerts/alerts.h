@@ -0,0 +1,51 @@
+#ifndef _ALERTS_H
+#define _ALERTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "../temperature/temperature.h"
+
+#define ALERTS_MAX_RULES 8
+
+/* Silence that trips the default STALE rule. */
+#define ALERTS_DEFAULT_STALE_MS 300000
+
+typedef enum {
+  ALERT_RULE_NONE = 0,
+  ALERT_RULE_HIGH,
+  ALERT_RULE_LOW,
+  ALERT_RULE_RATE,
+  ALERT_RULE_STALE,
+} alert_rule_type_t;
+
+/*
+ * threshold and hysteresis are in millicelsius for HIGH/LOW, millicelsius
+ * per minute for RATE and milliseconds for STALE. A rule applies to the
+ * sensor at addr, or to every sensor when addr is ds18x20_ANY. It changes
+ * state only after debounce consecutive evaluations agree.
+ */
+typedef struct {
+  alert_rule_type_t type;
+  ds18x20_addr_t addr;
+  int32_t threshold;
+  int32_t hysteresis;
+  uint8_t debounce;
+} alert_rule_t;
+
+typedef struct {
+  uint8_t rule;
+  alert_rule_type_t type;
+  ds18x20_addr_t addr;
+  int32_t value;
+  bool active;
+} alert_event_t;
+
+typedef void (*alert_handler_t)(const alert_event_t *event);
+
+void alerts_init(alert_handler_t handler);
+int alerts_set_rule(int index, const alert_rule_t *rule);
+int alerts_get_rule(int index, alert_rule_t *rule);
+void alerts_evaluate(const temperature_sample_t *samples, int count, uint32_t now_ms);
+const char *alert_rule_type_name(alert_rule_type_t type);
+
+#endif
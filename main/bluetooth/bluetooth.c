@@ -9,13 +9,34 @@
 #include "bluetooth.h"
 #include "console.h"
 #include "gatt_server.h"
+#include "gatt_session.h"
+#include "conn_policy.h"
+#include "reconnect.h"
+#include "../temperature/readings.h"
+#include "../config/config.h"
 
-#define DEVICE_NAME "Vacation Hydration"
 #define LOG_TAG "bluetooth"
 
-#define PASSKEY 1234
+/*
+ * Beacon payload carried as manufacturer data so gateways can collect
+ * readings without connecting:
+ *   company id (u16) | version (u8) | sequence (u16) |
+ *   { sensor id (u16) | centi-deg C (i16) } * n
+ * All fields are little endian. The sensor id is the low 16 bits of the
+ * sensor's serial number, so gateways can tell slots apart after the bus is
+ * rescanned and reordered. A sensor without a valid reading is sent as
+ * BEACON_NO_READING. With the flags and the service UUID, four sensors
+ * bring the advertisement to 30 of its 31 bytes.
+ */
+#define BEACON_VERSION 2
+#define BEACON_NO_READING ((int16_t)0x8000)
+#define BEACON_HEADER_LEN 5
+#define BEACON_SLOT_LEN 4
 
 static uint8_t own_addr_type;
+static reconnect_phase_t adv_phase;
+static struct ble_npl_event beacon_event;
+static bool beacon_ready = false;
 static int on_gap_event(struct ble_gap_event *event, void *arg);
 void ble_store_config_init(void);
 
@@ -55,14 +76,59 @@ static void on_reset(int reason)
     MODLOG_DFLT(ERROR, "Resetting state; reason=%d\n", reason);
 }
 
-static void advertise(void)
+static void put_le16(uint8_t *dst, uint16_t value)
+{
+    dst[0] = value & 0xff;
+    dst[1] = value >> 8;
+}
+
+/**
+ * Builds the advertising data: flags, the alert service UUID and the latest
+ * readings. The name and TX power live in the scan response to make room.
+ */
+static int set_adv_fields(void)
 {
-    struct ble_gap_adv_params adv_params;
     struct ble_hs_adv_fields fields;
-    const char *name;
-    int rc;
+    uint8_t mfg_data[BEACON_HEADER_LEN + BEACON_SLOT_LEN * TEMPERATURE_MAX_SENSORS];
+    reading_set_t readings;
+
     memset(&fields, 0, sizeof fields);
     fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+
+    fields.uuids16 = (ble_uuid16_t[]){
+        BLE_UUID16_INIT(GATT_SVR_SVC_ALERT_UUID)};
+
+    fields.num_uuids16 = 1;
+    fields.uuids16_is_complete = 1;
+
+    readings_get_latest(&readings);
+    put_le16(&mfg_data[0], CONFIG_APP_BEACON_COMPANY_ID);
+    mfg_data[2] = BEACON_VERSION;
+    put_le16(&mfg_data[3], readings.sequence);
+    for (int i = 0; i < readings.count; i++)
+    {
+        uint8_t *slot = &mfg_data[BEACON_HEADER_LEN + BEACON_SLOT_LEN * i];
+        int32_t centi = readings.samples[i].millicelsius / 10;
+        if (!readings.samples[i].success || centi < INT16_MIN + 1 || centi > INT16_MAX)
+        {
+            centi = BEACON_NO_READING;
+        }
+        /* Skip the family code in the low byte of the ROM code. */
+        put_le16(&slot[0], (uint16_t)(readings.samples[i].addr >> 8));
+        put_le16(&slot[2], (uint16_t)centi);
+    }
+    fields.mfg_data = mfg_data;
+    fields.mfg_data_len = BEACON_HEADER_LEN + BEACON_SLOT_LEN * readings.count;
+
+    return ble_gap_adv_set_fields(&fields);
+}
+
+static int set_rsp_fields(void)
+{
+    struct ble_hs_adv_fields fields;
+    const char *name;
+
+    memset(&fields, 0, sizeof fields);
     fields.tx_pwr_lvl_is_present = 1;
     fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
 
@@ -71,24 +137,34 @@ static void advertise(void)
     fields.name_len = strlen(name);
     fields.name_is_complete = 1;
 
-    fields.uuids16 = (ble_uuid16_t[]){
-        BLE_UUID16_INIT(GATT_SVR_SVC_ALERT_UUID)};
+    return ble_gap_adv_rsp_set_fields(&fields);
+}
 
-    fields.num_uuids16 = 1;
-    fields.uuids16_is_complete = 1;
+/**
+ * Advertises for the current reconnect phase; see reconnect.h.
+ */
+static void advertise(void)
+{
+    struct ble_gap_adv_params adv_params;
+    ble_addr_t peer;
+    int32_t duration_ms;
+    int rc;
 
-    rc = ble_gap_adv_set_fields(&fields);
+    rc = set_adv_fields();
+    if (rc == ESP_OK)
+    {
+        rc = set_rsp_fields();
+    }
     if (rc != ESP_OK)
     {
         MODLOG_DFLT(ERROR, "Error setting advertisement fields. rc=%d\n", rc);
         return;
     }
 
-    memset(&adv_params, 0, sizeof adv_params);
-    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
-    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
-    rc = ble_gap_adv_start(own_addr_type, NULL, BLE_HS_FOREVER,
-                           &adv_params, on_gap_event, NULL);
+    adv_phase = reconnect_adv_params(&adv_params, &peer, &duration_ms);
+    rc = ble_gap_adv_start(own_addr_type,
+                           adv_phase == RECONNECT_PHASE_DIRECTED ? &peer : NULL,
+                           duration_ms, &adv_params, on_gap_event, NULL);
     if (rc != ESP_OK)
     {
         MODLOG_DFLT(ERROR, "Error enabling advertisement. rc=%d\n", rc);
@@ -96,6 +172,31 @@ static void advertise(void)
     }
 }
 
+static void on_beacon_event(struct ble_npl_event *ev)
+{
+    /* Advertising keeps running; only its payload is replaced. */
+    if (ble_gap_adv_active())
+    {
+        int rc = set_adv_fields();
+        if (rc != ESP_OK)
+        {
+            MODLOG_DFLT(ERROR, "Error updating beacon data. rc=%d\n", rc);
+        }
+    }
+}
+
+/**
+ * Refreshes the readings in the advertising data. Safe to call from any
+ * task; the update itself runs on the NimBLE host task.
+ */
+void ble_beacon_update(void)
+{
+    if (beacon_ready)
+    {
+        ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &beacon_event);
+    }
+}
+
 
 static int on_gap_event(struct ble_gap_event *event, void *arg)
 {
@@ -113,8 +214,13 @@ static int on_gap_event(struct ble_gap_event *event, void *arg)
             rc = ble_gap_conn_find(event->connect.conn_handle, &desc);
             assert(rc == ESP_OK);
             print_conn_desc(&desc);
+            gatt_session_open(event->connect.conn_handle);
+            conn_policy_on_connect(event->connect.conn_handle);
+            reconnect_on_connect(event->connect.conn_handle);
         }
-        else
+        /* The controller stops advertising when a connection is made; keep
+         * the beacon and the free slots visible, in the same phase. */
+        if (!ble_gap_adv_active())
         {
             advertise();
         }
@@ -123,8 +229,20 @@ static int on_gap_event(struct ble_gap_event *event, void *arg)
     case BLE_GAP_EVENT_DISCONNECT:
         MODLOG_DFLT(INFO, "Disconnected. reason=%d", event->disc_complete.reason);
         print_conn_desc(&event->disconnect.conn);
+        gatt_session_close(event->disconnect.conn.conn_handle);
+        conn_policy_on_disconnect(event->disconnect.conn.conn_handle);
+        reconnect_on_disconnect(event->disconnect.conn.conn_handle);
 
-        advertise();
+        /* A slot is free again; the beacon gives way to a new cycle. */
+        if (ble_gap_adv_active() && adv_phase == RECONNECT_PHASE_BEACON)
+        {
+            ble_gap_adv_stop();
+        }
+        if (!ble_gap_adv_active())
+        {
+            reconnect_start();
+            advertise();
+        }
         return 0;
 
     case BLE_GAP_EVENT_CONN_UPDATE:
@@ -133,11 +251,16 @@ static int on_gap_event(struct ble_gap_event *event, void *arg)
         rc = ble_gap_conn_find(event->conn_update.conn_handle, &desc);
         assert(rc == ESP_OK);
         print_conn_desc(&desc);
+        conn_policy_on_update(event->conn_update.conn_handle);
         return 0;
 
     case BLE_GAP_EVENT_ADV_COMPLETE:
         MODLOG_DFLT(INFO, "Advertise complete. reason=%d",
                     event->adv_complete.reason);
+        if (event->adv_complete.reason == BLE_HS_ETIMEOUT)
+        {
+            reconnect_adv_timeout();
+        }
         advertise();
         return 0;
 
@@ -147,6 +270,14 @@ static int on_gap_event(struct ble_gap_event *event, void *arg)
         rc = ble_gap_conn_find(event->enc_change.conn_handle, &desc);
         assert(rc == ESP_OK);
         print_conn_desc(&desc);
+        reconnect_on_encrypted(event->enc_change.conn_handle, event->enc_change.status);
+        return 0;
+
+    case BLE_GAP_EVENT_IDENTITY_RESOLVED:
+        rc = ble_gap_conn_find(event->identity_resolved.conn_handle, &desc);
+        assert(rc == ESP_OK);
+        print_conn_desc(&desc);
+        reconnect_on_identity(event->identity_resolved.conn_handle);
         return 0;
 
     case BLE_GAP_EVENT_SUBSCRIBE:
@@ -159,6 +290,10 @@ static int on_gap_event(struct ble_gap_event *event, void *arg)
                     event->subscribe.cur_notify,
                     event->subscribe.prev_indicate,
                     event->subscribe.cur_indicate);
+        gatt_session_subscribe(event->subscribe.conn_handle,
+                               event->subscribe.attr_handle,
+                               event->subscribe.cur_notify ||
+                                   event->subscribe.cur_indicate);
         return 0;
 
     case BLE_GAP_EVENT_MTU:
@@ -171,7 +306,9 @@ static int on_gap_event(struct ble_gap_event *event, void *arg)
     case BLE_GAP_EVENT_REPEAT_PAIRING:
         rc = ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc);
         assert(rc == ESP_OK);
+        /* Only reached when the peer lost its keys; bonded peers re-encrypt. */
         ble_store_util_delete_peer(&desc.peer_id_addr);
+        reconnect_forget_peer(&desc.peer_id_addr);
 
         return BLE_GAP_REPEAT_PAIRING_RETRY;
 
@@ -183,7 +320,7 @@ static int on_gap_event(struct ble_gap_event *event, void *arg)
         if (event->passkey.params.action == BLE_SM_IOACT_DISP)
         {   
             pkey.action = event->passkey.params.action;
-            pkey.passkey = PASSKEY;
+            pkey.passkey = config_get()->passkey;
             ESP_LOGI(LOG_TAG, "Enter passkey %d on the peer side", pkey.passkey);
             rc = ble_sm_inject_io(event->passkey.conn_handle, &pkey);
             ESP_LOGI(LOG_TAG, "ble_sm_inject_io result: %d\n", rc);
@@ -243,8 +380,15 @@ static void on_sync(void)
     rc = ble_hs_util_ensure_addr(0);
     assert(rc == ESP_OK);
 
-    //Figure out address to use while advertising. No privacy for now.
-    rc = ble_hs_id_infer_auto(0, &own_addr_type);
+    /* Advertise with a resolvable private address. The controller then
+     * resolves bonded phones that use one against the resolving list, and
+     * aims directed advertising at their current address. */
+    uint8_t id_addr_type;
+    rc = ble_hs_id_infer_auto(0, &id_addr_type);
+    if (rc == ESP_OK)
+    {
+        rc = ble_hs_id_infer_auto(1, &own_addr_type);
+    }
     if (rc != ESP_OK)
     {
         MODLOG_DFLT(ERROR, "Error determining the address type. rc=%d\n", rc);
@@ -252,14 +396,25 @@ static void on_sync(void)
     }
 
     uint8_t addr_val[6] = {0};
-    rc = ble_hs_id_copy_addr(own_addr_type, addr_val, NULL);
+    rc = ble_hs_id_copy_addr(id_addr_type, addr_val, NULL);
 
     print_addr(addr_val);
     MODLOG_DFLT(INFO, "\n");
     /* Begin advertising. */
+    reconnect_load_identities();
+    reconnect_start();
     advertise();
 }
 
+/**
+ * Reports whether the host and controller are in sync, i.e. the BLE stack
+ * came up and can advertise.
+ */
+bool ble_is_synced(void)
+{
+    return ble_hs_synced();
+}
+
 void host_task(void *param)
 {
     ESP_LOGI(LOG_TAG, "BLE Host Task Started");
@@ -283,16 +438,20 @@ void init_ble()
     ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
     ble_hs_cfg.sm_io_cap = BLE_SM_IO_CAP_NO_IO;
     ble_hs_cfg.sm_bonding = 1;
-    ble_hs_cfg.sm_our_key_dist = 1;
-    ble_hs_cfg.sm_their_key_dist = 1;
+    /* Identity keys too: the phone's IRK is what resolves its private
+     * address on the next reconnect. */
+    ble_hs_cfg.sm_our_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
+    ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC | BLE_SM_PAIR_KEY_DIST_ID;
     ble_hs_cfg.sm_sc = 1;
     ble_hs_cfg.sm_mitm = 1;
     ble_svc_gap_init();
     
     rc = gatt_server_init();
     assert(rc == ESP_OK);
-    rc = ble_svc_gap_device_name_set(DEVICE_NAME);
+    rc = ble_svc_gap_device_name_set(config_get()->device_name);
     ble_store_config_init();
+    ble_npl_event_init(&beacon_event, on_beacon_event, NULL);
+    beacon_ready = true;
     nimble_port_freertos_init(host_task);
     rc= console_init();
     if(rc != ESP_OK) {
@@ -7,5 +7,7 @@
 
 
 void init_ble(void);
+void ble_beacon_update(void);
+bool ble_is_synced(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,218 @@
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "nimble/nimble_port.h"
+#include "host/ble_hs.h"
+#include "conn_policy.h"
+
+#define LOG_TAG "conn_policy"
+
+/* Connection parameters are in 1.25 ms units, supervision timeout in 10 ms. */
+#define ACTIVE_ITVL_MIN 6
+#define ACTIVE_ITVL_MAX 12
+#define ACTIVE_LATENCY 0
+#define ACTIVE_TIMEOUT 200
+
+#define IDLE_ITVL_MIN 400
+#define IDLE_ITVL_MAX 800
+#define IDLE_LATENCY 4
+#define IDLE_TIMEOUT 1200
+
+/* Drop back to the idle parameters after this long without GATT traffic. */
+#define IDLE_AFTER_MS 3000
+
+#define DLE_TX_OCTETS 251
+#define DLE_TX_TIME 2120
+
+typedef struct
+{
+    bool in_use;
+    bool active;
+    uint16_t conn_handle;
+    struct ble_npl_callout idle_timer;
+
+    conn_phase_t phase;
+    int64_t phase_start_us;
+    int64_t last_activity_us;
+    uint32_t phase_accesses;
+} conn_policy_t;
+
+static conn_policy_t policies[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+
+static const struct ble_gap_upd_params active_params = {
+    .itvl_min = ACTIVE_ITVL_MIN,
+    .itvl_max = ACTIVE_ITVL_MAX,
+    .latency = ACTIVE_LATENCY,
+    .supervision_timeout = ACTIVE_TIMEOUT,
+};
+
+static const struct ble_gap_upd_params idle_params = {
+    .itvl_min = IDLE_ITVL_MIN,
+    .itvl_max = IDLE_ITVL_MAX,
+    .latency = IDLE_LATENCY,
+    .supervision_timeout = IDLE_TIMEOUT,
+};
+
+static const char *phase_name(conn_phase_t phase)
+{
+    switch (phase)
+    {
+    case CONN_PHASE_SCAN:
+        return "scan";
+    case CONN_PHASE_SCAN_RESULTS:
+        return "scan_results";
+    case CONN_PHASE_CONNECT:
+        return "connect";
+    case CONN_PHASE_CONFIG:
+        return "config";
+    case CONN_PHASE_HISTORY:
+        return "history";
+    default:
+        return "none";
+    }
+}
+
+static conn_policy_t *find_policy(uint16_t conn_handle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (policies[i].in_use && policies[i].conn_handle == conn_handle)
+        {
+            return &policies[i];
+        }
+    }
+    return NULL;
+}
+
+/* Logs how long the finished phase kept the link busy. */
+static void end_phase(conn_policy_t *policy)
+{
+    if (policy->phase == CONN_PHASE_NONE)
+    {
+        return;
+    }
+    ESP_LOGI(LOG_TAG, "conn_handle=%d phase=%s accesses=%u transfer_ms=%lld mtu=%d",
+             policy->conn_handle, phase_name(policy->phase), policy->phase_accesses,
+             (policy->last_activity_us - policy->phase_start_us) / 1000,
+             ble_att_mtu(policy->conn_handle));
+    policy->phase = CONN_PHASE_NONE;
+}
+
+static void request_params(conn_policy_t *policy, bool active)
+{
+    int rc = ble_gap_update_params(policy->conn_handle,
+                                   active ? &active_params : &idle_params);
+    if (rc != 0 && rc != BLE_HS_EALREADY)
+    {
+        ESP_LOGW(LOG_TAG, "Parameter update failed; rc=%d", rc);
+        return;
+    }
+    policy->active = active;
+}
+
+static void on_idle(struct ble_npl_event *ev)
+{
+    conn_policy_t *policy = ble_npl_event_get_arg(ev);
+    if (!policy->in_use)
+    {
+        return;
+    }
+    end_phase(policy);
+    request_params(policy, false);
+}
+
+static int on_mtu(uint16_t conn_handle, const struct ble_gatt_error *error,
+                  uint16_t mtu, void *arg)
+{
+    if (error->status == 0)
+    {
+        ESP_LOGI(LOG_TAG, "conn_handle=%d negotiated mtu=%d", conn_handle, mtu);
+    }
+    return 0;
+}
+
+/**
+ * Starts a connection in the active profile: provisioning normally begins
+ * straight away, so ask for a short interval, the largest MTU and data
+ * length extension up front.
+ */
+void conn_policy_on_connect(uint16_t conn_handle)
+{
+    conn_policy_t *policy = NULL;
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (!policies[i].in_use)
+        {
+            policy = &policies[i];
+            break;
+        }
+    }
+    if (policy == NULL)
+    {
+        return;
+    }
+
+    memset(policy, 0, sizeof(*policy));
+    policy->in_use = true;
+    policy->conn_handle = conn_handle;
+    ble_npl_callout_init(&policy->idle_timer, nimble_port_get_dflt_eventq(),
+                         on_idle, policy);
+
+    ble_gattc_exchange_mtu(conn_handle, on_mtu, NULL);
+    ble_gap_set_data_len(conn_handle, DLE_TX_OCTETS, DLE_TX_TIME);
+    conn_policy_activity(conn_handle, CONN_PHASE_NONE);
+}
+
+void conn_policy_on_disconnect(uint16_t conn_handle)
+{
+    conn_policy_t *policy = find_policy(conn_handle);
+    if (policy == NULL)
+    {
+        return;
+    }
+    ble_npl_callout_stop(&policy->idle_timer);
+    end_phase(policy);
+    policy->in_use = false;
+}
+
+void conn_policy_on_update(uint16_t conn_handle)
+{
+    struct ble_gap_conn_desc desc;
+    if (ble_gap_conn_find(conn_handle, &desc) == 0)
+    {
+        ESP_LOGI(LOG_TAG, "conn_handle=%d itvl=%d latency=%d timeout=%d",
+                 conn_handle, desc.conn_itvl, desc.conn_latency,
+                 desc.supervision_timeout);
+    }
+}
+
+/**
+ * Records GATT traffic for a connection. Switches to the fast profile when
+ * the link was idle and re-arms the idle timer.
+ */
+void conn_policy_activity(uint16_t conn_handle, conn_phase_t phase)
+{
+    conn_policy_t *policy = find_policy(conn_handle);
+    int64_t now = esp_timer_get_time();
+    if (policy == NULL)
+    {
+        return;
+    }
+
+    if (phase != policy->phase)
+    {
+        end_phase(policy);
+        policy->phase = phase;
+        policy->phase_start_us = now;
+        policy->phase_accesses = 0;
+    }
+    policy->phase_accesses++;
+    policy->last_activity_us = now;
+
+    if (!policy->active)
+    {
+        request_params(policy, true);
+    }
+    ble_npl_callout_reset(&policy->idle_timer, ble_npl_time_ms_to_ticks32(IDLE_AFTER_MS));
+}
@@ -0,0 +1,21 @@
+#ifndef _CONN_POLICY_H
+#define _CONN_POLICY_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    CONN_PHASE_NONE = 0,
+    CONN_PHASE_SCAN,
+    CONN_PHASE_SCAN_RESULTS,
+    CONN_PHASE_CONNECT,
+    CONN_PHASE_CONFIG,
+    CONN_PHASE_HISTORY,
+} conn_phase_t;
+
+void conn_policy_on_connect(uint16_t conn_handle);
+void conn_policy_on_disconnect(uint16_t conn_handle);
+void conn_policy_on_update(uint16_t conn_handle);
+void conn_policy_activity(uint16_t conn_handle, conn_phase_t phase);
+
+#endif
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <esp_console.h>
@@ -6,13 +8,33 @@
 #include <freertos/queue.h>
 #include <freertos/task.h>
 #include <driver/uart.h>
+#include "esp_system.h"
 #include "esp_log.h"
 #include "console.h"
+#include "console_line.h"
+#include "reconnect.h"
+#include "../temperature/temperature.h"
+#include "../temperature/sampling.h"
+#include "../temperature/conditioning.h"
+#include "../temperature/readings.h"
+#include "../config/config.h"
+#include "../history/history.h"
+#include "../tasks/task_topology.h"
+#include "../alerts/alerts.h"
+#include "../wifi/wifi.h"
+#include "../ota/ota.h"
+#include "../uplink/uplink.h"
 
-#define BLE_RX_TIMEOUT (120000 / portTICK_PERIOD_MS)
+
+#define UART_RX_BUFFER_SIZE 1024
+#define UART_RX_CHUNK 128
+
+/* Enough for a pasted block of commands. When it fills up the reader waits
+ * for the dispatcher and the UART driver buffers the rest. */
+#define LINE_QUEUE_LENGTH 16
 
 static QueueHandle_t cli_handle;
-static TaskHandle_t cli_task;
+static QueueHandle_t line_queue;
 static int stop;
 
 static int enter_passkey_handler(int argc, char *argv[])
@@ -52,17 +74,470 @@ static int enter_passkey_handler(int argc, char *argv[])
     return 0;
 }
 
+/**
+ * Parses a whole argument as a decimal integer in [min, max].
+ * @returns false when the text is empty, has trailing characters or is out
+ * of range.
+ */
+static bool parse_number(const char *text, long min, long max, long *value)
+{
+    char *end;
+    errno = 0;
+    *value = strtol(text, &end, 10);
+    return end != text && *end == '\0' && errno == 0 && *value >= min && *value <= max;
+}
+
+static int sample_period_handler(int argc, char *argv[])
+{
+    sampling_policy_t policy;
+    long min, max;
+
+    sampling_get_policy(&policy);
+    max = policy.max_period_ms;
+    if (argc < 2 || argc > 3 || !parse_number(argv[1], 1, SAMPLING_MAX_PERIOD_MS, &min) ||
+        (argc == 3 && !parse_number(argv[2], 1, SAMPLING_MAX_PERIOD_MS, &max)))
+    {
+        printf("Usage: period <min_ms> [max_ms], at most %d ms\n", SAMPLING_MAX_PERIOD_MS);
+        return -1;
+    }
+    policy.min_period_ms = min;
+    policy.max_period_ms = max;
+    if (sampling_set_policy(&policy) != ESP_OK)
+    {
+        printf("Invalid sample period, the maximum is %u ms\n", policy.max_period_ms);
+        return -1;
+    }
+    printf("Sampling every %u..%u ms\n", policy.min_period_ms, policy.max_period_ms);
+    return 0;
+}
+
+static int resolution_handler(int argc, char *argv[])
+{
+    long bits;
+
+    if (argc != 2 || !parse_number(argv[1], 9, 12, &bits) ||
+        temperature_set_resolution(bits) != ESP_OK)
+    {
+        printf("Resolution must be 9..12 bits\n");
+        return -1;
+    }
+    return 0;
+}
+
+static int calibrate_handler(int argc, char *argv[])
+{
+    reading_set_t readings;
+    long sensor, offset, gain_ppm = 1000000;
+
+    if (argc < 3 || argc > 4)
+    {
+        return -1;
+    }
+    readings_get_latest(&readings);
+    if (!parse_number(argv[1], 0, readings.count - 1, &sensor))
+    {
+        printf("No sensor %s\n", argv[1]);
+        return -1;
+    }
+    if (!parse_number(argv[2], INT32_MIN, INT32_MAX, &offset) ||
+        (argc == 4 && !parse_number(argv[3], 500000, 2000000, &gain_ppm)))
+    {
+        printf("Usage: calibrate <n> <offset_mc> [gain_ppm 500000..2000000]\n");
+        return -1;
+    }
+    if (conditioning_set_calibration(readings.samples[sensor].addr, offset,
+                                     ((int64_t)gain_ppm << 16) / 1000000) != ESP_OK)
+    {
+        printf("Invalid calibration\n");
+        return -1;
+    }
+    return 0;
+}
+
+static alert_rule_type_t parse_rule_type(const char *text)
+{
+    for (alert_rule_type_t type = ALERT_RULE_NONE; type <= ALERT_RULE_STALE; type++)
+    {
+        if (strcasecmp(text, alert_rule_type_name(type)) == 0)
+        {
+            return type;
+        }
+    }
+    return (alert_rule_type_t)-1;
+}
+
+static void print_rules(void)
+{
+    alert_rule_t rule;
+    for (int i = 0; i < ALERTS_MAX_RULES; i++)
+    {
+        if (alerts_get_rule(i, &rule) != ESP_OK || rule.type == ALERT_RULE_NONE)
+        {
+            continue;
+        }
+        printf("%d: %s %d hysteresis %d debounce %d", i, alert_rule_type_name(rule.type),
+               rule.threshold, rule.hysteresis, rule.debounce);
+        if (rule.addr == ds18x20_ANY)
+        {
+            printf(" all sensors\n");
+        }
+        else
+        {
+            printf(" sensor %08x%08x\n", (uint32_t)(rule.addr >> 32), (uint32_t)rule.addr);
+        }
+    }
+}
+
+/* alert <n> <type> <threshold> [hysteresis [debounce [sensor]]] */
+static int alert_handler(int argc, char *argv[])
+{
+    reading_set_t readings;
+    alert_rule_t rule = {
+        .addr = ds18x20_ANY,
+        .debounce = 1,
+    };
+    long index, threshold = 0, hysteresis = 0, debounce = 1, sensor = -1;
+
+    if (argc == 1)
+    {
+        print_rules();
+        return 0;
+    }
+    if (argc < 3 || argc > 7 ||
+        !parse_number(argv[1], 0, ALERTS_MAX_RULES - 1, &index) ||
+        (rule.type = parse_rule_type(argv[2])) == (alert_rule_type_t)-1 ||
+        (rule.type != ALERT_RULE_NONE && argc < 4) ||
+        (argc > 3 && !parse_number(argv[3], INT32_MIN, INT32_MAX, &threshold)) ||
+        (argc > 4 && !parse_number(argv[4], 0, INT32_MAX, &hysteresis)) ||
+        (argc > 5 && !parse_number(argv[5], 1, UINT8_MAX, &debounce)) ||
+        (argc > 6 && !parse_number(argv[6], 0, TEMPERATURE_MAX_SENSORS - 1, &sensor)))
+    {
+        printf("Usage: alert <n> <none|high|low|rate|stale> <threshold> "
+               "[hysteresis [debounce [sensor]]]\n");
+        return -1;
+    }
+    if (sensor >= 0)
+    {
+        readings_get_latest(&readings);
+        if (sensor >= readings.count)
+        {
+            printf("No sensor %ld\n", sensor);
+            return -1;
+        }
+        rule.addr = readings.samples[sensor].addr;
+    }
+    rule.threshold = threshold;
+    rule.hysteresis = hysteresis;
+    rule.debounce = debounce;
+    if (alerts_set_rule(index, &rule) != ESP_OK)
+    {
+        printf("Invalid alert rule\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* scan passive <ms> | scan active <min_ms> <max_ms> */
+static int scan_handler(int argc, char *argv[])
+{
+    wifi_scan_params_t params = {0};
+    long first = 0, second = 0;
+
+    if (argc == 3 && strcasecmp(argv[1], "passive") == 0 &&
+        parse_number(argv[2], 1, 1500, &first))
+    {
+        params.passive = true;
+        params.passive_ms = first;
+    }
+    else if (argc == 4 && strcasecmp(argv[1], "active") == 0 &&
+             parse_number(argv[2], 0, 1500, &first) &&
+             parse_number(argv[3], first, 1500, &second))
+    {
+        params.active_min_ms = first;
+        params.active_max_ms = second;
+    }
+    else
+    {
+        printf("Usage: scan passive <ms> | scan active <min_ms> <max_ms>\n");
+        return -1;
+    }
+    wifi_set_scan_params(&params);
+    wifi_start_scan();
+    return 0;
+}
+
+static bool print_history_row(const history_row_t *row, void *arg)
+{
+    printf("%u", row->time);
+    for (int i = 0; i < row->count; i++)
+    {
+        if (row->valid[i])
+        {
+            printf(" %d", row->millicelsius[i]);
+        }
+        else
+        {
+            printf(" -");
+        }
+    }
+    printf("\n");
+    return true;
+}
+
+/**
+ * Parses a history time in seconds; zero or below counts back from now.
+ * @returns false when the argument is not a number in range.
+ */
+static bool history_time_arg(const char *arg, uint32_t now, uint32_t *time)
+{
+    long value;
+    if (!parse_number(arg, -INT32_MAX, INT32_MAX, &value))
+    {
+        return false;
+    }
+    *time = value > 0 ? (uint32_t)value : now + value;
+    return true;
+}
+
+static int history_handler(int argc, char *argv[])
+{
+    history_stats_t stats;
+    uint32_t now = history_now();
+    uint32_t from, to;
+    long step = 1;
+
+    if (argc == 1)
+    {
+        if (history_get_stats(&stats) != ESP_OK)
+        {
+            printf("History is not available\n");
+            return -1;
+        }
+        printf("History: %d of %d blocks, %u..%u, now %u\n",
+               stats.blocks_used, stats.blocks_total,
+               stats.oldest_time, stats.newest_time, now);
+        if (stats.samples_written > 0)
+        {
+            printf("%u samples since boot, %u.%02u bits per sample\n",
+                   stats.samples_written,
+                   stats.bits_written / stats.samples_written,
+                   stats.bits_written % stats.samples_written * 100 / stats.samples_written);
+        }
+        return 0;
+    }
+    if (argc < 3 || argc > 4 || !history_time_arg(argv[1], now, &from) ||
+        !history_time_arg(argv[2], now, &to) ||
+        (argc == 4 && !parse_number(argv[3], 1, UINT16_MAX, &step)))
+    {
+        printf("Usage: history [<from> <to> [step]]\n");
+        return -1;
+    }
+    return history_query(from, 0, to, step, print_history_row, NULL) == ESP_OK ? 0 : -1;
+}
+
+static void print_reconnect_stats(const char *name, const reconnect_peer_stats_t *peer)
+{
+    printf("%s: %u connections", name, peer->connections);
+    if (peer->connections > 0)
+    {
+        printf(", connect last %u ms avg %u ms, encrypt last %u ms total %u ms",
+               peer->last_connect_ms, peer->total_connect_ms / peer->connections,
+               peer->last_secure_ms, peer->total_secure_ms);
+    }
+    printf("\n");
+}
+
+static int reconnect_handler(int argc, char *argv[])
+{
+    reconnect_stats_t stats;
+
+    reconnect_get_stats(&stats);
+    print_reconnect_stats("Bonded", &stats.bonded);
+    print_reconnect_stats("New", &stats.fresh);
+    return 0;
+}
+
+static int uplink_handler(int argc, char *argv[])
+{
+    uplink_stats_t stats;
+    const tls_session_stats_t *tls = &stats.tls;
+
+    uplink_get_stats(&stats);
+    printf("Uplink: %u connects, %u publishes, %u errors\n", stats.connects, stats.publishes,
+           stats.errors);
+    printf("TLS: %u full", tls->full_handshakes);
+    if (tls->full_handshakes > 0)
+    {
+        printf(" (avg %u ms)", tls->total_full_ms / tls->full_handshakes);
+    }
+    printf(", %u resumed", tls->resumed_handshakes);
+    if (tls->resumed_handshakes > 0)
+    {
+        printf(" (avg %u ms)", tls->total_resumed_ms / tls->resumed_handshakes);
+    }
+    printf(", %u failed, %u sessions declined, last %u ms%s\n", tls->failed_handshakes,
+           tls->rejected_sessions, tls->last_handshake_ms,
+           tls->restored ? ", session restored after reset" : "");
+    return 0;
+}
+
+static int sensors_handler(int argc, char *argv[])
+{
+    temperature_sensor_stats_t stats[TEMPERATURE_MAX_SENSORS];
+    int count = get_temperature_sensor_stats(stats, TEMPERATURE_MAX_SENSORS);
+
+    if (count == 0)
+    {
+        printf("No sensors found\n");
+        return 0;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        printf("%d: %08x%08x %u reads, %u errors, last 8: %d failed%s\n", i,
+               (uint32_t)(stats[i].addr >> 32), (uint32_t)stats[i].addr,
+               stats[i].reads, stats[i].errors, __builtin_popcount(stats[i].recent_errors),
+               stats[i].quarantined ? ", quarantined" : "");
+    }
+    return 0;
+}
+
+/**
+ * Decodes a hex string into at most max bytes.
+ * @returns The number of bytes, or -1 for odd length or a non-hex character.
+ */
+static int parse_hex(const char *text, uint8_t *out, size_t max)
+{
+    size_t len = strlen(text);
+    if (len % 2 != 0 || len / 2 > max)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i += 2)
+    {
+        if (!isxdigit((unsigned char)text[i]) || !isxdigit((unsigned char)text[i + 1]))
+        {
+            return -1;
+        }
+        char byte[3] = {text[i], text[i + 1], '\0'};
+        out[i / 2] = strtoul(byte, NULL, 16);
+    }
+    return len / 2;
+}
+
+/*
+ * ota begin | ota write <hex> | ota end | ota abort
+ * Every call prints one "ota: <result>" line, which tools/ota_delta waits
+ * for before it sends the next chunk. The first write after begin checks
+ * the running image and erases the inactive slot, which takes seconds.
+ */
+static int ota_handler(int argc, char *argv[])
+{
+    uint8_t data[CONSOLE_LINE_MAX / 2];
+    int len;
+    esp_err_t err;
+
+    if (argc == 2 && strcmp(argv[1], "begin") == 0)
+    {
+        err = ota_delta_begin();
+    }
+    else if (argc == 3 && strcmp(argv[1], "write") == 0 &&
+             (len = parse_hex(argv[2], data, sizeof(data))) >= 0)
+    {
+        err = ota_delta_write(data, len);
+    }
+    else if (argc == 2 && strcmp(argv[1], "end") == 0)
+    {
+        err = ota_delta_end();
+    }
+    else if (argc == 2 && strcmp(argv[1], "abort") == 0)
+    {
+        ota_delta_abort();
+        err = ESP_OK;
+    }
+    else
+    {
+        printf("Usage: ota begin | ota write <hex> | ota end | ota abort\n");
+        return -1;
+    }
+
+    printf("ota: %s\n", esp_err_to_name(err));
+    if (err != ESP_OK)
+    {
+        return -1;
+    }
+    if (strcmp(argv[1], "end") == 0)
+    {
+        printf("Rebooting into the new image\n");
+        vTaskDelay(100 / portTICK_PERIOD_MS);
+        esp_restart();
+    }
+    return 0;
+}
+
 static esp_console_cmd_t cmds[] = {
     {
         .command = "key",
         .help = "",
         .func = enter_passkey_handler,
     },
+    {
+        .command = "period",
+        .help = "Set the sample period: period <min_ms> [max_ms]",
+        .func = sample_period_handler,
+    },
+    {
+        .command = "resolution",
+        .help = "Set the sensor resolution: resolution <9..12>",
+        .func = resolution_handler,
+    },
+    {
+        .command = "calibrate",
+        .help = "Calibrate a sensor: calibrate <n> <offset_mc> [gain_ppm]",
+        .func = calibrate_handler,
+    },
+    {
+        .command = "alert",
+        .help = "Show or set alert rules: alert [<n> <type> <threshold> "
+                "[hysteresis [debounce [sensor]]]]",
+        .func = alert_handler,
+    },
+    {
+        .command = "scan",
+        .help = "Set Wi-Fi scan dwell times and rescan: scan passive <ms> | "
+                "scan active <min_ms> <max_ms>",
+        .func = scan_handler,
+    },
+    {
+        .command = "history",
+        .help = "Show stored readings: history [<from> <to> [step]]",
+        .func = history_handler,
+    },
+    {
+        .command = "reconnect",
+        .help = "Show BLE reconnect times for bonded and new peers",
+        .func = reconnect_handler,
+    },
+    {
+        .command = "uplink",
+        .help = "Show MQTT uplink and TLS resumption counts",
+        .func = uplink_handler,
+    },
+    {
+        .command = "sensors",
+        .help = "Show read and error counts per sensor",
+        .func = sensors_handler,
+    },
+    {
+        .command = "ota",
+        .help = "Apply a delta update: ota begin | ota write <hex> | ota end | ota abort",
+        .func = ota_handler,
+    },
 };
 
 int console_receive_key(int *console_key)
 {
-    return xQueueReceive(cli_handle, console_key, BLE_RX_TIMEOUT);
+    return xQueueReceive(cli_handle, console_key,
+                         config_get()->ble_rx_timeout_ms / portTICK_PERIOD_MS);
 }
 
 static int ble_register_cli(void)
@@ -76,67 +551,113 @@ static int ble_register_cli(void)
     return 0;
 }
 
+/**
+ * Runs completed lines away from the UART receive path so a slow command
+ * never stalls input.
+ */
+static void console_dispatch_task(void *arg)
+{
+    char line[CONSOLE_LINE_MAX];
+    int cmd_ret;
+    esp_err_t ret;
+
+    while (!stop)
+    {
+        if (xQueueReceive(line_queue, line, portMAX_DELAY) != pdPASS)
+        {
+            continue;
+        }
+        if (line[0] == '\0')
+        {
+            continue;
+        }
+        ret = esp_console_run(line, &cmd_ret);
+        if (ret == ESP_ERR_NOT_FOUND)
+        {
+            printf("Unknown command: %s\n", line);
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+static void flush_echo(int uart_num, console_line_t *ld)
+{
+    if (ld->echo_len > 0)
+    {
+        uart_write_bytes(uart_num, ld->echo, ld->echo_len);
+        ld->echo_len = 0;
+    }
+}
+
 static void console_task(void *arg)
 {
     int uart_num = (int) arg;
-    uint8_t linebuf[256];
-    int i, cmd_ret;
+    static console_line_t ld;
+    uint8_t rxbuf[UART_RX_CHUNK];
     esp_err_t ret;
     QueueHandle_t uart_queue;
     uart_event_t event;
 
-    uart_driver_install(uart_num, 256, 0, 8, &uart_queue, 0);
+    uart_driver_install(uart_num, UART_RX_BUFFER_SIZE, 0, 8, &uart_queue, 0);
     /* Initialize the console */
     esp_console_config_t console_config = {
         .max_cmdline_args = 8,
-        .max_cmdline_length = 256,
+        .max_cmdline_length = CONSOLE_LINE_MAX,
     };
 
     esp_console_init(&console_config);
+    console_line_init(&ld);
 
     while (!stop) {
-        i = 0;
-        memset(linebuf, 0, sizeof(linebuf));
-        do {
-            ret = xQueueReceive(uart_queue, (void * )&event, (portTickType)portMAX_DELAY);
-            if (ret != pdPASS) {
-                if (stop == 1) {
-                    break;
-                } else {
-                    continue;
-                }
-            }
-            if (event.type == UART_DATA) {
-                while (uart_read_bytes(uart_num, (uint8_t *) &linebuf[i], 1, 0)) {
-                    if (linebuf[i] == '\r') {
-                        uart_write_bytes(uart_num, "\r\n", 2);
-                    } else {
-                        uart_write_bytes(uart_num, (char *) &linebuf[i], 1);
-                    }
-                    i++;
+        ret = xQueueReceive(uart_queue, (void * )&event, (portTickType)portMAX_DELAY);
+        if (ret != pdPASS) {
+            continue;
+        }
+        if (event.type == UART_FIFO_OVF) {
+            uart_flush_input(uart_num);
+            xQueueReset(uart_queue);
+            console_line_reset(&ld);
+            continue;
+        }
+        /* A full ring buffer only means the reader fell behind; drain it. */
+        if (event.type != UART_DATA && event.type != UART_BUFFER_FULL) {
+            continue;
+        }
+
+        /* Drain everything buffered, not just what this event announced. */
+        int len;
+        while ((len = uart_read_bytes(uart_num, rxbuf, sizeof(rxbuf), 0)) > 0) {
+            int off = 0;
+            while (off < len) {
+                bool ready;
+                off += console_line_feed(&ld, &rxbuf[off], len - off, &ready);
+                if (ready) {
+                    flush_echo(uart_num, &ld);
+                    xQueueSend(line_queue, ld.line, portMAX_DELAY);
+                    console_line_reset(&ld);
+                } else if (off < len) {
+                    flush_echo(uart_num, &ld);
                 }
             }
-        } while ((i < 255) && linebuf[i - 1] != '\r');
-        if (stop) {
-            break;
-        }
-        /* Remove the truncating \r\n */
-        linebuf[strlen((char *)linebuf) - 1] = '\0';
-        ret = esp_console_run((char *) linebuf, &cmd_ret);
-        if (ret < 0) {
-            break;
         }
+        flush_echo(uart_num, &ld);
     }
     vTaskDelete(NULL);
 }
 
 int console_init(void)
 {
-    /* Register CLI "key <value>" to accept input from user during pairing */
+    /* Register CLI "key <value>" to accept input from user during pairing
+     * and the runtime tuning commands */
     ble_register_cli();
 
-    xTaskCreate(console_task, "console_cli", 4096, (void *)0, 3, &cli_task);
-    if (cli_task == NULL)
+    line_queue = xQueueCreate(LINE_QUEUE_LENGTH, CONSOLE_LINE_MAX);
+    if (line_queue == NULL)
+    {
+        return ESP_FAIL;
+    }
+    if (task_topology_create(TASK_CONSOLE, console_task, (void *)0) != ESP_OK ||
+        task_topology_create(TASK_CONSOLE_DISPATCH, console_dispatch_task, NULL) != ESP_OK)
     {
         return ESP_FAIL;
     }
@@ -0,0 +1,120 @@
+#include <string.h>
+#include "console_line.h"
+
+#define ASCII_BS 0x08
+#define ASCII_ESC 0x1b
+#define ASCII_DEL 0x7f
+
+/* Worst case echo for a single byte ("\b \b"). */
+#define ECHO_RESERVE 3
+
+void console_line_init(console_line_t *ld)
+{
+    memset(ld, 0, sizeof(*ld));
+}
+
+/**
+ * Clears the current line after it has been consumed. Pending echo is kept.
+ */
+void console_line_reset(console_line_t *ld)
+{
+    ld->len = 0;
+    ld->line[0] = '\0';
+    if (ld->state != LINE_STATE_AFTER_CR)
+    {
+        ld->state = LINE_STATE_NORMAL;
+    }
+}
+
+static void echo(console_line_t *ld, const char *data, size_t len)
+{
+    memcpy(&ld->echo[ld->echo_len], data, len);
+    ld->echo_len += len;
+}
+
+/**
+ * Feeds received bytes through the line discipline. Stops after a complete
+ * line (line_ready is set and line holds it without the terminator) or when
+ * the echo buffer needs flushing.
+ * @returns The number of bytes consumed.
+ */
+size_t console_line_feed(console_line_t *ld, const uint8_t *data, size_t len,
+                         bool *line_ready)
+{
+    size_t i = 0;
+    *line_ready = false;
+
+    while (i < len && ld->echo_len + ECHO_RESERVE <= CONSOLE_ECHO_MAX)
+    {
+        uint8_t c = data[i++];
+        switch (ld->state)
+        {
+        case LINE_STATE_ESCAPE:
+            ld->state = c == '[' ? LINE_STATE_CSI : LINE_STATE_NORMAL;
+            continue;
+
+        case LINE_STATE_CSI:
+            /* Cursor keys and friends end with a byte in 0x40..0x7e. */
+            if (c >= 0x40 && c <= 0x7e)
+            {
+                ld->state = LINE_STATE_NORMAL;
+            }
+            continue;
+
+        case LINE_STATE_AFTER_CR:
+            ld->state = LINE_STATE_NORMAL;
+            if (c == '\n')
+            {
+                continue;
+            }
+            break;
+
+        default:
+            break;
+        }
+
+        if (c == '\r' || c == '\n')
+        {
+            echo(ld, "\r\n", 2);
+            bool overflowed = ld->state == LINE_STATE_OVERFLOW;
+            ld->state = c == '\r' ? LINE_STATE_AFTER_CR : LINE_STATE_NORMAL;
+            if (overflowed)
+            {
+                console_line_reset(ld);
+                continue;
+            }
+            ld->line[ld->len] = '\0';
+            *line_ready = true;
+            return i;
+        }
+
+        if (ld->state == LINE_STATE_OVERFLOW)
+        {
+            continue;
+        }
+
+        if (c == ASCII_BS || c == ASCII_DEL)
+        {
+            if (ld->len > 0)
+            {
+                ld->len--;
+                echo(ld, "\b \b", 3);
+            }
+        }
+        else if (c == ASCII_ESC)
+        {
+            ld->state = LINE_STATE_ESCAPE;
+        }
+        else if (c >= 0x20 && c < 0x7f)
+        {
+            if (ld->len + 1 >= CONSOLE_LINE_MAX)
+            {
+                ld->state = LINE_STATE_OVERFLOW;
+                continue;
+            }
+            ld->line[ld->len++] = c;
+            echo(ld, (const char *)&c, 1);
+        }
+    }
+    return i;
+}
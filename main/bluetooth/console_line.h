@@ -0,0 +1,38 @@
+#ifndef _CONSOLE_LINE_H
+#define _CONSOLE_LINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONSOLE_LINE_MAX 128
+#define CONSOLE_ECHO_MAX 256
+
+typedef enum
+{
+    LINE_STATE_NORMAL = 0,
+    LINE_STATE_AFTER_CR,
+    LINE_STATE_ESCAPE,
+    LINE_STATE_CSI,
+    LINE_STATE_OVERFLOW,
+} console_line_state_t;
+
+/*
+ * Line discipline for the serial console. Bytes are fed in bulk; echo is
+ * collected in echo[] so it can be written back in one call.
+ */
+typedef struct
+{
+    console_line_state_t state;
+    char line[CONSOLE_LINE_MAX];
+    size_t len;
+    char echo[CONSOLE_ECHO_MAX];
+    size_t echo_len;
+} console_line_t;
+
+void console_line_init(console_line_t *ld);
+size_t console_line_feed(console_line_t *ld, const uint8_t *data, size_t len,
+                         bool *line_ready);
+void console_line_reset(console_line_t *ld);
+
+#endif
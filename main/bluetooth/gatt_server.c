@@ -3,17 +3,37 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
 #include "host/ble_hs.h"
 #include "host/ble_uuid.h"
+#include "nimble/nimble_port.h"
 #include "services/gap/ble_svc_gap.h"
 #include "services/gatt/ble_svc_gatt.h"
 #include "gatt_server.h"
+#include "gatt_session.h"
+#include "mbuf_writer.h"
+#include "history_page.h"
+#include "conn_policy.h"
 #include "../wifi/wifi.h"
+#include "../temperature/sampling.h"
 #include "esp_log.h"
 #include "cJSON.h"
 
 #define DEBUG_LOG "******* DEBUG ******"
 
+/* A scan this recent is shared with other centrals instead of rescanning. */
+#define SCAN_REUSE_US (10 * 1000 * 1000)
+
+/*
+ * Longest Wi-Fi credentials write: a 32 byte SSID and a 64 character
+ * passphrase with every byte escaped as \u00XX, plus the keys and channel.
+ */
+#define WIFI_SSID_MAX 32
+#define WIFI_PASSWORD_MAX 64
+#define CONNECT_JSON_MAX ((WIFI_SSID_MAX + WIFI_PASSWORD_MAX) * 6 + \
+                          sizeof("{\"ssid\":\"\",\"password\":\"\",\"channel\":14}"))
+
 /**
  * The vendor specific security test service consists of two characteristics:
  *     o random-number-generator: generates a random 32-bit number each time
@@ -49,13 +69,43 @@ static const ble_uuid128_t get_wifi_conn_status_chr_uuid =
     BLE_UUID128_INIT(0x1d, 0x5f, 0xc9, 0xf7, 0x71, 0x01, 0x16, 0xc8,
                      0xe1, 0x45, 0x7e, 0x89, 0x9e, 0x65, 0x7e, 0xb0);
 
+/* 7a1c659e-897e-45e1-b016-007107c96df7 */
+static const ble_uuid128_t sampling_policy_chr_uuid =
+    BLE_UUID128_INIT(0xf7, 0x6d, 0xc9, 0x07, 0x71, 0x00, 0x16, 0xb0,
+                     0xe1, 0x45, 0x7e, 0x89, 0x9e, 0x65, 0x1c, 0x7a);
+
+/* 4157659e-897e-45e1-b016-007107c96df7 */
+static const ble_uuid128_t history_chr_uuid =
+    BLE_UUID128_INIT(0xf7, 0x6d, 0xc9, 0x07, 0x71, 0x00, 0x16, 0xb0,
+                     0xe1, 0x45, 0x7e, 0x89, 0x9e, 0x65, 0x57, 0x41);
+
 static int handle_wifi_ops(uint16_t conn_handle, uint16_t attr_handle,
                            struct ble_gatt_access_ctxt *ctxt,
                            void *arg);
 
-static char *ap_json;
+static int handle_sampling_policy(uint16_t conn_handle, uint16_t attr_handle,
+                                  struct ble_gatt_access_ctxt *ctxt,
+                                  void *arg);
 
-int scanned = 0;
+static int handle_alert_ops(uint16_t conn_handle, uint16_t attr_handle,
+                            struct ble_gatt_access_ctxt *ctxt,
+                            void *arg);
+
+static int handle_history(uint16_t conn_handle, uint16_t attr_handle,
+                          struct ble_gatt_access_ctxt *ctxt,
+                          void *arg);
+
+static scan_snapshot_t *latest_scan;
+static int64_t latest_scan_us;
+
+static uint16_t new_alert_val_handle;
+static uint8_t new_alert[2 + GATT_SVR_ALERT_TEXT_MAX_LEN];
+static uint16_t new_alert_len;
+static portMUX_TYPE new_alert_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct ble_npl_event new_alert_event;
+
+/* New Alert categories this server can raise. */
+static const uint16_t supported_alert_categories = 1 << GATT_SVR_ALERT_CAT_HIGH_PRIORITY;
 
 static const struct ble_gatt_svc_def services[] = {
     {
@@ -79,6 +129,39 @@ static const struct ble_gatt_svc_def services[] = {
              .uuid = &get_wifi_conn_status_chr_uuid.u,
              .access_cb = handle_wifi_ops,
              .flags = BLE_GATT_CHR_F_READ},
+            {/*** Characteristic: Sampling policy. */
+             .uuid = &sampling_policy_chr_uuid.u,
+             .access_cb = handle_sampling_policy,
+             .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_ENC |
+                      BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC},
+            {/*** Characteristic: Reading history. */
+             .uuid = &history_chr_uuid.u,
+             .access_cb = handle_history,
+             .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_READ_ENC |
+                      BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC},
+            {
+                0, /* No more characteristics in this service. */
+            }},
+    },
+
+    {
+        /*** Service: Alert Notification. */
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = BLE_UUID16_DECLARE(GATT_SVR_SVC_ALERT_UUID),
+        .characteristics = (struct ble_gatt_chr_def[]){
+            {/*** Characteristic: Supported New Alert Category. */
+             .uuid = BLE_UUID16_DECLARE(GATT_SVR_CHR_SUP_NEW_ALERT_CAT_UUID),
+             .access_cb = handle_alert_ops,
+             .flags = BLE_GATT_CHR_F_READ},
+            {/*** Characteristic: New Alert. */
+             .uuid = BLE_UUID16_DECLARE(GATT_SVR_CHR_NEW_ALERT),
+             .access_cb = handle_alert_ops,
+             .val_handle = &new_alert_val_handle,
+             .flags = BLE_GATT_CHR_F_NOTIFY},
+            {/*** Characteristic: Alert Notification Control Point. */
+             .uuid = BLE_UUID16_DECLARE(GATT_SVR_CHR_ALERT_NOT_CTRL_PT),
+             .access_cb = handle_alert_ops,
+             .flags = BLE_GATT_CHR_F_WRITE},
             {
                 0, /* No more characteristics in this service. */
             }},
@@ -95,7 +178,6 @@ static int process_write(struct os_mbuf *om, uint16_t max_len,
     uint16_t om_len;
     int rc;
     om_len = OS_MBUF_PKTLEN(om);
-    ESP_LOGI(DEBUG_LOG, "Process write JSON: %s", om->om_data);
     if (om_len > max_len)
     {
         return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
@@ -106,11 +188,162 @@ static int process_write(struct os_mbuf *om, uint16_t max_len,
     {
         return BLE_ATT_ERR_UNLIKELY;
     }
-    printf(dst);
 
     return 0;
 }
 
+/**
+ * Reads an optional integer field. A missing field leaves *out unchanged.
+ * @returns false when the field is present but not an integer in [min, max].
+ */
+static bool json_get_integer(const cJSON *root, const char *name,
+                             double min, double max, double *out)
+{
+    const cJSON *item = cJSON_GetObjectItem(root, name);
+    if (item == NULL)
+    {
+        return true;
+    }
+    if (!cJSON_IsNumber(item) || !(item->valuedouble >= min && item->valuedouble <= max) ||
+        item->valuedouble != (double)(int64_t)item->valuedouble)
+    {
+        return false;
+    }
+    *out = item->valuedouble;
+    return true;
+}
+
+static bool json_get_u32(const cJSON *root, const char *name, uint32_t *out)
+{
+    double value = *out;
+    if (!json_get_integer(root, name, 0, UINT32_MAX, &value))
+    {
+        return false;
+    }
+    *out = (uint32_t)value;
+    return true;
+}
+
+static bool json_get_i32(const cJSON *root, const char *name, int32_t min, int32_t *out)
+{
+    double value = *out;
+    if (!json_get_integer(root, name, min, INT32_MAX, &value))
+    {
+        return false;
+    }
+    *out = (int32_t)value;
+    return true;
+}
+
+static const char *provision_state_name(provision_state_t state)
+{
+    switch (state)
+    {
+    case PROVISION_SCANNED:
+        return "SCANNED";
+    case PROVISION_CONNECTING:
+        return "CONNECTING";
+    default:
+        return "IDLE";
+    }
+}
+
+/**
+ * Reports the station's link as {"state":"CONNECTED"}. Before this central
+ * asked for a connection the state is its provisioning step (IDLE or
+ * SCANNED). After that it is CONNECTING until the link is up, or FAILED
+ * with the wifi_err_reason_t of the last failed attempt as "reason" while
+ * the station keeps retrying.
+ */
+static int write_connection_status(gatt_session_t *session, struct os_mbuf *om)
+{
+    mbuf_writer_t writer;
+    uint8_t reason = wifi_last_failure_reason();
+    const char *state = provision_state_name(session->state);
+
+    if (wifi_is_connected())
+    {
+        state = "CONNECTED";
+    }
+    else if (session->state == PROVISION_CONNECTING && reason != 0)
+    {
+        state = "FAILED";
+    }
+    mbuf_writer_init(&writer, om);
+    mbuf_json_object_begin(&writer, NULL);
+    mbuf_json_string(&writer, "state", state);
+    if (strcmp(state, "FAILED") == 0)
+    {
+        mbuf_json_number(&writer, "reason", reason);
+    }
+    mbuf_json_object_end(&writer);
+    return mbuf_writer_finish(&writer);
+}
+
+/**
+ * Returns a reference to a scan snapshot, reusing the latest one when it is
+ * fresh enough.
+ */
+static scan_snapshot_t *acquire_scan(void)
+{
+    int64_t now = esp_timer_get_time();
+    if (latest_scan == NULL || now - latest_scan_us > SCAN_REUSE_US)
+    {
+        scan_snapshot_t *scan = scan_snapshot_create(get_aps_json());
+        if (scan == NULL)
+        {
+            return NULL;
+        }
+        scan_snapshot_release(latest_scan);
+        latest_scan = scan;
+        latest_scan_us = now;
+    }
+    return scan_snapshot_retain(latest_scan);
+}
+
+/**
+ * Starts a connection from {"ssid":...,"password":...,"channel":n}. The
+ * channel is optional and 0 (any) by default. Credentials are never logged.
+ */
+static int handle_connect_write(gatt_session_t *session, struct os_mbuf *om)
+{
+    char buf[CONNECT_JSON_MAX + 1];
+    uint16_t len;
+    cJSON *root, *ssid, *password, *channel;
+    int rc;
+
+    rc = process_write(om, sizeof(buf) - 1, buf, &len);
+    if (rc != 0)
+    {
+        return rc;
+    }
+    buf[len] = '\0';
+
+    root = cJSON_Parse(buf);
+    if (root == NULL)
+    {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+    ssid = cJSON_GetObjectItem(root, "ssid");
+    password = cJSON_GetObjectItem(root, "password");
+    channel = cJSON_GetObjectItem(root, "channel");
+    if (!cJSON_IsString(ssid) || !cJSON_IsString(password) ||
+        strlen(ssid->valuestring) == 0 || strlen(ssid->valuestring) > WIFI_SSID_MAX ||
+        strlen(password->valuestring) > WIFI_PASSWORD_MAX ||
+        (channel != NULL &&
+         (!cJSON_IsNumber(channel) || channel->valueint < 0 || channel->valueint > 14)))
+    {
+        cJSON_Delete(root);
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    connect_to_ap(ssid->valuestring, channel != NULL ? channel->valueint : 0,
+                  password->valuestring);
+    session->state = PROVISION_CONNECTING;
+    cJSON_Delete(root);
+    return 0;
+}
+
 static int handle_wifi_ops(uint16_t conn_handle, uint16_t attr_handle,
                            struct ble_gatt_access_ctxt *ctxt,
                            void *arg)
@@ -119,24 +352,34 @@ static int handle_wifi_ops(uint16_t conn_handle, uint16_t attr_handle,
     const ble_uuid_t *uuid;
     uuid = ctxt->chr->uuid;
     int rc;
+    gatt_session_t *session = gatt_session_find(conn_handle);
+    if (session == NULL)
+    {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+
     if (ble_uuid_cmp(uuid, &scan_wifi_aps_chr_uuid.u) == 0)
     {
 
         switch (ctxt->op)
         {
         case BLE_GATT_ACCESS_OP_READ_CHR:;
+            conn_policy_activity(conn_handle, CONN_PHASE_SCAN);
             ESP_LOGI(DEBUG_LOG, "Scanning...");
-            ap_json = get_aps_json();
-            ESP_LOGI(DEBUG_LOG, "Result: %s", ap_json);
-            cJSON *response_root;
-            response_root = cJSON_CreateObject();
-            cJSON_AddStringToObject(response_root, "data", "SCAN_COMPLETE");
-            cJSON_AddNumberToObject(response_root, "status", 200);
-            char* resp_str = cJSON_PrintUnformatted(response_root);
-            rc = os_mbuf_append(ctxt->om, resp_str, strlen(resp_str) * sizeof(char));
-            scanned = 1;
-            free(resp_str);
-            return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+            scan_snapshot_t *scan = acquire_scan();
+            if (scan == NULL)
+            {
+                return BLE_ATT_ERR_INSUFFICIENT_RES;
+            }
+            gatt_session_set_scan(session, scan);
+            ESP_LOGI(DEBUG_LOG, "Result: %s", scan->data);
+            mbuf_writer_t writer;
+            mbuf_writer_init(&writer, ctxt->om);
+            mbuf_json_object_begin(&writer, NULL);
+            mbuf_json_string(&writer, "data", "SCAN_COMPLETE");
+            mbuf_json_number(&writer, "status", 200);
+            mbuf_json_object_end(&writer);
+            return mbuf_writer_finish(&writer);
         default:
             assert(0);
             return BLE_ATT_ERR_UNLIKELY;
@@ -147,9 +390,11 @@ static int handle_wifi_ops(uint16_t conn_handle, uint16_t attr_handle,
         switch (ctxt->op)
         {
         case BLE_GATT_ACCESS_OP_READ_CHR:;
-            if (scanned == 1)
+            /* Long reads call back once per blob; NimBLE applies the offset. */
+            conn_policy_activity(conn_handle, CONN_PHASE_SCAN_RESULTS);
+            if (session->scan != NULL)
             {
-                rc = os_mbuf_append(ctxt->om, ap_json, strlen(ap_json) * sizeof(char));
+                rc = os_mbuf_append(ctxt->om, session->scan->data, session->scan->len);
                 return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
             }
             else
@@ -166,32 +411,288 @@ static int handle_wifi_ops(uint16_t conn_handle, uint16_t attr_handle,
     {
         switch (ctxt->op)
         {
-        case BLE_GATT_ACCESS_OP_WRITE_CHR:;
-            char *ap_connect_json = (char *)malloc(30 * sizeof(char));
-            printf("BLE_GATT_ACCESS_OP_WRITE_CHR: Figuring out what to do here\n");
-            rc = process_write(ctxt->om,
-                               sizeof ap_connect_json,
-                               &ap_connect_json, NULL);
-            ESP_LOGI(DEBUG_LOG, "Connect JSON: %s", ap_connect_json);
-
-            char *ssid = "";
-            char *password = "";
-            uint8_t channel = 1;
-            //connect_to_ap(ssid, channel, password);
-            return 0;
+        case BLE_GATT_ACCESS_OP_WRITE_CHR:
+            conn_policy_activity(conn_handle, CONN_PHASE_CONNECT);
+            return handle_connect_write(session, ctxt->om);
         }
         assert(0);
         return 0;
     }
     else if (ble_uuid_cmp(uuid, &get_wifi_conn_status_chr_uuid.u) == 0)
     {
-        ESP_LOGE(DEBUG_LOG, "Getting conn status");
-        return 0;
+        return write_connection_status(session, ctxt->om);
     }
     assert(0);
     return 0;
 }
 
+/**
+ * Reads or replaces the adaptive sampling policy as JSON, e.g.
+ * {"min_ms":1000,"max_ms":60000,"deadband_mc":250,"rate_mc_min":500,
+ *  "high_mc":8000,"low_mc":-25000}. Fields left out of a write keep their
+ * current value; a non-integer or negative period rejects the whole write.
+ */
+static int handle_sampling_policy(uint16_t conn_handle, uint16_t attr_handle,
+                                  struct ble_gatt_access_ctxt *ctxt,
+                                  void *arg)
+{
+    sampling_policy_t policy;
+    mbuf_writer_t writer;
+    char buf[192];
+    uint16_t len;
+    cJSON *root;
+    bool valid;
+    int rc;
+
+    conn_policy_activity(conn_handle, CONN_PHASE_CONFIG);
+    sampling_get_policy(&policy);
+    switch (ctxt->op)
+    {
+    case BLE_GATT_ACCESS_OP_READ_CHR:
+        mbuf_writer_init(&writer, ctxt->om);
+        mbuf_json_object_begin(&writer, NULL);
+        mbuf_json_number(&writer, "min_ms", policy.min_period_ms);
+        mbuf_json_number(&writer, "max_ms", policy.max_period_ms);
+        mbuf_json_number(&writer, "deadband_mc", policy.deadband_millicelsius);
+        mbuf_json_number(&writer, "rate_mc_min", policy.rate_millicelsius_per_min);
+        mbuf_json_number(&writer, "high_mc", policy.high_threshold_millicelsius);
+        mbuf_json_number(&writer, "low_mc", policy.low_threshold_millicelsius);
+        mbuf_json_object_end(&writer);
+        return mbuf_writer_finish(&writer);
+
+    case BLE_GATT_ACCESS_OP_WRITE_CHR:
+        rc = process_write(ctxt->om, sizeof(buf) - 1, buf, &len);
+        if (rc != 0)
+        {
+            return rc;
+        }
+        buf[len] = '\0';
+        root = cJSON_Parse(buf);
+        if (root == NULL)
+        {
+            return BLE_ATT_ERR_UNLIKELY;
+        }
+        valid = json_get_u32(root, "min_ms", &policy.min_period_ms) &&
+                json_get_u32(root, "max_ms", &policy.max_period_ms) &&
+                json_get_i32(root, "deadband_mc", 0, &policy.deadband_millicelsius) &&
+                json_get_i32(root, "rate_mc_min", 0, &policy.rate_millicelsius_per_min) &&
+                json_get_i32(root, "high_mc", INT32_MIN, &policy.high_threshold_millicelsius) &&
+                json_get_i32(root, "low_mc", INT32_MIN, &policy.low_threshold_millicelsius);
+        cJSON_Delete(root);
+        if (!valid)
+        {
+            return BLE_ATT_ERR_UNLIKELY;
+        }
+        return sampling_set_policy(&policy) == ESP_OK ? 0 : BLE_ATT_ERR_UNLIKELY;
+
+    default:
+        assert(0);
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+}
+
+/**
+ * Pages through the stored history. A write of {"from":t,"to":t,"step":n}
+ * selects the range; a read returns the page at that cursor, see
+ * history_page.h. The central writes "from" = next and "skip" = skip for
+ * the following page, until next is 0. Reads never move the cursor, so
+ * long reads that NimBLE splits by offset see the same page.
+ */
+static int handle_history(uint16_t conn_handle, uint16_t attr_handle,
+                          struct ble_gatt_access_ctxt *ctxt,
+                          void *arg)
+{
+    gatt_session_t *session = gatt_session_find(conn_handle);
+    char buf[96];
+    uint16_t len;
+    uint32_t from = 0, skip = 0, to = 0;
+    double step;
+    bool valid;
+    cJSON *root;
+    int rc;
+
+    if (session == NULL)
+    {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+    conn_policy_activity(conn_handle, CONN_PHASE_HISTORY);
+
+    switch (ctxt->op)
+    {
+    case BLE_GATT_ACCESS_OP_READ_CHR:
+        return history_page_write(ctxt->om, ble_att_mtu(conn_handle),
+                                  session->history_from, session->history_skip,
+                                  session->history_to ? session->history_to : UINT32_MAX,
+                                  session->history_step);
+
+    case BLE_GATT_ACCESS_OP_WRITE_CHR:
+        rc = process_write(ctxt->om, sizeof(buf) - 1, buf, &len);
+        if (rc != 0)
+        {
+            return rc;
+        }
+        buf[len] = '\0';
+        root = cJSON_Parse(buf);
+        if (root == NULL)
+        {
+            return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+        }
+        step = 1;
+        valid = json_get_u32(root, "from", &from) &&
+                json_get_u32(root, "skip", &skip) &&
+                json_get_u32(root, "to", &to) &&
+                json_get_integer(root, "step", 1, UINT16_MAX, &step);
+        cJSON_Delete(root);
+        if (!valid)
+        {
+            return BLE_ATT_ERR_UNLIKELY;
+        }
+        session->history_from = from;
+        session->history_skip = skip;
+        session->history_to = to;
+        session->history_step = step;
+        return 0;
+
+    default:
+        assert(0);
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+}
+
+/**
+ * Sends the latest New Alert to one session if it subscribed and enabled the
+ * alert's category through the control point. Runs on the host task.
+ */
+static void notify_session_alert(gatt_session_t *session, void *arg)
+{
+    uint8_t value[sizeof(new_alert)];
+    uint16_t len;
+    struct os_mbuf *om;
+
+    portENTER_CRITICAL(&new_alert_lock);
+    len = new_alert_len;
+    memcpy(value, new_alert, len);
+    portEXIT_CRITICAL(&new_alert_lock);
+
+    if (len == 0 || value[0] >= 16 || !(session->alert_categories & (1 << value[0])) ||
+        !gatt_session_is_subscribed(session, new_alert_val_handle))
+    {
+        return;
+    }
+    om = ble_hs_mbuf_from_flat(value, len);
+    if (om == NULL || ble_gattc_notify_custom(session->conn_handle, new_alert_val_handle, om) != 0)
+    {
+        ESP_LOGW(DEBUG_LOG, "New Alert to conn_handle=%d dropped", session->conn_handle);
+    }
+}
+
+static void send_new_alert(struct ble_npl_event *event)
+{
+    gatt_session_for_each(notify_session_alert, NULL);
+}
+
+/**
+ * Handles the Alert Notification Control Point: a command byte followed by
+ * a category ID, or GATT_SVR_ALERT_CAT_ALL. Only New Alert commands are
+ * supported since the server has no unread alert status.
+ */
+static int handle_alert_control(uint16_t conn_handle, struct os_mbuf *om)
+{
+    gatt_session_t *session = gatt_session_find(conn_handle);
+    uint8_t command[2];
+    uint16_t len;
+    uint16_t categories;
+    int rc;
+
+    rc = process_write(om, sizeof(command), command, &len);
+    if (rc != 0)
+    {
+        return rc;
+    }
+    if (session == NULL)
+    {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+    if (len != sizeof(command))
+    {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
+
+    if (command[1] == GATT_SVR_ALERT_CAT_ALL)
+    {
+        categories = supported_alert_categories;
+    }
+    else if (command[1] < 16 && (supported_alert_categories & (1 << command[1])))
+    {
+        categories = 1 << command[1];
+    }
+    else
+    {
+        return GATT_SVR_ALERT_ERR_CMD_NOT_SUPPORTED;
+    }
+
+    switch (command[0])
+    {
+    case GATT_SVR_ALERT_CMD_ENABLE_NEW:
+        session->alert_categories |= categories;
+        return 0;
+    case GATT_SVR_ALERT_CMD_DISABLE_NEW:
+        session->alert_categories &= ~categories;
+        return 0;
+    case GATT_SVR_ALERT_CMD_NOTIFY_NEW:
+        notify_session_alert(session, NULL);
+        return 0;
+    default:
+        return GATT_SVR_ALERT_ERR_CMD_NOT_SUPPORTED;
+    }
+}
+
+static int handle_alert_ops(uint16_t conn_handle, uint16_t attr_handle,
+                            struct ble_gatt_access_ctxt *ctxt,
+                            void *arg)
+{
+    uint16_t uuid = ble_uuid_u16(ctxt->chr->uuid);
+    uint8_t value[2];
+    int rc;
+
+    if (uuid == GATT_SVR_CHR_SUP_NEW_ALERT_CAT_UUID &&
+        ctxt->op == BLE_GATT_ACCESS_OP_READ_CHR)
+    {
+        /* Category ID bit mask, little endian. */
+        value[0] = supported_alert_categories & 0xff;
+        value[1] = supported_alert_categories >> 8;
+        rc = os_mbuf_append(ctxt->om, value, sizeof(value));
+        return rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+    if (uuid == GATT_SVR_CHR_ALERT_NOT_CTRL_PT &&
+        ctxt->op == BLE_GATT_ACCESS_OP_WRITE_CHR)
+    {
+        return handle_alert_control(conn_handle, ctxt->om);
+    }
+
+    /* New Alert is notify only and sent through notify_session_alert(). */
+    assert(0);
+    return BLE_ATT_ERR_UNLIKELY;
+}
+
+/**
+ * Publishes a New Alert (category, count, text). The host task then
+ * notifies every central that subscribed and enabled the category.
+ */
+void gatt_server_notify_alert(uint8_t category, const char *text)
+{
+    size_t text_len = strnlen(text, GATT_SVR_ALERT_TEXT_MAX_LEN);
+
+    portENTER_CRITICAL(&new_alert_lock);
+    new_alert[0] = category;
+    new_alert[1] = 1;
+    memcpy(&new_alert[2], text, text_len);
+    new_alert_len = 2 + text_len;
+    portEXIT_CRITICAL(&new_alert_lock);
+
+    ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &new_alert_event);
+}
+
 // static int process_read_write(uint16_t conn_handle, uint16_t attr_handle,
 //                               struct ble_gatt_access_ctxt *ctxt,
 //                               void *arg)
@@ -267,6 +768,7 @@ int gatt_server_init(void)
     int rc;
     ESP_LOGE(DEBUG_LOG, "Initializing GATT server");
     ble_svc_gatt_init();
+    ble_npl_event_init(&new_alert_event, send_new_alert, NULL);
 
     ESP_LOGE(DEBUG_LOG, "Registering services");
     rc = ble_gatts_count_cfg(services);
@@ -1,8 +1,13 @@
 #ifndef _GATT_H
 #define _GATT_H
 
+#include <stdint.h>
+
+struct ble_gatt_register_ctxt;
+
 int gatt_server_init(void);
 void gatt_server_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
+void gatt_server_notify_alert(uint8_t category, const char *text);
 
 #define GATT_SVR_SVC_ALERT_UUID               0x1811
 #define GATT_SVR_CHR_SUP_NEW_ALERT_CAT_UUID   0x2A47
@@ -11,4 +16,14 @@ void gatt_server_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
 #define GATT_SVR_CHR_UNR_ALERT_STAT_UUID      0x2A45
 #define GATT_SVR_CHR_ALERT_NOT_CTRL_PT        0x2A44
 
+#define GATT_SVR_ALERT_CAT_HIGH_PRIORITY      8
+#define GATT_SVR_ALERT_CAT_ALL                0xff
+#define GATT_SVR_ALERT_TEXT_MAX_LEN           18
+
+/* Alert Notification Control Point commands and error code. */
+#define GATT_SVR_ALERT_CMD_ENABLE_NEW         0
+#define GATT_SVR_ALERT_CMD_DISABLE_NEW        2
+#define GATT_SVR_ALERT_CMD_NOTIFY_NEW         4
+#define GATT_SVR_ALERT_ERR_CMD_NOT_SUPPORTED  0xa0
+
 #endif
\ No newline at end of file
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "gatt_session.h"
+
+#define LOG_TAG "gatt_session"
+
+/*
+ * Sessions are only touched from the NimBLE host task (GAP events and GATT
+ * access callbacks), so the table itself needs no lock. Snapshots can
+ * outlive a session and are reference counted atomically.
+ */
+static gatt_session_t sessions[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+
+gatt_session_t *gatt_session_find(uint16_t conn_handle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (sessions[i].in_use && sessions[i].conn_handle == conn_handle)
+        {
+            return &sessions[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Allocates the session for a new connection.
+ * @returns The session, or NULL when every slot is taken.
+ */
+gatt_session_t *gatt_session_open(uint16_t conn_handle)
+{
+    gatt_session_t *session = gatt_session_find(conn_handle);
+    if (session != NULL)
+    {
+        return session;
+    }
+
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (!sessions[i].in_use)
+        {
+            memset(&sessions[i], 0, sizeof(sessions[i]));
+            sessions[i].in_use = true;
+            sessions[i].conn_handle = conn_handle;
+            return &sessions[i];
+        }
+    }
+    ESP_LOGE(LOG_TAG, "No free session for conn_handle=%d", conn_handle);
+    return NULL;
+}
+
+void gatt_session_close(uint16_t conn_handle)
+{
+    gatt_session_t *session = gatt_session_find(conn_handle);
+    if (session == NULL)
+    {
+        return;
+    }
+    scan_snapshot_release(session->scan);
+    memset(session, 0, sizeof(*session));
+}
+
+void gatt_session_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify)
+{
+    gatt_session_t *session = gatt_session_find(conn_handle);
+    if (session == NULL)
+    {
+        return;
+    }
+
+    for (int i = 0; i < session->notify_count; i++)
+    {
+        if (session->notify_handles[i] == attr_handle)
+        {
+            if (!notify)
+            {
+                session->notify_handles[i] = session->notify_handles[--session->notify_count];
+            }
+            return;
+        }
+    }
+    if (notify && session->notify_count < sizeof(session->notify_handles) / sizeof(uint16_t))
+    {
+        session->notify_handles[session->notify_count++] = attr_handle;
+    }
+}
+
+bool gatt_session_is_subscribed(const gatt_session_t *session, uint16_t attr_handle)
+{
+    for (int i = 0; i < session->notify_count; i++)
+    {
+        if (session->notify_handles[i] == attr_handle)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void gatt_session_for_each(gatt_session_fn fn, void *arg)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (sessions[i].in_use)
+        {
+            fn(&sessions[i], arg);
+        }
+    }
+}
+
+/**
+ * Points the session at a new scan result, taking over the caller's
+ * reference and dropping the previous one.
+ */
+void gatt_session_set_scan(gatt_session_t *session, scan_snapshot_t *scan)
+{
+    scan_snapshot_release(session->scan);
+    session->scan = scan;
+    session->state = scan != NULL ? PROVISION_SCANNED : PROVISION_IDLE;
+}
+
+/**
+ * Wraps a JSON string in a snapshot with a single reference. The string is
+ * freed.
+ */
+scan_snapshot_t *scan_snapshot_create(char *json)
+{
+    if (json == NULL)
+    {
+        return NULL;
+    }
+    size_t len = strlen(json);
+    scan_snapshot_t *snapshot = malloc(sizeof(*snapshot) + len + 1);
+    if (snapshot != NULL)
+    {
+        snapshot->refcount = 1;
+        snapshot->len = len;
+        memcpy(snapshot->data, json, len + 1);
+    }
+    free(json);
+    return snapshot;
+}
+
+scan_snapshot_t *scan_snapshot_retain(scan_snapshot_t *snapshot)
+{
+    if (snapshot != NULL)
+    {
+        __atomic_add_fetch(&snapshot->refcount, 1, __ATOMIC_RELAXED);
+    }
+    return snapshot;
+}
+
+void scan_snapshot_release(scan_snapshot_t *snapshot)
+{
+    if (snapshot != NULL &&
+        __atomic_sub_fetch(&snapshot->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(snapshot);
+    }
+}
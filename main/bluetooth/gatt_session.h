@@ -0,0 +1,55 @@
+#ifndef _GATT_SESSION_H
+#define _GATT_SESSION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An immutable scan result shared between sessions. Readers hold a
+ * reference instead of a copy; the last release frees it.
+ */
+typedef struct
+{
+    int refcount;
+    size_t len;
+    char data[];
+} scan_snapshot_t;
+
+typedef enum
+{
+    PROVISION_IDLE = 0,
+    PROVISION_SCANNED,
+    PROVISION_CONNECTING,
+} provision_state_t;
+
+typedef struct
+{
+    bool in_use;
+    uint16_t conn_handle;
+    provision_state_t state;
+    scan_snapshot_t *scan;
+    uint16_t notify_handles[4];
+    uint8_t notify_count;
+    uint16_t alert_categories;
+    uint32_t history_from;
+    uint32_t history_skip;
+    uint32_t history_to;
+    uint16_t history_step;
+} gatt_session_t;
+
+typedef void (*gatt_session_fn)(gatt_session_t *session, void *arg);
+
+gatt_session_t *gatt_session_open(uint16_t conn_handle);
+gatt_session_t *gatt_session_find(uint16_t conn_handle);
+void gatt_session_close(uint16_t conn_handle);
+void gatt_session_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
+bool gatt_session_is_subscribed(const gatt_session_t *session, uint16_t attr_handle);
+void gatt_session_for_each(gatt_session_fn fn, void *arg);
+void gatt_session_set_scan(gatt_session_t *session, scan_snapshot_t *scan);
+
+scan_snapshot_t *scan_snapshot_create(char *json);
+scan_snapshot_t *scan_snapshot_retain(scan_snapshot_t *snapshot);
+void scan_snapshot_release(scan_snapshot_t *snapshot);
+
+#endif
@@ -0,0 +1,78 @@
+#include <stdbool.h>
+#include "host/ble_hs.h"
+#include "esp_err.h"
+#include "mbuf_writer.h"
+#include "history_page.h"
+#include "../history/history.h"
+
+typedef struct
+{
+    mbuf_writer_t *writer;
+    struct os_mbuf *om;
+    uint16_t limit;
+    int rows;
+    /* The cursor for the next page. */
+    uint32_t next;
+    uint32_t next_skip;
+} history_page_t;
+
+static bool write_history_row(const history_row_t *row, void *arg)
+{
+    history_page_t *page = arg;
+
+    if (page->rows == HISTORY_PAGE_ROWS ||
+        (page->rows > 0 &&
+         OS_MBUF_PKTLEN(page->om) + HISTORY_ROW_MAX(row->count) + HISTORY_PAGE_TAIL > page->limit))
+    {
+        page->next = row->time;
+        page->next_skip = row->skip;
+        return false;
+    }
+    mbuf_json_array_begin(page->writer, NULL);
+    mbuf_json_unsigned(page->writer, NULL, row->time);
+    for (int i = 0; i < row->count; i++)
+    {
+        if (row->valid[i])
+        {
+            mbuf_json_number(page->writer, NULL, row->millicelsius[i]);
+        }
+        else
+        {
+            mbuf_json_null(page->writer, NULL);
+        }
+    }
+    mbuf_json_array_end(page->writer);
+    page->rows++;
+    return true;
+}
+
+/**
+ * Appends the history page at cursor (from, skip) to om as
+ * {"rows":[[t,mc,...],...],"next":t,"skip":n}: as many rows up to `to` as
+ * fit in mtu - 1 bytes, at least one and at most HISTORY_PAGE_ROWS. next is
+ * 0 after the last row; skip counts the records stamped next that this and
+ * earlier pages already sent.
+ * @returns 0 or the ATT error for the read.
+ */
+int history_page_write(struct os_mbuf *om, uint16_t mtu, uint32_t from, uint32_t skip,
+                       uint32_t to, uint16_t step)
+{
+    history_page_t page = {0};
+    mbuf_writer_t writer;
+
+    mbuf_writer_init(&writer, om);
+    page.writer = &writer;
+    page.om = om;
+    page.limit = OS_MBUF_PKTLEN(om) + mtu - 1;
+    mbuf_json_object_begin(&writer, NULL);
+    mbuf_json_array_begin(&writer, "rows");
+    if (history_query(from, skip, to, step, write_history_row, &page) != ESP_OK)
+    {
+        return BLE_ATT_ERR_UNLIKELY;
+    }
+    mbuf_json_array_end(&writer);
+    mbuf_json_unsigned(&writer, "next", page.next);
+    mbuf_json_unsigned(&writer, "skip", page.next_skip);
+    mbuf_json_object_end(&writer);
+    return mbuf_writer_finish(&writer);
+}
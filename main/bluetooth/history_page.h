@@ -0,0 +1,22 @@
+#ifndef _HISTORY_PAGE_H
+#define _HISTORY_PAGE_H
+
+#include <stdint.h>
+#include "os/os_mbuf.h"
+
+/*
+ * Rows per history page at most. Fewer are sent when the negotiated MTU
+ * cannot carry them in one read response.
+ */
+#define HISTORY_PAGE_ROWS 10
+
+/* Longest `],"next":4294967295,"skip":4294967295}` that closes a history page. */
+#define HISTORY_PAGE_TAIL 38
+
+/* Longest encoded row: time and one int32 per sensor, with separators. */
+#define HISTORY_ROW_MAX(count) (13 + 12 * (count))
+
+int history_page_write(struct os_mbuf *om, uint16_t mtu, uint32_t from, uint32_t skip,
+                       uint32_t to, uint16_t step);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <string.h>
+#include "host/ble_hs.h"
+#include "mbuf_writer.h"
+
+void mbuf_writer_init(mbuf_writer_t *w, struct os_mbuf *om)
+{
+    memset(w, 0, sizeof(*w));
+    w->om = om;
+    w->first[0] = true;
+}
+
+/**
+ * @returns 0 when everything was written, otherwise the ATT error to hand
+ * back to NimBLE so the central retries instead of getting a truncated
+ * response.
+ */
+int mbuf_writer_finish(mbuf_writer_t *w)
+{
+    return w->rc == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+void mbuf_writer_bytes(mbuf_writer_t *w, const void *data, uint16_t len)
+{
+    if (w->rc == 0 && len > 0)
+    {
+        w->rc = os_mbuf_append(w->om, data, len);
+    }
+}
+
+static void put_str(mbuf_writer_t *w, const char *str)
+{
+    mbuf_writer_bytes(w, str, strlen(str));
+}
+
+static void put_escaped(mbuf_writer_t *w, const char *str)
+{
+    const char *run = str;
+    mbuf_writer_bytes(w, "\"", 1);
+    for (; *str != '\0'; str++)
+    {
+        unsigned char c = *str;
+        if (c != '"' && c != '\\' && c >= 0x20)
+        {
+            continue;
+        }
+        mbuf_writer_bytes(w, run, str - run);
+        if (c == '"' || c == '\\')
+        {
+            char escaped[2] = {'\\', c};
+            mbuf_writer_bytes(w, escaped, 2);
+        }
+        else
+        {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            mbuf_writer_bytes(w, escaped, 6);
+        }
+        run = str + 1;
+    }
+    mbuf_writer_bytes(w, run, str - run);
+    mbuf_writer_bytes(w, "\"", 1);
+}
+
+/* Writes the separator and key that precede every value. */
+static void begin_value(mbuf_writer_t *w, const char *key)
+{
+    if (!w->first[w->depth])
+    {
+        mbuf_writer_bytes(w, ",", 1);
+    }
+    w->first[w->depth] = false;
+    if (key != NULL)
+    {
+        put_escaped(w, key);
+        mbuf_writer_bytes(w, ":", 1);
+    }
+}
+
+static void open_scope(mbuf_writer_t *w, const char *key, const char *bracket)
+{
+    begin_value(w, key);
+    put_str(w, bracket);
+    if (w->depth + 1 >= MBUF_WRITER_MAX_DEPTH)
+    {
+        w->rc = BLE_HS_EINVAL;
+        return;
+    }
+    w->first[++w->depth] = true;
+}
+
+static void close_scope(mbuf_writer_t *w, const char *bracket)
+{
+    put_str(w, bracket);
+    if (w->depth > 0)
+    {
+        w->depth--;
+    }
+}
+
+void mbuf_json_object_begin(mbuf_writer_t *w, const char *key)
+{
+    open_scope(w, key, "{");
+}
+
+void mbuf_json_object_end(mbuf_writer_t *w)
+{
+    close_scope(w, "}");
+}
+
+void mbuf_json_array_begin(mbuf_writer_t *w, const char *key)
+{
+    open_scope(w, key, "[");
+}
+
+void mbuf_json_array_end(mbuf_writer_t *w)
+{
+    close_scope(w, "]");
+}
+
+void mbuf_json_string(mbuf_writer_t *w, const char *key, const char *value)
+{
+    begin_value(w, key);
+    put_escaped(w, value);
+}
+
+void mbuf_json_number(mbuf_writer_t *w, const char *key, int32_t value)
+{
+    char buf[12];
+    int len = snprintf(buf, sizeof(buf), "%d", value);
+    begin_value(w, key);
+    mbuf_writer_bytes(w, buf, len);
+}
+
+void mbuf_json_unsigned(mbuf_writer_t *w, const char *key, uint32_t value)
+{
+    char buf[11];
+    int len = snprintf(buf, sizeof(buf), "%u", value);
+    begin_value(w, key);
+    mbuf_writer_bytes(w, buf, len);
+}
+
+void mbuf_json_null(mbuf_writer_t *w, const char *key)
+{
+    begin_value(w, key);
+    put_str(w, "null");
+}
@@ -0,0 +1,38 @@
+#ifndef _MBUF_WRITER_H
+#define _MBUF_WRITER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "os/os_mbuf.h"
+
+#define MBUF_WRITER_MAX_DEPTH 8
+
+/*
+ * Serializes a response straight into a GATT response mbuf chain, without
+ * an intermediate heap string. The first failed append (usually msys
+ * exhaustion) latches and every later write becomes a no-op, so callers
+ * only check the result once in mbuf_writer_finish().
+ */
+typedef struct
+{
+    struct os_mbuf *om;
+    int rc;
+    uint8_t depth;
+    bool first[MBUF_WRITER_MAX_DEPTH];
+} mbuf_writer_t;
+
+void mbuf_writer_init(mbuf_writer_t *w, struct os_mbuf *om);
+int mbuf_writer_finish(mbuf_writer_t *w);
+
+void mbuf_writer_bytes(mbuf_writer_t *w, const void *data, uint16_t len);
+
+void mbuf_json_object_begin(mbuf_writer_t *w, const char *key);
+void mbuf_json_object_end(mbuf_writer_t *w);
+void mbuf_json_array_begin(mbuf_writer_t *w, const char *key);
+void mbuf_json_array_end(mbuf_writer_t *w);
+void mbuf_json_string(mbuf_writer_t *w, const char *key, const char *value);
+void mbuf_json_number(mbuf_writer_t *w, const char *key, int32_t value);
+void mbuf_json_unsigned(mbuf_writer_t *w, const char *key, uint32_t value);
+void mbuf_json_null(mbuf_writer_t *w, const char *key);
+
+#endif
@@ -0,0 +1,407 @@
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "host/ble_hs.h"
+#include "host/ble_store.h"
+#include "reconnect.h"
+
+#define LOG_TAG "reconnect"
+
+/* High-duty directed advertising is capped at 1.28 s by the spec. */
+#define DIRECTED_ADV_MS 1280
+
+/* How long only bonded peers may connect before advertising opens up. */
+#define ACCEPT_LIST_ADV_MS 10000
+
+#define MAX_BONDED_PEERS 8
+
+/*
+ * NimBLE declares this only in its private ble_hs_pvcy_priv.h. A new bond
+ * is added to the resolving list by ble_store_write_peer_sec(); the bonds
+ * from before a reset have to be loaded again.
+ */
+int ble_hs_pvcy_add_entry(const uint8_t *addr, uint8_t addr_type, const uint8_t *irk);
+
+typedef struct
+{
+    bool in_use;
+    bool bonded;
+    bool secured;
+    uint16_t conn_handle;
+    ble_addr_t peer;
+    int64_t connected_us;
+} pending_conn_t;
+
+static reconnect_phase_t phase = RECONNECT_PHASE_OPEN;
+static int64_t cycle_started_us;
+static int bonded_count;
+static ble_addr_t last_peer;
+static bool have_last_peer;
+static ble_addr_t directed_peer;
+static pending_conn_t conns[CONFIG_BT_NIMBLE_MAX_CONNECTIONS];
+static reconnect_stats_t stats;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *phase_name(reconnect_phase_t p)
+{
+    switch (p)
+    {
+    case RECONNECT_PHASE_DIRECTED:
+        return "directed";
+    case RECONNECT_PHASE_ACCEPT_LIST:
+        return "accept_list";
+    case RECONNECT_PHASE_BEACON:
+        return "beacon";
+    default:
+        return "open";
+    }
+}
+
+static bool is_bonded(const ble_addr_t *peer)
+{
+    struct ble_store_key_sec key = {0};
+    struct ble_store_value_sec value;
+
+    key.peer_addr = *peer;
+    return ble_store_read_peer_sec(&key, &value) == 0;
+}
+
+static pending_conn_t *find_conn(uint16_t conn_handle)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (conns[i].in_use && conns[i].conn_handle == conn_handle)
+        {
+            return &conns[i];
+        }
+    }
+    return NULL;
+}
+
+static bool is_connected(const ble_addr_t *peer)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (conns[i].in_use && ble_addr_cmp(&conns[i].peer, peer) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool slots_full(void)
+{
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (!conns[i].in_use)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Loads the IRK of every bonded peer into the controller's resolving list,
+ * so phones that use resolvable private addresses are seen under their
+ * identity address: the accept list matches them and directed advertising
+ * reaches them. Call once per host sync, before advertising starts.
+ */
+void reconnect_load_identities(void)
+{
+    ble_addr_t peers[MAX_BONDED_PEERS];
+    struct ble_store_key_sec key = {0};
+    struct ble_store_value_sec value;
+    int count, loaded = 0, with_irk = 0;
+    int rc;
+
+    if (ble_store_util_bonded_peers(peers, &count, MAX_BONDED_PEERS) != 0)
+    {
+        return;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        key.peer_addr = peers[i];
+        if (ble_store_read_peer_sec(&key, &value) != 0 || !value.irk_present)
+        {
+            continue;
+        }
+        with_irk++;
+        rc = ble_hs_pvcy_add_entry(value.peer_addr.val, value.peer_addr.type, value.irk);
+        if (rc != 0)
+        {
+            ESP_LOGW(LOG_TAG, "Could not add a peer IRK to the resolving list; rc=%d", rc);
+            continue;
+        }
+        loaded++;
+    }
+    ESP_LOGI(LOG_TAG, "%d of %d bonded peers in the resolving list, %d without an IRK",
+             loaded, count, count - with_irk);
+}
+
+/**
+ * Starts a new advertising cycle. Loads the bonded peers from the store
+ * into the controller's accept list; must be called while not advertising.
+ */
+void reconnect_start(void)
+{
+    ble_addr_t peers[MAX_BONDED_PEERS];
+    bool directed;
+    int rc;
+
+    cycle_started_us = esp_timer_get_time();
+    rc = ble_store_util_bonded_peers(peers, &bonded_count, MAX_BONDED_PEERS);
+    if (rc != 0)
+    {
+        bonded_count = 0;
+    }
+    if (bonded_count > 0)
+    {
+        rc = ble_gap_wl_set(peers, bonded_count);
+        if (rc != 0)
+        {
+            ESP_LOGW(LOG_TAG, "Could not load the accept list; rc=%d", rc);
+            bonded_count = 0;
+        }
+    }
+
+    /* The store keeps bonds in the order they were made. */
+    if (!have_last_peer && bonded_count > 0)
+    {
+        last_peer = peers[bonded_count - 1];
+        have_last_peer = true;
+    }
+    if (have_last_peer && !is_bonded(&last_peer))
+    {
+        have_last_peer = false;
+    }
+
+    /* Directed advertising at a peer that is connected on another link
+     * cannot succeed; aim at the newest bonded peer that is not instead. */
+    directed = have_last_peer && !is_connected(&last_peer);
+    directed_peer = last_peer;
+    for (int i = bonded_count - 1; i >= 0 && have_last_peer && !directed; i--)
+    {
+        if (!is_connected(&peers[i]))
+        {
+            directed_peer = peers[i];
+            directed = true;
+        }
+    }
+
+    if (directed)
+    {
+        phase = RECONNECT_PHASE_DIRECTED;
+    }
+    else
+    {
+        phase = bonded_count > 0 ? RECONNECT_PHASE_ACCEPT_LIST : RECONNECT_PHASE_OPEN;
+    }
+    ESP_LOGI(LOG_TAG, "%d bonded peers, starting with %s advertising",
+             bonded_count, phase_name(phase));
+}
+
+/**
+ * Fills in the advertising parameters for the current phase, or for a
+ * non-connectable beacon when no connection slot is free. The cycle's own
+ * phase is kept for when a slot frees up.
+ * @returns The phase; peer is only set for directed advertising.
+ */
+reconnect_phase_t reconnect_adv_params(struct ble_gap_adv_params *params,
+                                       ble_addr_t *peer, int32_t *duration_ms)
+{
+    reconnect_phase_t adv_phase;
+
+    /* The target may have connected since the cycle started. */
+    if (phase == RECONNECT_PHASE_DIRECTED && is_connected(&directed_peer))
+    {
+        reconnect_adv_timeout();
+    }
+    adv_phase = slots_full() ? RECONNECT_PHASE_BEACON : phase;
+    memset(params, 0, sizeof(*params));
+    switch (adv_phase)
+    {
+    case RECONNECT_PHASE_DIRECTED:
+        params->conn_mode = BLE_GAP_CONN_MODE_DIR;
+        params->disc_mode = BLE_GAP_DISC_MODE_NON;
+        params->high_duty_cycle = 1;
+        *peer = directed_peer;
+        *duration_ms = DIRECTED_ADV_MS;
+        break;
+
+    case RECONNECT_PHASE_ACCEPT_LIST:
+        params->conn_mode = BLE_GAP_CONN_MODE_UND;
+        params->disc_mode = BLE_GAP_DISC_MODE_GEN;
+        /* Only connections are filtered; scan responses go to everyone. */
+        params->filter_policy = BLE_HCI_ADV_FILT_CONN;
+        *duration_ms = ACCEPT_LIST_ADV_MS;
+        break;
+
+    case RECONNECT_PHASE_BEACON:
+        params->conn_mode = BLE_GAP_CONN_MODE_NON;
+        params->disc_mode = BLE_GAP_DISC_MODE_GEN;
+        *duration_ms = BLE_HS_FOREVER;
+        break;
+
+    default:
+        params->conn_mode = BLE_GAP_CONN_MODE_UND;
+        params->disc_mode = BLE_GAP_DISC_MODE_GEN;
+        *duration_ms = BLE_HS_FOREVER;
+        break;
+    }
+    return adv_phase;
+}
+
+/* Moves on to the next phase when advertising in this one timed out. */
+void reconnect_adv_timeout(void)
+{
+    if (phase == RECONNECT_PHASE_DIRECTED && bonded_count > 0)
+    {
+        phase = RECONNECT_PHASE_ACCEPT_LIST;
+    }
+    else
+    {
+        phase = RECONNECT_PHASE_OPEN;
+    }
+    ESP_LOGI(LOG_TAG, "Falling back to %s advertising", phase_name(phase));
+}
+
+static void record(reconnect_peer_stats_t *peer_stats, uint32_t connect_ms)
+{
+    portENTER_CRITICAL(&stats_lock);
+    peer_stats->connections++;
+    peer_stats->last_connect_ms = connect_ms;
+    peer_stats->total_connect_ms += connect_ms;
+    portEXIT_CRITICAL(&stats_lock);
+}
+
+/**
+ * Records the time from the start of advertising to the connection. A
+ * bonded peer is asked to re-encrypt with its stored keys straight away,
+ * so it never goes through pairing again.
+ */
+void reconnect_on_connect(uint16_t conn_handle)
+{
+    struct ble_gap_conn_desc desc;
+    pending_conn_t *conn = NULL;
+    uint32_t connect_ms;
+    int rc;
+
+    if (ble_gap_conn_find(conn_handle, &desc) != 0)
+    {
+        return;
+    }
+    for (int i = 0; i < CONFIG_BT_NIMBLE_MAX_CONNECTIONS; i++)
+    {
+        if (!conns[i].in_use)
+        {
+            conn = &conns[i];
+            break;
+        }
+    }
+    if (conn == NULL)
+    {
+        return;
+    }
+
+    memset(conn, 0, sizeof(*conn));
+    conn->in_use = true;
+    conn->conn_handle = conn_handle;
+    conn->peer = desc.peer_id_addr;
+    conn->connected_us = esp_timer_get_time();
+    conn->bonded = is_bonded(&desc.peer_id_addr);
+    connect_ms = (conn->connected_us - cycle_started_us) / 1000;
+    record(conn->bonded ? &stats.bonded : &stats.fresh, connect_ms);
+    ESP_LOGI(LOG_TAG, "conn_handle=%d %s peer connected %u ms after %s advertising",
+             conn_handle, conn->bonded ? "bonded" : "new", connect_ms, phase_name(phase));
+
+    if (conn->bonded)
+    {
+        last_peer = desc.peer_id_addr;
+        have_last_peer = true;
+        rc = ble_gap_security_initiate(conn_handle);
+        if (rc != 0 && rc != BLE_HS_EALREADY)
+        {
+            ESP_LOGW(LOG_TAG, "Could not start encryption; rc=%d", rc);
+        }
+    }
+}
+
+/* Records the time from connection to an encrypted link. */
+void reconnect_on_encrypted(uint16_t conn_handle, int status)
+{
+    pending_conn_t *conn = find_conn(conn_handle);
+    struct ble_gap_conn_desc desc;
+    reconnect_peer_stats_t *peer_stats;
+    uint32_t secure_ms;
+
+    if (conn == NULL || conn->secured || status != 0)
+    {
+        return;
+    }
+    conn->secured = true;
+    secure_ms = (esp_timer_get_time() - conn->connected_us) / 1000;
+    peer_stats = conn->bonded ? &stats.bonded : &stats.fresh;
+    portENTER_CRITICAL(&stats_lock);
+    peer_stats->last_secure_ms = secure_ms;
+    peer_stats->total_secure_ms += secure_ms;
+    portEXIT_CRITICAL(&stats_lock);
+    ESP_LOGI(LOG_TAG, "conn_handle=%d encrypted %u ms after connecting (%s)",
+             conn_handle, secure_ms, conn->bonded ? "stored keys" : "paired");
+
+    /* A newly bonded peer becomes the target of directed advertising. */
+    if (ble_gap_conn_find(conn_handle, &desc) == 0 && desc.sec_state.bonded)
+    {
+        last_peer = desc.peer_id_addr;
+        have_last_peer = true;
+    }
+}
+
+/*
+ * The peer's identity address became known, either from the resolving list
+ * or from the keys it just distributed while bonding.
+ */
+void reconnect_on_identity(uint16_t conn_handle)
+{
+    pending_conn_t *conn = find_conn(conn_handle);
+    struct ble_gap_conn_desc desc;
+
+    if (conn == NULL || ble_gap_conn_find(conn_handle, &desc) != 0)
+    {
+        return;
+    }
+    conn->peer = desc.peer_id_addr;
+    if (desc.sec_state.bonded)
+    {
+        last_peer = desc.peer_id_addr;
+        have_last_peer = true;
+    }
+}
+
+void reconnect_on_disconnect(uint16_t conn_handle)
+{
+    pending_conn_t *conn = find_conn(conn_handle);
+    if (conn != NULL)
+    {
+        conn->in_use = false;
+    }
+}
+
+/* Stops targeting a peer whose bond was deleted. */
+void reconnect_forget_peer(const ble_addr_t *peer)
+{
+    if (have_last_peer && ble_addr_cmp(&last_peer, peer) == 0)
+    {
+        have_last_peer = false;
+    }
+}
+
+void reconnect_get_stats(reconnect_stats_t *out)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_lock);
+}
@@ -0,0 +1,56 @@
+#ifndef _RECONNECT_H
+#define _RECONNECT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "host/ble_hs.h"
+
+/*
+ * Advertising runs in phases after boot and after every disconnect:
+ * high-duty directed advertising to the last bonded peer, then undirected
+ * advertising that only bonded peers on the accept list may answer, then
+ * open advertising for anyone. Phases without a bonded peer are skipped.
+ * While every connection slot is taken the device only advertises its
+ * beacon, non-connectable, whatever the phase.
+ *
+ * Bonded peers are kept by identity address. Their IRKs go into the
+ * controller's resolving list and the device advertises with a resolvable
+ * private address, so the controller resolves phones that use one and
+ * addresses directed advertising to their current private address.
+ */
+typedef enum
+{
+    RECONNECT_PHASE_DIRECTED = 0,
+    RECONNECT_PHASE_ACCEPT_LIST,
+    RECONNECT_PHASE_OPEN,
+    RECONNECT_PHASE_BEACON,
+} reconnect_phase_t;
+
+typedef struct
+{
+    uint32_t connections;
+    uint32_t last_connect_ms;
+    uint32_t total_connect_ms;
+    uint32_t last_secure_ms;
+    uint32_t total_secure_ms;
+} reconnect_peer_stats_t;
+
+typedef struct
+{
+    reconnect_peer_stats_t bonded;
+    reconnect_peer_stats_t fresh;
+} reconnect_stats_t;
+
+void reconnect_load_identities(void);
+void reconnect_start(void);
+reconnect_phase_t reconnect_adv_params(struct ble_gap_adv_params *params,
+                                       ble_addr_t *peer, int32_t *duration_ms);
+void reconnect_adv_timeout(void);
+void reconnect_on_connect(uint16_t conn_handle);
+void reconnect_on_encrypted(uint16_t conn_handle, int status);
+void reconnect_on_identity(uint16_t conn_handle);
+void reconnect_on_disconnect(uint16_t conn_handle);
+void reconnect_forget_peer(const ble_addr_t *peer);
+void reconnect_get_stats(reconnect_stats_t *stats);
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "coap.h"
+#include "coap_server.h"
+#include "../temperature/readings.h"
+#include "../tasks/task_topology.h"
+
+#define LOG_TAG "coap_server"
+
+/* How long coap_run_once() may block before new readings are checked. */
+#define POLL_INTERVAL_MS 250
+
+#define PAYLOAD_MAX 512
+
+static coap_resource_t *readings_resource;
+
+/*
+ * Only the CoAP task touches the payload buffer. Requests are answered
+ * from the cached reading set and never trigger a sensor read.
+ */
+static char payload[PAYLOAD_MAX];
+
+static size_t format_readings(void)
+{
+    reading_set_t readings;
+    size_t len;
+
+    readings_get_latest(&readings);
+    len = snprintf(payload, sizeof(payload), "{\"seq\":%u,\"age_ms\":%u,\"readings\":[",
+                   readings.sequence,
+                   (uint32_t)((esp_timer_get_time() - readings.timestamp_us) / 1000));
+    for (int i = 0; i < readings.count && len < sizeof(payload); i++)
+    {
+        const temperature_sample_t *sample = &readings.samples[i];
+        len += snprintf(&payload[len], sizeof(payload) - len,
+                        "%s{\"id\":\"%08x%08x\",\"ok\":%s,\"mc\":%d}",
+                        i ? "," : "",
+                        (uint32_t)(sample->addr >> 32), (uint32_t)sample->addr,
+                        sample->success ? "true" : "false", sample->millicelsius);
+    }
+    if (len < sizeof(payload))
+    {
+        len += snprintf(&payload[len], sizeof(payload) - len, "]}");
+    }
+    return len < sizeof(payload) ? len : sizeof(payload) - 1;
+}
+
+static size_t format_aggregates(void)
+{
+    reading_aggregate_t aggregates[TEMPERATURE_MAX_SENSORS];
+    int count = readings_get_aggregates(aggregates, TEMPERATURE_MAX_SENSORS);
+    size_t len = snprintf(payload, sizeof(payload), "{\"window\":%d,\"sensors\":[",
+                          READINGS_WINDOW);
+
+    for (int i = 0; i < count && len < sizeof(payload); i++)
+    {
+        const reading_aggregate_t *aggregate = &aggregates[i];
+        len += snprintf(&payload[len], sizeof(payload) - len,
+                        "%s{\"id\":\"%08x%08x\",\"n\":%d,\"min\":%d,\"max\":%d,\"mean\":%d}",
+                        i ? "," : "",
+                        (uint32_t)(aggregate->addr >> 32), (uint32_t)aggregate->addr,
+                        aggregate->count, aggregate->min_millicelsius,
+                        aggregate->max_millicelsius, aggregate->mean_millicelsius);
+    }
+    if (len < sizeof(payload))
+    {
+        len += snprintf(&payload[len], sizeof(payload) - len, "]}");
+    }
+    return len < sizeof(payload) ? len : sizeof(payload) - 1;
+}
+
+static void handle_get_readings(coap_context_t *ctx, coap_resource_t *resource,
+                                coap_session_t *session, coap_pdu_t *request,
+                                coap_binary_t *token, coap_string_t *query,
+                                coap_pdu_t *response)
+{
+    size_t len = format_readings();
+    coap_add_data_blocked_response(resource, session, request, response, token,
+                                   COAP_MEDIATYPE_APPLICATION_JSON, 0,
+                                   len, (const uint8_t *)payload);
+}
+
+static void handle_get_aggregates(coap_context_t *ctx, coap_resource_t *resource,
+                                  coap_session_t *session, coap_pdu_t *request,
+                                  coap_binary_t *token, coap_string_t *query,
+                                  coap_pdu_t *response)
+{
+    size_t len = format_aggregates();
+    coap_add_data_blocked_response(resource, session, request, response, token,
+                                   COAP_MEDIATYPE_APPLICATION_JSON, 0,
+                                   len, (const uint8_t *)payload);
+}
+
+static void coap_server_task(void *arg)
+{
+    coap_context_t *ctx = NULL;
+    coap_address_t serv_addr;
+    coap_resource_t *aggregates_resource;
+    uint32_t notified_sequence = 0;
+
+    coap_startup();
+    coap_address_init(&serv_addr);
+    serv_addr.addr.sin.sin_family = AF_INET;
+    serv_addr.addr.sin.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.addr.sin.sin_port = htons(COAP_DEFAULT_PORT);
+
+    ctx = coap_new_context(NULL);
+    if (ctx == NULL || coap_new_endpoint(ctx, &serv_addr, COAP_PROTO_UDP) == NULL)
+    {
+        ESP_LOGE(LOG_TAG, "Failed to create CoAP endpoint");
+        goto done;
+    }
+
+    readings_resource = coap_resource_init(coap_make_str_const("readings"), 0);
+    aggregates_resource = coap_resource_init(coap_make_str_const("aggregates"), 0);
+    if (readings_resource == NULL || aggregates_resource == NULL)
+    {
+        ESP_LOGE(LOG_TAG, "Failed to create CoAP resources");
+        goto done;
+    }
+    coap_register_handler(readings_resource, COAP_REQUEST_GET, handle_get_readings);
+    coap_resource_set_get_observable(readings_resource, 1);
+    coap_add_resource(ctx, readings_resource);
+    coap_register_handler(aggregates_resource, COAP_REQUEST_GET, handle_get_aggregates);
+    coap_add_resource(ctx, aggregates_resource);
+
+    ESP_LOGI(LOG_TAG, "Serving coap://<device>/readings and /aggregates");
+    while (true)
+    {
+        if (coap_run_once(ctx, POLL_INTERVAL_MS) < 0)
+        {
+            break;
+        }
+        /* Observers are pushed the new set on the next run. */
+        uint32_t sequence = readings_sequence();
+        if (sequence != notified_sequence)
+        {
+            notified_sequence = sequence;
+            coap_resource_notify_observers(readings_resource, NULL);
+        }
+    }
+
+done:
+    if (ctx != NULL)
+    {
+        coap_free_context(ctx);
+    }
+    coap_cleanup();
+    vTaskDelete(NULL);
+}
+
+/**
+ * Starts the LAN CoAP endpoint when it is enabled in menuconfig.
+ */
+int coap_server_start(void)
+{
+#if CONFIG_APP_COAP_SERVER
+    return task_topology_create(TASK_COAP, coap_server_task, NULL);
+#else
+    return ESP_OK;
+#endif
+}
@@ -0,0 +1,6 @@
+#ifndef _COAP_SERVER_H
+#define _COAP_SERVER_H
+
+int coap_server_start(void);
+
+#endif
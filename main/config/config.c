@@ -0,0 +1,278 @@
+#include <stddef.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "nvs.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "config.h"
+
+#define LOG_TAG "config"
+#define NVS_NAMESPACE "config"
+#define NVS_KEY_CONFIG "app"
+
+/* Where the sampling policy lived before it moved into the config blob. */
+#define LEGACY_SAMPLING_NAMESPACE "sampling"
+#define LEGACY_SAMPLING_KEY "policy"
+
+static const app_config_t defaults = {
+    .version = APP_CONFIG_VERSION,
+    .size = sizeof(app_config_t),
+    .sensor_gpio = 5,
+    .scan_list_size = 5,
+    .passkey = 1234,
+    .device_name = "Vacation Hydration",
+    .ble_rx_timeout_ms = 120000,
+    .sampling = {
+        .min_period_ms = 1000,
+        .max_period_ms = 60000,
+        .deadband_millicelsius = 250,
+        .rate_millicelsius_per_min = 500,
+        .high_threshold_millicelsius = 8000,
+        .low_threshold_millicelsius = -25000,
+    },
+    .sensor_resolution_bits = 12,
+};
+
+/*
+ * Readers get a pointer to an immutable snapshot. Updates build the next
+ * snapshot in the other slot and swap the pointer, so readers never take a
+ * lock or touch NVS. A reader must not hold the pointer across two updates.
+ */
+static app_config_t slots[2];
+static const app_config_t *volatile current = &defaults;
+static SemaphoreHandle_t update_lock;
+
+/* Set when the legacy policy was imported and must go once the blob is stored. */
+static bool legacy_imported;
+
+typedef bool (*config_migration_t)(nvs_handle_t handle, app_config_t *config);
+
+/**
+ * Pulls a policy stored before SAMPLING_MAX_PERIOD_MS existed under the cap,
+ * so an old max period does not throw away the whole config.
+ */
+static void clamp_sampling(sampling_policy_t *policy)
+{
+    if (policy->max_period_ms > SAMPLING_MAX_PERIOD_MS)
+    {
+        policy->max_period_ms = SAMPLING_MAX_PERIOD_MS;
+    }
+    if (policy->min_period_ms > policy->max_period_ms)
+    {
+        policy->min_period_ms = policy->max_period_ms;
+    }
+}
+
+/**
+ * Version 0 is a device without a config blob: start from the defaults and
+ * pick up a sampling policy stored by older firmware, if it is valid. The
+ * legacy key is only erased after the migrated blob is stored.
+ */
+static bool migrate_from_legacy(nvs_handle_t handle, app_config_t *config)
+{
+    nvs_handle_t legacy;
+    sampling_policy_t policy;
+    size_t len = sizeof(policy);
+
+    *config = defaults;
+    if (nvs_open(LEGACY_SAMPLING_NAMESPACE, NVS_READONLY, &legacy) == ESP_OK)
+    {
+        if (nvs_get_blob(legacy, LEGACY_SAMPLING_KEY, &policy, &len) == ESP_OK &&
+            len == sizeof(policy))
+        {
+            clamp_sampling(&policy);
+            if (sampling_policy_is_valid(&policy))
+            {
+                config->sampling = policy;
+            }
+            else
+            {
+                ESP_LOGW(LOG_TAG, "Legacy sampling policy invalid, using defaults");
+            }
+            legacy_imported = true;
+        }
+        nvs_close(legacy);
+    }
+    return true;
+}
+
+static void erase_legacy(void)
+{
+    nvs_handle_t legacy;
+    if (nvs_open(LEGACY_SAMPLING_NAMESPACE, NVS_READWRITE, &legacy) == ESP_OK)
+    {
+        nvs_erase_key(legacy, LEGACY_SAMPLING_KEY);
+        nvs_commit(legacy);
+        nvs_close(legacy);
+    }
+}
+
+/* Version 2 appended the sensor calibration table; start uncalibrated. */
+static bool migrate_add_calibration(nvs_handle_t handle, app_config_t *config)
+{
+    memset(config->calibration, 0, sizeof(config->calibration));
+    return true;
+}
+
+/* Version 3 appended the sensor resolution; sensors power up at 12 bits. */
+static bool migrate_add_resolution(nvs_handle_t handle, app_config_t *config)
+{
+    config->sensor_resolution_bits = 12;
+    return true;
+}
+
+/* migrations[n] turns a version n blob into version n + 1. */
+static const config_migration_t migrations[APP_CONFIG_VERSION] = {
+    migrate_from_legacy,
+    migrate_add_calibration,
+    migrate_add_resolution,
+};
+
+static esp_err_t store(const app_config_t *config)
+{
+    nvs_handle_t handle;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = nvs_set_blob(handle, NVS_KEY_CONFIG, config, sizeof(*config));
+    if (err == ESP_OK)
+    {
+        err = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    return err;
+}
+
+static bool is_valid(const app_config_t *config)
+{
+    for (int i = 0; i < TEMPERATURE_MAX_SENSORS; i++)
+    {
+        const sensor_calibration_t *calibration = &config->calibration[i];
+        if (calibration->addr != 0 &&
+            (calibration->gain_q16 < CONDITIONING_GAIN_ONE / 2 ||
+             calibration->gain_q16 > CONDITIONING_GAIN_ONE * 2))
+        {
+            return false;
+        }
+    }
+    return sampling_policy_is_valid(&config->sampling) &&
+           config->sensor_gpio >= 0 && config->sensor_gpio < 40 &&
+           config->sensor_resolution_bits >= 9 && config->sensor_resolution_bits <= 12 &&
+           config->scan_list_size > 0 &&
+           config->device_name[0] != '\0' &&
+           memchr(config->device_name, '\0', sizeof(config->device_name)) != NULL;
+}
+
+/**
+ * Reads the configuration blob once at boot, migrating older schema
+ * versions forward. Falls back to the compile-time defaults when the blob
+ * is missing, corrupt or from newer firmware.
+ */
+void config_load(void)
+{
+    int64_t started = esp_timer_get_time();
+    app_config_t *config = &slots[0];
+    nvs_handle_t handle;
+    size_t len = sizeof(*config);
+    uint16_t version = 0;
+    bool migrated = false;
+
+    update_lock = xSemaphoreCreateMutex();
+    memset(config, 0, sizeof(*config));
+
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK)
+    {
+        ESP_LOGE(LOG_TAG, "NVS unavailable, using defaults");
+        *config = defaults;
+        current = config;
+        return;
+    }
+
+    esp_err_t err = nvs_get_blob(handle, NVS_KEY_CONFIG, config, &len);
+    if (err == ESP_OK && len >= offsetof(app_config_t, size) + sizeof(config->size))
+    {
+        version = config->version;
+    }
+    else if (err != ESP_ERR_NVS_NOT_FOUND)
+    {
+        /* Unreadable or written by newer firmware: leave it for that. */
+        version = UINT16_MAX;
+    }
+
+    if (version > APP_CONFIG_VERSION ||
+        (version == APP_CONFIG_VERSION && len != sizeof(*config)))
+    {
+        ESP_LOGW(LOG_TAG, "Config blob not usable (version %d), using defaults",
+                 version);
+        *config = defaults;
+        version = APP_CONFIG_VERSION;
+    }
+    while (version < APP_CONFIG_VERSION)
+    {
+        if (!migrations[version](handle, config))
+        {
+            *config = defaults;
+            version = APP_CONFIG_VERSION;
+            break;
+        }
+        version++;
+        migrated = true;
+    }
+    nvs_close(handle);
+
+    config->version = APP_CONFIG_VERSION;
+    config->size = sizeof(*config);
+    clamp_sampling(&config->sampling);
+    if (!is_valid(config))
+    {
+        *config = defaults;
+    }
+    if (migrated && store(config) != ESP_OK)
+    {
+        ESP_LOGE(LOG_TAG, "Failed to store migrated config");
+    }
+    else if (legacy_imported)
+    {
+        erase_legacy();
+    }
+    current = config;
+
+    ESP_LOGI(LOG_TAG, "Config v%d loaded in %lld us%s", config->version,
+             esp_timer_get_time() - started, migrated ? " (migrated)" : "");
+}
+
+const app_config_t *config_get(void)
+{
+    return current;
+}
+
+/**
+ * Persists a new configuration and makes it the current snapshot.
+ * @returns ESP_OK, ESP_ERR_INVALID_ARG when it does not validate or the NVS
+ * error when it could not be stored (the current snapshot is kept).
+ */
+int config_update(const app_config_t *next)
+{
+    esp_err_t err;
+    if (!is_valid(next))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    xSemaphoreTake(update_lock, portMAX_DELAY);
+    app_config_t *slot = current == &slots[0] ? &slots[1] : &slots[0];
+    *slot = *next;
+    slot->version = APP_CONFIG_VERSION;
+    slot->size = sizeof(*slot);
+
+    err = store(slot);
+    if (err == ESP_OK)
+    {
+        current = slot;
+    }
+    xSemaphoreGive(update_lock);
+    return err;
+}
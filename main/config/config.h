@@ -0,0 +1,32 @@
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include <stdint.h>
+#include "../temperature/sampling.h"
+#include "../temperature/conditioning.h"
+
+/*
+ * Bump APP_CONFIG_VERSION whenever app_config_t changes and add a step to
+ * the migration table in config.c.
+ */
+#define APP_CONFIG_VERSION 3
+#define APP_CONFIG_NAME_MAX 32
+
+typedef struct {
+  uint16_t version;
+  uint16_t size;
+  int8_t sensor_gpio;
+  uint8_t scan_list_size;
+  uint32_t passkey;
+  char device_name[APP_CONFIG_NAME_MAX];
+  uint32_t ble_rx_timeout_ms;
+  sampling_policy_t sampling;
+  sensor_calibration_t calibration[TEMPERATURE_MAX_SENSORS];
+  uint8_t sensor_resolution_bits;
+} app_config_t;
+
+void config_load(void);
+const app_config_t *config_get(void);
+int config_update(const app_config_t *next);
+
+#endif
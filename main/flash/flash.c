@@ -1,6 +1,7 @@
 #include "flash.h"
 #include "nvs_flash.h"
 #include "esp_log.h"
+#include "../config/config.h"
 
 void init_flash()
 {
@@ -11,4 +12,5 @@ void init_flash()
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    config_load();
 }
\ No newline at end of file
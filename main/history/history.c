@@ -0,0 +1,782 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "history.h"
+
+#define LOG_TAG "history"
+
+#define BLOCK_MAGIC 0x31485354 /* "TSH1" */
+#define BLOCK_EMPTY UINT32_MAX
+#define BLOCK_BITS (HISTORY_BLOCK_SIZE * 8)
+
+/*
+ * Block layout: a header, then a bit stream of records, MSB first.
+ *
+ * A record is the timestamp followed by one value per sensor in the header.
+ * Timestamps are delta-of-delta encoded against the previous record:
+ *     0                  same interval as before
+ *     10   + 7 bits      zigzag delta-of-delta
+ *     110  + 9 bits      zigzag delta-of-delta
+ *     1110 + 12 bits     zigzag delta-of-delta
+ *     11110 + 32 bits    raw delta
+ *     11111              pad to the next byte
+ * Values are delta encoded against the previous value of the same sensor:
+ *     0                  unchanged
+ *     10   + 8 bits      zigzag delta
+ *     110  + 13 bits     zigzag delta
+ *     1110 + 32 bits     raw value
+ *     1111               no reading
+ *
+ * Erased flash reads as ones, so the stream ends at the first byte-aligned
+ * 0xFF; no record can start with eight ones. Every flush pads the stream to
+ * a byte boundary so only whole records ever reach flash.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t base_time;
+    uint8_t sensor_count;
+    uint8_t reserved[3];
+    ds18x20_addr_t addrs[TEMPERATURE_MAX_SENSORS];
+} block_header_t;
+
+#define DATA_START_BITS (sizeof(block_header_t) * 8)
+
+/* A record with every field raw, plus the pad of a flush behind it. */
+#define RECORD_MAX_BITS (5 + 32 + TEMPERATURE_MAX_SENSORS * (4 + 32) + 12)
+
+typedef struct
+{
+    uint8_t *buf;
+    uint32_t pos;
+    uint32_t end;
+} bitstream_t;
+
+/* Decoder and encoder state carried from record to record in a block. */
+typedef struct
+{
+    uint32_t time;
+    int64_t delta;
+    int32_t values[TEMPERATURE_MAX_SENSORS];
+} codec_state_t;
+
+/* The block index: enough to seek a time range without reading flash. */
+typedef struct
+{
+    uint32_t seq;
+    uint32_t base_time;
+} block_index_t;
+
+static const esp_partition_t *partition;
+static SemaphoreHandle_t lock;
+static int block_count;
+static block_index_t blocks[HISTORY_MAX_BLOCKS];
+static int head = -1;
+
+/* The open block is built in RAM and written out a flush at a time. */
+static uint8_t open_block[HISTORY_BLOCK_SIZE];
+static block_header_t open_header;
+static bitstream_t writer;
+static codec_state_t write_state;
+static uint32_t flushed_bytes;
+static int unflushed_records;
+
+/* Keeps timestamps increasing across reboots when the clock is not set. */
+static uint32_t clock_offset;
+static uint32_t newest_time;
+static uint32_t records_written;
+static uint32_t samples_written;
+static uint32_t bits_written;
+
+static uint64_t zigzag(int64_t value)
+{
+    return value < 0 ? ((uint64_t)-value << 1) - 1 : (uint64_t)value << 1;
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return value & 1 ? -(int64_t)((value + 1) >> 1) : (int64_t)(value >> 1);
+}
+
+static void put_bits(bitstream_t *bs, uint32_t value, int bits)
+{
+    for (int i = bits - 1; i >= 0; i--, bs->pos++)
+    {
+        uint8_t mask = 0x80 >> (bs->pos & 7);
+        if ((value >> i) & 1)
+        {
+            bs->buf[bs->pos >> 3] |= mask;
+        }
+        else
+        {
+            bs->buf[bs->pos >> 3] &= ~mask;
+        }
+    }
+}
+
+/* Bits past the end read as ones, like erased flash. */
+static uint32_t get_bits(bitstream_t *bs, int bits)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < bits; i++, bs->pos++)
+    {
+        uint32_t bit = bs->pos >= bs->end ? 1 : (bs->buf[bs->pos >> 3] >> (7 - (bs->pos & 7))) & 1;
+        value = (value << 1) | bit;
+    }
+    return value;
+}
+
+static int get_prefix(bitstream_t *bs, int max)
+{
+    int ones = 0;
+    while (ones < max && get_bits(bs, 1))
+    {
+        ones++;
+    }
+    return ones;
+}
+
+static void put_timestamp(bitstream_t *bs, codec_state_t *state, uint32_t timestamp)
+{
+    int64_t delta = (int64_t)timestamp - state->time;
+    uint64_t dod = zigzag(delta - state->delta);
+
+    if (dod == 0)
+    {
+        put_bits(bs, 0x0, 1);
+    }
+    else if (dod < (1 << 7))
+    {
+        put_bits(bs, 0x2, 2);
+        put_bits(bs, dod, 7);
+    }
+    else if (dod < (1 << 9))
+    {
+        put_bits(bs, 0x6, 3);
+        put_bits(bs, dod, 9);
+    }
+    else if (dod < (1 << 12))
+    {
+        put_bits(bs, 0xe, 4);
+        put_bits(bs, dod, 12);
+    }
+    else
+    {
+        put_bits(bs, 0x1e, 5);
+        put_bits(bs, (uint32_t)delta, 32);
+    }
+    state->delta = delta;
+    state->time = timestamp;
+}
+
+static void put_value(bitstream_t *bs, int32_t *prev, const temperature_sample_t *sample)
+{
+    uint64_t delta;
+
+    if (!sample->success)
+    {
+        put_bits(bs, 0xf, 4);
+        return;
+    }
+
+    delta = zigzag((int64_t)sample->millicelsius - *prev);
+    if (delta == 0)
+    {
+        put_bits(bs, 0x0, 1);
+    }
+    else if (delta < (1 << 8))
+    {
+        put_bits(bs, 0x2, 2);
+        put_bits(bs, delta, 8);
+    }
+    else if (delta < (1 << 13))
+    {
+        put_bits(bs, 0x6, 3);
+        put_bits(bs, delta, 13);
+    }
+    else
+    {
+        put_bits(bs, 0xe, 4);
+        put_bits(bs, (uint32_t)sample->millicelsius, 32);
+    }
+    *prev = sample->millicelsius;
+}
+
+/**
+ * Decodes the next record of a block into row.
+ * @returns false at the end of the block's data.
+ */
+static bool decode_record(bitstream_t *bs, codec_state_t *state, int sensors,
+                          history_row_t *row)
+{
+    int prefix;
+
+    while (true)
+    {
+        if (bs->pos >= bs->end ||
+            ((bs->pos & 7) == 0 && bs->buf[bs->pos >> 3] == 0xff))
+        {
+            return false;
+        }
+        prefix = get_prefix(bs, 5);
+        if (prefix != 5)
+        {
+            break;
+        }
+        bs->pos = (bs->pos + 7) & ~7u;
+    }
+
+    switch (prefix)
+    {
+    case 0:
+        break;
+    case 1:
+        state->delta += unzigzag(get_bits(bs, 7));
+        break;
+    case 2:
+        state->delta += unzigzag(get_bits(bs, 9));
+        break;
+    case 3:
+        state->delta += unzigzag(get_bits(bs, 12));
+        break;
+    default:
+        state->delta = get_bits(bs, 32);
+        break;
+    }
+    state->time += state->delta;
+
+    row->time = state->time;
+    row->count = sensors;
+    for (int i = 0; i < sensors; i++)
+    {
+        row->valid[i] = true;
+        switch (get_prefix(bs, 4))
+        {
+        case 0:
+            break;
+        case 1:
+            state->values[i] += unzigzag(get_bits(bs, 8));
+            break;
+        case 2:
+            state->values[i] += unzigzag(get_bits(bs, 13));
+            break;
+        case 3:
+            state->values[i] = (int32_t)get_bits(bs, 32);
+            break;
+        default:
+            row->valid[i] = false;
+            break;
+        }
+        row->millicelsius[i] = state->values[i];
+    }
+    return true;
+}
+
+static uint32_t slot_offset(int slot)
+{
+    return (uint32_t)slot * HISTORY_BLOCK_SIZE;
+}
+
+static int header_slot(const block_header_t *header, ds18x20_addr_t addr)
+{
+    for (int i = 0; i < header->sensor_count; i++)
+    {
+        if (header->addrs[i] == addr)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* True when every sample belongs to a sensor the open block has a column for. */
+static bool open_block_covers(const temperature_sample_t *samples, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (header_slot(&open_header, samples[i].addr) < 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Pads the stream to a byte boundary and writes out the new bytes. */
+static int flush_locked(void)
+{
+    uint32_t bytes;
+    esp_err_t err;
+
+    if (head < 0)
+    {
+        return ESP_OK;
+    }
+    if (writer.pos & 7)
+    {
+        put_bits(&writer, 0x1f, 5);
+        writer.pos = (writer.pos + 7) & ~7u;
+    }
+
+    bytes = writer.pos >> 3;
+    if (bytes > flushed_bytes)
+    {
+        err = esp_partition_write(partition, slot_offset(head) + flushed_bytes,
+                                  &open_block[flushed_bytes], bytes - flushed_bytes);
+        if (err != ESP_OK)
+        {
+            ESP_LOGE(LOG_TAG, "Flush of block %d failed: %s", head, esp_err_to_name(err));
+            return ESP_FAIL;
+        }
+        flushed_bytes = bytes;
+    }
+    unflushed_records = 0;
+    return ESP_OK;
+}
+
+/*
+ * Erases the next slot in the ring and starts a block there. The lock is
+ * dropped for the sector erase so queries do not stall behind it; the slot
+ * is marked empty first so they skip it, and only the sampling task
+ * appends, so head cannot move meanwhile.
+ */
+static int open_block_locked(const temperature_sample_t *samples, int count, uint32_t timestamp)
+{
+    int slot = head < 0 ? 0 : (head + 1) % block_count;
+    uint32_t seq = head < 0 ? 0 : blocks[head].seq + 1;
+    esp_err_t err;
+
+    blocks[slot].seq = BLOCK_EMPTY;
+    xSemaphoreGive(lock);
+    err = esp_partition_erase_range(partition, slot_offset(slot), HISTORY_BLOCK_SIZE);
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(LOG_TAG, "Erase of block %d failed: %s", slot, esp_err_to_name(err));
+        return ESP_FAIL;
+    }
+
+    memset(&open_header, 0xff, sizeof(open_header));
+    open_header.magic = BLOCK_MAGIC;
+    open_header.seq = seq;
+    open_header.base_time = timestamp;
+    open_header.sensor_count = count;
+    for (int i = 0; i < count; i++)
+    {
+        open_header.addrs[i] = samples[i].addr;
+    }
+    err = esp_partition_write(partition, slot_offset(slot), &open_header, sizeof(open_header));
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(LOG_TAG, "Header write of block %d failed: %s", slot, esp_err_to_name(err));
+        return ESP_FAIL;
+    }
+
+    memset(open_block, 0xff, sizeof(open_block));
+    memcpy(open_block, &open_header, sizeof(open_header));
+    writer.buf = open_block;
+    writer.pos = DATA_START_BITS;
+    writer.end = BLOCK_BITS;
+    memset(&write_state, 0, sizeof(write_state));
+    write_state.time = timestamp;
+    flushed_bytes = sizeof(open_header);
+    unflushed_records = 0;
+
+    blocks[slot].seq = seq;
+    blocks[slot].base_time = timestamp;
+    head = slot;
+    return ESP_OK;
+}
+
+/* Reloads the newest block after a reboot so appends continue in it. */
+static int resume_block_locked(void)
+{
+    history_row_t row;
+    esp_err_t err;
+
+    err = esp_partition_read(partition, slot_offset(head), open_block, sizeof(open_block));
+    if (err != ESP_OK)
+    {
+        return ESP_FAIL;
+    }
+    memcpy(&open_header, open_block, sizeof(open_header));
+
+    writer.buf = open_block;
+    writer.pos = DATA_START_BITS;
+    writer.end = BLOCK_BITS;
+    memset(&write_state, 0, sizeof(write_state));
+    write_state.time = open_header.base_time;
+    while (decode_record(&writer, &write_state, open_header.sensor_count, &row))
+    {
+    }
+    if (writer.pos > BLOCK_BITS)
+    {
+        writer.pos = BLOCK_BITS;
+    }
+    flushed_bytes = (writer.pos + 7) >> 3;
+    writer.pos = flushed_bytes * 8;
+    unflushed_records = 0;
+    newest_time = write_state.time;
+    return ESP_OK;
+}
+
+/**
+ * Finds the history partition and rebuilds the block index from the block
+ * headers.
+ * @returns ESP_OK when history is available, otherwise ESP_FAIL.
+ */
+int history_init(void)
+{
+    block_header_t header;
+    uint32_t now;
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                         HISTORY_PARTITION_SUBTYPE, "history");
+    if (partition == NULL)
+    {
+        ESP_LOGW(LOG_TAG, "No history partition, history disabled");
+        return ESP_FAIL;
+    }
+    lock = xSemaphoreCreateMutex();
+    block_count = partition->size / HISTORY_BLOCK_SIZE;
+    if (block_count > HISTORY_MAX_BLOCKS)
+    {
+        block_count = HISTORY_MAX_BLOCKS;
+    }
+
+    head = -1;
+    for (int i = 0; i < block_count; i++)
+    {
+        blocks[i].seq = BLOCK_EMPTY;
+        if (esp_partition_read(partition, slot_offset(i), &header, sizeof(header)) != ESP_OK ||
+            header.magic != BLOCK_MAGIC || header.seq == BLOCK_EMPTY ||
+            header.sensor_count > TEMPERATURE_MAX_SENSORS)
+        {
+            continue;
+        }
+        blocks[i].seq = header.seq;
+        blocks[i].base_time = header.base_time;
+        if (head < 0 || header.seq > blocks[head].seq)
+        {
+            head = i;
+        }
+    }
+
+    if (head >= 0 && resume_block_locked() != ESP_OK)
+    {
+        ESP_LOGW(LOG_TAG, "Could not reload block %d, starting a new one", head);
+        writer.pos = BLOCK_BITS;
+    }
+
+    now = (uint32_t)time(NULL);
+    clock_offset = now <= newest_time ? newest_time + 1 - now : 0;
+    ESP_LOGI(LOG_TAG, "%d blocks, head %d at %u", block_count, head, newest_time);
+    return ESP_OK;
+}
+
+/**
+ * @returns The history clock in seconds. It follows the system clock but
+ * never runs behind the newest stored record.
+ */
+uint32_t history_now(void)
+{
+    return (uint32_t)time(NULL) + clock_offset;
+}
+
+/**
+ * Appends one record with a value per sample. Records follow the sensor
+ * columns of the open block; a sensor of the block without a sample is
+ * stored as no reading. A new block is started when the open one is full
+ * or a sample comes from a sensor the block has no column for.
+ */
+int history_append(const temperature_sample_t *samples, int count)
+{
+    temperature_sample_t columns[TEMPERATURE_MAX_SENSORS];
+    uint32_t now, start;
+    int rc = ESP_OK;
+
+    if (partition == NULL || count <= 0)
+    {
+        return ESP_FAIL;
+    }
+    if (count > TEMPERATURE_MAX_SENSORS)
+    {
+        count = TEMPERATURE_MAX_SENSORS;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    now = history_now();
+    if (now < newest_time)
+    {
+        now = newest_time;
+    }
+
+    if (head < 0 || !open_block_covers(samples, count) ||
+        writer.pos + RECORD_MAX_BITS > BLOCK_BITS)
+    {
+        flush_locked();
+        rc = open_block_locked(samples, count, now);
+    }
+
+    if (rc == ESP_OK)
+    {
+        memset(columns, 0, sizeof(columns));
+        for (int i = 0; i < count; i++)
+        {
+            columns[header_slot(&open_header, samples[i].addr)] = samples[i];
+        }
+        start = writer.pos;
+        put_timestamp(&writer, &write_state, now);
+        for (int i = 0; i < open_header.sensor_count; i++)
+        {
+            put_value(&writer, &write_state.values[i], &columns[i]);
+        }
+        bits_written += writer.pos - start;
+        records_written++;
+        samples_written += count;
+        newest_time = now;
+
+        if (++unflushed_records >= HISTORY_FLUSH_RECORDS)
+        {
+            rc = flush_locked();
+        }
+    }
+    xSemaphoreGive(lock);
+    return rc;
+}
+
+/* Writes out records still held in RAM. */
+int history_flush(void)
+{
+    int rc;
+
+    if (partition == NULL)
+    {
+        return ESP_FAIL;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    rc = flush_locked();
+    xSemaphoreGive(lock);
+    return rc;
+}
+
+typedef struct
+{
+    history_row_t row;
+    ds18x20_addr_t addrs[TEMPERATURE_MAX_SENSORS];
+    int64_t sums[TEMPERATURE_MAX_SENSORS];
+    int valid[TEMPERATURE_MAX_SENSORS];
+    int records;
+    /* Records stamped run_time seen so far, including skipped ones. */
+    uint32_t run_time;
+    uint32_t run;
+} bucket_t;
+
+static bool bucket_matches(const bucket_t *bucket, const block_header_t *header)
+{
+    return bucket->row.count == header->sensor_count &&
+           memcmp(bucket->addrs, header->addrs,
+                  header->sensor_count * sizeof(header->addrs[0])) == 0;
+}
+
+static void bucket_add(bucket_t *bucket, const block_header_t *header,
+                       const history_row_t *row)
+{
+    if (bucket->records == 0)
+    {
+        memset(&bucket->row, 0, sizeof(bucket->row));
+        memset(bucket->sums, 0, sizeof(bucket->sums));
+        memset(bucket->valid, 0, sizeof(bucket->valid));
+        memcpy(bucket->addrs, header->addrs, sizeof(bucket->addrs));
+        bucket->row.time = row->time;
+        bucket->row.skip = bucket->run;
+        bucket->row.count = row->count;
+    }
+    for (int i = 0; i < row->count; i++)
+    {
+        if (row->valid[i])
+        {
+            bucket->sums[i] += row->millicelsius[i];
+            bucket->valid[i]++;
+        }
+    }
+    bucket->records++;
+}
+
+static bool bucket_emit(bucket_t *bucket, history_row_cb cb, void *arg)
+{
+    for (int i = 0; i < bucket->row.count; i++)
+    {
+        bucket->row.valid[i] = bucket->valid[i] > 0;
+        bucket->row.millicelsius[i] = bucket->valid[i] ? bucket->sums[i] / bucket->valid[i] : 0;
+    }
+    bucket->records = 0;
+    return cb(&bucket->row, arg);
+}
+
+/**
+ * Calls cb for every row between from and to (inclusive), oldest first.
+ * With a step above 1, each row is the mean of that many records. The
+ * first `skip` records stamped exactly `from` are dropped, so (time, skip)
+ * works as a paging cursor even when several records share a second or a
+ * row of the previous page already took some of them. Only the
+ * blocks the index places in the range are read, one at a time, and the
+ * lock is not held while rows are handed to cb.
+ */
+int history_query(uint32_t from, uint32_t skip, uint32_t to, uint16_t step,
+                  history_row_cb cb, void *arg)
+{
+    block_header_t header;
+    block_index_t entry, next;
+    codec_state_t state;
+    history_row_t row;
+    bitstream_t reader;
+    bucket_t bucket = {0};
+    uint32_t last_seq, next_base;
+    uint8_t *scratch;
+    bool more = true;
+    int start, slot;
+
+    if (partition == NULL)
+    {
+        return ESP_FAIL;
+    }
+    scratch = malloc(HISTORY_BLOCK_SIZE);
+    if (scratch == NULL)
+    {
+        return ESP_FAIL;
+    }
+    if (step == 0)
+    {
+        step = 1;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    start = head;
+    last_seq = head < 0 ? 0 : blocks[head].seq;
+    xSemaphoreGive(lock);
+
+    for (int n = 1; start >= 0 && n <= block_count && more; n++)
+    {
+        slot = (start + n) % block_count;
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        entry = blocks[slot];
+        next = blocks[(slot + 1) % block_count];
+        next_base = slot != head && next.seq == entry.seq + 1 ? next.base_time : UINT32_MAX;
+        if (entry.seq == BLOCK_EMPTY || entry.seq > last_seq || next_base < from)
+        {
+            xSemaphoreGive(lock);
+            continue;
+        }
+        if (entry.base_time > to)
+        {
+            xSemaphoreGive(lock);
+            break;
+        }
+        if (slot == head)
+        {
+            memcpy(scratch, open_block, (writer.pos + 7) >> 3);
+            reader.end = writer.pos;
+        }
+        else if (esp_partition_read(partition, slot_offset(slot), scratch, HISTORY_BLOCK_SIZE) == ESP_OK)
+        {
+            reader.end = BLOCK_BITS;
+        }
+        else
+        {
+            reader.end = 0;
+        }
+        xSemaphoreGive(lock);
+
+        memcpy(&header, scratch, sizeof(header));
+        if (reader.end == 0 || header.magic != BLOCK_MAGIC || header.seq != entry.seq ||
+            header.sensor_count > TEMPERATURE_MAX_SENSORS)
+        {
+            continue;
+        }
+        if (bucket.records > 0 && !bucket_matches(&bucket, &header))
+        {
+            more = bucket_emit(&bucket, cb, arg);
+        }
+
+        reader.buf = scratch;
+        reader.pos = DATA_START_BITS;
+        memset(&state, 0, sizeof(state));
+        state.time = header.base_time;
+        while (more && decode_record(&reader, &state, header.sensor_count, &row))
+        {
+            if (row.time < from)
+            {
+                continue;
+            }
+            if (row.time > to)
+            {
+                more = false;
+                break;
+            }
+            if (row.time != bucket.run_time)
+            {
+                bucket.run_time = row.time;
+                bucket.run = 0;
+            }
+            if (row.time == from && bucket.run < skip)
+            {
+                bucket.run++;
+                continue;
+            }
+            bucket_add(&bucket, &header, &row);
+            bucket.run++;
+            if (bucket.records >= step)
+            {
+                more = bucket_emit(&bucket, cb, arg);
+            }
+        }
+    }
+
+    if (more && bucket.records > 0)
+    {
+        bucket_emit(&bucket, cb, arg);
+    }
+    free(scratch);
+    return ESP_OK;
+}
+
+int history_get_stats(history_stats_t *stats)
+{
+    int oldest = -1;
+
+    memset(stats, 0, sizeof(*stats));
+    if (partition == NULL)
+    {
+        return ESP_FAIL;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    stats->blocks_total = block_count;
+    for (int i = 0; i < block_count; i++)
+    {
+        if (blocks[i].seq == BLOCK_EMPTY)
+        {
+            continue;
+        }
+        stats->blocks_used++;
+        if (oldest < 0 || blocks[i].seq < blocks[oldest].seq)
+        {
+            oldest = i;
+        }
+    }
+    stats->oldest_time = oldest < 0 ? 0 : blocks[oldest].base_time;
+    stats->newest_time = newest_time;
+    stats->records_written = records_written;
+    stats->samples_written = samples_written;
+    stats->bits_written = bits_written;
+    xSemaphoreGive(lock);
+    return ESP_OK;
+}
@@ -0,0 +1,53 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "../temperature/temperature.h"
+
+/* Data subtype of the "history" partition in partitions.csv. */
+#define HISTORY_PARTITION_SUBTYPE 0x40
+
+/* One flash sector per block; every block starts with its own header. */
+#define HISTORY_BLOCK_SIZE 4096
+#define HISTORY_MAX_BLOCKS 256
+
+/* Records are kept in RAM and written out this many at a time. */
+#define HISTORY_FLUSH_RECORDS 16
+
+/*
+ * One row of a query: a single record, or the mean of `step` records when
+ * downsampling. Sensors without a good reading in the row are not valid.
+ * skip is the number of records stamped `time` that come before the row's
+ * first record, so (time, skip) is a query cursor that starts at this row.
+ */
+typedef struct {
+  uint32_t time;
+  uint32_t skip;
+  int count;
+  bool valid[TEMPERATURE_MAX_SENSORS];
+  int32_t millicelsius[TEMPERATURE_MAX_SENSORS];
+} history_row_t;
+
+/* Return false to stop the query early. */
+typedef bool (*history_row_cb)(const history_row_t *row, void *arg);
+
+typedef struct {
+  int blocks_used;
+  int blocks_total;
+  uint32_t oldest_time;
+  uint32_t newest_time;
+  uint32_t records_written;
+  uint32_t samples_written;
+  uint32_t bits_written;
+} history_stats_t;
+
+int history_init(void);
+uint32_t history_now(void);
+int history_append(const temperature_sample_t *samples, int count);
+int history_flush(void);
+int history_query(uint32_t from, uint32_t skip, uint32_t to, uint16_t step,
+                  history_row_cb cb, void *arg);
+int history_get_stats(history_stats_t *stats);
+
+#endif
@@ -2,34 +2,131 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "temperature/temperature.h"
+#include "temperature/sampling.h"
+#include "temperature/conditioning.h"
+#include "temperature/readings.h"
+#include "alerts/alerts.h"
 #include "bluetooth/bluetooth.h"
 #include "flash/flash.h"
 #include "wifi/wifi.h"
+#include "tasks/task_topology.h"
+#include "ota/ota.h"
+#include "coap/coap_server.h"
+#include "uplink/uplink.h"
+#include "history/history.h"
+#include "bluetooth/gatt_server.h"
+#include "esp_timer.h"
+
+/* How long a freshly updated image gets to prove itself before rollback. */
+#define BOOT_HEALTH_TIMEOUT_MS 30000
+#define BOOT_HEALTH_POLL_MS 500
+
+/**
+ * Pushes an alert edge to subscribed centrals without waiting for the next
+ * reading to be collected.
+ */
+static void on_alert(const alert_event_t *event)
+{
+  char text[GATT_SVR_ALERT_TEXT_MAX_LEN + 1];
+  snprintf(text, sizeof(text), "%s %s %d", alert_rule_type_name(event->type),
+           event->active ? "ON" : "OFF", event->value);
+  printf("Alert rule %d: %s\n", event->rule, text);
+  gatt_server_notify_alert(GATT_SVR_ALERT_CAT_HIGH_PRIORITY, text);
+}
 
 /**
- * Temperature telemetry task. 
+ * Temperature telemetry task. The delay between conversions is chosen by the
+ * adaptive sampling policy.
+ *
+ * Alerts and the sampling policy get the calibrated readings before the
+ * filters: smoothed values reach a threshold or show a step late. History,
+ * CoAP and BLE get the filtered ones.
  */
 void temperature_telemetry(void *params)
 {
+  temperature_sample_t samples[TEMPERATURE_MAX_SENSORS];
+  temperature_sample_t unfiltered[TEMPERATURE_MAX_SENSORS];
   while (true)
   {
-    temperature_reading_t temperature_reading = get_temperature_in_c();
-    if (temperature_reading.success == true)
+    int count = read_temperatures(samples, TEMPERATURE_MAX_SENSORS);
+    conditioning_apply(samples, count, unfiltered);
+    for (int i = 0; i < count; i++)
+    {
+      if (samples[i].success == true)
+      {
+        printf("Sensor %d temperature is %d mdeg C\n", i, samples[i].millicelsius);
+      }
+    }
+    readings_publish(samples, count);
+    history_append(samples, count);
+    ble_beacon_update();
+    alerts_evaluate(unfiltered, count, (uint32_t)(esp_timer_get_time() / 1000));
+    uint32_t period_ms = sampling_next_period_ms(unfiltered, count);
+    vTaskDelay(period_ms / portTICK_PERIOD_MS);
+  }
+}
+
+static bool have_successful_reading(void)
+{
+  reading_set_t readings;
+  readings_get_latest(&readings);
+  for (int i = 0; i < readings.count; i++)
+  {
+    if (readings.samples[i].success)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * The image is healthy once a sensor has been read successfully and at
+ * least one radio came up, and the tasks sit where the topology says.
+ */
+static bool boot_is_healthy(void)
+{
+  bool sensor_ok = false;
+  bool radio_ok = false;
+  for (int waited = 0; waited < BOOT_HEALTH_TIMEOUT_MS; waited += BOOT_HEALTH_POLL_MS)
+  {
+    sensor_ok = have_successful_reading();
+    radio_ok = ble_is_synced() || wifi_is_connected();
+    if (sensor_ok && radio_ok)
     {
-      printf("Temperature is %d deg C\n", temperature_reading.value);
+      break;
     }
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
+    vTaskDelay(BOOT_HEALTH_POLL_MS / portTICK_PERIOD_MS);
   }
+  if (!sensor_ok)
+  {
+    printf("No successful sensor reading\n");
+  }
+  if (!radio_ok)
+  {
+    printf("Neither BLE nor Wi-Fi came up\n");
+  }
+  if (task_topology_self_check() != ESP_OK)
+  {
+    printf("Task topology self-check failed\n");
+    return false;
+  }
+  return sensor_ok && radio_ok;
 }
 
 void app_main(void)
 {
   
   init_flash();
+  history_init();
+  sampling_init();
+  alerts_init(on_alert);
   init_ble();
   init_wifi();
-  
-    
+  coap_server_start();
+  uplink_start();
+
+  task_topology_create(TASK_SAMPLING, &temperature_telemetry, NULL);
 
-  //xTaskCreate(&temperature_telemetry, "Temperature Telemetry", 2048, "Temperature Telemetry", 2, NULL);
+  ota_confirm_boot(boot_is_healthy());
 }
@@ -0,0 +1,421 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "esp32/rom/crc.h"
+#include "ota.h"
+
+#define LOG_TAG "ota"
+
+#define SECTOR_SIZE 4096
+#define HEADER_SIZE 20
+
+typedef enum
+{
+    STATE_IDLE = 0,
+    STATE_HEADER,
+    STATE_OP,
+    STATE_COPY_ARGS,
+    STATE_INSERT_ARGS,
+    STATE_INSERT_DATA,
+    STATE_FAILED,
+} delta_state_t;
+
+typedef struct
+{
+    delta_state_t state;
+    const esp_partition_t *source;
+    const esp_partition_t *target;
+    esp_ota_handle_t handle;
+    bool opened;
+
+    uint8_t field[HEADER_SIZE];
+    size_t field_len;
+    uint32_t remaining;
+
+    uint32_t source_size;
+    uint32_t source_crc;
+    uint32_t target_size;
+    uint32_t target_crc;
+    uint32_t written;
+    uint32_t crc;
+
+    uint32_t patch_bytes;
+    int64_t started_us;
+
+    /* Output is batched so each esp_ota_write covers a whole sector. */
+    uint8_t sector[SECTOR_SIZE];
+    size_t sector_len;
+} delta_ctx_t;
+
+static delta_ctx_t *ctx;
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static esp_err_t flush_sector(void)
+{
+    if (ctx->sector_len == 0)
+    {
+        return ESP_OK;
+    }
+    esp_err_t err = esp_ota_write(ctx->handle, ctx->sector, ctx->sector_len);
+    ctx->sector_len = 0;
+    return err;
+}
+
+static esp_err_t emit(const uint8_t *data, size_t len)
+{
+    if (ctx->written + len > ctx->target_size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    ctx->crc = crc32_le(ctx->crc, data, len);
+    ctx->written += len;
+
+    while (len > 0)
+    {
+        size_t chunk = SECTOR_SIZE - ctx->sector_len;
+        if (chunk > len)
+        {
+            chunk = len;
+        }
+        memcpy(&ctx->sector[ctx->sector_len], data, chunk);
+        ctx->sector_len += chunk;
+        data += chunk;
+        len -= chunk;
+        if (ctx->sector_len == SECTOR_SIZE)
+        {
+            esp_err_t err = flush_sector();
+            if (err != ESP_OK)
+            {
+                return err;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+/**
+ * Copies a range of the running image into the output, going through a small
+ * stack buffer so no extra sector-sized allocation is needed.
+ */
+static esp_err_t copy_from_source(uint32_t offset, uint32_t len)
+{
+    uint8_t buf[256];
+    if (offset + len > ctx->source_size || offset + len < offset)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    while (len > 0)
+    {
+        uint32_t chunk = len > sizeof(buf) ? sizeof(buf) : len;
+        esp_err_t err = esp_partition_read(ctx->source, offset, buf, chunk);
+        if (err == ESP_OK)
+        {
+            err = emit(buf, chunk);
+        }
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Checks that the running image is the one the patch was built against.
+ */
+static esp_err_t verify_source(void)
+{
+    uint8_t buf[256];
+    uint32_t crc = 0;
+    for (uint32_t offset = 0; offset < ctx->source_size; offset += sizeof(buf))
+    {
+        uint32_t chunk = ctx->source_size - offset;
+        if (chunk > sizeof(buf))
+        {
+            chunk = sizeof(buf);
+        }
+        esp_err_t err = esp_partition_read(ctx->source, offset, buf, chunk);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        crc = crc32_le(crc, buf, chunk);
+    }
+    if (crc != ctx->source_crc)
+    {
+        ESP_LOGE(LOG_TAG, "Source CRC mismatch, patch built against another image");
+        return ESP_ERR_INVALID_CRC;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Validates the patch header against the running image and only then opens
+ * the inactive slot, so a patch for another base never erases it.
+ */
+static esp_err_t start_patch(void)
+{
+    if (memcmp(ctx->field, OTA_DELTA_MAGIC, 4) != 0)
+    {
+        return ESP_ERR_INVALID_VERSION;
+    }
+    ctx->source_size = read_u32(&ctx->field[4]);
+    ctx->source_crc = read_u32(&ctx->field[8]);
+    ctx->target_size = read_u32(&ctx->field[12]);
+    ctx->target_crc = read_u32(&ctx->field[16]);
+    if (ctx->source_size > ctx->source->size ||
+        ctx->target_size > ctx->target->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t err = verify_source();
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    err = esp_ota_begin(ctx->target, ctx->target_size, &ctx->handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(LOG_TAG, "esp_ota_begin failed: %s", esp_err_to_name(err));
+        return err;
+    }
+    ctx->opened = true;
+    return ESP_OK;
+}
+
+/**
+ * Accumulates a fixed-size field that may be split across writes.
+ * @returns The number of bytes consumed.
+ */
+static size_t collect(const uint8_t *data, size_t len, size_t want)
+{
+    size_t take = want - ctx->field_len;
+    if (take > len)
+    {
+        take = len;
+    }
+    memcpy(&ctx->field[ctx->field_len], data, take);
+    ctx->field_len += take;
+    return take;
+}
+
+/**
+ * Prepares a delta against the running image. The inactive slot is opened
+ * once the patch header has been checked.
+ * @returns ESP_OK, ESP_ERR_INVALID_STATE when an update is in progress or
+ * ESP_ERR_NOT_FOUND when there is no slot to update.
+ */
+int ota_delta_begin(void)
+{
+    if (ctx != NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+
+    ctx->source = esp_ota_get_running_partition();
+    ctx->target = esp_ota_get_next_update_partition(NULL);
+    if (ctx->target == NULL)
+    {
+        ota_delta_abort();
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    ctx->state = STATE_HEADER;
+    ctx->started_us = esp_timer_get_time();
+    ESP_LOGI(LOG_TAG, "Patching %s into %s", ctx->source->label, ctx->target->label);
+    return ESP_OK;
+}
+
+/**
+ * Feeds the next chunk of a delta patch. Chunks may split the patch at any
+ * byte boundary.
+ */
+int ota_delta_write(const uint8_t *data, size_t len)
+{
+    esp_err_t err = ESP_OK;
+    if (ctx == NULL || ctx->state == STATE_FAILED)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    ctx->patch_bytes += len;
+
+    while (len > 0 && err == ESP_OK)
+    {
+        size_t used = 0;
+        switch (ctx->state)
+        {
+        case STATE_HEADER:
+            used = collect(data, len, HEADER_SIZE);
+            if (ctx->field_len == HEADER_SIZE)
+            {
+                err = start_patch();
+                ctx->field_len = 0;
+                ctx->state = STATE_OP;
+            }
+            break;
+
+        case STATE_OP:
+            used = 1;
+            if (data[0] == OTA_DELTA_OP_COPY)
+            {
+                ctx->state = STATE_COPY_ARGS;
+            }
+            else if (data[0] == OTA_DELTA_OP_INSERT)
+            {
+                ctx->state = STATE_INSERT_ARGS;
+            }
+            else
+            {
+                err = ESP_ERR_INVALID_ARG;
+            }
+            break;
+
+        case STATE_COPY_ARGS:
+            used = collect(data, len, 8);
+            if (ctx->field_len == 8)
+            {
+                err = copy_from_source(read_u32(&ctx->field[0]), read_u32(&ctx->field[4]));
+                ctx->field_len = 0;
+                ctx->state = STATE_OP;
+            }
+            break;
+
+        case STATE_INSERT_ARGS:
+            used = collect(data, len, 4);
+            if (ctx->field_len == 4)
+            {
+                ctx->remaining = read_u32(&ctx->field[0]);
+                ctx->field_len = 0;
+                ctx->state = ctx->remaining > 0 ? STATE_INSERT_DATA : STATE_OP;
+            }
+            break;
+
+        case STATE_INSERT_DATA:
+            used = len < ctx->remaining ? len : ctx->remaining;
+            err = emit(data, used);
+            ctx->remaining -= used;
+            if (ctx->remaining == 0)
+            {
+                ctx->state = STATE_OP;
+            }
+            break;
+
+        default:
+            err = ESP_ERR_INVALID_STATE;
+            break;
+        }
+        data += used;
+        len -= used;
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(LOG_TAG, "Patch rejected: %s", esp_err_to_name(err));
+        ctx->state = STATE_FAILED;
+    }
+    return err;
+}
+
+/**
+ * Finishes the update. The rebuilt image must match the size and CRC from
+ * the patch header and pass esp_ota_end() validation before it is selected
+ * for the next boot.
+ */
+int ota_delta_end(void)
+{
+    esp_err_t err;
+    if (ctx == NULL)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (ctx->state != STATE_OP || ctx->written != ctx->target_size)
+    {
+        ota_delta_abort();
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (ctx->crc != ctx->target_crc)
+    {
+        ESP_LOGE(LOG_TAG, "Target CRC mismatch");
+        ota_delta_abort();
+        return ESP_ERR_INVALID_CRC;
+    }
+
+    err = flush_sector();
+    if (err != ESP_OK)
+    {
+        ota_delta_abort();
+        return err;
+    }
+    err = esp_ota_end(ctx->handle);
+    if (err == ESP_OK)
+    {
+        err = esp_ota_set_boot_partition(ctx->target);
+    }
+
+    ESP_LOGI(LOG_TAG, "Patch %u bytes for a %u byte image (%u%%), applied in %lld ms",
+             ctx->patch_bytes, ctx->target_size,
+             ctx->target_size ? ctx->patch_bytes * 100 / ctx->target_size : 0,
+             (esp_timer_get_time() - ctx->started_us) / 1000);
+    free(ctx);
+    ctx = NULL;
+    return err;
+}
+
+void ota_delta_abort(void)
+{
+    if (ctx == NULL)
+    {
+        return;
+    }
+    if (ctx->opened)
+    {
+        /* Releases the handle; the partial image never validates. */
+        esp_ota_end(ctx->handle);
+    }
+    free(ctx);
+    ctx = NULL;
+}
+
+/**
+ * Confirms a freshly updated image once the boot health check has run, or
+ * rolls back to the previous slot when it failed. Does nothing for an image
+ * that is already confirmed.
+ */
+void ota_confirm_boot(bool healthy)
+{
+    esp_ota_img_states_t state;
+    const esp_partition_t *running = esp_ota_get_running_partition();
+
+    if (esp_ota_get_state_partition(running, &state) != ESP_OK ||
+        state != ESP_OTA_IMG_PENDING_VERIFY)
+    {
+        return;
+    }
+
+    if (healthy)
+    {
+        ESP_LOGI(LOG_TAG, "Health check passed, confirming %s", running->label);
+        esp_ota_mark_app_valid_cancel_rollback();
+    }
+    else
+    {
+        ESP_LOGE(LOG_TAG, "Health check failed, rolling back");
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef _OTA_H
+#define _OTA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Delta patch format, all integers little endian:
+ *
+ *   header: "TTD2" | u32 source_size | u32 source_crc32 |
+ *           u32 target_size | u32 target_crc32
+ *   ops:    0x01 COPY   | u32 source_offset | u32 length
+ *           0x02 INSERT | u32 length | length literal bytes
+ *
+ * COPY reads from the running image, INSERT carries new bytes. The source
+ * CRC is checked against the running image before anything is written, then
+ * the target is rebuilt in the inactive OTA slot while the patch streams in.
+ */
+#define OTA_DELTA_MAGIC "TTD2"
+#define OTA_DELTA_OP_COPY 0x01
+#define OTA_DELTA_OP_INSERT 0x02
+
+int ota_delta_begin(void);
+int ota_delta_write(const uint8_t *data, size_t len);
+int ota_delta_end(void);
+void ota_delta_abort(void);
+void ota_confirm_boot(bool healthy);
+
+#endif
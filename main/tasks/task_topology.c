@@ -0,0 +1,160 @@
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "task_topology.h"
+
+#define LOG_TAG "topology"
+
+#if CONFIG_BT_NIMBLE_PINNED_TO_CORE != TOPOLOGY_RADIO_CORE
+#error "NimBLE must be pinned to the radio core"
+#endif
+
+/*
+ * Stack sizes are estimates that have not been measured on hardware yet.
+ * task_topology_self_check() logs every task's high-water mark so they can
+ * be tuned, and fails when a task has less than TOPOLOGY_STACK_HEADROOM left.
+ */
+static const task_topology_entry_t topology[TASK_COUNT] = {
+    [TASK_SAMPLING] = {
+        .name = "temperature_telemetry",
+        .stack_size = 3072,
+        .priority = 6,
+        .core = TOPOLOGY_SAMPLING_CORE,
+    },
+    [TASK_UPLINK] = {
+        .name = "on_connected",
+        .stack_size = 3072,
+        .priority = 5,
+        .core = TOPOLOGY_RADIO_CORE,
+    },
+    [TASK_CONSOLE] = {
+        .name = "console_cli",
+        .stack_size = 4096,
+        .priority = 3,
+        .core = TOPOLOGY_RADIO_CORE,
+    },
+    [TASK_CONSOLE_DISPATCH] = {
+        .name = "console_cmd",
+        .stack_size = 3584,
+        .priority = 2,
+        .core = TOPOLOGY_RADIO_CORE,
+    },
+    [TASK_COAP] = {
+        .name = "coap_server",
+        .stack_size = 4096,
+        .priority = 4,
+        .core = TOPOLOGY_RADIO_CORE,
+    },
+    /* The TLS handshake verifies the broker certificate on this stack. */
+    [TASK_PUBLISH] = {
+        .name = "uplink",
+        .stack_size = 7168,
+        .priority = 3,
+        .core = TOPOLOGY_RADIO_CORE,
+    },
+};
+
+static TaskHandle_t handles[TASK_COUNT];
+
+const task_topology_entry_t *task_topology_get(task_id_t id)
+{
+    if (id >= TASK_COUNT)
+    {
+        return NULL;
+    }
+    return &topology[id];
+}
+
+/**
+ * Creates the task for the given topology slot, pinned to its core.
+ * @returns ESP_OK when the task was created, otherwise ESP_FAIL.
+ */
+int task_topology_create(task_id_t id, TaskFunction_t fn, void *params)
+{
+    const task_topology_entry_t *entry = task_topology_get(id);
+    if (entry == NULL)
+    {
+        return ESP_FAIL;
+    }
+
+    BaseType_t rc = xTaskCreatePinnedToCore(fn, entry->name, entry->stack_size,
+                                            params, entry->priority,
+                                            &handles[id], entry->core);
+    if (rc != pdPASS)
+    {
+        handles[id] = NULL;
+        ESP_LOGE(LOG_TAG, "Failed to create %s", entry->name);
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Verifies that every running task sits on the core and priority declared
+ * in the topology table and logs its stack high-water mark.
+ * @returns ESP_OK when the layout matches, the sampling task is running and
+ * every task keeps TOPOLOGY_STACK_HEADROOM free, otherwise ESP_FAIL.
+ */
+int task_topology_self_check(void)
+{
+    int rc = ESP_OK;
+    for (int i = 0; i < TASK_COUNT; i++)
+    {
+        const task_topology_entry_t *entry = &topology[i];
+        if (handles[i] == NULL)
+        {
+            if (i == TASK_SAMPLING)
+            {
+                ESP_LOGE(LOG_TAG, "%s: not running", entry->name);
+                rc = ESP_FAIL;
+            }
+            else
+            {
+                ESP_LOGI(LOG_TAG, "%s: not running", entry->name);
+            }
+            continue;
+        }
+
+        BaseType_t core = xTaskGetAffinity(handles[i]);
+        UBaseType_t priority = uxTaskPriorityGet(handles[i]);
+        UBaseType_t free_stack = uxTaskGetStackHighWaterMark(handles[i]);
+
+        if (core != entry->core || priority != entry->priority)
+        {
+            ESP_LOGE(LOG_TAG, "%s: expected core %d prio %d, got core %d prio %d",
+                     entry->name, entry->core, entry->priority, core, priority);
+            rc = ESP_FAIL;
+        }
+
+        if (free_stack < TOPOLOGY_STACK_HEADROOM)
+        {
+            ESP_LOGE(LOG_TAG, "%s: only %d of %d stack bytes free",
+                     entry->name, free_stack, entry->stack_size);
+            rc = ESP_FAIL;
+        }
+        else
+        {
+            ESP_LOGI(LOG_TAG, "%s: core %d prio %d, %d of %d stack bytes free",
+                     entry->name, core, priority, free_stack, entry->stack_size);
+        }
+    }
+
+    for (int i = 0; i < TASK_COUNT; i++)
+    {
+        if (i == TASK_SAMPLING)
+        {
+            continue;
+        }
+        if (topology[i].core == TOPOLOGY_SAMPLING_CORE)
+        {
+            ESP_LOGE(LOG_TAG, "%s shares the sampling core", topology[i].name);
+            rc = ESP_FAIL;
+        }
+        if (topology[i].priority >= topology[TASK_SAMPLING].priority)
+        {
+            ESP_LOGE(LOG_TAG, "%s outranks sampling", topology[i].name);
+            rc = ESP_FAIL;
+        }
+    }
+    return rc;
+}
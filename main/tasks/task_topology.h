@@ -0,0 +1,44 @@
+#ifndef _TASK_TOPOLOGY_H
+#define _TASK_TOPOLOGY_H
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/*
+ * Central task placement for the firmware.
+ *
+ * The radio stacks (Wi-Fi and NimBLE) are pinned to core 0 by sdkconfig, so
+ * everything that talks to the radio lives there too. Core 1 is reserved for
+ * sampling so the bit-banged 1-Wire timing is not disturbed by radio
+ * interrupts. Sampling runs above the other application tasks.
+ */
+#define TOPOLOGY_RADIO_CORE 0
+#define TOPOLOGY_SAMPLING_CORE 1
+
+/* Minimum free stack (bytes) a task must keep before the self-check fails. */
+#define TOPOLOGY_STACK_HEADROOM 512
+
+typedef enum
+{
+    TASK_SAMPLING = 0,
+    TASK_UPLINK,
+    TASK_CONSOLE,
+    TASK_CONSOLE_DISPATCH,
+    TASK_COAP,
+    TASK_PUBLISH,
+    TASK_COUNT
+} task_id_t;
+
+typedef struct
+{
+    const char *name;
+    uint32_t stack_size;
+    UBaseType_t priority;
+    BaseType_t core;
+} task_topology_entry_t;
+
+const task_topology_entry_t *task_topology_get(task_id_t id);
+int task_topology_create(task_id_t id, TaskFunction_t fn, void *params);
+int task_topology_self_check(void);
+
+#endif
@@ -0,0 +1,228 @@
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "conditioning.h"
+#include "../config/config.h"
+
+#define LOG_TAG "conditioning"
+
+#if CONDITIONING_MEDIAN_TAPS % 2 == 0
+#error "CONDITIONING_MEDIAN_TAPS must be odd"
+#endif
+
+/*
+ * 1-D Kalman smoother for a temperature that drifts slowly between samples.
+ * Variances are in millicelsius squared; the estimate keeps 4 fraction bits.
+ * A reading further than GATE_MILLICELSIUS from the estimate is a real step
+ * (spikes were already removed by the median), so the filter restarts there
+ * instead of lagging behind it.
+ */
+#define PROCESS_VARIANCE 100
+#define MEASUREMENT_VARIANCE 1600
+#define GATE_MILLICELSIUS 1000
+#define ESTIMATE_SHIFT 4
+
+/*
+ * Filter state for every sensor slot, laid out per stage so each stage runs
+ * as one pass over all sensors. Slot i normally follows samples[i]; a slot
+ * is restarted when a different sensor shows up in its place.
+ */
+static ds18x20_addr_t slot_addrs[TEMPERATURE_MAX_SENSORS];
+static int32_t window[CONDITIONING_MEDIAN_TAPS][TEMPERATURE_MAX_SENSORS];
+static uint8_t window_fill[TEMPERATURE_MAX_SENSORS];
+static uint8_t window_pos[TEMPERATURE_MAX_SENSORS];
+static int32_t estimate[TEMPERATURE_MAX_SENSORS];
+static int32_t variance[TEMPERATURE_MAX_SENSORS];
+
+static void restart_slot(int slot, ds18x20_addr_t addr)
+{
+    slot_addrs[slot] = addr;
+    window_fill[slot] = 0;
+    window_pos[slot] = 0;
+    variance[slot] = 0;
+}
+
+static void calibrate(temperature_sample_t *samples, int count)
+{
+    const app_config_t *config = config_get();
+    int32_t offset[TEMPERATURE_MAX_SENSORS];
+    int32_t gain[TEMPERATURE_MAX_SENSORS];
+
+    for (int i = 0; i < count; i++)
+    {
+        offset[i] = 0;
+        gain[i] = CONDITIONING_GAIN_ONE;
+        for (int j = 0; j < TEMPERATURE_MAX_SENSORS; j++)
+        {
+            if (config->calibration[j].addr == samples[i].addr)
+            {
+                offset[i] = config->calibration[j].offset_millicelsius;
+                gain[i] = config->calibration[j].gain_q16;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (!samples[i].success)
+        {
+            continue;
+        }
+        int64_t scaled = (int64_t)samples[i].millicelsius * gain[i];
+        samples[i].millicelsius = (int32_t)(scaled >> 16) + offset[i];
+    }
+}
+
+static int32_t median(const int32_t *values, int n)
+{
+    int32_t sorted[CONDITIONING_MEDIAN_TAPS];
+
+    for (int i = 0; i < n; i++)
+    {
+        int32_t value = values[i];
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > value; j--)
+        {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = value;
+    }
+    return sorted[n / 2];
+}
+
+static void median_filter(temperature_sample_t *samples, int count)
+{
+    int32_t taps[CONDITIONING_MEDIAN_TAPS];
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!samples[i].success)
+        {
+            continue;
+        }
+        window[window_pos[i]][i] = samples[i].millicelsius;
+        window_pos[i] = (window_pos[i] + 1) % CONDITIONING_MEDIAN_TAPS;
+        if (window_fill[i] < CONDITIONING_MEDIAN_TAPS)
+        {
+            window_fill[i]++;
+        }
+        /* Until the window is full, pass readings through unchanged. */
+        if (window_fill[i] == CONDITIONING_MEDIAN_TAPS)
+        {
+            for (int t = 0; t < CONDITIONING_MEDIAN_TAPS; t++)
+            {
+                taps[t] = window[t][i];
+            }
+            samples[i].millicelsius = median(taps, CONDITIONING_MEDIAN_TAPS);
+        }
+    }
+}
+
+static void kalman_filter(temperature_sample_t *samples, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!samples[i].success)
+        {
+            continue;
+        }
+
+        int32_t measured = samples[i].millicelsius;
+        int32_t innovation = measured - (estimate[i] >> ESTIMATE_SHIFT);
+        if (variance[i] == 0 || innovation > GATE_MILLICELSIUS || innovation < -GATE_MILLICELSIUS)
+        {
+            estimate[i] = measured * (1 << ESTIMATE_SHIFT);
+            variance[i] = MEASUREMENT_VARIANCE;
+            continue;
+        }
+
+        int32_t predicted = variance[i] + PROCESS_VARIANCE;
+        int32_t gain_q16 = ((int64_t)predicted << 16) / (predicted + MEASUREMENT_VARIANCE);
+        int32_t residual = measured * (1 << ESTIMATE_SHIFT) - estimate[i];
+        estimate[i] += ((int64_t)gain_q16 * residual) >> 16;
+        variance[i] = ((int64_t)(CONDITIONING_GAIN_ONE - gain_q16) * predicted) >> 16;
+
+        /* Round the Q4 estimate to the nearest millicelsius. */
+        samples[i].millicelsius = (estimate[i] + (1 << (ESTIMATE_SHIFT - 1))) >> ESTIMATE_SHIFT;
+    }
+}
+
+/**
+ * Conditions a batch of readings in place: calibration, then spike
+ * rejection, then smoothing. Failed samples pass through and leave the
+ * filter state of their sensor untouched. Runs on the sampling task only.
+ * @param calibrated When not NULL, receives the readings after calibration
+ * and before the filters, for consumers that must not see filter lag.
+ */
+void conditioning_apply(temperature_sample_t *samples, int count,
+                        temperature_sample_t *calibrated)
+{
+    if (count > TEMPERATURE_MAX_SENSORS)
+    {
+        count = TEMPERATURE_MAX_SENSORS;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (slot_addrs[i] != samples[i].addr)
+        {
+            restart_slot(i, samples[i].addr);
+        }
+    }
+
+    calibrate(samples, count);
+    if (calibrated != NULL)
+    {
+        memcpy(calibrated, samples, count * sizeof(*samples));
+    }
+    median_filter(samples, count);
+    kalman_filter(samples, count);
+}
+
+/**
+ * Stores the calibration for a sensor. A gain of CONDITIONING_GAIN_ONE and
+ * an offset of 0 removes the entry.
+ * @returns ESP_OK, ESP_ERR_INVALID_ARG for an out of range gain, or
+ * ESP_ERR_NO_MEM when every calibration entry is taken.
+ */
+int conditioning_set_calibration(ds18x20_addr_t addr, int32_t offset_millicelsius,
+                                 int32_t gain_q16)
+{
+    app_config_t next = *config_get();
+    sensor_calibration_t *entry = NULL;
+    bool identity = offset_millicelsius == 0 && gain_q16 == CONDITIONING_GAIN_ONE;
+
+    if (addr == 0 || gain_q16 < CONDITIONING_GAIN_ONE / 2 || gain_q16 > CONDITIONING_GAIN_ONE * 2)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < TEMPERATURE_MAX_SENSORS; i++)
+    {
+        if (next.calibration[i].addr == addr)
+        {
+            entry = &next.calibration[i];
+            break;
+        }
+        if (entry == NULL && next.calibration[i].addr == 0)
+        {
+            entry = &next.calibration[i];
+        }
+    }
+    if (entry == NULL)
+    {
+        return identity ? ESP_OK : ESP_ERR_NO_MEM;
+    }
+
+    if (identity)
+    {
+        memset(entry, 0, sizeof(*entry));
+    }
+    else
+    {
+        entry->addr = addr;
+        entry->offset_millicelsius = offset_millicelsius;
+        entry->gain_q16 = gain_q16;
+    }
+    ESP_LOGI(LOG_TAG, "Calibration for %08x%08x: offset %d mC, gain %d/65536",
+             (uint32_t)(addr >> 32), (uint32_t)addr, offset_millicelsius, gain_q16);
+    return config_update(&next);
+}
@@ -0,0 +1,28 @@
+#ifndef _CONDITIONING_H
+#define _CONDITIONING_H
+
+#include <stdint.h>
+#include "temperature.h"
+
+/* Taps of the spike-rejecting median filter; must be odd. */
+#define CONDITIONING_MEDIAN_TAPS 3
+
+/* Calibration gains are Q16 fixed point. */
+#define CONDITIONING_GAIN_ONE (1 << 16)
+
+/*
+ * Per-sensor calibration: calibrated = raw * gain_q16 / 2^16 + offset.
+ * Entries with addr 0 are unused.
+ */
+typedef struct {
+  ds18x20_addr_t addr;
+  int32_t offset_millicelsius;
+  int32_t gain_q16;
+} sensor_calibration_t;
+
+void conditioning_apply(temperature_sample_t *samples, int count,
+                        temperature_sample_t *calibrated);
+int conditioning_set_calibration(ds18x20_addr_t addr, int32_t offset_millicelsius,
+                                 int32_t gain_q16);
+
+#endif
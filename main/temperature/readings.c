@@ -0,0 +1,162 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "readings.h"
+
+typedef struct {
+  ds18x20_addr_t addr;
+  bool valid;
+  int count;
+  int head;
+  int32_t values[READINGS_WINDOW];
+} reading_window_t;
+
+static reading_set_t latest;
+static reading_window_t windows[TEMPERATURE_MAX_SENSORS];
+static portMUX_TYPE latest_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static reading_window_t *find_window(ds18x20_addr_t addr)
+{
+    reading_window_t *unused = NULL;
+    for (int i = 0; i < TEMPERATURE_MAX_SENSORS; i++)
+    {
+        if (windows[i].valid && windows[i].addr == addr)
+        {
+            return &windows[i];
+        }
+        if (!windows[i].valid && unused == NULL)
+        {
+            unused = &windows[i];
+        }
+    }
+    return unused;
+}
+
+static void add_to_window(const temperature_sample_t *sample)
+{
+    reading_window_t *window = find_window(sample->addr);
+    if (window == NULL)
+    {
+        return;
+    }
+    if (!window->valid)
+    {
+        memset(window, 0, sizeof(*window));
+        window->valid = true;
+        window->addr = sample->addr;
+    }
+    window->values[window->head] = sample->millicelsius;
+    window->head = (window->head + 1) % READINGS_WINDOW;
+    if (window->count < READINGS_WINDOW)
+    {
+        window->count++;
+    }
+}
+
+/*
+ * Frees the windows of sensors that are no longer on the bus, so a sensor
+ * fitted in their place gets aggregates. An empty set means the bus is
+ * down; the windows are kept.
+ */
+static void release_vanished_windows(const temperature_sample_t *samples, int count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    for (int i = 0; i < TEMPERATURE_MAX_SENSORS; i++)
+    {
+        bool present = false;
+        for (int j = 0; j < count && windows[i].valid; j++)
+        {
+            present |= samples[j].addr == windows[i].addr;
+        }
+        if (!present)
+        {
+            windows[i].valid = false;
+        }
+    }
+}
+
+/**
+ * Replaces the cached reading set. Readers on other tasks only ever see a
+ * complete set.
+ */
+void readings_publish(const temperature_sample_t *samples, int count)
+{
+    if (count > TEMPERATURE_MAX_SENSORS)
+    {
+        count = TEMPERATURE_MAX_SENSORS;
+    }
+    int64_t now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&latest_lock);
+    latest.sequence++;
+    latest.timestamp_us = now;
+    latest.count = count;
+    memcpy(latest.samples, samples, count * sizeof(*samples));
+    release_vanished_windows(samples, count);
+    for (int i = 0; i < count; i++)
+    {
+        if (samples[i].success)
+        {
+            add_to_window(&samples[i]);
+        }
+    }
+    portEXIT_CRITICAL(&latest_lock);
+}
+
+void readings_get_latest(reading_set_t *out)
+{
+    portENTER_CRITICAL(&latest_lock);
+    *out = latest;
+    portEXIT_CRITICAL(&latest_lock);
+}
+
+uint32_t readings_sequence(void)
+{
+    return latest.sequence;
+}
+
+/**
+ * Summarises the recent window of every sensor seen so far.
+ * @returns The number of aggregates written.
+ */
+int readings_get_aggregates(reading_aggregate_t *out, int max)
+{
+    reading_window_t copy[TEMPERATURE_MAX_SENSORS];
+    int written = 0;
+
+    portENTER_CRITICAL(&latest_lock);
+    memcpy(copy, windows, sizeof(copy));
+    portEXIT_CRITICAL(&latest_lock);
+
+    for (int i = 0; i < TEMPERATURE_MAX_SENSORS && written < max; i++)
+    {
+        if (!copy[i].valid || copy[i].count == 0)
+        {
+            continue;
+        }
+        reading_aggregate_t *aggregate = &out[written++];
+        int64_t sum = 0;
+        aggregate->addr = copy[i].addr;
+        aggregate->count = copy[i].count;
+        aggregate->min_millicelsius = INT32_MAX;
+        aggregate->max_millicelsius = INT32_MIN;
+        for (int j = 0; j < copy[i].count; j++)
+        {
+            int32_t value = copy[i].values[j];
+            sum += value;
+            if (value < aggregate->min_millicelsius)
+            {
+                aggregate->min_millicelsius = value;
+            }
+            if (value > aggregate->max_millicelsius)
+            {
+                aggregate->max_millicelsius = value;
+            }
+        }
+        aggregate->mean_millicelsius = (int32_t)(sum / copy[i].count);
+    }
+    return written;
+}
@@ -0,0 +1,31 @@
+#ifndef _READINGS_H
+#define _READINGS_H
+
+#include <stdint.h>
+#include "temperature.h"
+
+/* The latest reading set, as published by the sampling task. */
+typedef struct {
+  uint32_t sequence;
+  int64_t timestamp_us;
+  int count;
+  temperature_sample_t samples[TEMPERATURE_MAX_SENSORS];
+} reading_set_t;
+
+/* Statistics over the last READINGS_WINDOW successful samples of a sensor. */
+#define READINGS_WINDOW 32
+
+typedef struct {
+  ds18x20_addr_t addr;
+  int count;
+  int32_t min_millicelsius;
+  int32_t max_millicelsius;
+  int32_t mean_millicelsius;
+} reading_aggregate_t;
+
+void readings_publish(const temperature_sample_t *samples, int count);
+void readings_get_latest(reading_set_t *out);
+uint32_t readings_sequence(void);
+int readings_get_aggregates(reading_aggregate_t *out, int max);
+
+#endif
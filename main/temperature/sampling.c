@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "sampling.h"
+#include "../config/config.h"
+
+#define LOG_TAG "sampling"
+
+/* One DS18B20 LSB at 12 bits is 62.5 mC; a step this small is a reading
+ * toggling between two codes, not a change. */
+#define SENSOR_LSB_MILLICELSIUS 63
+
+typedef struct {
+  ds18x20_addr_t addr;
+  bool valid;
+  int32_t reference;
+  int32_t last;
+} sensor_trend_t;
+
+static sensor_trend_t trends[TEMPERATURE_MAX_SENSORS];
+static uint32_t period_ms;
+
+bool sampling_policy_is_valid(const sampling_policy_t *candidate)
+{
+    return candidate->min_period_ms >= 100 &&
+           candidate->max_period_ms >= candidate->min_period_ms &&
+           candidate->max_period_ms <= SAMPLING_MAX_PERIOD_MS &&
+           candidate->deadband_millicelsius >= 0 &&
+           candidate->rate_millicelsius_per_min > 0 &&
+           candidate->high_threshold_millicelsius > candidate->low_threshold_millicelsius;
+}
+
+void sampling_init(void)
+{
+    const sampling_policy_t *policy = &config_get()->sampling;
+    period_ms = policy->min_period_ms;
+    ESP_LOGI(LOG_TAG, "Sampling every %u..%u ms, deadband %d mC",
+             policy->min_period_ms, policy->max_period_ms, policy->deadband_millicelsius);
+}
+
+void sampling_get_policy(sampling_policy_t *out)
+{
+    *out = config_get()->sampling;
+}
+
+/**
+ * Validates, persists and applies a new sampling policy.
+ * @returns ESP_OK on success, ESP_ERR_INVALID_ARG for an inconsistent policy
+ * or the NVS error when it could not be stored.
+ */
+int sampling_set_policy(const sampling_policy_t *candidate)
+{
+    app_config_t next;
+
+    if (!sampling_policy_is_valid(candidate))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    next = *config_get();
+    next.sampling = *candidate;
+    return config_update(&next);
+}
+
+static sensor_trend_t *find_trend(ds18x20_addr_t addr)
+{
+    sensor_trend_t *unused = NULL;
+    for (int i = 0; i < TEMPERATURE_MAX_SENSORS; i++)
+    {
+        if (trends[i].valid && trends[i].addr == addr)
+        {
+            return &trends[i];
+        }
+        if (!trends[i].valid && unused == NULL)
+        {
+            unused = &trends[i];
+        }
+    }
+    return unused;
+}
+
+static bool crossed(int32_t previous, int32_t current, int32_t threshold)
+{
+    return (previous < threshold) != (current < threshold);
+}
+
+/**
+ * Works out how long to wait before the next conversion. While every sensor
+ * stays inside the deadband the period doubles towards the policy maximum;
+ * any excursion, fast change or threshold crossing drops it straight back to
+ * the minimum.
+ */
+uint32_t sampling_next_period_ms(const temperature_sample_t *samples, int count)
+{
+    const sampling_policy_t current = config_get()->sampling;
+    bool fast = false;
+    bool seen = false;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!samples[i].success)
+        {
+            continue;
+        }
+
+        seen = true;
+        int32_t value = samples[i].millicelsius;
+        sensor_trend_t *trend = find_trend(samples[i].addr);
+        if (trend == NULL)
+        {
+            fast = true;
+            continue;
+        }
+        if (!trend->valid)
+        {
+            trend->addr = samples[i].addr;
+            trend->valid = true;
+            trend->reference = value;
+            trend->last = value;
+            fast = true;
+            continue;
+        }
+
+        int32_t step = abs(value - trend->last);
+        int64_t rate = step <= SENSOR_LSB_MILLICELSIUS ? 0 : (int64_t)step * 60000 / period_ms;
+        if (abs(value - trend->reference) > current.deadband_millicelsius ||
+            rate > current.rate_millicelsius_per_min ||
+            crossed(trend->last, value, current.high_threshold_millicelsius) ||
+            crossed(trend->last, value, current.low_threshold_millicelsius))
+        {
+            trend->reference = value;
+            fast = true;
+        }
+        trend->last = value;
+    }
+
+    if (fast)
+    {
+        period_ms = current.min_period_ms;
+    }
+    else if (seen)
+    {
+        period_ms *= 2;
+    }
+    if (period_ms > current.max_period_ms)
+    {
+        period_ms = current.max_period_ms;
+    }
+    if (period_ms < current.min_period_ms)
+    {
+        period_ms = current.min_period_ms;
+    }
+    return period_ms;
+}
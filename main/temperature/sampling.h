@@ -0,0 +1,31 @@
+#ifndef _SAMPLING_H
+#define _SAMPLING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "temperature.h"
+#include "../alerts/alerts.h"
+
+/*
+ * Longest allowed max_period_ms. At half the default STALE window one failed
+ * read does not yet look like a dead sensor, and doubling the period can
+ * never overflow.
+ */
+#define SAMPLING_MAX_PERIOD_MS (ALERTS_DEFAULT_STALE_MS / 2)
+
+typedef struct {
+  uint32_t min_period_ms;
+  uint32_t max_period_ms;
+  int32_t deadband_millicelsius;
+  int32_t rate_millicelsius_per_min;
+  int32_t high_threshold_millicelsius;
+  int32_t low_threshold_millicelsius;
+} sampling_policy_t;
+
+void sampling_init(void);
+bool sampling_policy_is_valid(const sampling_policy_t *policy);
+void sampling_get_policy(sampling_policy_t *policy);
+int sampling_set_policy(const sampling_policy_t *policy);
+uint32_t sampling_next_period_ms(const temperature_sample_t *samples, int count);
+
+#endif
@@ -1,35 +1,362 @@
+#include <string.h>
 #include <ds18x20.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
 #include "temperature.h"
+#include "../config/config.h"
 
-static const gpio_num_t SENSOR_GPIO = 5;
+#define LOG_TAG "temperature"
+
+#define FAMILY_DS18S20 0x10
+
+/* 85 deg C is what the sensor reports before its first conversion. */
+#define POWER_ON_RESET_RAW_DS18B20 0x0550
+#define POWER_ON_RESET_RAW_DS18S20 0x00AA
+
+#define RETRY_LIMIT 3
+#define RETRY_BASE_DELAY_MS 10
+#define RETRY_MAX_DELAY_MS 80
+
+/* A sensor that failed QUARANTINE_THRESHOLD of its last 8 reads is skipped
+ * and only probed again every QUARANTINE_PROBE_INTERVAL reads. */
+#define QUARANTINE_THRESHOLD 4
+#define QUARANTINE_PROBE_INTERVAL 30
+
+#define SENSOR_GPIO ((gpio_num_t)config_get()->sensor_gpio)
+
+static temperature_sensor_stats_t sensors[TEMPERATURE_MAX_SENSORS];
+static int sensor_count = 0;
+
+/* Copy of the stats for other tasks, updated after every read. */
+static temperature_sensor_stats_t published[TEMPERATURE_MAX_SENSORS];
+static int published_count = 0;
+static portMUX_TYPE published_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool rescan = false;
+
+/* Set when the configured resolution changed; the sampling task that owns
+ * the bus applies it before the next read. */
+static volatile bool resolution_changed = false;
+
+/* Worst case 12-bit conversion time; each bit less halves it. */
+#define CONVERSION_MAX_MS 750
 
 /**
- * Gets the temperature from the sensor connected to GPIO pin 5.
- * @returns A temperature_reading_t struct. If the read was successful the 
- * success value will equal 1 (true).
+ * Scans the bus, keeping the error history of sensors that are still present.
  */
-temperature_reading_t get_temperature_in_c()
+static void scan_sensors(void)
 {
-    temperature_reading_t reading;
-    ds18x20_addr_t addrs[1];
-    float temps[1];
-    int sensor_count;
+    ds18x20_addr_t addrs[TEMPERATURE_MAX_SENSORS];
+    temperature_sensor_stats_t previous[TEMPERATURE_MAX_SENSORS];
+    int previous_count = sensor_count;
+    int found = ds18x20_scan_devices(SENSOR_GPIO, addrs, TEMPERATURE_MAX_SENSORS);
+    if (found > TEMPERATURE_MAX_SENSORS)
+    {
+        found = TEMPERATURE_MAX_SENSORS;
+    }
+    if (found < 0)
+    {
+        found = 0;
+    }
+
+    memcpy(previous, sensors, sizeof(sensors));
+    memset(sensors, 0, sizeof(sensors));
+    for (int i = 0; i < found; i++)
+    {
+        sensors[i].addr = addrs[i];
+        for (int j = 0; j < previous_count; j++)
+        {
+            if (previous[j].addr == addrs[i])
+            {
+                sensors[i] = previous[j];
+                break;
+            }
+        }
+    }
+    sensor_count = found;
+}
 
-    sensor_count = ds18x20_scan_devices(SENSOR_GPIO, addrs, 1);
-    if (sensor_count < 1)
+/**
+ * Works out how long a conversion takes at the configured resolution. The
+ * DS18S20 has a fixed resolution and always needs the full time.
+ */
+static uint32_t conversion_ms(void)
+{
+    int shift = 12 - config_get()->sensor_resolution_bits;
+    for (int i = 0; i < sensor_count; i++)
     {
-        reading.success = ESP_FAIL;
-        reading.value = 0;
+        if ((uint8_t)sensors[i].addr == FAMILY_DS18S20)
+        {
+            shift = 0;
+        }
+    }
+    return (CONVERSION_MAX_MS + (1 << shift) - 1) >> shift;
+}
+
+static void publish_stats(void)
+{
+    portENTER_CRITICAL(&published_lock);
+    memcpy(published, sensors, sizeof(sensors));
+    published_count = sensor_count;
+    portEXIT_CRITICAL(&published_lock);
+}
+
+/**
+ * Starts a conversion and waits only as long as the resolution needs,
+ * instead of the driver's fixed 750 ms.
+ */
+static esp_err_t convert(ds18x20_addr_t addr)
+{
+    esp_err_t err = ds18x20_measure(SENSOR_GPIO, addr, false);
+    if (err == ESP_OK)
+    {
+        vTaskDelay((conversion_ms() + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS + 1);
+    }
+    return err;
+}
+
+/**
+ * Reads the scratchpad of a single sensor and validates it. The driver
+ * returns the first 8 scratchpad bytes and checks the CRC byte itself.
+ * @returns ESP_OK with the temperature in millicelsius, ESP_ERR_INVALID_CRC
+ * when the scratchpad is corrupt or ESP_ERR_INVALID_STATE when the sensor
+ * still holds its power-on reset value.
+ */
+static esp_err_t read_scratchpad_validated(ds18x20_addr_t addr, int32_t *millicelsius)
+{
+    uint8_t scratchpad[8];
+    esp_err_t err = ds18x20_read_scratchpad(SENSOR_GPIO, addr, scratchpad);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    int16_t raw = (int16_t)((scratchpad[1] << 8) | scratchpad[0]);
+    if ((uint8_t)addr == FAMILY_DS18S20)
+    {
+        if (raw == POWER_ON_RESET_RAW_DS18S20)
+        {
+            return ESP_ERR_INVALID_STATE;
+        }
+        *millicelsius = (int32_t)raw * 500;
     }
     else
     {
-        if (sensor_count > 1)
+        if (raw == POWER_ON_RESET_RAW_DS18B20)
         {
-            sensor_count = 1;
+            return ESP_ERR_INVALID_STATE;
+        }
+        *millicelsius = ((int32_t)raw * 125) / 2;
+    }
+    return ESP_OK;
+}
+
+/**
+ * Reads a sensor, re-triggering its conversion with a bounded exponential
+ * backoff when the result does not validate.
+ */
+static esp_err_t read_with_retries(ds18x20_addr_t addr, int32_t *millicelsius)
+{
+    uint32_t delay_ms = RETRY_BASE_DELAY_MS;
+    esp_err_t err = read_scratchpad_validated(addr, millicelsius);
+    for (int attempt = 1; attempt < RETRY_LIMIT && err != ESP_OK; attempt++)
+    {
+        ESP_LOGW(LOG_TAG, "Sensor %08x%08x read failed (%s), retrying",
+                 (uint32_t)(addr >> 32), (uint32_t)addr, esp_err_to_name(err));
+        vTaskDelay(delay_ms / portTICK_PERIOD_MS);
+        delay_ms = delay_ms * 2 > RETRY_MAX_DELAY_MS ? RETRY_MAX_DELAY_MS : delay_ms * 2;
+
+        err = convert(addr);
+        if (err == ESP_OK)
+        {
+            err = read_scratchpad_validated(addr, millicelsius);
+        }
+    }
+    return err;
+}
+
+static void record_result(temperature_sensor_stats_t *sensor, bool success)
+{
+    sensor->reads++;
+    sensor->recent_errors <<= 1;
+    if (!success)
+    {
+        sensor->errors++;
+        sensor->recent_errors |= 1;
+    }
+
+    if (sensor->quarantined && success)
+    {
+        ESP_LOGI(LOG_TAG, "Sensor %08x%08x recovered",
+                 (uint32_t)(sensor->addr >> 32), (uint32_t)sensor->addr);
+        sensor->quarantined = false;
+        sensor->recent_errors = 0;
+    }
+    else if (!sensor->quarantined &&
+             __builtin_popcount(sensor->recent_errors) >= QUARANTINE_THRESHOLD)
+    {
+        ESP_LOGE(LOG_TAG, "Sensor %08x%08x quarantined after %u/%u errors",
+                 (uint32_t)(sensor->addr >> 32), (uint32_t)sensor->addr,
+                 sensor->errors, sensor->reads);
+        sensor->quarantined = true;
+    }
+
+    if (sensor->quarantined)
+    {
+        sensor->probe_countdown = QUARANTINE_PROBE_INTERVAL;
+    }
+}
+
+/**
+ * Stores a new conversion resolution for every sensor. It is written to the
+ * sensors before the next read so only the sampling task touches the bus,
+ * and again to any sensor found by a later scan.
+ * @returns ESP_OK, ESP_ERR_INVALID_ARG or the error from config_update().
+ */
+int temperature_set_resolution(int bits)
+{
+    app_config_t next;
+
+    if (bits < 9 || bits > 12)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    next = *config_get();
+    next.sensor_resolution_bits = bits;
+    int err = config_update(&next);
+    if (err == ESP_OK)
+    {
+        resolution_changed = true;
+    }
+    return err;
+}
+
+/**
+ * Writes the configured resolution to every sensor that is not already
+ * using it.
+ */
+static void apply_resolution(void)
+{
+    int bits = config_get()->sensor_resolution_bits;
+    uint8_t config_byte = ((bits - 9) << 5) | 0x1f;
+    uint8_t scratchpad[8];
+    for (int i = 0; i < sensor_count; i++)
+    {
+        if ((uint8_t)sensors[i].addr == FAMILY_DS18S20 ||
+            ds18x20_read_scratchpad(SENSOR_GPIO, sensors[i].addr, scratchpad) != ESP_OK ||
+            scratchpad[4] == config_byte)
+        {
+            continue;
+        }
+        /* TH and TL are written back unchanged with the new config byte. */
+        scratchpad[4] = config_byte;
+        if (ds18x20_write_scratchpad(SENSOR_GPIO, sensors[i].addr, &scratchpad[2]) == ESP_OK)
+        {
+            ESP_LOGI(LOG_TAG, "Sensor %08x%08x set to %d bits",
+                     (uint32_t)(sensors[i].addr >> 32), (uint32_t)sensors[i].addr, bits);
+        }
+    }
+}
+
+/**
+ * Reads all sensors on the bus. Every known sensor gets one sample in scan
+ * order; quarantined sensors whose next probe is not yet due and samples
+ * that fail validation are marked unsuccessful and must not be reported.
+ * @returns The number of samples written.
+ */
+int read_temperatures(temperature_sample_t *samples, int max_samples)
+{
+    if (sensor_count == 0 || rescan)
+    {
+        rescan = false;
+        scan_sensors();
+        resolution_changed = true;
+    }
+    if (sensor_count == 0)
+    {
+        publish_stats();
+        return 0;
+    }
+    if (resolution_changed)
+    {
+        resolution_changed = false;
+        apply_resolution();
+    }
+
+    /* When the broadcast conversion fails each sensor is converted on its
+     * own so one bad device does not take the whole batch down. */
+    bool broadcast = convert(ds18x20_ANY) == ESP_OK;
+    int written = 0;
+    int probed = 0;
+    int healthy = 0;
+    for (int i = 0; i < sensor_count && written < max_samples; i++)
+    {
+        temperature_sensor_stats_t *sensor = &sensors[i];
+        temperature_sample_t *sample = &samples[written++];
+        sample->addr = sensor->addr;
+        sample->millicelsius = 0;
+        sample->success = false;
+        if (sensor->quarantined && --sensor->probe_countdown > 0)
+        {
+            continue;
+        }
+
+        probed++;
+        esp_err_t err = broadcast ? ESP_OK : convert(sensor->addr);
+        sample->success = err == ESP_OK &&
+                          read_with_retries(sensor->addr, &sample->millicelsius) == ESP_OK;
+        record_result(sensor, sample->success);
+        if (sample->success)
+        {
+            healthy++;
+        }
+    }
+
+    /* Nothing answered; the bus may have changed so rescan next time. */
+    if (healthy == 0 && probed > 0)
+    {
+        rescan = true;
+    }
+    publish_stats();
+    return written;
+}
+
+/**
+ * Gets the temperature from the first healthy sensor on the configured GPIO.
+ * @returns A temperature_reading_t struct. If the read was successful the 
+ * success value will equal 1 (true).
+ */
+temperature_reading_t get_temperature_in_c()
+{
+    temperature_reading_t reading = {
+        .success = false,
+        .value = 0,
+    };
+    temperature_sample_t samples[TEMPERATURE_MAX_SENSORS];
+    int count = read_temperatures(samples, TEMPERATURE_MAX_SENSORS);
+
+    for (int i = 0; i < count; i++)
+    {
+        if (samples[i].success)
+        {
+            reading.success = true;
+            reading.value = samples[i].millicelsius / 1000;
+            break;
         }
-        ds18x20_measure_and_read_multi(SENSOR_GPIO, addrs, sensor_count, temps);
-        reading.success = ESP_OK;
-        reading.value = (int)temps[0];
     }
     return reading;
 }
+
+/**
+ * Copies the error counters of the sensors found by the last scan, as of the
+ * last read. Safe to call from any task.
+ * @returns The number of entries written to stats.
+ */
+int get_temperature_sensor_stats(temperature_sensor_stats_t *stats, int max_stats)
+{
+    portENTER_CRITICAL(&published_lock);
+    int count = published_count < max_stats ? published_count : max_stats;
+    memcpy(stats, published, count * sizeof(*stats));
+    portEXIT_CRITICAL(&published_lock);
+    return count;
+}
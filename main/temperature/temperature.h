@@ -1,15 +1,35 @@
-#ifndef bool
-#define  bool _Bool
-#endif
-
 #ifndef _TEMPERATURE_H
 #define _TEMPERATURE_H
 
+#include <stdbool.h>
+#include <stdint.h>
+#include <ds18x20.h>
+
+#define TEMPERATURE_MAX_SENSORS 4
+
 typedef struct  {
   bool success;
   int value;
 } temperature_reading_t;
 
+typedef struct {
+  ds18x20_addr_t addr;
+  bool success;
+  int32_t millicelsius;
+} temperature_sample_t;
+
+typedef struct {
+  ds18x20_addr_t addr;
+  uint32_t reads;
+  uint32_t errors;
+  uint8_t recent_errors;
+  bool quarantined;
+  uint16_t probe_countdown;
+} temperature_sensor_stats_t;
+
 temperature_reading_t get_temperature_in_c();
+int read_temperatures(temperature_sample_t *samples, int max_samples);
+int get_temperature_sensor_stats(temperature_sensor_stats_t *stats, int max_stats);
+int temperature_set_resolution(int bits);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,110 @@
+#include <string.h>
+#include "mqtt_packet.h"
+
+/* Remaining lengths above this need a fifth header byte, which we never send. */
+#define REMAINING_MAX 268435455
+
+/**
+ * Writes a fixed header with the remaining length as a base-128 varint.
+ * @returns The header length, or 0 when the remaining length is too long.
+ */
+static size_t put_header(uint8_t *out, uint8_t type, size_t remaining)
+{
+    size_t len = 0;
+
+    if (remaining > REMAINING_MAX)
+    {
+        return 0;
+    }
+    out[len++] = type;
+    do
+    {
+        uint8_t digit = remaining % 128;
+        remaining /= 128;
+        out[len++] = digit | (remaining > 0 ? 0x80 : 0);
+    } while (remaining > 0);
+    return len;
+}
+
+static size_t header_size(size_t remaining)
+{
+    size_t len = 2;
+    while (remaining >= 128)
+    {
+        remaining /= 128;
+        len++;
+    }
+    return len;
+}
+
+static size_t put_string(uint8_t *out, const char *text, size_t len)
+{
+    out[0] = len >> 8;
+    out[1] = len & 0xff;
+    memcpy(&out[2], text, len);
+    return len + 2;
+}
+
+/**
+ * Encodes a clean-session CONNECT.
+ * @returns The packet length, or 0 when it does not fit in max.
+ */
+size_t mqtt_connect(uint8_t *out, size_t max, const char *client_id, uint16_t keepalive_s)
+{
+    static const uint8_t variable[] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04, 0x02};
+    size_t id_len = strlen(client_id);
+    size_t remaining = sizeof(variable) + 2 + 2 + id_len;
+    size_t len;
+
+    if (id_len > UINT16_MAX || header_size(remaining) + remaining > max)
+    {
+        return 0;
+    }
+    len = put_header(out, 0x10, remaining);
+    memcpy(&out[len], variable, sizeof(variable));
+    len += sizeof(variable);
+    out[len++] = keepalive_s >> 8;
+    out[len++] = keepalive_s & 0xff;
+    return len + put_string(&out[len], client_id, id_len);
+}
+
+/**
+ * Encodes a QoS 0 PUBLISH, which has no packet identifier.
+ * @returns The packet length, or 0 when it does not fit in max.
+ */
+size_t mqtt_publish(uint8_t *out, size_t max, const char *topic, const uint8_t *payload,
+                    size_t payload_len)
+{
+    size_t topic_len = strlen(topic);
+    size_t remaining = 2 + topic_len + payload_len;
+    size_t len;
+
+    if (topic_len == 0 || topic_len > UINT16_MAX || remaining > REMAINING_MAX ||
+        header_size(remaining) + remaining > max)
+    {
+        return 0;
+    }
+    len = put_header(out, 0x30, remaining);
+    len += put_string(&out[len], topic, topic_len);
+    memcpy(&out[len], payload, payload_len);
+    return len + payload_len;
+}
+
+size_t mqtt_pingreq(uint8_t *out, size_t max)
+{
+    return max >= 2 ? put_header(out, 0xC0, 0) : 0;
+}
+
+/**
+ * Checks a CONNACK.
+ * @returns Its return code (0 when the broker accepted the connection), or
+ * -1 when in is not a well-formed CONNACK.
+ */
+int mqtt_connack_code(const uint8_t *in, size_t len)
+{
+    if (len != 4 || in[0] != MQTT_PACKET_CONNACK || in[1] != 2 || (in[2] & 0xfe) != 0)
+    {
+        return -1;
+    }
+    return in[3];
+}
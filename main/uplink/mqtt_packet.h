@@ -0,0 +1,21 @@
+#ifndef _MQTT_PACKET_H
+#define _MQTT_PACKET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The few MQTT 3.1.1 packets the uplink needs: a clean-session CONNECT
+ * without credentials, QoS 0 PUBLISH and PINGREQ. The TLS client
+ * certificate identifies the device, so there is no username.
+ */
+#define MQTT_PACKET_CONNACK 0x20
+#define MQTT_PACKET_PINGRESP 0xD0
+
+size_t mqtt_connect(uint8_t *out, size_t max, const char *client_id, uint16_t keepalive_s);
+size_t mqtt_publish(uint8_t *out, size_t max, const char *topic, const uint8_t *payload,
+                    size_t len);
+size_t mqtt_pingreq(uint8_t *out, size_t max);
+int mqtt_connack_code(const uint8_t *in, size_t len);
+
+#endif
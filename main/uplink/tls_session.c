@@ -0,0 +1,327 @@
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "mbedtls/gcm.h"
+#include "mbedtls/platform.h"
+#include "mbedtls/platform_util.h"
+#include "tls_session.h"
+
+#define LOG_TAG "tls_session"
+
+#define NVS_NAMESPACE "uplink"
+#define NVS_KEY_SEAL "session_key"
+
+#define SEAL_MAGIC 0x32534c54 /* "TLS2" */
+#define SEAL_KEY_BITS 256
+#define SEAL_IV_SIZE 12
+#define SEAL_TAG_SIZE 16
+
+/*
+ * Only the uplink task runs handshakes, so the cached session needs no
+ * lock. The stats are also read by the console.
+ */
+static mbedtls_ssl_session cached;
+static bool cached_valid;
+static char cached_host[TLS_SESSION_HOST_MAX];
+static tls_session_stats_t stats;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+#if TLS_SESSION_PERSIST
+/*
+ * The serialised session sealed with AES-GCM, the host as additional data.
+ * After a power cycle RTC memory holds garbage, which fails the tag check
+ * like a session sealed for another broker or with another key.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t len;
+    uint8_t iv[SEAL_IV_SIZE];
+    uint8_t tag[SEAL_TAG_SIZE];
+    uint8_t blob[TLS_SESSION_BLOB_MAX];
+} sealed_session_t;
+
+static RTC_NOINIT_ATTR sealed_session_t sealed;
+static bool restore_tried;
+
+/**
+ * Reads the sealing key from NVS, creating it on first use.
+ */
+static bool seal_key(uint8_t key[SEAL_KEY_BITS / 8])
+{
+    nvs_handle_t handle;
+    size_t len = SEAL_KEY_BITS / 8;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle);
+
+    if (err == ESP_OK)
+    {
+        err = nvs_get_blob(handle, NVS_KEY_SEAL, key, &len);
+        if (err == ESP_ERR_NVS_NOT_FOUND)
+        {
+            esp_fill_random(key, SEAL_KEY_BITS / 8);
+            err = nvs_set_blob(handle, NVS_KEY_SEAL, key, SEAL_KEY_BITS / 8);
+            if (err == ESP_OK)
+            {
+                err = nvs_commit(handle);
+            }
+        }
+        else if (err == ESP_OK && len != SEAL_KEY_BITS / 8)
+        {
+            err = ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        nvs_close(handle);
+    }
+    if (err != ESP_OK)
+    {
+        mbedtls_platform_zeroize(key, SEAL_KEY_BITS / 8);
+        ESP_LOGW(LOG_TAG, "No session key: %s", esp_err_to_name(err));
+    }
+    return err == ESP_OK;
+}
+
+static void persist(const char *host)
+{
+    uint8_t plain[TLS_SESSION_BLOB_MAX];
+    uint8_t key[SEAL_KEY_BITS / 8];
+    mbedtls_gcm_context gcm;
+    size_t len;
+    int rc;
+
+    sealed.magic = 0;
+    rc = mbedtls_ssl_session_save(&cached, plain, sizeof(plain), &len);
+    if (rc != 0)
+    {
+        ESP_LOGW(LOG_TAG, "Session not persisted: -0x%04x", -rc);
+        return;
+    }
+    if (seal_key(key))
+    {
+        esp_fill_random(sealed.iv, sizeof(sealed.iv));
+        mbedtls_gcm_init(&gcm);
+        if (mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, SEAL_KEY_BITS) == 0 &&
+            mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, len, sealed.iv,
+                                      sizeof(sealed.iv), (const uint8_t *)host, strlen(host),
+                                      plain, sealed.blob, sizeof(sealed.tag),
+                                      sealed.tag) == 0)
+        {
+            sealed.len = len;
+            sealed.magic = SEAL_MAGIC;
+        }
+        mbedtls_gcm_free(&gcm);
+    }
+    mbedtls_platform_zeroize(plain, sizeof(plain));
+    mbedtls_platform_zeroize(key, sizeof(key));
+}
+
+/**
+ * Loads the session sealed before the last reset, once per boot.
+ */
+static void restore(const char *host)
+{
+    uint8_t plain[TLS_SESSION_BLOB_MAX];
+    uint8_t key[SEAL_KEY_BITS / 8];
+    mbedtls_gcm_context gcm;
+    bool opened = false;
+
+    if (restore_tried)
+    {
+        return;
+    }
+    restore_tried = true;
+    if (sealed.magic != SEAL_MAGIC || sealed.len > sizeof(sealed.blob) || !seal_key(key))
+    {
+        return;
+    }
+
+    mbedtls_gcm_init(&gcm);
+    opened = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, SEAL_KEY_BITS) == 0 &&
+             mbedtls_gcm_auth_decrypt(&gcm, sealed.len, sealed.iv, sizeof(sealed.iv),
+                                      (const uint8_t *)host, strlen(host), sealed.tag,
+                                      sizeof(sealed.tag), sealed.blob, plain) == 0;
+    mbedtls_gcm_free(&gcm);
+
+    if (opened && mbedtls_ssl_session_load(&cached, plain, sealed.len) == 0)
+    {
+        cached_valid = true;
+        strlcpy(cached_host, host, sizeof(cached_host));
+        portENTER_CRITICAL(&stats_lock);
+        stats.restored = true;
+        portEXIT_CRITICAL(&stats_lock);
+        ESP_LOGI(LOG_TAG, "Restored the session for %s", host);
+    }
+    else
+    {
+        mbedtls_ssl_session_free(&cached);
+        mbedtls_ssl_session_init(&cached);
+        sealed.magic = 0;
+    }
+    mbedtls_platform_zeroize(plain, sizeof(plain));
+    mbedtls_platform_zeroize(key, sizeof(key));
+}
+#endif
+
+/*
+ * Keeps the negotiated session. The peer certificate is dropped: a resumed
+ * handshake does not check it again, and it would not fit in RTC memory.
+ */
+static void save_session(const mbedtls_ssl_context *ssl, const char *host)
+{
+    tls_session_forget();
+    if (mbedtls_ssl_get_session(ssl, &cached) != 0 || cached.verify_result != 0 ||
+        (cached.id_len == 0
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+         && cached.ticket_len == 0
+#endif
+         ))
+    {
+        tls_session_forget();
+        return;
+    }
+#if TLS_SESSION_PERSIST && defined(MBEDTLS_X509_CRT_PARSE_C) && \
+    defined(MBEDTLS_SSL_KEEP_PEER_CERTIFICATE)
+    if (cached.peer_cert != NULL)
+    {
+        mbedtls_x509_crt_free(cached.peer_cert);
+        mbedtls_free(cached.peer_cert);
+        cached.peer_cert = NULL;
+    }
+#endif
+    cached_valid = true;
+    strlcpy(cached_host, host, sizeof(cached_host));
+#if TLS_SESSION_PERSIST
+    persist(host);
+#endif
+}
+
+/**
+ * Steps through the handshake. The server resumed the offered session when
+ * its ServerHello echoes the session ID of our ClientHello; with a ticket,
+ * that ID is the random one mbedtls sends next to the ticket.
+ */
+static int run_handshake(mbedtls_ssl_context *ssl, bool offered, bool *resumed)
+{
+    unsigned char offered_id[32];
+    size_t offered_len = 0;
+    int rc;
+
+    *resumed = false;
+    while (ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER)
+    {
+        int state = ssl->state;
+
+        rc = mbedtls_ssl_handshake_step(ssl);
+        if (rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            continue;
+        }
+        if (rc != 0)
+        {
+            return rc;
+        }
+        if (state == MBEDTLS_SSL_CLIENT_HELLO && ssl->state != state && offered)
+        {
+            offered_len = ssl->session_negotiate->id_len;
+            memcpy(offered_id, ssl->session_negotiate->id, offered_len);
+        }
+        else if (state == MBEDTLS_SSL_SERVER_HELLO && ssl->state != state)
+        {
+            *resumed = offered_len > 0 && ssl->session_negotiate->id_len == offered_len &&
+                       memcmp(ssl->session_negotiate->id, offered_id, offered_len) == 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Runs the TLS handshake on a configured ssl context, offering the cached
+ * session for host first. The negotiated session replaces the cached one,
+ * and the handshake is counted as resumed or full.
+ * @returns The mbedtls result of the handshake.
+ */
+int tls_session_handshake(mbedtls_ssl_context *ssl, const char *host)
+{
+    bool offered = false, resumed;
+    int64_t started;
+    uint32_t elapsed_ms;
+    int rc;
+
+#if TLS_SESSION_PERSIST
+    restore(host);
+#endif
+    if (cached_valid && strncmp(cached_host, host, sizeof(cached_host)) == 0)
+    {
+        rc = mbedtls_ssl_set_session(ssl, &cached);
+        offered = rc == 0;
+        if (rc != 0)
+        {
+            ESP_LOGW(LOG_TAG, "Could not offer the session: -0x%04x", -rc);
+        }
+    }
+
+    started = esp_timer_get_time();
+    rc = run_handshake(ssl, offered, &resumed);
+    elapsed_ms = (esp_timer_get_time() - started) / 1000;
+
+    if (rc != 0)
+    {
+        /* Do not keep offering a session the server may be choking on. */
+        if (offered)
+        {
+            tls_session_forget();
+        }
+        portENTER_CRITICAL(&stats_lock);
+        stats.failed_handshakes++;
+        stats.last_handshake_ms = elapsed_ms;
+        portEXIT_CRITICAL(&stats_lock);
+        ESP_LOGE(LOG_TAG, "Handshake with %s failed after %u ms: -0x%04x",
+                 host, elapsed_ms, -rc);
+        return rc;
+    }
+
+    /* Saved again when resumed too: the server may have sent a new ticket. */
+    save_session(ssl, host);
+
+    portENTER_CRITICAL(&stats_lock);
+    if (resumed)
+    {
+        stats.resumed_handshakes++;
+        stats.total_resumed_ms += elapsed_ms;
+    }
+    else
+    {
+        stats.full_handshakes++;
+        stats.total_full_ms += elapsed_ms;
+        stats.rejected_sessions += offered;
+    }
+    stats.last_handshake_ms = elapsed_ms;
+    portEXIT_CRITICAL(&stats_lock);
+
+    ESP_LOGI(LOG_TAG, "%s handshake with %s in %u ms",
+             resumed ? "Resumed" : offered ? "Full (session declined)" : "Full", host,
+             elapsed_ms);
+    return 0;
+}
+
+/* Drops the cached session, in RAM and in RTC memory. */
+void tls_session_forget(void)
+{
+    mbedtls_ssl_session_free(&cached);
+    mbedtls_ssl_session_init(&cached);
+    cached_valid = false;
+    cached_host[0] = '\0';
+#if TLS_SESSION_PERSIST
+    sealed.magic = 0;
+#endif
+}
+
+void tls_session_get_stats(tls_session_stats_t *out)
+{
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_lock);
+}
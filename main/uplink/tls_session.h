@@ -0,0 +1,45 @@
+#ifndef _TLS_SESSION_H
+#define _TLS_SESSION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "mbedtls/ssl.h"
+
+/*
+ * TLS session resumption for the uplink. The session of the last full
+ * handshake is offered on every reconnect, so a broker that still knows it
+ * (by session ID or ticket) skips the certificate exchange and key
+ * agreement.
+ *
+ * With mbedtls 2.19 or later the session is also sealed with AES-GCM into
+ * RTC memory and survives deep sleep and software resets. The key lives in
+ * NVS, so the master secret is never in RTC memory in the clear. Older
+ * mbedtls has no session serialisation and the cache only lasts until the
+ * next reset.
+ */
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+#define TLS_SESSION_PERSIST 1
+#else
+#define TLS_SESSION_PERSIST 0
+#endif
+
+/* Largest serialised session that is persisted, ticket included. */
+#define TLS_SESSION_BLOB_MAX 640
+#define TLS_SESSION_HOST_MAX 64
+
+typedef struct {
+    uint32_t full_handshakes;
+    uint32_t resumed_handshakes;
+    uint32_t failed_handshakes;
+    uint32_t rejected_sessions;
+    uint32_t last_handshake_ms;
+    uint32_t total_full_ms;
+    uint32_t total_resumed_ms;
+    bool restored;
+} tls_session_stats_t;
+
+int tls_session_handshake(mbedtls_ssl_context *ssl, const char *host);
+void tls_session_forget(void);
+void tls_session_get_stats(tls_session_stats_t *stats);
+
+#endif
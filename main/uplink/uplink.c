@@ -0,0 +1,435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/platform_util.h"
+#include "mbedtls/x509_crt.h"
+#include "uplink.h"
+#include "mqtt_packet.h"
+#include "../temperature/readings.h"
+#include "../tasks/task_topology.h"
+#include "../wifi/wifi.h"
+#include "../wifi/backoff.h"
+
+#define LOG_TAG "uplink"
+#define NVS_NAMESPACE "uplink"
+
+/* How long the task waits for broker traffic before new readings are checked. */
+#define POLL_INTERVAL_MS 250
+#define WIFI_POLL_MS 1000
+
+/* Bounds every blocking read, the handshake included. */
+#define IO_TIMEOUT_MS 10000
+
+/* A PINGREQ goes out after half the keepalive without a packet. */
+#define KEEPALIVE_S 60
+
+#define PAYLOAD_MAX 512
+#define PACKET_MAX (PAYLOAD_MAX + 128)
+
+#if CONFIG_APP_UPLINK
+
+/* Parsed once; the TLS config refers to them for the life of the task. */
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context drbg;
+static mbedtls_x509_crt ca;
+static mbedtls_x509_crt client_cert;
+static mbedtls_pk_context client_key;
+static mbedtls_ssl_config conf;
+
+/* Only the uplink task touches the buffers. */
+static uint8_t packet[PACKET_MAX];
+static char payload[PAYLOAD_MAX];
+static char client_id[24];
+
+static uplink_stats_t stats;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * Reads a PEM string from NVS. The length includes the terminating NUL,
+ * which mbedtls needs to tell PEM from DER.
+ * @returns A malloc'd string, or NULL when the key is missing.
+ */
+static char *read_pem(nvs_handle_t handle, const char *key, size_t *len)
+{
+    char *pem;
+
+    if (nvs_get_str(handle, key, NULL, len) != ESP_OK)
+    {
+        return NULL;
+    }
+    pem = malloc(*len);
+    if (pem != NULL && nvs_get_str(handle, key, pem, len) != ESP_OK)
+    {
+        free(pem);
+        pem = NULL;
+    }
+    return pem;
+}
+
+static bool load_credentials(bool *client_auth)
+{
+    nvs_handle_t handle;
+    char *pem, *key_pem;
+    size_t len, key_len;
+    bool ok;
+
+    *client_auth = false;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) != ESP_OK)
+    {
+        ESP_LOGW(LOG_TAG, "No \"%s\" namespace in NVS", NVS_NAMESPACE);
+        return false;
+    }
+
+    pem = read_pem(handle, "ca", &len);
+    ok = pem != NULL && mbedtls_x509_crt_parse(&ca, (const uint8_t *)pem, len) == 0;
+    free(pem);
+    if (!ok)
+    {
+        ESP_LOGW(LOG_TAG, "No valid CA certificate in NVS");
+    }
+
+    pem = ok ? read_pem(handle, "cert", &len) : NULL;
+    if (pem != NULL)
+    {
+        key_pem = read_pem(handle, "key", &key_len);
+        ok = key_pem != NULL &&
+             mbedtls_x509_crt_parse(&client_cert, (const uint8_t *)pem, len) == 0 &&
+             mbedtls_pk_parse_key(&client_key, (const uint8_t *)key_pem, key_len, NULL, 0) == 0;
+        *client_auth = ok;
+        if (key_pem != NULL)
+        {
+            mbedtls_platform_zeroize(key_pem, key_len);
+            free(key_pem);
+        }
+        free(pem);
+        if (!ok)
+        {
+            ESP_LOGW(LOG_TAG, "Client certificate without a valid key in NVS");
+        }
+    }
+    nvs_close(handle);
+    return ok;
+}
+
+static bool setup_tls(bool client_auth)
+{
+    int rc;
+
+    rc = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                               (const uint8_t *)LOG_TAG, strlen(LOG_TAG));
+    if (rc == 0)
+    {
+        rc = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT,
+                                         MBEDTLS_SSL_TRANSPORT_STREAM,
+                                         MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if (rc == 0 && client_auth)
+    {
+        rc = mbedtls_ssl_conf_own_cert(&conf, &client_cert, &client_key);
+    }
+    if (rc != 0)
+    {
+        ESP_LOGE(LOG_TAG, "TLS setup failed: -0x%04x", -rc);
+        return false;
+    }
+    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&conf, &ca, NULL);
+    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+    mbedtls_ssl_conf_read_timeout(&conf, IO_TIMEOUT_MS);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    return true;
+}
+
+static int write_all(mbedtls_ssl_context *ssl, const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        int rc = mbedtls_ssl_write(ssl, data, len);
+        if (rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            continue;
+        }
+        if (rc < 0)
+        {
+            return rc;
+        }
+        data += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+static int read_exact(mbedtls_ssl_context *ssl, uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        int rc = mbedtls_ssl_read(ssl, data, len);
+        if (rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            return rc < 0 ? rc : MBEDTLS_ERR_SSL_CONN_EOF;
+        }
+        data += rc;
+        len -= rc;
+    }
+    return 0;
+}
+
+/**
+ * Opens TCP, runs the TLS handshake through the session cache and sends
+ * the MQTT CONNECT.
+ * @returns 0 once the broker accepted the connection, otherwise an mbedtls
+ * error or -1 when the broker refused it.
+ */
+static int connect_broker(mbedtls_ssl_context *ssl, mbedtls_net_context *net)
+{
+    char port[6];
+    uint8_t connack[4];
+    size_t len;
+    int rc;
+
+    snprintf(port, sizeof(port), "%d", CONFIG_APP_UPLINK_PORT);
+    rc = mbedtls_net_connect(net, CONFIG_APP_UPLINK_HOST, port, MBEDTLS_NET_PROTO_TCP);
+    if (rc == 0)
+    {
+        rc = mbedtls_ssl_setup(ssl, &conf);
+    }
+    if (rc == 0)
+    {
+        rc = mbedtls_ssl_set_hostname(ssl, CONFIG_APP_UPLINK_HOST);
+    }
+    if (rc != 0)
+    {
+        ESP_LOGE(LOG_TAG, "Connecting to %s:%s failed: -0x%04x",
+                 CONFIG_APP_UPLINK_HOST, port, -rc);
+        return rc;
+    }
+    mbedtls_ssl_set_bio(ssl, net, mbedtls_net_send, NULL, mbedtls_net_recv_timeout);
+
+    rc = tls_session_handshake(ssl, CONFIG_APP_UPLINK_HOST);
+    if (rc != 0)
+    {
+        return rc;
+    }
+
+    len = mqtt_connect(packet, sizeof(packet), client_id, KEEPALIVE_S);
+    rc = write_all(ssl, packet, len);
+    if (rc == 0)
+    {
+        rc = read_exact(ssl, connack, sizeof(connack));
+    }
+    if (rc == 0 && mqtt_connack_code(connack, sizeof(connack)) != 0)
+    {
+        ESP_LOGE(LOG_TAG, "Broker refused the connection: %d",
+                 mqtt_connack_code(connack, sizeof(connack)));
+        return -1;
+    }
+    return rc;
+}
+
+static size_t format_readings(void)
+{
+    reading_set_t readings;
+    size_t len;
+
+    readings_get_latest(&readings);
+    len = snprintf(payload, sizeof(payload), "{\"seq\":%u,\"age_ms\":%u,\"readings\":[",
+                   readings.sequence,
+                   (uint32_t)((esp_timer_get_time() - readings.timestamp_us) / 1000));
+    for (int i = 0; i < readings.count && len < sizeof(payload); i++)
+    {
+        const temperature_sample_t *sample = &readings.samples[i];
+        len += snprintf(&payload[len], sizeof(payload) - len,
+                        "%s{\"id\":\"%08x%08x\",\"ok\":%s,\"mc\":%d}",
+                        i ? "," : "",
+                        (uint32_t)(sample->addr >> 32), (uint32_t)sample->addr,
+                        sample->success ? "true" : "false", sample->millicelsius);
+    }
+    if (len < sizeof(payload))
+    {
+        len += snprintf(&payload[len], sizeof(payload) - len, "]}");
+    }
+    return len < sizeof(payload) ? len : sizeof(payload) - 1;
+}
+
+/**
+ * Publishes each new reading set and keeps the connection alive until Wi-Fi
+ * drops or the broker goes quiet.
+ * @returns 0 when Wi-Fi went down, otherwise the error that ended it.
+ */
+static int run_session(mbedtls_ssl_context *ssl, mbedtls_net_context *net)
+{
+    uint32_t published = 0;
+    int64_t last_sent_us = esp_timer_get_time();
+    int64_t ping_sent_us = 0;
+    uint8_t in[2];
+    size_t len;
+    int rc;
+
+    while (wifi_is_connected())
+    {
+        rc = mbedtls_ssl_get_bytes_avail(ssl) > 0
+                 ? MBEDTLS_NET_POLL_READ
+                 : mbedtls_net_poll(net, MBEDTLS_NET_POLL_READ, POLL_INTERVAL_MS);
+        if (rc < 0)
+        {
+            return rc;
+        }
+        if (rc & MBEDTLS_NET_POLL_READ)
+        {
+            /* A QoS 0 publisher without subscriptions only gets PINGRESP. */
+            rc = read_exact(ssl, in, sizeof(in));
+            if (rc != 0)
+            {
+                return rc;
+            }
+            if (in[0] != MQTT_PACKET_PINGRESP || in[1] != 0)
+            {
+                ESP_LOGE(LOG_TAG, "Unexpected packet 0x%02x from the broker", in[0]);
+                return -1;
+            }
+            ping_sent_us = 0;
+        }
+
+        uint32_t sequence = readings_sequence();
+        if (sequence != 0 && sequence != published)
+        {
+            len = format_readings();
+            len = mqtt_publish(packet, sizeof(packet), CONFIG_APP_UPLINK_TOPIC,
+                               (const uint8_t *)payload, len);
+            rc = len > 0 ? write_all(ssl, packet, len) : -1;
+            if (rc != 0)
+            {
+                return rc;
+            }
+            published = sequence;
+            last_sent_us = esp_timer_get_time();
+            portENTER_CRITICAL(&stats_lock);
+            stats.publishes++;
+            portEXIT_CRITICAL(&stats_lock);
+        }
+
+        int64_t now_us = esp_timer_get_time();
+        if (ping_sent_us != 0 && now_us - ping_sent_us > KEEPALIVE_S * 1000000LL)
+        {
+            ESP_LOGE(LOG_TAG, "No PINGRESP within %d s", KEEPALIVE_S);
+            return -1;
+        }
+        if (ping_sent_us == 0 && now_us - last_sent_us > KEEPALIVE_S * 1000000LL / 2)
+        {
+            len = mqtt_pingreq(packet, sizeof(packet));
+            rc = write_all(ssl, packet, len);
+            if (rc != 0)
+            {
+                return rc;
+            }
+            last_sent_us = ping_sent_us = now_us;
+        }
+    }
+    return 0;
+}
+
+static void uplink_task(void *arg)
+{
+    mbedtls_net_context net;
+    mbedtls_ssl_context ssl;
+    uint8_t mac[6];
+    bool client_auth;
+    int attempt = 0;
+    int rc;
+
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_x509_crt_init(&ca);
+    mbedtls_x509_crt_init(&client_cert);
+    mbedtls_pk_init(&client_key);
+    mbedtls_ssl_config_init(&conf);
+    if (!load_credentials(&client_auth) || !setup_tls(client_auth))
+    {
+        ESP_LOGW(LOG_TAG, "Uplink idle");
+        vTaskDelete(NULL);
+        return;
+    }
+    esp_efuse_mac_get_default(mac);
+    snprintf(client_id, sizeof(client_id), "tt-%02x%02x%02x%02x%02x%02x",
+             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    ESP_LOGI(LOG_TAG, "Publishing to %s:%d as %s", CONFIG_APP_UPLINK_HOST,
+             CONFIG_APP_UPLINK_PORT, client_id);
+
+    while (true)
+    {
+        while (!wifi_is_connected())
+        {
+            vTaskDelay(WIFI_POLL_MS / portTICK_PERIOD_MS);
+        }
+
+        mbedtls_net_init(&net);
+        mbedtls_ssl_init(&ssl);
+        rc = connect_broker(&ssl, &net);
+        if (rc == 0)
+        {
+            attempt = 0;
+            portENTER_CRITICAL(&stats_lock);
+            stats.connects++;
+            portEXIT_CRITICAL(&stats_lock);
+            rc = run_session(&ssl, &net);
+            /* Without a close_notify OpenSSL based brokers drop the session. */
+            mbedtls_ssl_close_notify(&ssl);
+        }
+        mbedtls_ssl_free(&ssl);
+        mbedtls_net_free(&net);
+        if (rc == 0)
+        {
+            continue;
+        }
+
+        portENTER_CRITICAL(&stats_lock);
+        stats.errors++;
+        portEXIT_CRITICAL(&stats_lock);
+        uint32_t delay_ms = reconnect_backoff_ms(attempt++, esp_random());
+        ESP_LOGW(LOG_TAG, "Reconnecting in %u ms (attempt %d)", delay_ms, attempt);
+        vTaskDelay(delay_ms / portTICK_PERIOD_MS);
+    }
+}
+#endif
+
+/**
+ * Starts the MQTT uplink when it is enabled in menuconfig.
+ */
+int uplink_start(void)
+{
+#if CONFIG_APP_UPLINK
+    return task_topology_create(TASK_PUBLISH, uplink_task, NULL);
+#else
+    return ESP_OK;
+#endif
+}
+
+void uplink_get_stats(uplink_stats_t *out)
+{
+#if CONFIG_APP_UPLINK
+    portENTER_CRITICAL(&stats_lock);
+    *out = stats;
+    portEXIT_CRITICAL(&stats_lock);
+    tls_session_get_stats(&out->tls);
+#else
+    memset(out, 0, sizeof(*out));
+#endif
+}
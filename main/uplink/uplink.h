@@ -0,0 +1,23 @@
+#ifndef _UPLINK_H
+#define _UPLINK_H
+
+#include <stdint.h>
+#include "tls_session.h"
+
+/*
+ * Publishes every new reading set to an MQTT broker over TLS, see
+ * CONFIG_APP_UPLINK. The CA certificate, and optionally a client
+ * certificate and key, are PEM strings in the "uplink" NVS namespace under
+ * "ca", "cert" and "key"; without a CA the uplink stays idle.
+ */
+typedef struct {
+    uint32_t connects;
+    uint32_t publishes;
+    uint32_t errors;
+    tls_session_stats_t tls;
+} uplink_stats_t;
+
+int uplink_start(void);
+void uplink_get_stats(uplink_stats_t *stats);
+
+#endif
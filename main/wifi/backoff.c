@@ -0,0 +1,23 @@
+#include "backoff.h"
+
+/**
+ * Works out the delay before the next reconnect attempt. Kept free of
+ * ESP-IDF calls so tools/reconnect_sim can run it on the host.
+ * @param attempt Failed attempts so far, starting at 0.
+ * @param random A random value, e.g. from esp_random(). Zero removes the
+ * jitter.
+ * @returns A delay between half and all of the current backoff.
+ */
+uint32_t reconnect_backoff_ms(int attempt, uint32_t random)
+{
+    uint32_t backoff = RECONNECT_BASE_MS;
+    for (int i = 0; i < attempt && backoff < RECONNECT_MAX_MS; i++)
+    {
+        backoff *= 2;
+    }
+    if (backoff > RECONNECT_MAX_MS)
+    {
+        backoff = RECONNECT_MAX_MS;
+    }
+    return backoff / 2 + random % (backoff / 2);
+}
@@ -0,0 +1,16 @@
+#ifndef _BACKOFF_H
+#define _BACKOFF_H
+
+#include <stdint.h>
+
+/*
+ * Reconnect backoff. The delay doubles per failed attempt up to the cap and
+ * half of it is randomised so a site full of devices coming back after a
+ * power cut does not hit the AP and the broker in lock step.
+ */
+#define RECONNECT_BASE_MS 1000
+#define RECONNECT_MAX_MS 60000
+
+uint32_t reconnect_backoff_ms(int attempt, uint32_t random);
+
+#endif
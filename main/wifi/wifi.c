@@ -2,203 +2,399 @@
 #include "wifi.h"
 #include "esp_log.h"
 #include "esp_event.h"
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "freertos/event_groups.h"
+#include "esp_system.h"
 #include "nvs_flash.h"
 #include "cJSON.h"
+#include "../tasks/task_topology.h"
+#include "../config/config.h"
+#include "backoff.h"
 
 #define LOG_TAG "wifi"
 #define DEBUG_LOG "***** DEBUG *****"
 
-#define DEFAULT_SCAN_LIST_SIZE 5
+#define CONNECT_TIMEOUT_MS 20000
 
-static char* ap_json;;
+#define CONNECTED_BIT BIT0
+#define DISCONNECTED_BIT BIT1
 
-xSemaphoreHandle connectionSemaphore;
-xSemaphoreHandle scanningSemaphore;
+#define SCAN_RECORDS_MAX 16
+#define AP_TABLE_SIZE 16
 
-static int8_t do_scan = 0;
-static int8_t do_connect = 0;
+/* Entries missing from this many consecutive scans are dropped. */
+#define AP_MAX_MISSED_SCANS 3
 
-static char *get_auth_mode(int authmode)
+/* RSSI is kept as an exponential moving average in 1/16 dBm. */
+#define RSSI_SHIFT 4
+#define RSSI_SMOOTHING 2
+
+typedef struct
+{
+    bool valid;
+    uint8_t bssid[6];
+    char ssid[33];
+    uint8_t channel;
+    wifi_auth_mode_t authmode;
+    int16_t rssi_avg;
+    uint8_t missed_scans;
+} ap_entry_t;
+
+static EventGroupHandle_t connection_events;
+
+static xSemaphoreHandle scan_lock;
+static xSemaphoreHandle ap_table_lock;
+static ap_entry_t ap_table[AP_TABLE_SIZE];
+static wifi_ap_record_t scan_records[SCAN_RECORDS_MAX];
+static volatile bool scan_running = false;
+static volatile bool connected = false;
+/* Why the last attempt since connect_to_ap() failed, 0 while none has. */
+static volatile uint8_t last_failure_reason = 0;
+static bool uplink_started = false;
+
+static wifi_scan_params_t scan_params = {
+    .passive = false,
+    .passive_ms = 120,
+    .active_min_ms = 30,
+    .active_max_ms = 80,
+};
+
+static const char *get_auth_mode(int authmode)
 {
-    char *str = (char *)malloc(30 * sizeof(char));
     switch (authmode)
     {
     case WIFI_AUTH_OPEN:
-        strcpy(str, "WIFI_AUTH_OPEN");
-        break;
+        return "WIFI_AUTH_OPEN";
     case WIFI_AUTH_WEP:
-        strcpy(str, "WIFI_AUTH_WEP");
-        break;
+        return "WIFI_AUTH_WEP";
     case WIFI_AUTH_WPA_PSK:
-        strcpy(str, "WIFI_AUTH_WPA_PSK");
-        break;
+        return "WIFI_AUTH_WPA_PSK";
     case WIFI_AUTH_WPA2_PSK:
-        strcpy(str, "WIFI_AUTH_WPA2_PSK");
-        break;
+        return "WIFI_AUTH_WPA2_PSK";
     case WIFI_AUTH_WPA_WPA2_PSK:
-        strcpy(str, "WIFI_AUTH_WPA_WPA2_PSK");
-        break;
+        return "WIFI_AUTH_WPA_WPA2_PSK";
     case WIFI_AUTH_WPA2_ENTERPRISE:
-        strcpy(str, "WIFI_AUTH_WPA2_ENTERPRISE");
-        break;
+        return "WIFI_AUTH_WPA2_ENTERPRISE";
     case WIFI_AUTH_WPA3_PSK:
-        strcpy(str, "WIFI_AUTH_WPA3_PSK");
-        break;
+        return "WIFI_AUTH_WPA3_PSK";
     case WIFI_AUTH_WPA2_WPA3_PSK:
-        strcpy(str, "WIFI_AUTH_WPA2_WPA3_PSK");
-        break;
+        return "WIFI_AUTH_WPA2_WPA3_PSK";
     default:
-        strcpy(str, "WIFI_AUTH_UNKNOWN");
-        break;
+        return "WIFI_AUTH_UNKNOWN";
     }
-    return str;
 }
 
-static esp_err_t event_handler(void *ctx, system_event_t *event)
+static ap_entry_t *find_ap_slot(const uint8_t *bssid)
 {
-    if (do_scan == 1)
+    ap_entry_t *unused = NULL;
+    ap_entry_t *weakest = NULL;
+    for (int i = 0; i < AP_TABLE_SIZE; i++)
     {
-        switch (event->event_id)
+        ap_entry_t *entry = &ap_table[i];
+        if (!entry->valid)
         {
-        case SYSTEM_EVENT_STA_START:
-
-            ESP_LOGI(LOG_TAG, "scanning...\n");
-            uint16_t number = DEFAULT_SCAN_LIST_SIZE;
-            wifi_ap_record_t ap_info[DEFAULT_SCAN_LIST_SIZE];
-            uint16_t ap_count = 0;
-            memset(ap_info, 0, sizeof(ap_info));
-
-            ESP_ERROR_CHECK(esp_wifi_scan_start(NULL, true));
-            ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&number, ap_info));
-            ESP_ERROR_CHECK(esp_wifi_scan_get_ap_num(&ap_count));
-
-            cJSON *resp_root, *ap_list_arr;
-            resp_root = cJSON_CreateObject();
-            ap_list_arr = cJSON_CreateArray();
-            
-            for (int i = 0; (i < DEFAULT_SCAN_LIST_SIZE) && (i < ap_count); i++)
-            {   
-                cJSON *ap_object = cJSON_CreateObject();
-                cJSON_AddStringToObject(ap_object, "ssid",(char *)ap_info[i].ssid);
-                cJSON_AddNumberToObject(ap_object, "channel", ap_info[i].primary);
-                char *auth_mode = get_auth_mode(ap_info[i].authmode);
-                cJSON_AddStringToObject(ap_object, "auth_mode", auth_mode);
-
-                cJSON_AddItemToArray(ap_list_arr, ap_object);
+            if (unused == NULL)
+            {
+                unused = entry;
             }
-            cJSON_AddItemToObject(resp_root, "ap_list", ap_list_arr);
-            ap_json = cJSON_PrintUnformatted(resp_root);
-            break;
-        case WIFI_EVENT_SCAN_DONE:
-            xSemaphoreGive(scanningSemaphore);
-            break;
-        default:
-            break;
+            continue;
+        }
+        if (memcmp(entry->bssid, bssid, sizeof(entry->bssid)) == 0)
+        {
+            return entry;
+        }
+        if (weakest == NULL || entry->rssi_avg < weakest->rssi_avg)
+        {
+            weakest = entry;
+        }
+    }
+    return unused != NULL ? unused : weakest;
+}
+
+/**
+ * Merges the records of a completed scan into the AP table, keyed by BSSID.
+ */
+static void merge_scan_results(void)
+{
+    uint16_t number = SCAN_RECORDS_MAX;
+    if (esp_wifi_scan_get_ap_records(&number, scan_records) != ESP_OK)
+    {
+        number = 0;
+    }
+
+    xSemaphoreTake(ap_table_lock, portMAX_DELAY);
+    for (int i = 0; i < AP_TABLE_SIZE; i++)
+    {
+        ap_table[i].missed_scans++;
+    }
+
+    for (int i = 0; i < number; i++)
+    {
+        const wifi_ap_record_t *record = &scan_records[i];
+        ap_entry_t *entry = find_ap_slot(record->bssid);
+        int16_t rssi = (int16_t)record->rssi << RSSI_SHIFT;
+
+        if (!entry->valid || memcmp(entry->bssid, record->bssid, sizeof(entry->bssid)) != 0)
+        {
+            memcpy(entry->bssid, record->bssid, sizeof(entry->bssid));
+            entry->rssi_avg = rssi;
+            entry->valid = true;
         }
+        else
+        {
+            entry->rssi_avg += (rssi - entry->rssi_avg) >> RSSI_SMOOTHING;
+        }
+        strlcpy(entry->ssid, (const char *)record->ssid, sizeof(entry->ssid));
+        entry->channel = record->primary;
+        entry->authmode = record->authmode;
+        entry->missed_scans = 0;
     }
-    else if (do_connect == 1)
+
+    for (int i = 0; i < AP_TABLE_SIZE; i++)
     {
-        switch (event->event_id)
+        if (ap_table[i].missed_scans > AP_MAX_MISSED_SCANS)
         {
-        case SYSTEM_EVENT_STA_START:
-            esp_wifi_connect();
-            ESP_LOGI(LOG_TAG, "connecting...\n");
-            break;
-
-        case SYSTEM_EVENT_STA_CONNECTED:
-            ESP_LOGI(LOG_TAG, "connected\n");
-            break;
-
-        case SYSTEM_EVENT_STA_GOT_IP:
-            ESP_LOGI(LOG_TAG, "got ip\n");
-            xSemaphoreGive(connectionSemaphore);
-            break;
-
-        case SYSTEM_EVENT_STA_DISCONNECTED:
-            ESP_LOGI(LOG_TAG, "disconnected\n");
-            break;
-
-        default:
-            break;
+            ap_table[i].valid = false;
         }
     }
+    xSemaphoreGive(ap_table_lock);
+}
+
+static esp_err_t event_handler(void *ctx, system_event_t *event)
+{
+    switch (event->event_id)
+    {
+    case SYSTEM_EVENT_SCAN_DONE:
+        ESP_LOGI(LOG_TAG, "scan done\n");
+        merge_scan_results();
+        scan_running = false;
+        break;
+
+    case SYSTEM_EVENT_STA_CONNECTED:
+        ESP_LOGI(LOG_TAG, "connected\n");
+        break;
+
+    case SYSTEM_EVENT_STA_GOT_IP:
+        ESP_LOGI(LOG_TAG, "got ip\n");
+        connected = true;
+        last_failure_reason = 0;
+        xEventGroupClearBits(connection_events, DISCONNECTED_BIT);
+        xEventGroupSetBits(connection_events, CONNECTED_BIT);
+        break;
+
+    case SYSTEM_EVENT_STA_DISCONNECTED:
+        ESP_LOGI(LOG_TAG, "disconnected, reason %d\n", event->event_info.disconnected.reason);
+        connected = false;
+        /* ASSOC_LEAVE is our own esp_wifi_disconnect(), not a failure. */
+        if (event->event_info.disconnected.reason != WIFI_REASON_ASSOC_LEAVE)
+        {
+            last_failure_reason = event->event_info.disconnected.reason;
+        }
+        xEventGroupSetBits(connection_events, DISCONNECTED_BIT);
+        break;
+
+    default:
+        break;
+    }
 
     return ESP_OK;
 }
 
+/**
+ * Starts the station once. It stays started for the lifetime of the device
+ * so scans can run next to an established connection.
+ */
 void init_wifi()
 {
+    connection_events = xEventGroupCreate();
+    scan_lock = xSemaphoreCreateMutex();
+    ap_table_lock = xSemaphoreCreateMutex();
+
     tcpip_adapter_init();
     ESP_ERROR_CHECK(esp_event_loop_init(event_handler, NULL));
 
     wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
     ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_start());
+
+    /* Warm the AP table before a central asks for it. */
+    wifi_start_scan();
+}
+
+/**
+ * Starts a background scan unless one is already running. The results are
+ * merged into the AP table when SYSTEM_EVENT_SCAN_DONE arrives.
+ */
+void wifi_start_scan(void)
+{
+    wifi_scan_config_t scan_config = {0};
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    if (!scan_running)
+    {
+        if (scan_params.passive)
+        {
+            scan_config.scan_type = WIFI_SCAN_TYPE_PASSIVE;
+            scan_config.scan_time.passive = scan_params.passive_ms;
+        }
+        else
+        {
+            scan_config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+            scan_config.scan_time.active.min = scan_params.active_min_ms;
+            scan_config.scan_time.active.max = scan_params.active_max_ms;
+        }
+        err = esp_wifi_scan_start(&scan_config, false);
+        scan_running = err == ESP_OK;
+    }
+    xSemaphoreGive(scan_lock);
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGW(LOG_TAG, "scan not started: %s", esp_err_to_name(err));
+    }
+}
+
+/**
+ * Replaces the dwell times used from the next scan on.
+ */
+void wifi_set_scan_params(const wifi_scan_params_t *params)
+{
+    xSemaphoreTake(scan_lock, portMAX_DELAY);
+    scan_params = *params;
+    xSemaphoreGive(scan_lock);
+}
+
+bool wifi_is_connected(void)
+{
+    return connected;
 }
 
+/**
+ * Reports why the station last lost or failed to get a connection since the
+ * credentials were set, as a wifi_err_reason_t (e.g. 15 for a wrong
+ * password, 201 when the AP was not found).
+ * @returns 0 while connected or when no attempt has failed yet.
+ */
+uint8_t wifi_last_failure_reason(void)
+{
+    return last_failure_reason;
+}
+
+/**
+ * Keeps the station connected. Failed attempts and dropped links are
+ * retried with a jittered exponential backoff. A failed attempt ends with
+ * SYSTEM_EVENT_STA_DISCONNECTED; the timeout only covers an attempt that
+ * never reports back.
+ */
 static void on_connected(void *para)
 {
+    int attempt = 0;
     while (true)
     {
-        if (xSemaphoreTake(connectionSemaphore, 20000 / portTICK_RATE_MS))
+        EventBits_t bits = xEventGroupWaitBits(connection_events,
+                                               CONNECTED_BIT | DISCONNECTED_BIT,
+                                               pdTRUE, pdFALSE,
+                                               CONNECT_TIMEOUT_MS / portTICK_RATE_MS);
+        if (bits & CONNECTED_BIT)
         {
             ESP_LOGI(LOG_TAG, "connected");
+            attempt = 0;
 
-            xSemaphoreTake(connectionSemaphore, portMAX_DELAY);
+            if (!(bits & DISCONNECTED_BIT))
+            {
+                xEventGroupWaitBits(connection_events, DISCONNECTED_BIT,
+                                    pdTRUE, pdFALSE, portMAX_DELAY);
+            }
+            ESP_LOGE(LOG_TAG, "Connection lost");
+        }
+        else if (bits & DISCONNECTED_BIT)
+        {
+            ESP_LOGE(LOG_TAG, "Failed to connect");
         }
         else
         {
-            ESP_LOGE(LOG_TAG, "Failed to connect. Retry in");
-            for (int i = 0; i < 5; i++)
-            {
-                ESP_LOGE(LOG_TAG, "...%d", i);
-                vTaskDelay(1000 / portTICK_RATE_MS);
-            }
-            esp_wifi_stop();
-            esp_wifi_start();
+            ESP_LOGE(LOG_TAG, "Connect timed out");
+            esp_wifi_disconnect();
         }
+
+        uint32_t delay_ms = reconnect_backoff_ms(attempt++, esp_random());
+        ESP_LOGI(LOG_TAG, "Reconnecting in %u ms (attempt %d)", delay_ms, attempt);
+        vTaskDelay(delay_ms / portTICK_RATE_MS);
+        xEventGroupClearBits(connection_events, CONNECTED_BIT | DISCONNECTED_BIT);
+        esp_wifi_connect();
     }
 }
 
 
 int connect_to_ap(char *ssid, uint8_t channel, char *password)
 {
-    esp_wifi_stop();
-    do_scan = 0;
-    do_connect = 1;
-    connectionSemaphore = xSemaphoreCreateBinary();
     wifi_config_t wifi_config = {0};
-    strcpy((char *)wifi_config.sta.ssid, ssid);
-    strcpy((char *)wifi_config.sta.password, password);
+    strlcpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
+    strlcpy((char *)wifi_config.sta.password, password, sizeof(wifi_config.sta.password));
     wifi_config.sta.channel = channel;
+
+    esp_wifi_disconnect();
     esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config);
+    last_failure_reason = 0;
+    esp_wifi_connect();
 
-    esp_wifi_start();
-    xTaskCreate(&on_connected, "on_connected", 1024 * 3, NULL, 5, NULL);
+    if (!uplink_started)
+    {
+        uplink_started = task_topology_create(TASK_UPLINK, &on_connected, NULL) == ESP_OK;
+    }
     return 0;
 }
 
+static int compare_rssi(const void *a, const void *b)
+{
+    const ap_entry_t *left = a;
+    const ap_entry_t *right = b;
+    if (left->valid != right->valid)
+    {
+        return left->valid ? -1 : 1;
+    }
+    return right->rssi_avg - left->rssi_avg;
+}
+
+/**
+ * Returns the deduplicated AP table as JSON straight away and starts a
+ * background scan to refresh it, so callers never wait for the radio. The
+ * caller frees the string.
+ */
 char *get_aps_json()
 {
-    esp_wifi_stop();
-    do_scan = 1;
-    do_connect = 0;
-    scanningSemaphore = xSemaphoreCreateBinary();
+    wifi_start_scan();
 
-    ESP_ERROR_CHECK(esp_wifi_start());
-    while (true)
+    cJSON *resp_root, *ap_list_arr;
+    resp_root = cJSON_CreateObject();
+    ap_list_arr = cJSON_CreateArray();
+
+    ap_entry_t snapshot[AP_TABLE_SIZE];
+    xSemaphoreTake(ap_table_lock, portMAX_DELAY);
+    memcpy(snapshot, ap_table, sizeof(snapshot));
+    xSemaphoreGive(ap_table_lock);
+    qsort(snapshot, AP_TABLE_SIZE, sizeof(snapshot[0]), compare_rssi);
+
+    int list_size = config_get()->scan_list_size;
+    for (int i = 0; i < list_size && i < AP_TABLE_SIZE && snapshot[i].valid; i++)
     {
-        if (xSemaphoreTake(scanningSemaphore, 20000 / portTICK_RATE_MS))
-        {
-            ESP_LOGI(LOG_TAG, "scanning_complete");
-            break;
-        }
+        const ap_entry_t *entry = &snapshot[i];
+        cJSON *ap_object = cJSON_CreateObject();
+        cJSON_AddStringToObject(ap_object, "ssid", entry->ssid);
+        cJSON_AddNumberToObject(ap_object, "channel", entry->channel);
+        cJSON_AddStringToObject(ap_object, "auth_mode", get_auth_mode(entry->authmode));
+        cJSON_AddNumberToObject(ap_object, "rssi", entry->rssi_avg >> RSSI_SHIFT);
+        cJSON_AddItemToArray(ap_list_arr, ap_object);
     }
-    char *str = (char *)malloc(strlen(ap_json) * sizeof(char));
-    strcpy(str, ap_json);
+
+    cJSON_AddItemToObject(resp_root, "ap_list", ap_list_arr);
+    char *str = cJSON_PrintUnformatted(resp_root);
+    cJSON_Delete(resp_root);
     return str;
-}
\ No newline at end of file
+}
@@ -1,9 +1,27 @@
-
 #ifndef _WIFI_H
 #define _WIFI_H
 
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Scan dwell times per channel. A passive scan only listens for beacons and
+ * is the cheapest to run next to an established connection.
+ */
+typedef struct
+{
+    bool passive;
+    uint32_t passive_ms;
+    uint32_t active_min_ms;
+    uint32_t active_max_ms;
+} wifi_scan_params_t;
+
 void init_wifi(void);
+void wifi_start_scan(void);
+void wifi_set_scan_params(const wifi_scan_params_t *params);
 char* get_aps_json(void);
 int connect_to_ap(char *ssid, uint8_t channel, char *password);
+bool wifi_is_connected(void);
+uint8_t wifi_last_failure_reason(void);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,389 @@
+#!/usr/bin/env python3
+"""MQTT over TLS stand-in broker that reports TLS session resumption.
+
+    broker_standin.py --make-certs certs --host broker.local
+    broker_standin.py --certs certs --expect 10
+    broker_standin.py --self-test
+
+Speaks as much MQTT 3.1.1 over TLS 1.2 as main/uplink/uplink.c uses:
+CONNECT, QoS 0 PUBLISH, PINGREQ and DISCONNECT. Every connection prints
+whether its TLS session was resumed and how long the server side of the
+handshake took, and every PUBLISH payload is checked against the readings
+format the uplink sends. Sessions resume by ticket, or only by session ID
+with --no-tickets. Each connection is closed after --hold seconds so the
+device reconnects and offers its session again.
+
+--make-certs writes a CA, a server certificate for --host and a client
+certificate, and uplink_nvs.csv, which nvs_partition_gen.py turns into an
+NVS image with the CA and client credentials in the "uplink" namespace.
+Set CONFIG_APP_UPLINK_HOST to the same host name.
+
+With --expect N the stand-in exits after N connections, non-zero unless
+every connection after the first resumed its session and every payload
+was well-formed. The first connection after a device reset also resumes
+when the device persists its session (mbedtls 2.19 or later).
+
+--self-test runs a client that reconnects like the uplink, with tickets,
+with session IDs only, and against a restarted broker that must decline
+the session. It needs the openssl command for the certificates; only the
+standard library is used otherwise.
+"""
+import argparse
+import json
+import os
+import socket
+import ssl
+import statistics
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+MQTT_PORT = 8883
+
+CONNECT, CONNACK, PUBLISH, PINGREQ, PINGRESP, DISCONNECT = 1, 2, 3, 12, 13, 14
+
+
+class CheckError(Exception):
+    pass
+
+
+def make_certs(directory, host):
+    """Writes a throwaway CA, server and client certificate with openssl."""
+    os.makedirs(directory, exist_ok=True)
+
+    def path(name):
+        return os.path.join(directory, name)
+
+    def openssl(*args):
+        subprocess.run(("openssl",) + args, check=True, capture_output=True)
+
+    openssl("req", "-x509", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1",
+            "-nodes", "-days", "3650", "-subj", "/CN=broker stand-in CA",
+            "-keyout", path("ca.key"), "-out", path("ca.pem"))
+    for name, subject in (("server", host), ("client", "telemetry device")):
+        openssl("req", "-newkey", "ec", "-pkeyopt", "ec_paramgen_curve:prime256v1", "-nodes",
+                "-subj", "/CN=" + subject, "-keyout", path(name + ".key"),
+                "-out", path(name + ".csr"))
+        with open(path(name + ".ext"), "w") as f:
+            if name == "server":
+                f.write("subjectAltName=DNS:%s\n" % host)
+        openssl("x509", "-req", "-in", path(name + ".csr"), "-CA", path("ca.pem"),
+                "-CAkey", path("ca.key"), "-CAcreateserial", "-days", "3650",
+                "-extfile", path(name + ".ext"), "-out", path(name + ".pem"))
+    with open(path("uplink_nvs.csv"), "w") as f:
+        f.write("key,type,encoding,value\n")
+        f.write("uplink,namespace,,\n")
+        f.write("ca,file,string,%s\n" % os.path.abspath(path("ca.pem")))
+        f.write("cert,file,string,%s\n" % os.path.abspath(path("client.pem")))
+        f.write("key,file,string,%s\n" % os.path.abspath(path("client.key")))
+
+
+def server_context(directory, tickets):
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    # mbedtls 2.x resumes TLS 1.2 sessions only.
+    context.minimum_version = context.maximum_version = ssl.TLSVersion.TLSv1_2
+    context.load_cert_chain(os.path.join(directory, "server.pem"),
+                            os.path.join(directory, "server.key"))
+    context.load_verify_locations(os.path.join(directory, "ca.pem"))
+    context.verify_mode = ssl.CERT_OPTIONAL
+    if not tickets:
+        context.options |= ssl.OP_NO_TICKET
+    return context
+
+
+def read_exact(sock, length):
+    data = b""
+    while len(data) < length:
+        chunk = sock.recv(length - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def read_packet(sock):
+    """Returns (type, flags, body) of the next MQTT packet."""
+    header = read_exact(sock, 1)[0]
+    remaining = 0
+    for shift in range(0, 28, 7):
+        digit = read_exact(sock, 1)[0]
+        remaining |= (digit & 0x7f) << shift
+        if not digit & 0x80:
+            break
+    else:
+        raise CheckError("remaining length longer than four bytes")
+    return header >> 4, header & 0xf, read_exact(sock, remaining)
+
+
+def encode_packet(packet_type, body=b"", flags=0):
+    out = bytes([packet_type << 4 | flags])
+    remaining = len(body)
+    while True:
+        digit = remaining & 0x7f
+        remaining >>= 7
+        out += bytes([digit | (0x80 if remaining else 0)])
+        if not remaining:
+            return out + body
+
+
+def parse_string(body, pos):
+    (length,) = struct.unpack_from(">H", body, pos)
+    return body[pos + 2:pos + 2 + length].decode(), pos + 2 + length
+
+
+def check_readings(payload):
+    """The JSON uplink.c publishes: seq, age_ms and one entry per sensor."""
+    try:
+        doc = json.loads(payload.decode())
+    except (UnicodeDecodeError, ValueError) as e:
+        raise CheckError("payload is not JSON (%s): %r" % (e, payload[:80]))
+    if not isinstance(doc.get("seq"), int) or not isinstance(doc.get("age_ms"), int) or \
+            not isinstance(doc.get("readings"), list):
+        raise CheckError("bad payload header %r" % payload[:80])
+    for reading in doc["readings"]:
+        if len(reading.get("id", "")) != 16 or not isinstance(reading.get("ok"), bool) or \
+                not isinstance(reading.get("mc"), int):
+            raise CheckError("bad reading %r" % reading)
+    return doc["seq"]
+
+
+class Broker:
+    """Accepts connections on localhost or all interfaces, one thread each."""
+
+    def __init__(self, directory, address, port, tickets, hold, quiet=False):
+        self.context = server_context(directory, tickets)
+        self.listener = socket.create_server((address, port))
+        self.port = self.listener.getsockname()[1]
+        self.hold = hold
+        self.quiet = quiet
+        self.lock = threading.Lock()
+        self.done = threading.Condition(self.lock)
+        self.connections = []
+        threading.Thread(target=self.serve, daemon=True).start()
+
+    def serve(self):
+        while True:
+            try:
+                sock, peer = self.listener.accept()
+            except OSError:
+                return
+            threading.Thread(target=self.handle, args=(sock, peer), daemon=True).start()
+
+    def close(self):
+        self.listener.close()
+
+    def handle(self, sock, peer):
+        result = {"peer": peer[0], "client": None, "resumed": None, "handshake_ms": None,
+                  "publishes": 0, "error": None}
+        tls = None
+        try:
+            sock.settimeout(10)
+            tls = self.context.wrap_socket(sock, server_side=True,
+                                           do_handshake_on_connect=False)
+            started = time.monotonic()
+            tls.do_handshake()
+            result["handshake_ms"] = (time.monotonic() - started) * 1000
+            result["resumed"] = tls.session_reused
+            self.session(tls, result)
+        except (OSError, EOFError, CheckError, ValueError, struct.error) as e:
+            result["error"] = str(e) or type(e).__name__
+        finally:
+            if tls is not None:
+                try:
+                    # The close_notify keeps the session resumable.
+                    tls.unwrap()
+                except (OSError, ValueError):
+                    pass
+            sock.close()
+        if not self.quiet:
+            print("%-15s %-16s %-7s handshake %6.1f ms, %d publishes%s" %
+                  (result["peer"], result["client"] or "-",
+                   "-" if result["resumed"] is None else
+                   "resumed" if result["resumed"] else "full",
+                   result["handshake_ms"] or 0, result["publishes"],
+                   ", " + result["error"] if result["error"] else ""), flush=True)
+        with self.lock:
+            self.connections.append(result)
+            self.done.notify_all()
+
+    def session(self, tls, result):
+        packet_type, _, body = read_packet(tls)
+        if packet_type != CONNECT:
+            raise CheckError("first packet is type %d, not CONNECT" % packet_type)
+        protocol, pos = parse_string(body, 0)
+        if protocol != "MQTT" or body[pos] != 4:
+            tls.sendall(encode_packet(CONNACK, b"\x00\x01"))
+            raise CheckError("not MQTT 3.1.1: %r level %d" % (protocol, body[pos]))
+        (keepalive,) = struct.unpack_from(">H", body, pos + 2)
+        result["client"], _ = parse_string(body, pos + 4)
+        tls.sendall(encode_packet(CONNACK, b"\x00\x00"))
+
+        # The device must send something within 1.5 keepalives.
+        quiet_limit = keepalive * 1.5 if keepalive else self.hold
+        deadline = time.monotonic() + self.hold
+        while True:
+            tls.settimeout(max(0.01, min(quiet_limit, deadline - time.monotonic())))
+            try:
+                packet_type, flags, body = read_packet(tls)
+            except socket.timeout:
+                if time.monotonic() >= deadline:
+                    return
+                raise CheckError("no packet within 1.5 keepalives")
+            if packet_type == PUBLISH:
+                if flags & 0x6:
+                    raise CheckError("PUBLISH with QoS %d" % (flags >> 1 & 3))
+                topic, pos = parse_string(body, 0)
+                sequence = check_readings(body[pos:])
+                result["publishes"] += 1
+                result["topic"] = topic
+                result["last_seq"] = sequence
+            elif packet_type == PINGREQ:
+                tls.sendall(encode_packet(PINGRESP))
+            elif packet_type == DISCONNECT:
+                return
+            else:
+                raise CheckError("unexpected packet type %d" % packet_type)
+
+    def wait(self, count, timeout=None):
+        with self.lock:
+            self.done.wait_for(lambda: len(self.connections) >= count, timeout)
+            return list(self.connections)
+
+
+def summarize(connections):
+    """Prints full and resumed handshake times; returns the number of problems."""
+    full = [c["handshake_ms"] for c in connections if c["resumed"] is False]
+    resumed = [c["handshake_ms"] for c in connections if c["resumed"]]
+    for name, times in (("full", full), ("resumed", resumed)):
+        if times:
+            print("%-7s %3d handshakes, median %.1f ms" % (name, len(times),
+                                                          statistics.median(times)))
+    problems = [c for c in connections if c["error"]]
+    problems += [c for c in connections[1:] if not c["resumed"] and not c["error"]]
+    return len(problems)
+
+
+class Client:
+    """Reconnects the way uplink.c does, offering the last session."""
+
+    def __init__(self, directory, port):
+        self.context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+        self.context.maximum_version = ssl.TLSVersion.TLSv1_2
+        self.context.load_verify_locations(os.path.join(directory, "ca.pem"))
+        self.context.load_cert_chain(os.path.join(directory, "client.pem"),
+                                     os.path.join(directory, "client.key"))
+        self.port = port
+        self.session = None
+
+    def connect(self, payload, level=4):
+        sock = socket.create_connection(("127.0.0.1", self.port), timeout=5)
+        tls = self.context.wrap_socket(sock, server_hostname="localhost",
+                                       session=self.session)
+        self.session = tls.session
+        resumed = tls.session_reused
+        client_id = b"tt-selftest"
+        body = struct.pack(">H", 4) + b"MQTT" + bytes([level, 0x02]) + struct.pack(">H", 60)
+        body += struct.pack(">H", len(client_id)) + client_id
+        tls.sendall(encode_packet(CONNECT, body))
+        packet_type, _, body = read_packet(tls)
+        if packet_type != CONNACK or body[1] != 0:
+            tls.close()
+            return resumed, False
+        topic = b"telemetry/readings"
+        tls.sendall(encode_packet(PUBLISH, struct.pack(">H", len(topic)) + topic + payload))
+        tls.sendall(encode_packet(PINGREQ))
+        packet_type, _, _ = read_packet(tls)
+        if packet_type != PINGRESP:
+            raise CheckError("no PINGRESP")
+        tls.sendall(encode_packet(DISCONNECT))
+        try:
+            tls.unwrap()
+        except OSError:
+            pass
+        tls.close()
+        return resumed, True
+
+
+def self_test():
+    good = b'{"seq":7,"age_ms":120,"readings":[{"id":"000000aa00112228","ok":true,"mc":4125}]}'
+    bad = b'{"seq":8,"readings":[]}'
+
+    with tempfile.TemporaryDirectory() as directory:
+        make_certs(directory, "localhost")
+        for tickets in (True, False):
+            broker = Broker(directory, "127.0.0.1", 0, tickets, hold=5, quiet=True)
+            client = Client(directory, broker.port)
+            seen = [client.connect(good)[0] for _ in range(4)]
+            connections = broker.wait(4, 10)
+            broker.close()
+            mode = "tickets" if tickets else "session IDs"
+            if [c["resumed"] for c in connections] != [False, True, True, True] or \
+                    seen != [False, True, True, True]:
+                raise CheckError("%s: broker saw %r, client saw %r" %
+                                 (mode, [c["resumed"] for c in connections], seen))
+            if summarize(connections) or any(c["publishes"] != 1 for c in connections):
+                raise CheckError("%s: %r" % (mode, connections))
+            print("%s: full, then resumed three times" % mode)
+
+            # A restarted broker has a new cache and ticket key.
+            broker = Broker(directory, "127.0.0.1", 0, tickets, hold=5, quiet=True)
+            client.port = broker.port
+            try:
+                client.connect(bad)
+            except EOFError:
+                pass
+            client.connect(good, level=3)
+            connections = broker.wait(2, 10)
+            broker.close()
+            if connections[0]["resumed"] or "bad payload" not in (connections[0]["error"] or ""):
+                raise CheckError("%s: restarted broker %r" % (mode, connections[0]))
+            if "not MQTT 3.1.1" not in (connections[1]["error"] or ""):
+                raise CheckError("%s: MQTT 3.1 accepted" % mode)
+            print("%s: restarted broker declined the session, bad payload and MQTT 3.1 "
+                  "caught" % mode)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--certs", default="certs", help="certificate directory")
+    parser.add_argument("--make-certs", metavar="DIR", help="write certificates to DIR")
+    parser.add_argument("--host", default="broker.local",
+                        help="server certificate host name for --make-certs")
+    parser.add_argument("-a", "--address", default="0.0.0.0")
+    parser.add_argument("-p", "--port", type=int, default=MQTT_PORT)
+    parser.add_argument("--no-tickets", action="store_true",
+                        help="resume by session ID only")
+    parser.add_argument("--hold", type=float, default=30,
+                        help="seconds before each connection is closed")
+    parser.add_argument("-n", "--expect", type=int, default=0,
+                        help="exit after this many connections")
+    parser.add_argument("--self-test", action="store_true",
+                        help="check against a local client")
+    args = parser.parse_args()
+
+    try:
+        if args.self_test:
+            self_test()
+        elif args.make_certs:
+            make_certs(args.make_certs, args.host)
+            print("Wrote %s; flash uplink_nvs.csv with nvs_partition_gen.py" % args.make_certs)
+        else:
+            broker = Broker(args.certs, args.address, args.port, not args.no_tickets,
+                            args.hold)
+            print("Listening on %s:%d" % (args.address, broker.port), flush=True)
+            connections = broker.wait(args.expect or float("inf"))
+            broker.close()
+            problems = summarize(connections)
+            if problems:
+                sys.exit("%d connections failed or were not resumed" % problems)
+    except CheckError as e:
+        sys.exit(str(e))
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
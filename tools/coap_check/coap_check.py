@@ -0,0 +1,349 @@
+#!/usr/bin/env python3
+"""Checks the device's CoAP endpoint from a machine on the same network.
+
+    coap_check.py 192.168.1.40
+    coap_check.py 192.168.1.40 --requests 50 --observe 5
+    coap_check.py --self-test
+
+GETs /readings and /aggregates, checks both payloads against the format
+main/coap/coap_server.c writes and against each other (every aggregate
+belongs to a sensor in the reading set, min <= mean <= max, 1 <= n <=
+window), and prints the round-trip time of repeated GETs. Repeated GETs of
+the same reading set must report a growing age, which shows they are
+answered from the cache and do not trigger a sensor read. With --observe it
+registers on /readings and waits for that many notifications, which must
+carry new sequence numbers. Only the standard library is used.
+
+--self-test runs the checks against a stand-in server on localhost, once
+with well-formed payloads and once with a broken aggregate that must fail.
+"""
+import argparse
+import json
+import os
+import socket
+import statistics
+import struct
+import sys
+import threading
+import time
+
+COAP_PORT = 5683
+
+TYPE_CON, TYPE_NON, TYPE_ACK, TYPE_RST = range(4)
+CODE_GET = 0x01
+CODE_CONTENT = 0x45
+
+OPTION_OBSERVE = 6
+OPTION_URI_PATH = 11
+OPTION_CONTENT_FORMAT = 12
+OPTION_BLOCK2 = 23
+
+FORMAT_JSON = 50
+
+
+class CheckError(Exception):
+    pass
+
+
+def encode_uint(value):
+    out = b""
+    while value:
+        out = bytes([value & 0xff]) + out
+        value >>= 8
+    return out
+
+
+def encode_options(options):
+    """options is a list of (number, bytes), in any order."""
+    out = bytearray()
+    last = 0
+    for number, value in sorted(options, key=lambda o: o[0]):
+        fields = []
+        header = 0
+        for shift, n in ((4, number - last), (0, len(value))):
+            if n < 13:
+                header |= n << shift
+            elif n < 269:
+                header |= 13 << shift
+                fields.append(bytes([n - 13]))
+            else:
+                header |= 14 << shift
+                fields.append(struct.pack(">H", n - 269))
+        out.append(header)
+        for field in fields:
+            out += field
+        out += value
+        last = number
+    return bytes(out)
+
+
+def encode(msg_type, code, message_id, token, options=(), payload=b""):
+    out = bytes([0x40 | msg_type << 4 | len(token), code]) + struct.pack(">H", message_id)
+    out += token + encode_options(options)
+    if payload:
+        out += b"\xff" + payload
+    return out
+
+
+def decode(data):
+    if len(data) < 4 or data[0] >> 6 != 1:
+        raise CheckError("not a CoAP message")
+    msg_type = data[0] >> 4 & 3
+    tkl = data[0] & 0xf
+    code = data[1]
+    (message_id,) = struct.unpack_from(">H", data, 2)
+    token = data[4:4 + tkl]
+    pos = 4 + tkl
+    options = {}
+    number = 0
+    while pos < len(data) and data[pos] != 0xff:
+        header = data[pos]
+        pos += 1
+        values = []
+        for nibble in (header >> 4, header & 0xf):
+            if nibble == 13:
+                values.append(data[pos] + 13)
+                pos += 1
+            elif nibble == 14:
+                values.append(struct.unpack_from(">H", data, pos)[0] + 269)
+                pos += 2
+            elif nibble == 15:
+                raise CheckError("bad option header")
+            else:
+                values.append(nibble)
+        number += values[0]
+        options.setdefault(number, []).append(data[pos:pos + values[1]])
+        pos += values[1]
+    payload = data[pos + 1:] if pos < len(data) else b""
+    return msg_type, code, message_id, token, options, payload
+
+
+def option_uint(options, number):
+    if number not in options:
+        return None
+    return int.from_bytes(options[number][0], "big")
+
+
+class Client:
+    def __init__(self, host, port, timeout):
+        self.address = (host, port)
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.settimeout(timeout)
+        self.message_id = int.from_bytes(os.urandom(2), "big")
+
+    def next_id(self):
+        self.message_id = (self.message_id + 1) & 0xffff
+        return self.message_id
+
+    def receive(self, token):
+        """Returns the next response carrying token, acking CON messages."""
+        while True:
+            data, _ = self.sock.recvfrom(2048)
+            msg_type, code, message_id, got_token, options, payload = decode(data)
+            if msg_type == TYPE_CON:
+                self.sock.sendto(encode(TYPE_ACK, 0, message_id, b""), self.address)
+            if got_token == token and code != 0:
+                return code, options, payload
+
+    def get(self, path, observe=None, token=None):
+        """GETs path, following Block2 if the server splits the payload."""
+        token = token or os.urandom(4)
+        body = b""
+        block = 0
+        while True:
+            options = [(OPTION_URI_PATH, part.encode()) for part in path.strip("/").split("/")]
+            if observe is not None and block == 0:
+                options.append((OPTION_OBSERVE, encode_uint(observe)))
+            if block:
+                options.append((OPTION_BLOCK2, encode_uint(block << 4 | 6)))
+            self.sock.sendto(encode(TYPE_CON, CODE_GET, self.next_id(), token, options),
+                             self.address)
+            code, got, payload = self.receive(token)
+            if code != CODE_CONTENT:
+                raise CheckError("%s: response code %d.%02d" % (path, code >> 5, code & 31))
+            if option_uint(got, OPTION_CONTENT_FORMAT) not in (None, FORMAT_JSON):
+                raise CheckError("%s: content format is not JSON" % path)
+            body += payload
+            block2 = option_uint(got, OPTION_BLOCK2)
+            if block2 is None or not block2 & 0x8:
+                return got, body
+            block = (block2 >> 4) + 1
+
+
+def parse(path, body):
+    try:
+        return json.loads(body.decode())
+    except (UnicodeDecodeError, ValueError) as e:
+        raise CheckError("%s: not JSON (%s): %r" % (path, e, body[:80]))
+
+
+def check_readings(doc):
+    for key in ("seq", "age_ms", "readings"):
+        if key not in doc:
+            raise CheckError("/readings: no %s" % key)
+    ids = set()
+    for reading in doc["readings"]:
+        if len(reading.get("id", "")) != 16 or not isinstance(reading.get("ok"), bool) or \
+                not isinstance(reading.get("mc"), int):
+            raise CheckError("/readings: bad entry %r" % reading)
+        if reading["ok"] and not -55000 <= reading["mc"] <= 125000:
+            raise CheckError("/readings: %d mC is outside the DS18B20 range" % reading["mc"])
+        ids.add(reading["id"])
+    return ids
+
+
+def check_aggregates(doc, ids):
+    window = doc.get("window")
+    if not isinstance(window, int) or window <= 0 or "sensors" not in doc:
+        raise CheckError("/aggregates: bad header %r" % doc)
+    for sensor in doc["sensors"]:
+        if sensor.get("id") not in ids:
+            raise CheckError("/aggregates: %s is not in /readings" % sensor.get("id"))
+        if not 1 <= sensor.get("n", 0) <= window:
+            raise CheckError("/aggregates: n %r outside 1..%d" % (sensor.get("n"), window))
+        if not sensor["min"] <= sensor["mean"] <= sensor["max"]:
+            raise CheckError("/aggregates: %s has min %d mean %d max %d" %
+                             (sensor["id"], sensor["min"], sensor["mean"], sensor["max"]))
+
+
+def run_checks(host, port, requests, observe, timeout):
+    client = Client(host, port, timeout)
+    times = []
+    previous = None
+    for _ in range(requests):
+        started = time.monotonic()
+        _, body = client.get("readings")
+        times.append((time.monotonic() - started) * 1000)
+        doc = parse("/readings", body)
+        ids = check_readings(doc)
+        if previous and previous["seq"] == doc["seq"] and doc["age_ms"] < previous["age_ms"]:
+            raise CheckError("/readings: same sequence %d got younger, was it read again?" %
+                             doc["seq"])
+        previous = doc
+    _, body = client.get("aggregates")
+    check_aggregates(parse("/aggregates", body), ids)
+    print("%d GETs of /readings: %.1f / %.1f / %.1f ms min / median / max, %d sensors, "
+          "/aggregates consistent" % (requests, min(times), statistics.median(times),
+                                      max(times), len(ids)))
+
+    if observe:
+        token = os.urandom(4)
+        got, body = client.get("readings", observe=0, token=token)
+        if OPTION_OBSERVE not in got:
+            raise CheckError("/readings: observe not accepted")
+        sequence = parse("/readings", body)["seq"]
+        client.sock.settimeout(max(timeout, 200))
+        for _ in range(observe):
+            _, got, body = client.receive(token)
+            doc = parse("/readings", body)
+            check_readings(doc)
+            if doc["seq"] <= sequence:
+                raise CheckError("/readings: notification repeats sequence %d" % doc["seq"])
+            sequence = doc["seq"]
+        client.sock.settimeout(timeout)
+        client.get("readings", observe=1, token=token)
+        print("%d notifications, up to sequence %d" % (observe, sequence))
+
+
+class StandIn:
+    """Answers GETs the way coap_server.c formats them; broken skews one aggregate."""
+
+    def __init__(self, broken):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.bind(("127.0.0.1", 0))
+        self.port = self.sock.getsockname()[1]
+        self.broken = broken
+        self.started = time.monotonic()
+        self.observers = {}
+        self.sequence = 1
+        threading.Thread(target=self.serve, daemon=True).start()
+
+    def readings(self):
+        age = int((time.monotonic() - self.started) * 1000)
+        return json.dumps({"seq": self.sequence, "age_ms": age, "readings": [
+            {"id": "000000aa00112228", "ok": True, "mc": 4125},
+            {"id": "000000aa00334428", "ok": False, "mc": 0}]}, separators=(",", ":"))
+
+    def aggregates(self):
+        sensor = {"id": "000000aa00112228", "n": 32, "min": 3875, "max": 4500, "mean": 4140}
+        if self.broken:
+            sensor["mean"] = 4600
+        return json.dumps({"window": 32, "sensors": [sensor]}, separators=(",", ":"))
+
+    def respond(self, address, message_id, token, payload, observe=None, msg_type=TYPE_ACK):
+        options = [(OPTION_CONTENT_FORMAT, encode_uint(FORMAT_JSON))]
+        if observe is not None:
+            options.append((OPTION_OBSERVE, encode_uint(observe)))
+        self.sock.sendto(encode(msg_type, CODE_CONTENT, message_id, token, options,
+                                payload.encode()), address)
+
+    def serve(self):
+        self.sock.settimeout(0.05)
+        while True:
+            try:
+                data, address = self.sock.recvfrom(2048)
+            except socket.timeout:
+                self.notify()
+                continue
+            msg_type, code, message_id, token, options, _ = decode(data)
+            if code != CODE_GET:
+                continue
+            path = "/".join(part.decode() for part in options.get(OPTION_URI_PATH, []))
+            observe = option_uint(options, OPTION_OBSERVE)
+            if path == "readings":
+                if observe == 0:
+                    self.observers[token] = address
+                elif observe == 1:
+                    self.observers.pop(token, None)
+                self.respond(address, message_id, token, self.readings(),
+                             self.sequence if observe == 0 else None)
+            elif path == "aggregates":
+                self.respond(address, message_id, token, self.aggregates())
+
+    def notify(self):
+        if not self.observers or time.monotonic() - self.started < 0.2 * self.sequence:
+            return
+        self.sequence += 1
+        for token, address in self.observers.items():
+            self.respond(address, self.sequence, token, self.readings(), self.sequence,
+                         TYPE_NON)
+
+
+def self_test():
+    run_checks("127.0.0.1", StandIn(False).port, 10, 3, 2)
+    try:
+        run_checks("127.0.0.1", StandIn(True).port, 1, 0, 2)
+    except CheckError as e:
+        print("broken stand-in caught: %s" % e)
+    else:
+        sys.exit("broken stand-in passed the checks")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("host", nargs="?", help="device address")
+    parser.add_argument("-p", "--port", type=int, default=COAP_PORT)
+    parser.add_argument("-n", "--requests", type=int, default=20,
+                        help="GETs of /readings to time")
+    parser.add_argument("-o", "--observe", type=int, default=0,
+                        help="notifications to wait for on /readings")
+    parser.add_argument("-t", "--timeout", type=float, default=5, help="seconds per reply")
+    parser.add_argument("--self-test", action="store_true",
+                        help="check against a local stand-in server")
+    args = parser.parse_args()
+
+    try:
+        if args.self_test:
+            self_test()
+        elif args.host:
+            run_checks(args.host, args.port, args.requests, args.observe, args.timeout)
+        else:
+            parser.error("give a device address or --self-test")
+    except socket.timeout:
+        sys.exit("no reply within %.0f s" % args.timeout)
+    except CheckError as e:
+        sys.exit(str(e))
+
+
+if __name__ == "__main__":
+    main()
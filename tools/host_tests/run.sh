@@ -0,0 +1,48 @@
+#!/bin/sh
+# Builds and runs the host tests with the system compiler.
+# Usage: tools/host_tests/run.sh [test name ...], e.g. run.sh topology history
+set -e
+
+root=$(cd "$(dirname "$0")/../.." && pwd)
+here="$root/tools/host_tests"
+out=${HOST_TEST_OUT:-/tmp/host_tests}
+cflags="-O2 -Wall -Wextra -Wno-unused-parameter -I$here/stubs -I$root/main"
+mkdir -p "$out"
+
+# Firmware sources each test links against.
+sources()
+{
+    case "$1" in
+    alerts) echo "main/alerts/alerts.c" ;;
+    conditioning) echo "main/temperature/conditioning.c" ;;
+    config) echo "main/config/config.c main/temperature/sampling.c" ;;
+    console_line) echo "main/bluetooth/console_line.c" ;;
+    mbuf_writer) echo "main/bluetooth/mbuf_writer.c" ;;
+    mqtt_packet) echo "main/uplink/mqtt_packet.c" ;;
+    history) echo "main/history/history.c main/bluetooth/history_page.c main/bluetooth/mbuf_writer.c" ;;
+    ota_delta) echo "main/ota/ota.c" ;;
+    readings) echo "main/temperature/readings.c" ;;
+    topology) echo "main/tasks/task_topology.c" ;;
+    esac
+}
+
+tests=$*
+if [ -z "$tests" ]; then
+    tests=$(cd "$here" && ls test_*.c | sed 's/^test_//; s/\.c$//')
+fi
+
+failed=0
+for name in $tests; do
+    srcs=""
+    for src in $(sources "$name"); do
+        srcs="$srcs $root/$src"
+    done
+    echo "== $name"
+    # shellcheck disable=SC2086
+    gcc $cflags -o "$out/test_$name" "$here/test_$name.c" "$here/stubs/host_stubs.c" $srcs -lm
+    if ! "$out/test_$name"; then
+        echo "== $name FAILED"
+        failed=1
+    fi
+done
+exit $failed
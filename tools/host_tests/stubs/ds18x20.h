@@ -0,0 +1,13 @@
+#ifndef _HOST_DS18X20_H
+#define _HOST_DS18X20_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef uint64_t ds18x20_addr_t;
+typedef int gpio_num_t;
+
+#define ds18x20_ANY ((ds18x20_addr_t)0xffffffffffffffffULL)
+
+#endif
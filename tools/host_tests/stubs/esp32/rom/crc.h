@@ -0,0 +1,9 @@
+#ifndef _HOST_ROM_CRC_H
+#define _HOST_ROM_CRC_H
+
+#include <stdint.h>
+
+/* Same CRC-32 as zlib's crc32(), like the ESP32 ROM routine. */
+uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len);
+
+#endif
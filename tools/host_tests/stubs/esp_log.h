@@ -0,0 +1,14 @@
+#ifndef _HOST_ESP_LOG_H
+#define _HOST_ESP_LOG_H
+
+#include "esp_err.h"
+
+/* Logs are dropped unless HOST_LOG is set in the environment. */
+void host_log(const char *tag, const char *fmt, ...);
+
+#define ESP_LOGE(tag, fmt, ...) host_log(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) host_log(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) host_log(tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) host_log(tag, fmt, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef _HOST_ESP_PARTITION_H
+#define _HOST_ESP_PARTITION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum
+{
+    ESP_PARTITION_TYPE_APP = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01,
+} esp_partition_type_t;
+
+typedef struct
+{
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+} esp_partition_t;
+
+/* Tests that include this provide the functions they need over a RAM flash. */
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, int subtype,
+                                                const char *label);
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset,
+                             void *dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset,
+                              const void *src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset,
+                                    size_t size);
+
+#endif
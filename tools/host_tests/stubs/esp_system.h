@@ -0,0 +1,8 @@
+#ifndef _HOST_ESP_SYSTEM_H
+#define _HOST_ESP_SYSTEM_H
+
+#include "esp_err.h"
+
+void esp_restart(void);
+
+#endif
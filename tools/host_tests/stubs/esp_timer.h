@@ -0,0 +1,9 @@
+#ifndef _HOST_ESP_TIMER_H
+#define _HOST_ESP_TIMER_H
+
+#include <stdint.h>
+
+/* Microseconds since the process started. */
+int64_t esp_timer_get_time(void);
+
+#endif
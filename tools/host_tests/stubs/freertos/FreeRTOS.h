@@ -0,0 +1,31 @@
+#ifndef _HOST_FREERTOS_H
+#define _HOST_FREERTOS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef void *QueueHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef struct
+{
+    int unused;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0}
+#define portENTER_CRITICAL(mux) (void)(mux)
+#define portEXIT_CRITICAL(mux) (void)(mux)
+#define portTICK_PERIOD_MS 10
+#define portTICK_RATE_MS portTICK_PERIOD_MS
+#define portMAX_DELAY 0xffffffffu
+#define pdPASS 1
+#define pdFAIL 0
+#define pdTRUE 1
+#define pdFALSE 0
+
+#endif
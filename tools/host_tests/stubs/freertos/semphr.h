@@ -0,0 +1,11 @@
+#ifndef _HOST_SEMPHR_H
+#define _HOST_SEMPHR_H
+
+#include "FreeRTOS.h"
+
+/* Host tests are single threaded; the lock functions only count calls. */
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t lock, TickType_t ticks);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t lock);
+
+#endif
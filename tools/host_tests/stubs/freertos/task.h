@@ -0,0 +1,14 @@
+#ifndef _HOST_TASK_H
+#define _HOST_TASK_H
+
+#include "FreeRTOS.h"
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_size,
+                                   void *params, UBaseType_t priority,
+                                   TaskHandle_t *handle, BaseType_t core);
+BaseType_t xTaskGetAffinity(TaskHandle_t handle);
+UBaseType_t uxTaskPriorityGet(TaskHandle_t handle);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t handle);
+void vTaskDelay(TickType_t ticks);
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef _HOST_BLE_HS_H
+#define _HOST_BLE_HS_H
+
+#include "os/os_mbuf.h"
+
+#define BLE_HS_EINVAL 3
+#define BLE_ATT_ERR_UNLIKELY 0x0e
+#define BLE_ATT_ERR_INSUFFICIENT_RES 0x11
+
+#endif
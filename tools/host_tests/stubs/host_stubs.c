@@ -0,0 +1,84 @@
+/*
+ * Shared stand-ins for the ESP-IDF and FreeRTOS calls that host-built
+ * modules make. Tests that need a behaving fake (flash, NVS, tasks) define
+ * their own next to the test.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp32/rom/crc.h"
+#include "freertos/semphr.h"
+#include "../host_test.h"
+
+int host_failures;
+
+const char *esp_err_to_name(esp_err_t err)
+{
+    return err == ESP_OK ? "ESP_OK" : "ESP_FAIL";
+}
+
+void host_log(const char *tag, const char *fmt, ...)
+{
+    static int enabled = -1;
+    va_list args;
+
+    if (enabled < 0)
+    {
+        enabled = getenv("HOST_LOG") != NULL;
+    }
+    if (!enabled)
+    {
+        return;
+    }
+    fprintf(stderr, "%s: ", tag);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+int64_t esp_timer_get_time(void)
+{
+    static double start_us;
+    if (start_us == 0)
+    {
+        start_us = host_now_us();
+    }
+    return (int64_t)(host_now_us() - start_us);
+}
+
+uint32_t crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    crc = ~crc;
+    while (len--)
+    {
+        crc ^= *buf++;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+int host_lock_depth;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return &host_lock_depth;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t lock, TickType_t ticks)
+{
+    host_lock_depth++;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t lock)
+{
+    host_lock_depth--;
+    return pdTRUE;
+}
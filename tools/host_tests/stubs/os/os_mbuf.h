@@ -0,0 +1,44 @@
+#ifndef _HOST_OS_MBUF_H
+#define _HOST_OS_MBUF_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define OS_ENOMEM 1
+
+/*
+ * One flat buffer standing in for an mbuf chain. cap is the room left in
+ * the msys pool; like NimBLE's os_mbuf_append, an append that does not fit
+ * copies what it can and then fails.
+ */
+struct os_mbuf
+{
+    uint8_t *om_data;
+    uint16_t om_len;
+    uint16_t cap;
+    /* Calls to os_mbuf_append, and those after the first one failed. */
+    int appends;
+    int appends_after_failure;
+    int failed;
+};
+
+#define OS_MBUF_PKTLEN(om) ((om)->om_len)
+
+static inline int os_mbuf_append(struct os_mbuf *om, const void *data, uint16_t len)
+{
+    uint16_t room = om->cap - om->om_len;
+    uint16_t copy = len < room ? len : room;
+
+    om->appends++;
+    om->appends_after_failure += om->failed;
+    memcpy(&om->om_data[om->om_len], data, copy);
+    om->om_len += copy;
+    if (copy < len)
+    {
+        om->failed = 1;
+        return OS_ENOMEM;
+    }
+    return 0;
+}
+
+#endif
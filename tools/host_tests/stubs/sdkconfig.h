@@ -0,0 +1,8 @@
+#ifndef _HOST_SDKCONFIG_H
+#define _HOST_SDKCONFIG_H
+
+/* The values from the project sdkconfig that host-built modules read. */
+#define CONFIG_BT_NIMBLE_PINNED_TO_CORE 0
+#define CONFIG_BT_NIMBLE_MAX_CONNECTIONS 3
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Alert rule evaluation: level rules only count new readings, and sensors
+ * that leave the bus give their slot back.
+ */
+#include <string.h>
+#include "host_test.h"
+#include "alerts/alerts.h"
+
+#define SENSOR_A 0x1128
+#define SENSOR_B 0x2228
+
+static alert_event_t events[16];
+static int event_count;
+
+static void record(const alert_event_t *event)
+{
+    if (event_count < (int)(sizeof(events) / sizeof(events[0])))
+    {
+        events[event_count] = *event;
+    }
+    event_count++;
+}
+
+static void evaluate(uint32_t now_ms, int count, ds18x20_addr_t a, bool a_ok, int32_t a_mc,
+                     ds18x20_addr_t b, bool b_ok, int32_t b_mc)
+{
+    temperature_sample_t samples[2] = {
+        {.addr = a, .success = a_ok, .millicelsius = a_mc},
+        {.addr = b, .success = b_ok, .millicelsius = b_mc},
+    };
+    alerts_evaluate(samples, count, now_ms);
+}
+
+int main(void)
+{
+    alert_rule_t none = {.type = ALERT_RULE_NONE, .debounce = 1};
+    uint32_t now = 0;
+
+    alerts_init(record);
+    /* Keep only the default HIGH rule: 8 C, hysteresis 0.5 C, debounce 3. */
+    for (int i = 1; i < ALERTS_MAX_RULES; i++)
+    {
+        alerts_set_rule(i, &none);
+    }
+
+    /* One hot reading followed by failed reads must not trip. */
+    evaluate(now += 1000, 2, SENSOR_A, true, 9000, SENSOR_B, true, 4000);
+    for (int i = 0; i < 5; i++)
+    {
+        evaluate(now += 1000, 2, SENSOR_A, false, 0, SENSOR_B, true, 4000);
+    }
+    CHECK(event_count == 0, "HIGH tripped on a repeated old reading (%d events)", event_count);
+
+    /* Three fresh hot readings do. */
+    for (int i = 0; i < 3; i++)
+    {
+        evaluate(now += 1000, 2, SENSOR_A, true, 9000, SENSOR_B, true, 4000);
+    }
+    CHECK(event_count == 1 && events[0].active && events[0].addr == SENSOR_A,
+          "HIGH did not trip after three hot readings");
+
+    /* A dead bus keeps the slot so STALE can still report it. */
+    evaluate(now += 1000, 0, 0, false, 0, 0, false, 0);
+    CHECK(event_count == 1, "slots released on an empty sample set");
+
+    /* Sensor A removed: its alert clears and its slot is reused. */
+    evaluate(now += 1000, 1, SENSOR_B, true, 4000, 0, false, 0);
+    CHECK(event_count == 2 && !events[1].active && events[1].addr == SENSOR_A,
+          "alert on a removed sensor was not cleared");
+    for (ds18x20_addr_t addr = 0x3328; addr < 0x3328 + 0x300; addr += 0x100)
+    {
+        evaluate(now += 1000, 2, SENSOR_B, true, 4000, addr, true, 9000);
+        evaluate(now += 1000, 2, SENSOR_B, true, 4000, addr, true, 9000);
+        evaluate(now += 1000, 2, SENSOR_B, true, 4000, addr, true, 9000);
+    }
+    CHECK(event_count == 2 + 3 + 2, "replaced sensors did not get slots (%d events)", event_count);
+
+    return host_failures ? 1 : 0;
+}
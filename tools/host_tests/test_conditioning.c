@@ -0,0 +1,222 @@
+/*
+ * Accuracy and cost of main/temperature/conditioning.c.
+ *
+ * Four sensors follow a slow drift with 3 C steps, read with Gaussian noise
+ * of 60 mC, DS18B20 quantisation of 62.5 mC, spikes of 5 C in 1% of the
+ * reads (at most one per median window, all the median promises to remove)
+ * and a failed read in 0.1%. Sensor 2 reads off by a gain and an
+ * offset that its calibration undoes. The calibrated readings must match
+ * the calibration exactly, the filtered ones must be closer to the truth,
+ * let no spike through and settle on a step within a few samples. A sensor
+ * swapped into a slot must not inherit the old sensor's filter state. The
+ * host time per sample is printed; it says nothing about the ESP32.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "config/config.h"
+#include "temperature/conditioning.h"
+
+#define SENSORS 4
+#define BATCHES 200000
+#define WARMUP 100
+#define STEP_EVERY 20000
+#define STEP_MILLICELSIUS 3000
+#define NOISE_MILLICELSIUS 60.0
+#define SPIKE_MILLICELSIUS 5000
+#define QUANTUM 62.5
+
+/* A step counts as settled once the output is this close to the truth. */
+#define SETTLED_MILLICELSIUS 250
+#define MAX_SETTLE_SAMPLES 3
+
+#define MISCALIBRATED 1
+#define OFFSET_MILLICELSIUS -500
+#define GAIN 1.02
+
+static app_config_t config;
+
+const app_config_t *config_get(void)
+{
+    return &config;
+}
+
+int config_update(const app_config_t *next)
+{
+    config = *next;
+    return 0;
+}
+
+static uint32_t random_state = 3;
+
+static uint32_t next_random(void)
+{
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random_state = x;
+    return x;
+}
+
+static double gaussian(void)
+{
+    double u = (next_random() + 1.0) / 4294967297.0;
+    double v = (next_random() + 1.0) / 4294967297.0;
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static int32_t calibrated_value(int sensor, int32_t raw)
+{
+    if (sensor != MISCALIBRATED)
+    {
+        return raw;
+    }
+    return (int32_t)(((int64_t)raw * config.calibration[0].gain_q16) >> 16) +
+           config.calibration[0].offset_millicelsius;
+}
+
+static void check_accuracy(void)
+{
+    temperature_sample_t samples[SENSORS], calibrated[SENSORS];
+    int32_t raw[SENSORS];
+    double truth[SENSORS], step = 0;
+    double raw_error = 0, filtered_error = 0, ns = 0;
+    int measured = 0, spikes = 0, spikes_passed = 0, miscalibrated = 0, failed_changed = 0;
+    int step_at = -1, settle = 0, worst_settle = 0;
+    int reads_since_spike[SENSORS];
+
+    memset(&config, 0, sizeof(config));
+    CHECK(conditioning_set_calibration(MISCALIBRATED + 1, OFFSET_MILLICELSIUS,
+                                       (int32_t)(GAIN * CONDITIONING_GAIN_ONE)) == 0,
+          "setting the calibration failed");
+
+    for (int i = 0; i < SENSORS; i++)
+    {
+        reads_since_spike[i] = CONDITIONING_MEDIAN_TAPS;
+    }
+    for (int k = 0; k < BATCHES; k++)
+    {
+        bool spiked[SENSORS] = {false};
+
+        if (k % STEP_EVERY == STEP_EVERY / 2)
+        {
+            step += (k / STEP_EVERY) % 2 ? -STEP_MILLICELSIUS : STEP_MILLICELSIUS;
+            step_at = k;
+            settle = 0;
+        }
+        for (int i = 0; i < SENSORS; i++)
+        {
+            double reading;
+
+            truth[i] = 20000 + 2000 * sin(k / 3000.0 + i) + step;
+            reading = truth[i] + NOISE_MILLICELSIUS * gaussian();
+            if (next_random() % 100 == 0 && reads_since_spike[i] >= CONDITIONING_MEDIAN_TAPS)
+            {
+                reads_since_spike[i] = 0;
+                reading += next_random() % 2 ? SPIKE_MILLICELSIUS : -SPIKE_MILLICELSIUS;
+                spiked[i] = true;
+                spikes++;
+            }
+            /* The miscalibrated sensor reads what its calibration undoes. */
+            if (i == MISCALIBRATED)
+            {
+                reading = (reading - OFFSET_MILLICELSIUS) / GAIN;
+            }
+            samples[i].addr = i + 1;
+            samples[i].success = next_random() % 1000 != 0;
+            samples[i].millicelsius = (int32_t)(floor(reading / QUANTUM) * QUANTUM);
+            raw[i] = samples[i].millicelsius;
+            /* Failed reads do not enter the median window. */
+            reads_since_spike[i] += samples[i].success;
+        }
+
+        double started = host_now_us();
+        conditioning_apply(samples, SENSORS, calibrated);
+        ns += (host_now_us() - started) * 1000;
+
+        for (int i = 0; i < SENSORS; i++)
+        {
+            if (!samples[i].success)
+            {
+                failed_changed += samples[i].millicelsius != raw[i] ||
+                                  calibrated[i].millicelsius != raw[i];
+                continue;
+            }
+            miscalibrated += calibrated[i].millicelsius != calibrated_value(i, raw[i]);
+            if (k < WARMUP)
+            {
+                continue;
+            }
+            double raw_diff = calibrated[i].millicelsius - truth[i];
+            double filtered_diff = samples[i].millicelsius - truth[i];
+            raw_error += raw_diff * raw_diff;
+            filtered_error += filtered_diff * filtered_diff;
+            measured++;
+            /* While a step settles its lag is counted below, not here. */
+            if (spiked[i] && step_at < 0 && fabs(filtered_diff) > SPIKE_MILLICELSIUS / 2)
+            {
+                spikes_passed++;
+            }
+        }
+
+        /* Samples after a step until every sensor is back on the truth. */
+        if (step_at >= 0)
+        {
+            bool settled = true;
+            for (int i = 0; i < SENSORS; i++)
+            {
+                settled &= !samples[i].success ||
+                           fabs(samples[i].millicelsius - truth[i]) < SETTLED_MILLICELSIUS;
+            }
+            if (settled)
+            {
+                worst_settle = settle > worst_settle ? settle : worst_settle;
+                step_at = -1;
+            }
+            settle++;
+        }
+    }
+
+    double raw_rmse = sqrt(raw_error / measured);
+    double filtered_rmse = sqrt(filtered_error / measured);
+    printf("RMSE against the truth: calibrated %.1f mC, filtered %.1f mC; %d spikes, "
+           "%d passed; steps settle within %d samples\n",
+           raw_rmse, filtered_rmse, spikes, spikes_passed, worst_settle);
+    printf("%.0f ns per sample on the host\n", ns / BATCHES / SENSORS);
+
+    CHECK(miscalibrated == 0, "%d calibrated readings differ from raw * gain + offset",
+          miscalibrated);
+    CHECK(failed_changed == 0, "%d failed samples were changed", failed_changed);
+    CHECK(filtered_rmse < raw_rmse * 0.8, "filtering left %.1f mC of %.1f mC error",
+          filtered_rmse, raw_rmse);
+    CHECK(spikes_passed == 0, "%d of %d spikes passed the median", spikes_passed, spikes);
+    CHECK(worst_settle <= MAX_SETTLE_SAMPLES, "a %d mC step took %d samples to settle",
+          STEP_MILLICELSIUS, worst_settle);
+}
+
+/* A sensor swapped into a slot starts from its own readings. */
+static void check_swap(void)
+{
+    temperature_sample_t sample = {.addr = 0x28aa, .success = true, .millicelsius = 20000};
+
+    memset(&config, 0, sizeof(config));
+    for (int k = 0; k < 20; k++)
+    {
+        sample.millicelsius = 20000 + (k % 2) * 62;
+        conditioning_apply(&sample, 1, NULL);
+    }
+    sample.addr = 0x28bb;
+    sample.millicelsius = 4000;
+    conditioning_apply(&sample, 1, NULL);
+    CHECK(sample.millicelsius == 4000, "swapped sensor read 4000 mC, conditioned to %d",
+          sample.millicelsius);
+}
+
+int main(void)
+{
+    check_accuracy();
+    check_swap();
+    return host_failures ? 1 : 0;
+}
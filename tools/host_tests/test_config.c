@@ -0,0 +1,392 @@
+/*
+ * Config migrations. Blobs laid out as versions 1 and 2 of app_config_t
+ * stored them, and the sampling policy older firmware kept under its own
+ * key, are put in a RAM NVS; config_load() must carry every field forward
+ * to version 3, store the result once and only then drop the legacy key.
+ */
+#include <stddef.h>
+#include <string.h>
+#include "host_test.h"
+#include "nvs.h"
+#include "config/config.h"
+
+#define MAX_ENTRIES 8
+#define MAX_BLOB 256
+
+typedef struct
+{
+    bool used;
+    char name[16];
+    char key[16];
+    uint8_t data[MAX_BLOB];
+    size_t len;
+} nvs_entry_t;
+
+/* RAM NVS: handles are namespace indexes, one entry per namespace and key. */
+static const char *namespaces[] = {"config", "sampling"};
+static nvs_entry_t entries[MAX_ENTRIES];
+static int writes;
+static bool fail_writes;
+
+/* The layouts versions 1 and 2 of the firmware stored. */
+typedef struct
+{
+    uint16_t version;
+    uint16_t size;
+    int8_t sensor_gpio;
+    uint8_t scan_list_size;
+    uint32_t passkey;
+    char device_name[APP_CONFIG_NAME_MAX];
+    uint32_t ble_rx_timeout_ms;
+    sampling_policy_t sampling;
+} config_v1_t;
+
+typedef struct
+{
+    config_v1_t v1;
+    sensor_calibration_t calibration[TEMPERATURE_MAX_SENSORS];
+} config_v2_t;
+
+static nvs_entry_t *find(nvs_handle_t handle, const char *key, bool create)
+{
+    nvs_entry_t *free_entry = NULL;
+    for (int i = 0; i < MAX_ENTRIES; i++)
+    {
+        if (entries[i].used && strcmp(entries[i].name, namespaces[handle]) == 0 &&
+            strcmp(entries[i].key, key) == 0)
+        {
+            return &entries[i];
+        }
+        if (!entries[i].used && free_entry == NULL)
+        {
+            free_entry = &entries[i];
+        }
+    }
+    if (!create || free_entry == NULL)
+    {
+        return NULL;
+    }
+    free_entry->used = true;
+    strcpy(free_entry->name, namespaces[handle]);
+    strcpy(free_entry->key, key);
+    return free_entry;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    for (nvs_handle_t i = 0; i < sizeof(namespaces) / sizeof(namespaces[0]); i++)
+    {
+        if (strcmp(namespaces[i], name) != 0)
+        {
+            continue;
+        }
+        /* Like NVS, a read-only open fails for a namespace never written. */
+        if (open_mode == NVS_READONLY)
+        {
+            bool exists = false;
+            for (int e = 0; e < MAX_ENTRIES; e++)
+            {
+                exists |= entries[e].used && strcmp(entries[e].name, name) == 0;
+            }
+            if (!exists)
+            {
+                return ESP_ERR_NVS_NOT_FOUND;
+            }
+        }
+        *out_handle = i;
+        return ESP_OK;
+    }
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    nvs_entry_t *entry = find(handle, key, false);
+    if (entry == NULL)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (*length < entry->len)
+    {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    memcpy(out_value, entry->data, entry->len);
+    *length = entry->len;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    nvs_entry_t *entry;
+    if (fail_writes)
+    {
+        return ESP_FAIL;
+    }
+    entry = find(handle, key, true);
+    memcpy(entry->data, value, length);
+    entry->len = length;
+    writes++;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    nvs_entry_t *entry = find(handle, key, false);
+    if (entry == NULL)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    entry->used = false;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+static void reset_nvs(void)
+{
+    memset(entries, 0, sizeof(entries));
+    writes = 0;
+    fail_writes = false;
+}
+
+static void put(const char *name, const char *key, const void *data, size_t len)
+{
+    nvs_handle_t handle;
+    nvs_open(name, NVS_READWRITE, &handle);
+    nvs_set_blob(handle, key, data, len);
+    writes = 0;
+}
+
+static bool has_legacy(void)
+{
+    return find(1, "policy", false) != NULL;
+}
+
+/* Checks the blob config_load() stored matches what it loaded. */
+static void check_stored(const char *name)
+{
+    nvs_entry_t *entry = find(0, "app", false);
+    CHECK(entry != NULL && entry->len == sizeof(app_config_t) &&
+              memcmp(entry->data, config_get(), sizeof(app_config_t)) == 0,
+          "%s: stored blob differs from the loaded config", name);
+}
+
+static const sampling_policy_t custom_policy = {
+    .min_period_ms = 2000,
+    .max_period_ms = 90000,
+    .deadband_millicelsius = 125,
+    .rate_millicelsius_per_min = 300,
+    .high_threshold_millicelsius = 6000,
+    .low_threshold_millicelsius = -18000,
+};
+
+static config_v1_t make_v1(void)
+{
+    config_v1_t v1;
+    memset(&v1, 0, sizeof(v1));
+    v1.version = 1;
+    v1.size = sizeof(v1);
+    v1.sensor_gpio = 17;
+    v1.scan_list_size = 9;
+    v1.passkey = 654321;
+    strcpy(v1.device_name, "Cellar");
+    v1.ble_rx_timeout_ms = 45000;
+    v1.sampling = custom_policy;
+    return v1;
+}
+
+static void check_v1_fields(const char *name, const app_config_t *config)
+{
+    CHECK(config->version == APP_CONFIG_VERSION && config->size == sizeof(*config),
+          "%s: version %u size %u", name, config->version, config->size);
+    CHECK(config->sensor_gpio == 17 && config->scan_list_size == 9 &&
+              config->passkey == 654321 && strcmp(config->device_name, "Cellar") == 0 &&
+              config->ble_rx_timeout_ms == 45000,
+          "%s: version 1 fields lost", name);
+}
+
+int main(void)
+{
+    static const sampling_policy_t zero_policy;
+    const app_config_t *config;
+    app_config_t defaults;
+    int cases = 0;
+
+    /* A fresh device: defaults, stored once. */
+    reset_nvs();
+    config_load();
+    defaults = *config_get();
+    CHECK(defaults.version == APP_CONFIG_VERSION && defaults.sensor_resolution_bits == 12,
+          "fresh: version %u", defaults.version);
+    CHECK(writes == 1, "fresh: %d writes", writes);
+    check_stored("fresh");
+    cases++;
+
+    /* Only the legacy policy: imported, then its key dropped. */
+    reset_nvs();
+    put("sampling", "policy", &custom_policy, sizeof(custom_policy));
+    config_load();
+    CHECK(memcmp(&config_get()->sampling, &custom_policy, sizeof(custom_policy)) == 0,
+          "legacy: policy not imported");
+    CHECK(!has_legacy(), "legacy: key kept after the blob was stored");
+    check_stored("legacy");
+    cases++;
+
+    /* A legacy max period over the cap is clamped, not discarded. */
+    reset_nvs();
+    {
+        sampling_policy_t policy = custom_policy;
+        policy.max_period_ms = 600000;
+        put("sampling", "policy", &policy, sizeof(policy));
+    }
+    config_load();
+    CHECK(config_get()->sampling.max_period_ms == SAMPLING_MAX_PERIOD_MS &&
+              config_get()->sampling.deadband_millicelsius == custom_policy.deadband_millicelsius,
+          "legacy over cap: max %u", config_get()->sampling.max_period_ms);
+    cases++;
+
+    /* An invalid legacy policy falls back to the default policy. */
+    reset_nvs();
+    put("sampling", "policy", &zero_policy, sizeof(zero_policy));
+    config_load();
+    CHECK(memcmp(&config_get()->sampling, &defaults.sampling, sizeof(defaults.sampling)) == 0,
+          "legacy invalid: policy kept");
+    CHECK(!has_legacy(), "legacy invalid: key kept");
+    cases++;
+
+    /* The legacy key stays when the migrated blob cannot be stored. */
+    reset_nvs();
+    put("sampling", "policy", &custom_policy, sizeof(custom_policy));
+    fail_writes = true;
+    config_load();
+    CHECK(memcmp(&config_get()->sampling, &custom_policy, sizeof(custom_policy)) == 0,
+          "store failed: policy not used");
+    CHECK(has_legacy(), "store failed: legacy key erased before it was migrated");
+    cases++;
+
+    /* Version 1: every field kept, calibration cleared, 12 bit sensors. */
+    reset_nvs();
+    {
+        config_v1_t v1 = make_v1();
+        put("config", "app", &v1, sizeof(v1));
+    }
+    config_load();
+    config = config_get();
+    check_v1_fields("v1", config);
+    CHECK(memcmp(&config->sampling, &custom_policy, sizeof(custom_policy)) == 0,
+          "v1: policy lost");
+    for (int i = 0; i < TEMPERATURE_MAX_SENSORS; i++)
+    {
+        CHECK(config->calibration[i].addr == 0 && config->calibration[i].gain_q16 == 0,
+              "v1: calibration %d not cleared", i);
+    }
+    CHECK(config->sensor_resolution_bits == 12, "v1: %u bits", config->sensor_resolution_bits);
+    CHECK(writes == 1, "v1: %d writes", writes);
+    check_stored("v1");
+    cases++;
+
+    /* Version 1 with a period over today's cap. */
+    reset_nvs();
+    {
+        config_v1_t v1 = make_v1();
+        v1.sampling.max_period_ms = 3600000;
+        put("config", "app", &v1, sizeof(v1));
+    }
+    config_load();
+    check_v1_fields("v1 over cap", config_get());
+    CHECK(config_get()->sampling.max_period_ms == SAMPLING_MAX_PERIOD_MS,
+          "v1 over cap: max %u", config_get()->sampling.max_period_ms);
+    cases++;
+
+    /* Version 2: the calibration table comes through. */
+    reset_nvs();
+    {
+        config_v2_t v2;
+        memset(&v2, 0, sizeof(v2));
+        v2.v1 = make_v1();
+        v2.v1.version = 2;
+        v2.v1.size = sizeof(v2);
+        v2.calibration[1].addr = 0x28ff00112233;
+        v2.calibration[1].offset_millicelsius = -375;
+        v2.calibration[1].gain_q16 = CONDITIONING_GAIN_ONE + 655;
+        put("config", "app", &v2, sizeof(v2));
+    }
+    config_load();
+    config = config_get();
+    check_v1_fields("v2", config);
+    CHECK(config->calibration[1].addr == 0x28ff00112233 &&
+              config->calibration[1].offset_millicelsius == -375 &&
+              config->calibration[1].gain_q16 == CONDITIONING_GAIN_ONE + 655,
+          "v2: calibration lost");
+    CHECK(config->sensor_resolution_bits == 12, "v2: %u bits", config->sensor_resolution_bits);
+    check_stored("v2");
+    cases++;
+
+    /* The current version loads as is and is not rewritten. */
+    reset_nvs();
+    {
+        app_config_t v3 = defaults;
+        v3.sensor_resolution_bits = 10;
+        strcpy(v3.device_name, "Attic");
+        put("config", "app", &v3, sizeof(v3));
+    }
+    config_load();
+    CHECK(config_get()->sensor_resolution_bits == 10 &&
+              strcmp(config_get()->device_name, "Attic") == 0,
+          "v3: fields changed");
+    CHECK(writes == 0, "v3: rewritten %d times", writes);
+    cases++;
+
+    /* A current-version blob of the wrong size falls back to defaults. */
+    reset_nvs();
+    {
+        config_v2_t short_v3;
+        memset(&short_v3, 0, sizeof(short_v3));
+        short_v3.v1 = make_v1();
+        short_v3.v1.version = APP_CONFIG_VERSION;
+        put("config", "app", &short_v3, sizeof(short_v3));
+    }
+    config_load();
+    CHECK(memcmp(config_get(), &defaults, sizeof(defaults)) == 0, "short v3: not defaults");
+    cases++;
+
+    /* A blob from newer firmware is left alone for that firmware. */
+    reset_nvs();
+    {
+        app_config_t v4 = defaults;
+        v4.version = APP_CONFIG_VERSION + 1;
+        strcpy(v4.device_name, "Future");
+        put("config", "app", &v4, sizeof(v4));
+    }
+    config_load();
+    CHECK(memcmp(config_get(), &defaults, sizeof(defaults)) == 0, "v4: not defaults");
+    CHECK(writes == 0 && strcmp((char *)find(0, "app", false)->data +
+                                    offsetof(app_config_t, device_name), "Future") == 0,
+          "v4: newer blob overwritten");
+    cases++;
+
+    /* config_update() rejects what is_valid() rejects. */
+    {
+        app_config_t next = *config_get();
+        next.sampling.max_period_ms = SAMPLING_MAX_PERIOD_MS + 1;
+        CHECK(config_update(&next) == ESP_ERR_INVALID_ARG, "update over cap accepted");
+        next = *config_get();
+        next.sensor_resolution_bits = 13;
+        CHECK(config_update(&next) == ESP_ERR_INVALID_ARG, "update at 13 bits accepted");
+        next.sensor_resolution_bits = 9;
+        CHECK(config_update(&next) == ESP_OK && config_get()->sensor_resolution_bits == 9,
+              "valid update refused");
+    }
+    cases++;
+
+    printf("%d config cases, v1 blob %zu bytes, v2 %zu, v3 %zu\n", cases, sizeof(config_v1_t),
+           sizeof(config_v2_t), sizeof(app_config_t));
+    return host_failures ? 1 : 0;
+}
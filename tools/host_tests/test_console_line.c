@@ -0,0 +1,135 @@
+/*
+ * Console line discipline with pasted input: a block of commands arrives in
+ * UART-sized reads with mixed line endings, editing keys, escape sequences
+ * and an over-long line. The lines that come out must not depend on how the
+ * input was split, and the echo buffer must never overflow.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "bluetooth/console_line.h"
+
+#define MAX_LINES 512
+
+typedef struct
+{
+    char lines[MAX_LINES][CONSOLE_LINE_MAX];
+    int count;
+    size_t echoed;
+} output_t;
+
+/* Same loop as console_task(): feed, flush echo, queue complete lines. */
+static void feed_all(const uint8_t *data, size_t len, size_t chunk, output_t *out)
+{
+    console_line_t ld;
+    console_line_init(&ld);
+    memset(out, 0, sizeof(*out));
+
+    for (size_t at = 0; at < len; at += chunk)
+    {
+        size_t read = len - at < chunk ? len - at : chunk;
+        size_t off = 0;
+        while (off < read)
+        {
+            bool ready;
+            off += console_line_feed(&ld, &data[at + off], read - off, &ready);
+            CHECK(ld.echo_len <= CONSOLE_ECHO_MAX, "echo overflow");
+            out->echoed += ld.echo_len;
+            ld.echo_len = 0;
+            if (ready)
+            {
+                if (out->count < MAX_LINES)
+                {
+                    strcpy(out->lines[out->count], ld.line);
+                }
+                out->count++;
+                console_line_reset(&ld);
+            }
+        }
+    }
+}
+
+static size_t append(char *buf, size_t len, const char *text)
+{
+    size_t n = strlen(text);
+    memcpy(&buf[len], text, n);
+    return len + n;
+}
+
+int main(void)
+{
+    static char paste[64 * 1024];
+    static char expected[MAX_LINES][CONSOLE_LINE_MAX];
+    static output_t reference, out;
+    char overlong[CONSOLE_LINE_MAX + 40];
+    size_t len = 0;
+    int lines = 0;
+
+    /* Line endings of every kind, including a lone CR before LF-only lines. */
+    len = append(paste, len, "period 1000 60000\r\n");
+    strcpy(expected[lines++], "period 1000 60000");
+    len = append(paste, len, "resolution 11\n");
+    strcpy(expected[lines++], "resolution 11");
+    len = append(paste, len, "history -3600 0\r");
+    strcpy(expected[lines++], "history -3600 0");
+    len = append(paste, len, "sensors\r\n");
+    strcpy(expected[lines++], "sensors");
+
+    /* Editing keys and an up-arrow from a terminal. */
+    len = append(paste, len, "alret\b\b\bert 0 high 8000\x1b[A\r\n");
+    strcpy(expected[lines++], "alert 0 high 8000");
+    len = append(paste, len, "scan passive 120\x7f" "0\r\n");
+    strcpy(expected[lines++], "scan passive 120");
+
+    /* An over-long line is dropped whole; the next line is intact. */
+    memset(overlong, 'x', sizeof(overlong) - 1);
+    overlong[sizeof(overlong) - 1] = '\0';
+    len = append(paste, len, overlong);
+    len = append(paste, len, "\r\nreconnect\r\n");
+    strcpy(expected[lines++], "reconnect");
+
+    /* A long paste of OTA chunks, each near the line limit. */
+    while (lines < 400)
+    {
+        char line[CONSOLE_LINE_MAX];
+        int n = snprintf(line, sizeof(line), "ota write ");
+        while (n < CONSOLE_LINE_MAX - 3)
+        {
+            line[n] = "0123456789abcdef"[(lines + n) & 15];
+            n++;
+        }
+        line[n] = '\0';
+        strcpy(expected[lines++], line);
+        len = append(paste, len, line);
+        len = append(paste, len, "\r\n");
+    }
+
+    feed_all((const uint8_t *)paste, len, 128, &reference);
+    CHECK(reference.count == lines, "got %d lines, expected %d", reference.count, lines);
+    for (int i = 0; i < lines && i < reference.count; i++)
+    {
+        CHECK(strcmp(reference.lines[i], expected[i]) == 0, "line %d: \"%s\"", i,
+              reference.lines[i]);
+    }
+
+    /* Every way of splitting the paste gives the same lines and echo. */
+    for (size_t chunk = 1; chunk <= 256; chunk++)
+    {
+        feed_all((const uint8_t *)paste, len, chunk, &out);
+        CHECK(out.count == reference.count &&
+                  memcmp(out.lines, reference.lines, sizeof(out.lines)) == 0 &&
+                  out.echoed == reference.echoed,
+              "reads of %zu bytes changed the result", chunk);
+    }
+
+    double started = host_now_us();
+    int rounds = 200;
+    for (int i = 0; i < rounds; i++)
+    {
+        feed_all((const uint8_t *)paste, len, 128, &out);
+    }
+    double us = (host_now_us() - started) / rounds;
+    printf("%d lines, %zu bytes pasted, %.0f us per paste on the host (%.1f MB/s)\n",
+           lines, len, us, len / us);
+    return host_failures ? 1 : 0;
+}
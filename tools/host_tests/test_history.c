@@ -0,0 +1,385 @@
+/*
+ * History codec, block ring and BLE paging on a RAM flash the size of the
+ * history partition in partitions.csv.
+ *
+ * A month of two sensors, sampled every 10 to 60 s with failed reads and a
+ * reboot, is appended through main/history/history.c. Every row a query
+ * returns must match what was appended, and the rows must run without a gap
+ * from the oldest retained record to the newest. Pages are then read
+ * through main/bluetooth/history_page.c at several MTUs and steps, with
+ * many rows sharing a second; following next/skip must return exactly the
+ * rows of one full query, and no page may be longer than ATT_MTU - 1 unless
+ * it holds a single row.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "host_test.h"
+#include "esp_partition.h"
+#include "history/history.h"
+#include "bluetooth/history_page.h"
+
+#define HISTORY_SIZE 0xE000
+#define SENSORS 2
+#define MONTH_S (30 * 24 * 3600)
+#define MAX_TRUTH 300000
+#define MAX_ROWS 2000
+
+static uint8_t flash[HISTORY_SIZE];
+static const esp_partition_t history_partition = {.address = 0x1F2000, .size = HISTORY_SIZE,
+                                                  .label = "history"};
+static time_t fake_now = 1700000000;
+static long erases, write_bytes;
+
+time_t time(time_t *out)
+{
+    if (out != NULL)
+    {
+        *out = fake_now;
+    }
+    return fake_now;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, int subtype,
+                                                const char *label)
+{
+    return &history_partition;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst,
+                             size_t size)
+{
+    memcpy(dst, &flash[offset], size);
+    return ESP_OK;
+}
+
+/* NOR flash: programming only clears bits. */
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *src,
+                              size_t size)
+{
+    const uint8_t *bytes = src;
+    for (size_t i = 0; i < size; i++)
+    {
+        flash[offset + i] &= bytes[i];
+    }
+    write_bytes += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    memset(&flash[offset], 0xff, size);
+    erases++;
+    return ESP_OK;
+}
+
+typedef struct
+{
+    uint32_t time;
+    bool valid[SENSORS];
+    int32_t millicelsius[SENSORS];
+} truth_t;
+
+static truth_t truth[MAX_TRUTH];
+static int truth_count;
+
+typedef struct
+{
+    int rows;
+    int first;
+    int next;
+    int mismatches;
+} replay_t;
+
+static bool check_row(const history_row_t *row, void *arg)
+{
+    replay_t *replay = arg;
+
+    if (replay->rows++ == 0)
+    {
+        while (replay->next < truth_count && truth[replay->next].time < row->time)
+        {
+            replay->next++;
+        }
+        replay->first = replay->next;
+    }
+    if (replay->next >= truth_count || truth[replay->next].time != row->time ||
+        row->count != SENSORS)
+    {
+        replay->mismatches++;
+        return true;
+    }
+    for (int i = 0; i < SENSORS; i++)
+    {
+        const truth_t *expected = &truth[replay->next];
+        if (row->valid[i] != expected->valid[i] ||
+            (row->valid[i] && row->millicelsius[i] != expected->millicelsius[i]))
+        {
+            replay->mismatches++;
+        }
+    }
+    replay->next++;
+    return true;
+}
+
+static int rows_counted;
+
+static bool count_row(const history_row_t *row, void *arg)
+{
+    rows_counted++;
+    return true;
+}
+
+static void check_month(void)
+{
+    temperature_sample_t samples[SENSORS] = {
+        {.addr = 0x28aa00000001ull, .success = true},
+        {.addr = 0x28aa00000002ull, .success = true},
+    };
+    double temperature[SENSORS] = {21000, 4000};
+    uint32_t period = 10;
+    time_t start = fake_now;
+    bool rebooted = false;
+    history_stats_t stats;
+    replay_t replay = {0};
+
+    memset(flash, 0xff, sizeof(flash));
+    CHECK(history_init() == ESP_OK, "history_init failed");
+    srand(1);
+    while (fake_now - start < MONTH_S && truth_count < MAX_TRUTH)
+    {
+        truth_t *record = &truth[truth_count];
+        for (int i = 0; i < SENSORS; i++)
+        {
+            /* A random walk in DS18B20 steps of 62.5 mC. */
+            temperature[i] += (rand() % 3 - 1) * 62.5;
+            samples[i].millicelsius = (int32_t)temperature[i];
+            samples[i].success = rand() % 500 != 0;
+            record->valid[i] = samples[i].success;
+            record->millicelsius[i] = samples[i].millicelsius;
+        }
+        if (!rebooted && fake_now - start >= 5 * 24 * 3600)
+        {
+            history_flush();
+            CHECK(history_init() == ESP_OK, "history_init after reboot failed");
+            rebooted = true;
+        }
+        history_append(samples, SENSORS);
+        record->time = history_now();
+        truth_count++;
+        /* The adaptive policy backs off and snaps back to the minimum. */
+        period = rand() % 50 == 0 ? 10 : (period < 60 ? period * 2 : 60);
+        fake_now += period;
+    }
+    history_flush();
+    history_get_stats(&stats);
+
+    double started = host_now_us();
+    history_query(0, 0, UINT32_MAX, 1, check_row, &replay);
+    double full_ms = (host_now_us() - started) / 1000;
+
+    CHECK(replay.mismatches == 0, "%d rows differ from what was appended", replay.mismatches);
+    CHECK(replay.next == truth_count, "query ended %d records before the newest",
+          truth_count - replay.next);
+    CHECK(replay.rows == truth_count - replay.first, "%d rows for %d retained records",
+          replay.rows, truth_count - replay.first);
+    CHECK(stats.blocks_used == stats.blocks_total, "ring not full after a month: %d of %d",
+          stats.blocks_used, stats.blocks_total);
+
+    rows_counted = 0;
+    started = host_now_us();
+    history_query(stats.newest_time - 24 * 3600, 0, stats.newest_time, 60, count_row, NULL);
+    double day_ms = (host_now_us() - started) / 1000;
+
+    uint32_t retained_s = truth[truth_count - 1].time - truth[replay.first].time;
+    printf("month of %d records: %.2f bits/sample coded, %.2f bytes/sample on flash, "
+           "%d blocks hold %.1f days, %ld erases\n",
+           truth_count, (double)stats.bits_written / stats.samples_written,
+           (double)write_bytes / stats.samples_written, stats.blocks_total,
+           retained_s / 86400.0, erases);
+    printf("query of the %d retained rows %.2f ms, last day at step 60 (%d rows) %.2f ms "
+           "on the host\n",
+           replay.rows, full_ms, rows_counted, day_ms);
+}
+
+typedef struct
+{
+    uint32_t time;
+    int count;
+    char values[SENSORS + 1][12];
+} page_row_t;
+
+static page_row_t expected_rows[MAX_ROWS];
+static int expected_count;
+
+static bool collect_row(const history_row_t *row, void *arg)
+{
+    page_row_t *out = &expected_rows[expected_count++];
+    out->time = row->time;
+    out->count = row->count;
+    for (int i = 0; i < row->count; i++)
+    {
+        if (row->valid[i])
+        {
+            snprintf(out->values[i], sizeof(out->values[i]), "%d", row->millicelsius[i]);
+        }
+        else
+        {
+            strcpy(out->values[i], "null");
+        }
+    }
+    return expected_count < MAX_ROWS;
+}
+
+/* Parses {"rows":[[t,v,...],...],"next":n,"skip":n}; returns the row count or -1. */
+static int parse_page(const char *text, page_row_t *rows, int max, uint32_t *next, uint32_t *skip)
+{
+    const char *p = text;
+    int count = 0;
+
+    if (strncmp(p, "{\"rows\":[", 9) != 0)
+    {
+        return -1;
+    }
+    p += 9;
+    while (*p == '[' && count < max)
+    {
+        page_row_t *row = &rows[count++];
+        char *end;
+        row->time = strtoul(p + 1, &end, 10);
+        row->count = 0;
+        p = end;
+        while (*p == ',' && row->count <= SENSORS)
+        {
+            size_t len = strcspn(p + 1, ",]");
+            if (len >= sizeof(row->values[0]))
+            {
+                return -1;
+            }
+            memcpy(row->values[row->count], p + 1, len);
+            row->values[row->count++][len] = '\0';
+            p += 1 + len;
+        }
+        if (*p++ != ']')
+        {
+            return -1;
+        }
+        if (*p == ',')
+        {
+            p++;
+        }
+    }
+    if (sscanf(p, "],\"next\":%u,\"skip\":%u}", next, skip) != 2)
+    {
+        return -1;
+    }
+    return count;
+}
+
+static void check_paging(uint16_t mtu, uint16_t step)
+{
+    static uint8_t data[1024];
+    static page_row_t got[MAX_ROWS];
+    uint32_t from = 0, skip = 0;
+    int got_count = 0, pages = 0, longest = 0;
+
+    expected_count = 0;
+    history_query(0, 0, UINT32_MAX, step, collect_row, NULL);
+
+    do
+    {
+        struct os_mbuf om = {.om_data = data, .cap = sizeof(data) - 1};
+        page_row_t rows[HISTORY_PAGE_ROWS + 1];
+        uint32_t next, next_skip;
+        int count;
+
+        CHECK(history_page_write(&om, mtu, from, skip, UINT32_MAX, step) == 0,
+              "mtu %u step %u: page at %u+%u failed", mtu, step, from, skip);
+        data[om.om_len] = '\0';
+        count = parse_page((char *)data, rows, HISTORY_PAGE_ROWS + 1, &next, &next_skip);
+        if (count < 0)
+        {
+            CHECK(false, "mtu %u step %u: unparsable page %s", mtu, step, data);
+            return;
+        }
+        CHECK(count >= 1 && count <= HISTORY_PAGE_ROWS, "mtu %u: %d rows on a page", mtu,
+              count);
+        CHECK(om.om_len <= mtu - 1 || count == 1,
+              "mtu %u step %u: %u byte page with %d rows: %s", mtu, step, om.om_len, count,
+              data);
+        longest = om.om_len > longest ? om.om_len : longest;
+        for (int i = 0; i < count && got_count < MAX_ROWS; i++)
+        {
+            got[got_count++] = rows[i];
+        }
+        from = next;
+        skip = next_skip;
+        pages++;
+    } while (from != 0 && pages < MAX_ROWS);
+
+    CHECK(got_count == expected_count, "mtu %u step %u: %d rows paged, %d in the range", mtu,
+          step, got_count, expected_count);
+    for (int i = 0; i < got_count && i < expected_count; i++)
+    {
+        bool same = got[i].time == expected_rows[i].time &&
+                    got[i].count == expected_rows[i].count;
+        for (int v = 0; same && v < got[i].count; v++)
+        {
+            same = strcmp(got[i].values[v], expected_rows[i].values[v]) == 0;
+        }
+        if (!same)
+        {
+            CHECK(false, "mtu %u step %u: row %d differs", mtu, step, i);
+            break;
+        }
+    }
+    printf("mtu %3u step %u: %3d rows in %3d pages, longest %3d bytes\n", mtu, step, got_count,
+           pages, longest);
+}
+
+static void fill_for_paging(void)
+{
+    temperature_sample_t samples[SENSORS + 1] = {
+        {.addr = 0x28bb00000001ull, .success = true},
+        {.addr = 0x28bb00000002ull, .success = true},
+        {.addr = 0x28bb00000003ull, .success = true},
+    };
+
+    memset(flash, 0xff, sizeof(flash));
+    fake_now = 1700000000;
+    history_init();
+    for (int i = 0; i < 300; i++)
+    {
+        /* Bursts of up to 30 rows in one second. Every other row has the
+           longest values the codec stores, so rows are as long as
+           HISTORY_ROW_MAX allows. */
+        for (int s = 0; s < SENSORS + 1; s++)
+        {
+            samples[s].success = i % 2 == 0 || (i + s) % 7 != 0;
+            samples[s].millicelsius = i % 2 == 0 ? INT32_MIN + i + s
+                                                 : 125000 - i * 17 * (s + 1);
+        }
+        history_append(samples, SENSORS + 1);
+        if (i % 40 >= 10)
+        {
+            fake_now += 1 + i % 3;
+        }
+    }
+    history_flush();
+}
+
+int main(void)
+{
+    const uint16_t mtus[] = {23, 64, 185, 517};
+
+    check_month();
+
+    fill_for_paging();
+    for (size_t m = 0; m < sizeof(mtus) / sizeof(mtus[0]); m++)
+    {
+        check_paging(mtus[m], 1);
+        check_paging(mtus[m], 7);
+    }
+    return host_failures ? 1 : 0;
+}
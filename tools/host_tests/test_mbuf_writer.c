@@ -0,0 +1,148 @@
+/*
+ * GATT response serialization when the msys pool runs out. Every response
+ * shape is written into an mbuf that holds one byte less than it needs, and
+ * into every smaller one; each must fail with an ATT error, leave a prefix
+ * of the full response and make no append after the first failed one.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "host/ble_hs.h"
+#include "bluetooth/mbuf_writer.h"
+
+#define MBUF_MAX 1024
+
+typedef void (*writer_fn_t)(mbuf_writer_t *w);
+
+/* Shaped like the scan response, with names that need escaping. */
+static void write_scan(mbuf_writer_t *w)
+{
+    mbuf_json_object_begin(w, NULL);
+    mbuf_json_array_begin(w, "aps");
+    for (int i = 0; i < 6; i++)
+    {
+        char ssid[33];
+        snprintf(ssid, sizeof(ssid), "net \"%d\"\\\t%c", i, 'a' + i);
+        mbuf_json_object_begin(w, NULL);
+        mbuf_json_string(w, "ssid", ssid);
+        mbuf_json_number(w, "rssi", -40 - 7 * i);
+        mbuf_json_unsigned(w, "channel", 1 + i * 2);
+        mbuf_json_object_end(w);
+    }
+    mbuf_json_array_end(w);
+    mbuf_json_object_end(w);
+}
+
+/* Shaped like a history page. */
+static void write_history(mbuf_writer_t *w)
+{
+    mbuf_json_object_begin(w, NULL);
+    mbuf_json_array_begin(w, "rows");
+    for (int i = 0; i < 8; i++)
+    {
+        mbuf_json_array_begin(w, NULL);
+        mbuf_json_unsigned(w, NULL, 1700000000u + 60 * i);
+        mbuf_json_number(w, NULL, -12500 + 1000 * i);
+        if (i % 3 == 0)
+        {
+            mbuf_json_null(w, NULL);
+        }
+        else
+        {
+            mbuf_json_number(w, NULL, INT32_MIN + i);
+        }
+        mbuf_json_array_end(w);
+    }
+    mbuf_json_array_end(w);
+    mbuf_json_unsigned(w, "next", UINT32_MAX);
+    mbuf_json_unsigned(w, "skip", UINT32_MAX);
+    mbuf_json_object_end(w);
+}
+
+static void write_status(mbuf_writer_t *w)
+{
+    mbuf_json_object_begin(w, NULL);
+    mbuf_json_string(w, "state", "FAILED");
+    mbuf_json_number(w, "reason", 201);
+    mbuf_json_object_end(w);
+}
+
+/* More nesting than MBUF_WRITER_MAX_DEPTH allows. */
+static void write_too_deep(mbuf_writer_t *w)
+{
+    for (int i = 0; i < MBUF_WRITER_MAX_DEPTH + 1; i++)
+    {
+        mbuf_json_array_begin(w, NULL);
+    }
+    for (int i = 0; i < MBUF_WRITER_MAX_DEPTH + 2; i++)
+    {
+        mbuf_json_array_end(w);
+    }
+}
+
+static int run(writer_fn_t fn, uint8_t *data, uint16_t cap, struct os_mbuf *om)
+{
+    mbuf_writer_t w;
+    memset(om, 0, sizeof(*om));
+    om->om_data = data;
+    om->cap = cap;
+    mbuf_writer_init(&w, om);
+    fn(&w);
+    return mbuf_writer_finish(&w);
+}
+
+static void check_overflow(const char *name, writer_fn_t fn, const char *expected)
+{
+    static uint8_t full[MBUF_MAX], part[MBUF_MAX];
+    struct os_mbuf om;
+    int appends;
+    uint16_t len;
+
+    CHECK(run(fn, full, MBUF_MAX, &om) == 0, "%s: failed with room to spare", name);
+    len = om.om_len;
+    appends = om.appends;
+    if (expected != NULL)
+    {
+        CHECK(len == strlen(expected) && memcmp(full, expected, len) == 0,
+              "%s: wrote %.*s", name, len, full);
+    }
+
+    for (int cap = len - 1; cap >= 0; cap--)
+    {
+        int rc = run(fn, part, cap, &om);
+        CHECK(rc == BLE_ATT_ERR_INSUFFICIENT_RES, "%s: %d bytes free gave %d", name, cap, rc);
+        CHECK(memcmp(part, full, om.om_len) == 0, "%s: %d bytes free, not a prefix", name, cap);
+        CHECK(om.appends_after_failure == 0, "%s: %d bytes free, %d appends after the failure",
+              name, cap, om.appends_after_failure);
+    }
+
+    double started = host_now_us();
+    int rounds = 100000;
+    for (int i = 0; i < rounds; i++)
+    {
+        run(fn, full, MBUF_MAX, &om);
+    }
+    printf("%-8s %5u bytes %4d appends %7.2f us per response on the host\n", name, len, appends,
+           (host_now_us() - started) / rounds);
+}
+
+int main(void)
+{
+    static uint8_t data[MBUF_MAX];
+    struct os_mbuf om;
+
+    check_overflow("status", write_status, "{\"state\":\"FAILED\",\"reason\":201}");
+    check_overflow("scan", write_scan, NULL);
+    check_overflow("history", write_history, NULL);
+
+    /* Escaping: quotes, backslashes and control characters. */
+    CHECK(run(write_scan, data, MBUF_MAX - 1, &om) == 0, "scan failed");
+    data[om.om_len] = '\0';
+    CHECK(strstr((char *)data, "\"ssid\":\"net \\\"0\\\"\\\\\\u0009a\"") != NULL, "scan: %s", data);
+
+    /* Nesting past the limit fails even with room, and closing more scopes
+       than were opened does not underflow the depth. */
+    CHECK(run(write_too_deep, data, MBUF_MAX, &om) == BLE_ATT_ERR_INSUFFICIENT_RES,
+          "nesting past MBUF_WRITER_MAX_DEPTH was accepted");
+    return host_failures ? 1 : 0;
+}
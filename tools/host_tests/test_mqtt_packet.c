@@ -0,0 +1,91 @@
+/*
+ * MQTT 3.1.1 packets of main/uplink/mqtt_packet.c against hand-encoded
+ * ones, the remaining length at every varint boundary a PUBLISH can reach,
+ * and buffers one byte short of each packet.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "host_test.h"
+#include "uplink/mqtt_packet.h"
+
+#define BUFFER_SIZE 20000
+
+static uint8_t out[BUFFER_SIZE];
+static uint8_t payload[BUFFER_SIZE];
+
+static void check_connect(void)
+{
+    static const uint8_t expected[] = {
+        0x10, 0x13,                               /* CONNECT, 19 bytes */
+        0x00, 0x04, 'M', 'Q', 'T', 'T', 0x04,     /* protocol, level 4 */
+        0x02,                                     /* clean session */
+        0x00, 0x3c,                               /* keepalive 60 s */
+        0x00, 0x07, 't', 't', '-', 'a', 'b', 'c', 'd',
+    };
+    size_t len = mqtt_connect(out, sizeof(out), "tt-abcd", 60);
+
+    CHECK(len == sizeof(expected) && memcmp(out, expected, len) == 0,
+          "CONNECT is %zu bytes, expected %zu", len, sizeof(expected));
+    CHECK(mqtt_connect(out, sizeof(expected) - 1, "tt-abcd", 60) == 0,
+          "CONNECT written into a buffer one byte short");
+}
+
+static void check_publish(void)
+{
+    static const uint8_t expected[] = {
+        0x30, 0x08, 0x00, 0x03, 'a', '/', 'b', '{', '}', '!',
+    };
+    size_t len = mqtt_publish(out, sizeof(out), "a/b", (const uint8_t *)"{}!", 3);
+
+    CHECK(len == sizeof(expected) && memcmp(out, expected, len) == 0,
+          "PUBLISH is %zu bytes, expected %zu", len, sizeof(expected));
+    CHECK(mqtt_publish(out, sizeof(out), "", payload, 1) == 0, "PUBLISH without a topic");
+
+    /* Remaining lengths either side of the one and two byte varint limits. */
+    const size_t remaining[] = {127, 128, 16383, 16384};
+    for (size_t i = 0; i < sizeof(remaining) / sizeof(remaining[0]); i++)
+    {
+        size_t payload_len = remaining[i] - 2 - 3;
+        size_t header = remaining[i] < 128 ? 2 : remaining[i] < 16384 ? 3 : 4;
+        size_t decoded = 0, multiplier = 1, pos = 1;
+
+        memset(payload, 'x', payload_len);
+        len = mqtt_publish(out, sizeof(out), "a/b", payload, payload_len);
+        CHECK(len == header + remaining[i], "remaining %zu: %zu byte packet", remaining[i],
+              len);
+        do
+        {
+            decoded += (out[pos] & 0x7f) * multiplier;
+            multiplier *= 128;
+        } while (out[pos++] & 0x80);
+        CHECK(decoded == remaining[i] && pos == header,
+              "remaining %zu decoded as %zu in %zu header bytes", remaining[i], decoded, pos);
+        CHECK(mqtt_publish(out, len - 1, "a/b", payload, payload_len) == 0,
+              "remaining %zu: PUBLISH written into a buffer one byte short", remaining[i]);
+    }
+}
+
+static void check_small_packets(void)
+{
+    const uint8_t accepted[] = {0x20, 0x02, 0x00, 0x00};
+    const uint8_t refused[] = {0x20, 0x02, 0x00, 0x05};
+    const uint8_t present[] = {0x20, 0x02, 0x01, 0x00};
+    const uint8_t pingresp[] = {0xd0, 0x00, 0x00, 0x00};
+
+    CHECK(mqtt_pingreq(out, sizeof(out)) == 2 && out[0] == 0xc0 && out[1] == 0,
+          "PINGREQ");
+    CHECK(mqtt_pingreq(out, 1) == 0, "PINGREQ in one byte");
+    CHECK(mqtt_connack_code(accepted, 4) == 0, "accepted CONNACK");
+    CHECK(mqtt_connack_code(refused, 4) == 5, "CONNACK refusing the client");
+    CHECK(mqtt_connack_code(present, 4) == 0, "CONNACK with session present");
+    CHECK(mqtt_connack_code(pingresp, 4) == -1, "PINGRESP taken for a CONNACK");
+    CHECK(mqtt_connack_code(accepted, 3) == -1, "short CONNACK");
+}
+
+int main(void)
+{
+    check_connect();
+    check_publish();
+    check_small_packets();
+    return host_failures ? 1 : 0;
+}
@@ -0,0 +1,366 @@
+/*
+ * Delta OTA against a RAM flash.
+ *
+ * Builds patches between synthetic images with a simple block matcher,
+ * streams them through main/ota/ota.c into a 2 MB NOR flash emulation laid
+ * out like partitions.csv, and checks the rebuilt slot byte for byte. For
+ * each case it prints the patch size, the host apply time, the flash work
+ * (read, erased, written) and what that flash work would take at typical
+ * SPI NOR datasheet timings, plus the time to send the patch through the
+ * console "ota write" command at 115200 baud.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "esp_ota_ops.h"
+#include "esp_timer.h"
+#include "esp32/rom/crc.h"
+#include "ota/ota.h"
+
+#define FLASH_SIZE (2 * 1024 * 1024)
+#define FLASH_SECTOR 4096
+#define SLOT_SIZE 0xF0000
+
+/* Typical SPI NOR figures: 4 KB erase, 256 byte page program, 40 MHz DIO read. */
+#define ERASE_SECTOR_US 45000
+#define PROGRAM_PAGE_US 700
+#define READ_BYTE_NS 200
+
+/* Bytes per console "ota write" line and its length on the wire. */
+#define CONSOLE_CHUNK 56
+#define CONSOLE_LINE_CHARS (10 + 2 * CONSOLE_CHUNK + 1)
+#define CONSOLE_CHARS_PER_S 11520
+
+/* Matcher block: shorter matches are sent as literals. */
+#define MATCH_BLOCK 16
+#define HASH_BITS 20
+
+typedef struct
+{
+    uint64_t read_bytes;
+    uint32_t erased_sectors;
+    uint64_t written_bytes;
+} flash_stats_t;
+
+static uint8_t flash[FLASH_SIZE];
+static flash_stats_t stats;
+static const esp_partition_t ota_0 = {.address = 0x10000, .size = SLOT_SIZE, .label = "ota_0"};
+static const esp_partition_t ota_1 = {.address = 0x100000, .size = SLOT_SIZE, .label = "ota_1"};
+static const esp_partition_t *boot_partition = &ota_0;
+static uint32_t write_offset;
+static bool ota_open;
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *dst, size_t size)
+{
+    if (offset + size > partition->size)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(dst, &flash[partition->address + offset], size);
+    stats.read_bytes += size;
+    return ESP_OK;
+}
+
+const esp_partition_t *esp_ota_get_running_partition(void)
+{
+    return &ota_0;
+}
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *start_from)
+{
+    return &ota_1;
+}
+
+esp_err_t esp_ota_begin(const esp_partition_t *partition, size_t image_size, esp_ota_handle_t *handle)
+{
+    uint32_t sectors = (image_size + FLASH_SECTOR - 1) / FLASH_SECTOR;
+    memset(&flash[partition->address], 0xff, sectors * FLASH_SECTOR);
+    stats.erased_sectors += sectors;
+    write_offset = 0;
+    ota_open = true;
+    *handle = 1;
+    return ESP_OK;
+}
+
+/* NOR programming can only clear bits. */
+esp_err_t esp_ota_write(esp_ota_handle_t handle, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    if (!ota_open || write_offset + size > ota_1.size)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        flash[ota_1.address + write_offset + i] &= bytes[i];
+    }
+    write_offset += size;
+    stats.written_bytes += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_end(esp_ota_handle_t handle)
+{
+    ota_open = false;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition)
+{
+    boot_partition = partition;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *partition, esp_ota_img_states_t *state)
+{
+    *state = ESP_OTA_IMG_VALID;
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_valid_cancel_rollback(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot(void)
+{
+    return ESP_OK;
+}
+
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+} buffer_t;
+
+static void put(buffer_t *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->capacity)
+    {
+        buf->capacity = (buf->len + len) * 2;
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    memcpy(&buf->data[buf->len], data, len);
+    buf->len += len;
+}
+
+static void put_u32(buffer_t *buf, uint32_t value)
+{
+    uint8_t bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+    put(buf, bytes, 4);
+}
+
+static void put_insert(buffer_t *patch, const uint8_t *data, size_t len)
+{
+    if (len > 0)
+    {
+        put(patch, (uint8_t[]){OTA_DELTA_OP_INSERT}, 1);
+        put_u32(patch, len);
+        put(patch, data, len);
+    }
+}
+
+static uint32_t block_hash(const uint8_t *p)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < MATCH_BLOCK; i++)
+    {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h >> (32 - HASH_BITS);
+}
+
+/* Greedy matcher: COPY every run found through a hash of source blocks. */
+static void make_patch(const uint8_t *source, size_t source_len,
+                       const uint8_t *target, size_t target_len, buffer_t *patch)
+{
+    int32_t *table = malloc(sizeof(int32_t) << HASH_BITS);
+    size_t literal = 0;
+
+    memset(table, 0xff, sizeof(int32_t) << HASH_BITS);
+    for (size_t i = 0; i + MATCH_BLOCK <= source_len; i++)
+    {
+        uint32_t h = block_hash(&source[i]);
+        if (table[h] < 0)
+        {
+            table[h] = i;
+        }
+    }
+
+    patch->len = 0;
+    put(patch, OTA_DELTA_MAGIC, 4);
+    put_u32(patch, source_len);
+    put_u32(patch, crc32_le(0, source, source_len));
+    put_u32(patch, target_len);
+    put_u32(patch, crc32_le(0, target, target_len));
+
+    for (size_t i = 0; i < target_len;)
+    {
+        int32_t at = i + MATCH_BLOCK <= target_len ? table[block_hash(&target[i])] : -1;
+        if (at < 0 || memcmp(&source[at], &target[i], MATCH_BLOCK) != 0)
+        {
+            i++;
+            continue;
+        }
+        size_t len = MATCH_BLOCK;
+        while (at + len < source_len && i + len < target_len && source[at + len] == target[i + len])
+        {
+            len++;
+        }
+        put_insert(patch, &target[literal], i - literal);
+        put(patch, (uint8_t[]){OTA_DELTA_OP_COPY}, 1);
+        put_u32(patch, at);
+        put_u32(patch, len);
+        i += len;
+        literal = i;
+    }
+    put_insert(patch, &target[literal], target_len - literal);
+    free(table);
+}
+
+static uint32_t random_state = 7;
+
+static uint32_t next_random(void)
+{
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random_state = x;
+    return x;
+}
+
+/* Streams a patch in chunk sized writes; returns the first error. */
+static int apply(const buffer_t *patch, size_t chunk, double *elapsed_us)
+{
+    double started = host_now_us();
+    int err = ota_delta_begin();
+    for (size_t i = 0; err == ESP_OK && i < patch->len; i += chunk)
+    {
+        err = ota_delta_write(&patch->data[i], patch->len - i < chunk ? patch->len - i : chunk);
+    }
+    if (err == ESP_OK)
+    {
+        err = ota_delta_end();
+    }
+    else
+    {
+        ota_delta_abort();
+    }
+    *elapsed_us = host_now_us() - started;
+    return err;
+}
+
+static void run_case(const char *name, const uint8_t *source, size_t source_len,
+                     const uint8_t *target, size_t target_len)
+{
+    buffer_t patch = {0};
+    double elapsed_us;
+
+    memcpy(&flash[ota_0.address], source, source_len);
+    make_patch(source, source_len, target, target_len, &patch);
+    memset(&stats, 0, sizeof(stats));
+    boot_partition = &ota_0;
+
+    int err = apply(&patch, CONSOLE_CHUNK, &elapsed_us);
+    CHECK(err == ESP_OK, "%s: apply failed (%d)", name, err);
+    CHECK(memcmp(&flash[ota_1.address], target, target_len) == 0, "%s: slot differs", name);
+    CHECK(boot_partition == &ota_1, "%s: boot partition not switched", name);
+
+    double device_ms = (stats.erased_sectors * (double)ERASE_SECTOR_US +
+                        (stats.written_bytes + 255) / 256 * (double)PROGRAM_PAGE_US +
+                        stats.read_bytes * READ_BYTE_NS / 1000.0) / 1000;
+    double console_s = (double)(patch.len + CONSOLE_CHUNK - 1) / CONSOLE_CHUNK *
+                       CONSOLE_LINE_CHARS / CONSOLE_CHARS_PER_S;
+    printf("%-16s %7zu %7zu %5.1f%% %8.1f %7llu %6u %7llu %8.0f %8.1f\n", name, target_len,
+           patch.len, 100.0 * patch.len / target_len, elapsed_us / 1000,
+           (unsigned long long)stats.read_bytes / 1024, stats.erased_sectors,
+           (unsigned long long)stats.written_bytes / 1024, device_ms, console_s);
+    free(patch.data);
+}
+
+int main(void)
+{
+    const size_t image_len = 640 * 1024;
+    uint8_t *source = malloc(image_len);
+    uint8_t *target = malloc(SLOT_SIZE);
+    buffer_t patch = {0};
+    double elapsed_us;
+
+    /* Code-like filler: runs of repeated words mixed with random bytes. */
+    for (size_t i = 0; i < image_len; i += 4)
+    {
+        uint32_t word = next_random();
+        word = (word & 3) == 0 ? 0x00000000 : (word & 3) == 1 ? 0x3ffb0000 | (word >> 20) : word;
+        memcpy(&source[i], &word, 4);
+    }
+
+    printf("case               image   patch  ratio apply_ms read_kb erased write_kb device_ms console_s\n");
+
+    /* A changed constant in a few places. */
+    memcpy(target, source, image_len);
+    for (int i = 0; i < 40; i++)
+    {
+        uint32_t at = next_random() % (image_len / 4) * 4;
+        target[at] ^= 0x5a;
+    }
+    run_case("constants", source, image_len, target, image_len);
+
+    /* A new function: 1.5 KB of code, later addresses shifted in 300
+     * literal pool entries, and 2 KB more rodata at the end. */
+    size_t at = image_len * 2 / 5;
+    memcpy(target, source, at);
+    for (size_t i = 0; i < 1536; i++)
+    {
+        target[at + i] = next_random();
+    }
+    memcpy(&target[at + 1536], &source[at], image_len - at);
+    for (int i = 0; i < 300; i++)
+    {
+        uint32_t word = (at + 1536 + next_random() % (image_len - at)) & ~3u;
+        target[word] += 0x06;
+    }
+    for (size_t i = 0; i < 2048; i++)
+    {
+        target[image_len + 1536 + i] = next_random();
+    }
+    run_case("new function", source, image_len, target, image_len + 1536 + 2048);
+
+    /* Nothing in common: the patch is the whole image. */
+    for (size_t i = 0; i < image_len; i++)
+    {
+        target[i] = next_random();
+    }
+    run_case("full image", source, image_len, target, image_len);
+
+    /* Fields split across one byte writes still decode. */
+    memcpy(target, source, image_len);
+    target[1000] ^= 1;
+    make_patch(source, image_len, target, image_len, &patch);
+    CHECK(apply(&patch, 1, &elapsed_us) == ESP_OK &&
+              memcmp(&flash[ota_1.address], target, image_len) == 0,
+          "one byte chunks failed");
+
+    /* A patch for another base is refused before the slot is erased. */
+    memset(&stats, 0, sizeof(stats));
+    patch.data[8] ^= 1;
+    CHECK(apply(&patch, CONSOLE_CHUNK, &elapsed_us) == ESP_ERR_INVALID_CRC,
+          "wrong base image accepted");
+    CHECK(stats.erased_sectors == 0, "slot erased for a wrong base image");
+    patch.data[8] ^= 1;
+
+    /* A truncated patch never becomes bootable. */
+    boot_partition = &ota_0;
+    patch.len -= 3;
+    CHECK(apply(&patch, CONSOLE_CHUNK, &elapsed_us) != ESP_OK, "truncated patch accepted");
+    CHECK(boot_partition == &ota_0, "truncated patch switched the boot partition");
+
+    printf("device_ms: flash work at typical datasheet timings (erase %d ms/4 KB, "
+           "program %d us/page, read %d ns/byte), not measured\n",
+           ERASE_SECTOR_US / 1000, PROGRAM_PAGE_US, READ_BYTE_NS);
+    free(patch.data);
+    free(source);
+    free(target);
+    return host_failures ? 1 : 0;
+}
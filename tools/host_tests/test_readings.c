@@ -0,0 +1,155 @@
+/*
+ * Per-sensor aggregates behind the CoAP /aggregates resource. Random
+ * reading streams with failed reads, an empty bus and a swapped sensor are
+ * published through main/temperature/readings.c and every aggregate is
+ * compared with one recomputed from the last READINGS_WINDOW successful
+ * samples.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "temperature/readings.h"
+
+#define ROUNDS 5000
+
+typedef struct
+{
+    ds18x20_addr_t addr;
+    int count;
+    int32_t values[ROUNDS];
+} reference_t;
+
+static reference_t references[TEMPERATURE_MAX_SENSORS + 1];
+static uint32_t random_state = 7;
+
+static uint32_t next_random(void)
+{
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random_state = x;
+    return x;
+}
+
+static reference_t *reference_for(ds18x20_addr_t addr)
+{
+    for (size_t i = 0; i < sizeof(references) / sizeof(references[0]); i++)
+    {
+        if (references[i].addr == addr)
+        {
+            return &references[i];
+        }
+    }
+    return NULL;
+}
+
+static void check_aggregates(int round, int expected_sensors)
+{
+    reading_aggregate_t aggregates[TEMPERATURE_MAX_SENSORS];
+    int count = readings_get_aggregates(aggregates, TEMPERATURE_MAX_SENSORS);
+
+    CHECK(count == expected_sensors, "round %d: %d aggregates, expected %d", round, count,
+          expected_sensors);
+    for (int i = 0; i < count; i++)
+    {
+        const reading_aggregate_t *aggregate = &aggregates[i];
+        reference_t *reference = reference_for(aggregate->addr);
+        int n = 0;
+        int64_t sum = 0;
+        int32_t min = INT32_MAX, max = INT32_MIN;
+
+        if (reference == NULL || reference->count == 0)
+        {
+            CHECK(false, "round %d: aggregate for a sensor that is gone", round);
+            continue;
+        }
+        for (int j = reference->count - 1; j >= 0 && n < READINGS_WINDOW; j--, n++)
+        {
+            int32_t value = reference->values[j];
+            sum += value;
+            min = value < min ? value : min;
+            max = value > max ? value : max;
+        }
+        CHECK(aggregate->count == n && aggregate->min_millicelsius == min &&
+                  aggregate->max_millicelsius == max &&
+                  aggregate->mean_millicelsius == (int32_t)(sum / n),
+              "round %d sensor %d: n %d min %d max %d mean %d, expected %d %d %d %d", round, i,
+              aggregate->count, aggregate->min_millicelsius, aggregate->max_millicelsius,
+              aggregate->mean_millicelsius, n, min, max, (int32_t)(sum / n));
+    }
+}
+
+int main(void)
+{
+    temperature_sample_t samples[TEMPERATURE_MAX_SENSORS];
+    reading_set_t latest;
+    int sensors = TEMPERATURE_MAX_SENSORS;
+
+    for (int i = 0; i < TEMPERATURE_MAX_SENSORS + 1; i++)
+    {
+        references[i].addr = 0x28000000000000ull | (0x1000 * (i + 1)) | 0x28;
+    }
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        int count = sensors;
+
+        /* Halfway the last sensor is swapped for a new one. */
+        if (round == ROUNDS / 2)
+        {
+            references[TEMPERATURE_MAX_SENSORS - 1].count = 0;
+        }
+        /* Now and then the whole bus is down for a round. */
+        if (round % 997 == 500)
+        {
+            count = 0;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            int ref = i == TEMPERATURE_MAX_SENSORS - 1 && round >= ROUNDS / 2 ? i + 1 : i;
+            reference_t *reference = &references[ref];
+            samples[i].addr = reference->addr;
+            samples[i].success = next_random() % 10 != 0;
+            /* Wide swings, including both signs and the DS18B20 extremes. */
+            samples[i].millicelsius = -55000 + (int32_t)(next_random() % 180001);
+            if (samples[i].success)
+            {
+                reference->values[reference->count++] = samples[i].millicelsius;
+            }
+        }
+        readings_publish(samples, count);
+
+        int expected = 0;
+        for (int i = 0; i < TEMPERATURE_MAX_SENSORS + 1; i++)
+        {
+            bool swapped_out = i == TEMPERATURE_MAX_SENSORS - 1 && round >= ROUNDS / 2;
+            expected += references[i].count > 0 && !swapped_out;
+        }
+        check_aggregates(round, expected);
+    }
+
+    readings_get_latest(&latest);
+    CHECK(latest.sequence == ROUNDS && latest.count == sensors, "latest: seq %u count %d",
+          latest.sequence, latest.count);
+
+    /* A publish of more sensors than fit is cut to TEMPERATURE_MAX_SENSORS. */
+    {
+        temperature_sample_t many[TEMPERATURE_MAX_SENSORS + 2];
+        memset(many, 0, sizeof(many));
+        readings_publish(many, TEMPERATURE_MAX_SENSORS + 2);
+        readings_get_latest(&latest);
+        CHECK(latest.count == TEMPERATURE_MAX_SENSORS, "oversized publish kept %d", latest.count);
+    }
+
+    double started = host_now_us();
+    int calls = 100000;
+    reading_aggregate_t aggregates[TEMPERATURE_MAX_SENSORS];
+    for (int i = 0; i < calls; i++)
+    {
+        readings_get_aggregates(aggregates, TEMPERATURE_MAX_SENSORS);
+    }
+    printf("%d rounds of %d sensors checked, %.2f us per aggregate query on the host\n", ROUNDS,
+           sensors, (host_now_us() - started) / calls);
+    return host_failures ? 1 : 0;
+}
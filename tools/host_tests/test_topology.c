@@ -0,0 +1,360 @@
+/*
+ * Sample-timing jitter under simulated radio load.
+ *
+ * The real task_topology.c creates its tasks through a fake
+ * xTaskCreatePinnedToCore() that registers them with a 1 us step model of
+ * the two ESP32 cores: fixed-priority preemption per core, radio interrupts
+ * on core 0, and the NimBLE and Wi-Fi tasks that sdkconfig pins there. The
+ * sampling task bit-bangs 1-Wire slots inside critical sections, as the
+ * onewire driver does, so on a shared core it also holds radio interrupts
+ * off.
+ *
+ * The same load is run twice: with the topology table, and with the layout
+ * from before it (sampling unpinned at priority 2, modelled on core 0). The
+ * figures are from the model, not from hardware.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "sdkconfig.h"
+#include "esp_err.h"
+#include "tasks/task_topology.h"
+
+#define CORES 2
+#define SIM_SECONDS 120
+#define MAX_SIM_TASKS 12
+
+/* One DS18B20 scratchpad read: reset, match ROM, read 72 bits. */
+#define ONEWIRE_SLOTS 150
+#define ONEWIRE_SLOT_US 70
+#define ONEWIRE_GAP_US 10
+#define SENSORS 4
+
+/* Radio interrupts on core 0: mean spacing and length range. */
+#define RADIO_IRQ_MEAN_US 400
+#define RADIO_IRQ_MIN_US 10
+#define RADIO_IRQ_MAX_US 60
+
+typedef struct
+{
+    const char *name;
+    uint32_t period_us;
+    uint32_t work_us;
+} workload_t;
+
+/* Periodic work per task name; the sampling job is built separately. */
+static const workload_t workloads[] = {
+    {"on_connected", 100000, 2000},
+    {"console_cli", 20000, 100},
+    {"console_cmd", 500000, 1000},
+    {"coap_server", 250000, 800},
+    {"uplink", 250000, 500},
+    {"nimble_host", 7500, 300},
+    {"wifi", 102400, 500},
+};
+
+typedef struct
+{
+    const char *name;
+    int priority;
+    int core;
+    uint32_t stack_size;
+    bool sampling;
+    uint32_t period_us;
+    uint32_t work_us;
+    /* Run state. */
+    uint64_t release_us;
+    uint32_t remaining_us;
+    bool ready;
+    bool started;
+    int slot;
+    bool in_critical;
+} sim_task_t;
+
+typedef struct
+{
+    uint32_t samples;
+    uint32_t max_start_us;
+    uint64_t total_start_us;
+    uint32_t max_read_us;
+    uint32_t min_read_us;
+    uint32_t max_irq_wait_us;
+    uint32_t irq_delayed_by_onewire;
+} sim_result_t;
+
+static sim_task_t tasks[MAX_SIM_TASKS];
+static int task_count;
+static uint32_t random_state = 1;
+
+static uint32_t next_random(void)
+{
+    uint32_t x = random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    random_state = x;
+    return x;
+}
+
+static sim_task_t *add_task(const char *name, uint32_t stack_size, int priority, int core)
+{
+    sim_task_t *task = &tasks[task_count++];
+    memset(task, 0, sizeof(*task));
+    task->name = name;
+    task->priority = priority;
+    task->core = core;
+    task->stack_size = stack_size;
+    task->sampling = strcmp(name, "temperature_telemetry") == 0;
+    task->period_us = 1000000;
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        if (strcmp(workloads[i].name, name) == 0)
+        {
+            task->period_us = workloads[i].period_us;
+            task->work_us = workloads[i].work_us;
+        }
+    }
+    /* Spread the first releases so tasks do not start in lock step. */
+    task->release_us = next_random() % task->period_us;
+    return task;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack_size,
+                                   void *params, UBaseType_t priority,
+                                   TaskHandle_t *handle, BaseType_t core)
+{
+    if (task_count == MAX_SIM_TASKS)
+    {
+        return pdFAIL;
+    }
+    *handle = add_task(name, stack_size, priority, core);
+    return pdPASS;
+}
+
+BaseType_t xTaskGetAffinity(TaskHandle_t handle)
+{
+    return ((sim_task_t *)handle)->core;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t handle)
+{
+    return ((sim_task_t *)handle)->priority;
+}
+
+/* The model has no stacks; report half of each one free. */
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t handle)
+{
+    return ((sim_task_t *)handle)->stack_size / 2;
+}
+
+static void task_body(void *arg)
+{
+}
+
+/* The tasks sdkconfig places outside the topology table. */
+static void add_radio_tasks(void)
+{
+    add_task("nimble_host", 4096, 21, CONFIG_BT_NIMBLE_PINNED_TO_CORE);
+    add_task("wifi", 4096, 23, 0);
+}
+
+static void release(sim_task_t *task, uint64_t now)
+{
+    task->ready = true;
+    task->started = false;
+    task->release_us = now;
+    task->slot = 0;
+    task->in_critical = false;
+    task->remaining_us = task->sampling ? ONEWIRE_GAP_US : task->work_us;
+}
+
+static sim_task_t *pick(int core)
+{
+    sim_task_t *best = NULL;
+    for (int i = 0; i < task_count; i++)
+    {
+        sim_task_t *task = &tasks[i];
+        if (task->core != core || !task->ready)
+        {
+            continue;
+        }
+        if (task->in_critical)
+        {
+            return task;
+        }
+        if (best == NULL || task->priority > best->priority)
+        {
+            best = task;
+        }
+    }
+    return best;
+}
+
+/* Runs one microsecond of a task; returns true when its job completed. */
+static bool step_task(sim_task_t *task)
+{
+    if (--task->remaining_us > 0)
+    {
+        return false;
+    }
+    if (!task->sampling)
+    {
+        return true;
+    }
+    /* The sampling job alternates a gap with a critical 1-Wire slot. */
+    if (!task->in_critical)
+    {
+        task->in_critical = true;
+        task->remaining_us = ONEWIRE_SLOT_US;
+        return false;
+    }
+    task->in_critical = false;
+    if (++task->slot == ONEWIRE_SLOTS * SENSORS)
+    {
+        return true;
+    }
+    task->remaining_us = ONEWIRE_GAP_US;
+    return false;
+}
+
+static void simulate(sim_result_t *result)
+{
+    uint64_t end = (uint64_t)SIM_SECONDS * 1000000;
+    uint64_t next_irq = 0;
+    uint32_t irq_left = 0;
+    uint64_t irq_arrived = 0;
+    bool irq_pending = false;
+
+    memset(result, 0, sizeof(*result));
+    result->min_read_us = UINT32_MAX;
+    for (int i = 0; i < task_count; i++)
+    {
+        tasks[i].ready = false;
+    }
+
+    for (uint64_t now = 0; now < end; now++)
+    {
+        for (int i = 0; i < task_count; i++)
+        {
+            if (!tasks[i].ready && now >= tasks[i].release_us)
+            {
+                release(&tasks[i], now);
+            }
+        }
+        if (!irq_pending && irq_left == 0 && now >= next_irq)
+        {
+            irq_pending = true;
+            irq_arrived = now;
+            next_irq = now + 1 + next_random() % (2 * RADIO_IRQ_MEAN_US);
+        }
+
+        for (int core = 0; core < CORES; core++)
+        {
+            sim_task_t *task = pick(core);
+            bool masked = task != NULL && task->in_critical;
+
+            if (core == 0 && irq_left == 0 && irq_pending)
+            {
+                if (masked)
+                {
+                    result->irq_delayed_by_onewire++;
+                }
+                else
+                {
+                    uint32_t waited = now - irq_arrived;
+                    if (waited > result->max_irq_wait_us)
+                    {
+                        result->max_irq_wait_us = waited;
+                    }
+                    irq_pending = false;
+                    irq_left = RADIO_IRQ_MIN_US +
+                               next_random() % (RADIO_IRQ_MAX_US - RADIO_IRQ_MIN_US + 1);
+                }
+            }
+            if (core == 0 && irq_left > 0)
+            {
+                irq_left--;
+                continue;
+            }
+            if (task == NULL)
+            {
+                continue;
+            }
+            if (task->sampling && !task->started)
+            {
+                uint32_t waited = now - task->release_us;
+                task->started = true;
+                result->total_start_us += waited;
+                if (waited > result->max_start_us)
+                {
+                    result->max_start_us = waited;
+                }
+            }
+            if (step_task(task))
+            {
+                task->ready = false;
+                if (task->sampling)
+                {
+                    uint32_t took = now + 1 - task->release_us;
+                    result->samples++;
+                    if (took > result->max_read_us)
+                    {
+                        result->max_read_us = took;
+                    }
+                    if (took < result->min_read_us)
+                    {
+                        result->min_read_us = took;
+                    }
+                }
+                task->release_us += task->period_us;
+            }
+        }
+    }
+}
+
+static void print_result(const char *layout, const sim_result_t *result)
+{
+    printf("%-9s %7u %9u %9.1f %9u %9u %9u\n", layout, result->samples,
+           result->max_start_us, (double)result->total_start_us / result->samples,
+           result->min_read_us, result->max_read_us, result->max_irq_wait_us);
+}
+
+int main(void)
+{
+    sim_result_t topology, legacy;
+    const task_id_t ids[] = {TASK_SAMPLING, TASK_UPLINK, TASK_CONSOLE,
+                             TASK_CONSOLE_DISPATCH, TASK_COAP, TASK_PUBLISH};
+
+    for (size_t i = 0; i < sizeof(ids) / sizeof(ids[0]); i++)
+    {
+        CHECK(task_topology_create(ids[i], task_body, NULL) == ESP_OK,
+              "creating topology task %d", ids[i]);
+    }
+    CHECK(task_topology_self_check() == ESP_OK, "self-check of the topology table");
+    add_radio_tasks();
+    simulate(&topology);
+
+    /* The layout before the topology table, everything on core 0. */
+    task_count = 0;
+    random_state = 1;
+    add_task("temperature_telemetry", 2048, 2, 0);
+    add_task("on_connected", 3072, 5, 0);
+    add_task("console_cli", 4096, 3, 0);
+    add_radio_tasks();
+    simulate(&legacy);
+
+    printf("%d s, %d sensors, radio IRQ every ~%d us\n", SIM_SECONDS, SENSORS, RADIO_IRQ_MEAN_US);
+    printf("layout    samples start_max start_avg  read_min  read_max irq_wait_max (us)\n");
+    print_result("topology", &topology);
+    print_result("legacy", &legacy);
+    printf("radio IRQ steps held off by 1-Wire critical sections: topology %u, legacy %u\n",
+           topology.irq_delayed_by_onewire, legacy.irq_delayed_by_onewire);
+
+    CHECK(topology.samples == SIM_SECONDS, "topology took %u samples", topology.samples);
+    CHECK(topology.irq_delayed_by_onewire == 0, "1-Wire held radio IRQs off on core 0");
+    CHECK(topology.max_start_us <= legacy.max_start_us, "start jitter got worse");
+    CHECK(topology.max_read_us - topology.min_read_us <= legacy.max_read_us - legacy.min_read_us,
+          "read time spread got worse");
+    return host_failures ? 1 : 0;
+}
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+"""Builds a delta patch between two app images and optionally sends it.
+
+The patch format is described in main/ota/ota.h. The base image must be the
+one running on the device, byte for byte (build/<project>.bin of that
+build); the device checks its CRC before it touches the inactive slot.
+
+    ota_delta.py old.bin new.bin -o update.ttd
+    ota_delta.py old.bin new.bin --port /dev/ttyUSB0
+
+With --port the patch goes through the console "ota" command, one
+"ota write" line at a time, waiting for each "ota: ..." reply. Sending needs
+pyserial, which the ESP-IDF Python environment already has. Close any
+monitor on the port first.
+"""
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = b"TTD2"
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+# Shorter matches cost more as a COPY than as literals.
+MATCH_BLOCK = 16
+
+# "ota write " plus the hex has to fit the 127 character console line.
+CONSOLE_CHUNK = 56
+
+
+def make_patch(source, target):
+    """Greedy block matcher: COPY every run found through a hash of source blocks."""
+    table = {}
+    for i in range(len(source) - MATCH_BLOCK + 1):
+        table.setdefault(source[i:i + MATCH_BLOCK], i)
+
+    out = bytearray(MAGIC)
+    out += struct.pack("<IIII", len(source), zlib.crc32(source),
+                       len(target), zlib.crc32(target))
+
+    def insert(start, end):
+        if end > start:
+            out.append(OP_INSERT)
+            out.extend(struct.pack("<I", end - start))
+            out.extend(target[start:end])
+
+    literal = 0
+    i = 0
+    while i < len(target):
+        at = table.get(target[i:i + MATCH_BLOCK]) if i + MATCH_BLOCK <= len(target) else None
+        if at is None:
+            i += 1
+            continue
+        length = MATCH_BLOCK
+        while (at + length < len(source) and i + length < len(target) and
+               source[at + length] == target[i + length]):
+            length += 1
+        insert(literal, i)
+        out.append(OP_COPY)
+        out.extend(struct.pack("<II", at, length))
+        i += length
+        literal = i
+    insert(literal, len(target))
+    return bytes(out)
+
+
+def apply_patch(source, patch):
+    """Rebuilds the target the way main/ota/ota.c does, to check a patch."""
+    if patch[:4] != MAGIC:
+        raise ValueError("bad magic")
+    source_size, source_crc, target_size, target_crc = struct.unpack_from("<IIII", patch, 4)
+    if source_size != len(source) or source_crc != zlib.crc32(source):
+        raise ValueError("patch is for another base image")
+    out = bytearray()
+    pos = 20
+    while pos < len(patch):
+        op = patch[pos]
+        if op == OP_COPY:
+            offset, length = struct.unpack_from("<II", patch, pos + 1)
+            out += source[offset:offset + length]
+            pos += 9
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<I", patch, pos + 1)
+            out += patch[pos + 5:pos + 5 + length]
+            pos += 5 + length
+        else:
+            raise ValueError("bad op 0x%02x at %d" % (op, pos))
+    if len(out) != target_size or zlib.crc32(bytes(out)) != target_crc:
+        raise ValueError("rebuilt image does not match the header")
+    return bytes(out)
+
+
+def command(port, line, timeout):
+    """Sends one console line and returns the device's "ota: ..." reply."""
+    port.write(line.encode() + b"\r")
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        reply = port.readline().decode(errors="replace").strip()
+        if reply.startswith("ota: "):
+            return reply[5:]
+    return "no reply"
+
+
+def send(device, patch, baud):
+    import serial
+
+    with serial.Serial(device, baud, timeout=1) as port:
+        # The first write checks the running image and erases the slot.
+        steps = [("ota begin", 5)]
+        steps += [("ota write " + patch[i:i + CONSOLE_CHUNK].hex(), 30)
+                  for i in range(0, len(patch), CONSOLE_CHUNK)]
+        steps.append(("ota end", 30))
+        started = time.monotonic()
+        for n, (line, timeout) in enumerate(steps):
+            result = command(port, line, timeout)
+            if result != "ESP_OK":
+                command(port, "ota abort", 5)
+                sys.exit("%s failed: %s" % (line.split(" ", 2)[1], result))
+            print("\r%d/%d" % (n + 1, len(steps)), end="", flush=True)
+        print("\nSent %d bytes in %.1f s, device is rebooting" %
+              (len(patch), time.monotonic() - started))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("base", help="image running on the device")
+    parser.add_argument("target", help="new image")
+    parser.add_argument("-o", "--output", help="write the patch to this file")
+    parser.add_argument("-p", "--port", help="send the patch over this serial port")
+    parser.add_argument("-b", "--baud", type=int, default=115200)
+    args = parser.parse_args()
+
+    with open(args.base, "rb") as f:
+        source = f.read()
+    with open(args.target, "rb") as f:
+        target = f.read()
+
+    started = time.monotonic()
+    patch = make_patch(source, target)
+    apply_patch(source, patch)
+    print("%d byte patch for a %d byte image (%.1f%%), built in %.1f s" %
+          (len(patch), len(target), 100.0 * len(patch) / len(target),
+           time.monotonic() - started))
+
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(patch)
+    if args.port:
+        send(args.port, patch, args.baud)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,263 @@
+/*
+ * Host simulator for reconnect storms. N virtual devices come back at once
+ * after a site power cut and reconnect to a stand-in broker using the same
+ * backoff code as the firmware (main/wifi/backoff.c).
+ *
+ * Build and run on the host:
+ *
+ *   gcc -O2 -Imain/wifi -o reconnect_sim tools/reconnect_sim/reconnect_sim.c \
+ *       main/wifi/backoff.c
+ *   ./reconnect_sim -n 5000 -c 32
+ *
+ * The broker admits at most -c handshakes at a time, each taking -h ms.
+ * Anything that would wait longer than the -t ms connect timeout fails and
+ * the device backs off. A handshake that started but could not finish before
+ * the device gave up keeps its slot for -t ms from its start, the broker's own
+ * handshake timeout, so every such failure also delays the attempts queued
+ * behind it. Attempts abandoned while still queued cost the broker nothing.
+ * Every device has its own clock offset (boot time) and random stream; all
+ * of them share one event-driven scheduler.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "backoff.h"
+
+typedef struct
+{
+    uint32_t time_ms;
+    int device;
+} event_t;
+
+typedef struct
+{
+    int attempt;
+    bool connected;
+    uint32_t random_state;
+} device_t;
+
+typedef struct
+{
+    uint32_t attempts;
+    uint32_t failures;
+    uint32_t connects;
+} second_stats_t;
+
+static event_t *heap;
+static int heap_len;
+
+static void heap_push(event_t event)
+{
+    int i = heap_len++;
+    while (i > 0 && heap[(i - 1) / 2].time_ms > event.time_ms)
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = event;
+}
+
+static event_t heap_pop(void)
+{
+    event_t top = heap[0];
+    event_t last = heap[--heap_len];
+    int i = 0;
+    while (2 * i + 1 < heap_len)
+    {
+        int child = 2 * i + 1;
+        if (child + 1 < heap_len && heap[child + 1].time_ms < heap[child].time_ms)
+        {
+            child++;
+        }
+        if (heap[child].time_ms >= last.time_ms)
+        {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/* xorshift32; one stream per device so runs are reproducible. */
+static uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t left = *(const uint32_t *)a;
+    uint32_t right = *(const uint32_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-n devices] [-c broker_slots] [-h handshake_ms] [-t timeout_ms]\n"
+            "          [-b boot_spread_ms] [-d duration_s] [-s seed] [-J]\n"
+            "  -J  disable the backoff jitter to show a lock-step storm\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    int devices = 1000;
+    int slots = 32;
+    uint32_t handshake_ms = 50;
+    uint32_t timeout_ms = 5000;
+    uint32_t boot_spread_ms = 2000;
+    uint32_t duration_s = 600;
+    uint32_t seed = 1;
+    bool jitter = true;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:h:t:b:d:s:J")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            devices = atoi(optarg);
+            break;
+        case 'c':
+            slots = atoi(optarg);
+            break;
+        case 'h':
+            handshake_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            timeout_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            boot_spread_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            duration_s = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'J':
+            jitter = false;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (devices <= 0 || slots <= 0 || duration_s == 0 || handshake_ms == 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    device_t *fleet = calloc(devices, sizeof(*fleet));
+    uint32_t *slot_free_ms = calloc(slots, sizeof(*slot_free_ms));
+    uint32_t *latencies = calloc(devices, sizeof(*latencies));
+    second_stats_t *seconds = calloc(duration_s, sizeof(*seconds));
+    heap = calloc(devices, sizeof(*heap));
+    if (fleet == NULL || slot_free_ms == NULL || latencies == NULL ||
+        seconds == NULL || heap == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < devices; i++)
+    {
+        fleet[i].random_state = seed * 2654435761u + i + 1;
+        uint32_t boot_ms = boot_spread_ms ? next_random(&fleet[i].random_state) % boot_spread_ms : 0;
+        heap_push((event_t){.time_ms = boot_ms, .device = i});
+    }
+
+    uint32_t end_ms = duration_s * 1000;
+    uint32_t attempts = 0;
+    int connected = 0;
+    uint32_t all_connected_ms = 0;
+
+    while (heap_len > 0 && heap[0].time_ms < end_ms)
+    {
+        event_t event = heap_pop();
+        device_t *device = &fleet[event.device];
+        second_stats_t *second = &seconds[event.time_ms / 1000];
+
+        /* The broker hands the attempt to whichever slot frees up first. */
+        int slot = 0;
+        for (int i = 1; i < slots; i++)
+        {
+            if (slot_free_ms[i] < slot_free_ms[slot])
+            {
+                slot = i;
+            }
+        }
+        uint32_t start_ms = slot_free_ms[slot] > event.time_ms ? slot_free_ms[slot] : event.time_ms;
+        uint32_t latency_ms = start_ms - event.time_ms + handshake_ms;
+
+        attempts++;
+        second->attempts++;
+        if (latency_ms <= timeout_ms)
+        {
+            slot_free_ms[slot] = start_ms + handshake_ms;
+            device->connected = true;
+            latencies[connected++] = latency_ms;
+            second->connects++;
+            if (connected == devices)
+            {
+                all_connected_ms = event.time_ms + latency_ms;
+            }
+            continue;
+        }
+
+        /* Started too late to finish: the broker waits out its timeout. */
+        if (start_ms < event.time_ms + timeout_ms)
+        {
+            slot_free_ms[slot] = start_ms + timeout_ms;
+        }
+        second->failures++;
+        uint32_t random = jitter ? next_random(&device->random_state) : 0;
+        uint32_t retry_ms = event.time_ms + timeout_ms + reconnect_backoff_ms(device->attempt++, random);
+        heap_push((event_t){.time_ms = retry_ms, .device = event.device});
+    }
+
+    printf("second attempts failures connects\n");
+    for (uint32_t s = 0; s < duration_s; s++)
+    {
+        if (seconds[s].attempts > 0)
+        {
+            printf("%6u %8u %8u %8u\n", s, seconds[s].attempts, seconds[s].failures,
+                   seconds[s].connects);
+        }
+    }
+
+    printf("\n%d devices, %d broker slots, %u ms handshake, %u ms timeout, jitter %s\n",
+           devices, slots, handshake_ms, timeout_ms, jitter ? "on" : "off");
+    printf("%u attempts, %d of %d connected", attempts, connected, devices);
+    if (connected == devices)
+    {
+        printf(" after %u.%03u s", all_connected_ms / 1000, all_connected_ms % 1000);
+    }
+    printf("\n");
+    if (connected > 0)
+    {
+        qsort(latencies, connected, sizeof(*latencies), compare_u32);
+        printf("broker latency ms: p50 %u p99 %u max %u\n", latencies[connected / 2],
+               latencies[(connected - 1) * 99 / 100], latencies[connected - 1]);
+    }
+
+    free(fleet);
+    free(slot_free_ms);
+    free(latencies);
+    free(seconds);
+    free(heap);
+    return 0;
+}
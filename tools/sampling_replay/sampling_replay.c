@@ -0,0 +1,411 @@
+/*
+ * Replays a temperature trace through the firmware's adaptive sampling
+ * policy (main/temperature/sampling.c) and compares it with sampling at the
+ * fixed minimum period.
+ *
+ * Build and run on the host:
+ *
+ *   gcc -O2 -Itools/host_tests/stubs -Imain -o sampling_replay \
+ *       tools/sampling_replay/sampling_replay.c main/temperature/sampling.c \
+ *       tools/host_tests/stubs/host_stubs.c -lm
+ *   ./sampling_replay                 # synthetic 24 h fridge/freezer trace
+ *   ./sampling_replay -f trace.txt    # output of "history <from> <to>"
+ *
+ * A trace line is "<seconds> <mC> [<mC> ...]" with "-" for a missing
+ * reading, which is what the console history command prints. Between rows
+ * the last row holds. The tool reports how many samples the policy takes
+ * against the fixed period, how late it sees each crossing of the high and
+ * low thresholds, and the largest error between the trace and the last
+ * value the policy sampled.
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "config/config.h"
+#include "temperature/sampling.h"
+
+#define TRACE_LINE_MAX 256
+
+/* Two LSBs at 12 bits. */
+#define CROSSING_BAND_MC 125
+
+typedef struct
+{
+    uint32_t time_s;
+    int32_t value[TEMPERATURE_MAX_SENSORS];
+    bool valid[TEMPERATURE_MAX_SENSORS];
+} trace_row_t;
+
+typedef struct
+{
+    trace_row_t *rows;
+    int count;
+    int capacity;
+    int sensors;
+} trace_t;
+
+static app_config_t config = {
+    .sampling = {
+        .min_period_ms = 1000,
+        .max_period_ms = 60000,
+        .deadband_millicelsius = 250,
+        .rate_millicelsius_per_min = 500,
+        .high_threshold_millicelsius = 8000,
+        .low_threshold_millicelsius = -25000,
+    },
+};
+
+const app_config_t *config_get(void)
+{
+    return &config;
+}
+
+int config_update(const app_config_t *next)
+{
+    config = *next;
+    return ESP_OK;
+}
+
+/* xorshift32 so the synthetic trace is the same on every run. */
+static uint32_t next_random(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static trace_row_t *append_row(trace_t *trace)
+{
+    if (trace->count == trace->capacity)
+    {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        trace->rows = realloc(trace->rows, trace->capacity * sizeof(*trace->rows));
+        if (trace->rows == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    trace_row_t *row = &trace->rows[trace->count++];
+    memset(row, 0, sizeof(*row));
+    return row;
+}
+
+/* Rounds to the 62.5 mC steps a 12-bit DS18B20 reports. */
+static int32_t quantize(double millicelsius)
+{
+    return (int32_t)lround(millicelsius / 62.5) * 625 / 10;
+}
+
+/*
+ * A fridge cycling between 3 and 5 C with its door left open every few
+ * hours, and a freezer cycling around -18 C with a defrost every 8 hours.
+ * One row per second with one LSB of noise.
+ */
+static void synthesize(trace_t *trace, uint32_t hours, uint32_t seed)
+{
+    uint32_t random = seed * 2654435761u + 1;
+    uint32_t next_door_s = 3600 + next_random(&random) % 7200;
+    uint32_t door_s = UINT32_MAX;
+
+    trace->sensors = 2;
+    for (uint32_t t = 0; t < hours * 3600; t++)
+    {
+        trace_row_t *row = append_row(trace);
+        double cycle = fmod(t, 2700.0);
+        double fridge = cycle < 2100 ? 3000 + 2000 * cycle / 2100 : 5000 - 2000 * (cycle - 2100) / 600;
+        if (t == next_door_s)
+        {
+            door_s = t;
+            next_door_s = t + 7200 + next_random(&random) % 7200;
+        }
+        if (door_s != UINT32_MAX)
+        {
+            double since = t - door_s;
+            if (since < 240)
+            {
+                fridge += 6000 * since / 240;
+            }
+            else if (since < 1140)
+            {
+                fridge += 6000 * (1140 - since) / 900;
+            }
+            else
+            {
+                door_s = UINT32_MAX;
+            }
+        }
+        double freezer = -18000 + 1500 * sin(t * 2 * M_PI / 3600);
+        double defrost = fmod(t, 8 * 3600.0);
+        if (defrost < 1200)
+        {
+            freezer += 10000 * sin(defrost * M_PI / 1200);
+        }
+
+        row->time_s = t;
+        row->value[0] = quantize(fridge + (int)(next_random(&random) % 3) * 62.5 - 62.5);
+        row->value[1] = quantize(freezer + (int)(next_random(&random) % 3) * 62.5 - 62.5);
+        row->valid[0] = true;
+        row->valid[1] = true;
+    }
+}
+
+static int load(trace_t *trace, const char *path)
+{
+    char line[TRACE_LINE_MAX];
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char *field = strtok(line, " \t\r\n");
+        char *end;
+        unsigned long time_s;
+        if (field == NULL || (time_s = strtoul(field, &end, 10), *end != '\0'))
+        {
+            continue;
+        }
+        if (trace->count > 0 && time_s <= trace->rows[trace->count - 1].time_s)
+        {
+            fprintf(stderr, "%s: times must increase (%lu)\n", path, time_s);
+            return -1;
+        }
+        trace_row_t *row = append_row(trace);
+        row->time_s = time_s;
+        int sensors = 0;
+        while ((field = strtok(NULL, " \t\r\n")) != NULL && sensors < TEMPERATURE_MAX_SENSORS)
+        {
+            row->valid[sensors] = strcmp(field, "-") != 0;
+            row->value[sensors] = row->valid[sensors] ? strtol(field, NULL, 10) : 0;
+            sensors++;
+        }
+        if (sensors > trace->sensors)
+        {
+            trace->sensors = sensors;
+        }
+    }
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+    return trace->count > 1 ? 0 : -1;
+}
+
+/* Index of the last row at or before time_ms, starting the search at hint. */
+static int row_at(const trace_t *trace, uint64_t time_ms, int hint)
+{
+    while (hint + 1 < trace->count && (uint64_t)trace->rows[hint + 1].time_s * 1000 <= time_ms)
+    {
+        hint++;
+    }
+    return hint;
+}
+
+typedef struct
+{
+    bool known;
+    bool above;
+    bool pending;
+    uint64_t since_ms;
+} crossing_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-f trace|-] [-H hours] [-s seed] [-m min_ms] [-M max_ms]\n"
+            "          [-d deadband_mc] [-r rate_mc_per_min] [-t high_mc] [-l low_mc]\n",
+            name);
+}
+
+int main(int argc, char *argv[])
+{
+    sampling_policy_t *policy = &config.sampling;
+    const char *path = NULL;
+    uint32_t hours = 24;
+    uint32_t seed = 1;
+    trace_t trace = {0};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:H:s:m:M:d:r:t:l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            path = optarg;
+            break;
+        case 'H':
+            hours = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            policy->min_period_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            policy->max_period_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            policy->deadband_millicelsius = strtol(optarg, NULL, 10);
+            break;
+        case 'r':
+            policy->rate_millicelsius_per_min = strtol(optarg, NULL, 10);
+            break;
+        case 't':
+            policy->high_threshold_millicelsius = strtol(optarg, NULL, 10);
+            break;
+        case 'l':
+            policy->low_threshold_millicelsius = strtol(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!sampling_policy_is_valid(policy))
+    {
+        fprintf(stderr, "policy rejected by sampling_policy_is_valid (max period at most %u ms)\n",
+                SAMPLING_MAX_PERIOD_MS);
+        return 1;
+    }
+    if (path != NULL ? load(&trace, path) != 0 : (synthesize(&trace, hours, seed), hours == 0))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* Replay: every sample reads the trace row current at that time. */
+    uint64_t start_ms = (uint64_t)trace.rows[0].time_s * 1000;
+    uint64_t end_ms = (uint64_t)trace.rows[trace.count - 1].time_s * 1000;
+    uint64_t *sample_ms = NULL;
+    int sample_count = 0;
+    int sample_capacity = 0;
+    int row = 0;
+
+    sampling_init();
+    for (uint64_t t = start_ms; t <= end_ms;)
+    {
+        temperature_sample_t samples[TEMPERATURE_MAX_SENSORS];
+        row = row_at(&trace, t, row);
+        for (int i = 0; i < trace.sensors; i++)
+        {
+            samples[i].addr = 0x28 + ((ds18x20_addr_t)(i + 1) << 8);
+            samples[i].success = trace.rows[row].valid[i];
+            samples[i].millicelsius = trace.rows[row].value[i];
+        }
+        if (sample_count == sample_capacity)
+        {
+            sample_capacity = sample_capacity ? sample_capacity * 2 : 1024;
+            sample_ms = realloc(sample_ms, sample_capacity * sizeof(*sample_ms));
+        }
+        sample_ms[sample_count++] = t;
+        t += sampling_next_period_ms(samples, trace.sensors);
+    }
+
+    /*
+     * Threshold crossings in the trace and when the policy first saw them.
+     * A crossing back needs CROSSING_BAND_MC so noise on the threshold does
+     * not count as a stream of crossings.
+     */
+    uint32_t crossings = 0, missed = 0;
+    uint64_t total_latency_ms = 0, max_latency_ms = 0;
+    int32_t max_error = 0;
+    uint32_t max_error_s = 0;
+    for (int s = 0; s < trace.sensors; s++)
+    {
+        const int32_t thresholds[2] = {policy->high_threshold_millicelsius,
+                                       policy->low_threshold_millicelsius};
+        crossing_t state[2] = {0};
+        int next_sample = 0;
+        int sampled_row = -1;
+        for (int r = 0; r < trace.count; r++)
+        {
+            uint64_t t = (uint64_t)trace.rows[r].time_s * 1000;
+            if (trace.rows[r].valid[s])
+            {
+                for (int k = 0; k < 2; k++)
+                {
+                    int32_t value = trace.rows[r].value[s];
+                    bool above = state[k].above ? value >= thresholds[k] - CROSSING_BAND_MC
+                                                : value >= thresholds[k];
+                    if (!state[k].known)
+                    {
+                        state[k].known = true;
+                        state[k].above = above;
+                    }
+                    else if (above != state[k].above)
+                    {
+                        crossings++;
+                        missed += state[k].pending;
+                        state[k].above = above;
+                        state[k].pending = true;
+                        state[k].since_ms = t;
+                    }
+                }
+            }
+            while (next_sample < sample_count && sample_ms[next_sample] <= t)
+            {
+                sampled_row = row_at(&trace, sample_ms[next_sample], sampled_row < 0 ? 0 : sampled_row);
+                for (int k = 0; k < 2 && trace.rows[sampled_row].valid[s]; k++)
+                {
+                    if (state[k].pending &&
+                        (trace.rows[sampled_row].value[s] >= thresholds[k]) == state[k].above)
+                    {
+                        uint64_t latency = sample_ms[next_sample] - state[k].since_ms;
+                        total_latency_ms += latency;
+                        if (latency > max_latency_ms)
+                        {
+                            max_latency_ms = latency;
+                        }
+                        state[k].pending = false;
+                    }
+                }
+                next_sample++;
+            }
+            if (!trace.rows[r].valid[s] || sampled_row < 0 || !trace.rows[sampled_row].valid[s])
+            {
+                continue;
+            }
+            int32_t error = abs(trace.rows[r].value[s] - trace.rows[sampled_row].value[s]);
+            if (error > max_error)
+            {
+                max_error = error;
+                max_error_s = trace.rows[r].time_s;
+            }
+        }
+        missed += state[0].pending + state[1].pending;
+    }
+
+    uint64_t fixed = (end_ms - start_ms) / policy->min_period_ms + 1;
+    printf("trace: %d rows, %d sensors, %.1f h\n", trace.count, trace.sensors,
+           (end_ms - start_ms) / 3600000.0);
+    printf("policy: %u..%u ms, deadband %d mC, rate %d mC/min, thresholds %d/%d mC\n",
+           policy->min_period_ms, policy->max_period_ms, policy->deadband_millicelsius,
+           policy->rate_millicelsius_per_min, policy->high_threshold_millicelsius,
+           policy->low_threshold_millicelsius);
+    printf("samples: %d adaptive vs %llu fixed at %u ms (%.1f%% fewer)\n", sample_count,
+           (unsigned long long)fixed, policy->min_period_ms,
+           100.0 * (1.0 - (double)sample_count / fixed));
+    printf("threshold crossings: %u, missed %u", crossings, missed);
+    if (crossings > missed)
+    {
+        printf(", detection latency avg %llu ms max %llu ms (fixed period: at most %u ms)",
+               (unsigned long long)(total_latency_ms / (crossings - missed)),
+               (unsigned long long)max_latency_ms, policy->min_period_ms);
+    }
+    printf("\nlargest error against the last sample: %d mC at %u s\n", max_error, max_error_s);
+
+    free(sample_ms);
+    free(trace.rows);
+    return 0;
+}